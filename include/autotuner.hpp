@@ -0,0 +1,314 @@
+#ifndef AUTOTUNER_HPP
+#define AUTOTUNER_HPP
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "opencl_utils.hpp"
+#include "benchmark.hpp"
+
+/* Work-group sizes measured on the device.
+ * For a kernel, a variant (build definitions, halo, ...) and a problem size bucket (the
+ * global range rounded up to powers of two), tune() launches the kernel with every
+ * candidate local size, times the launches with profiling events and keeps the fastest
+ * one. Results are kept in a tuning file, one line per entry:
+ *     device <TAB> kernel[variant] WxH <TAB> local sizes <TAB> seconds
+ * The device field holds its name and driver version, so that a driver update starts
+ * over. The file is read when the tuner is created and rewritten (atomically, as the
+ * program cache) after every new measurement, so later runs start with the sizes found
+ * by earlier ones. With sweeping disabled, only the stored sizes are used.
+ *
+ * Usage:
+ *     Autotuner tuner(device);
+ *     tuner.set_sweep(true);
+ *     kernel.setArg(...);
+ *     cl::NDRange local = tuned_local_size(tuner, queue, kernel, global);
+ *     queue.enqueueNDRangeKernel(kernel, cl::NullRange, pad_global_range(global, local), local);
+ * Kernels launched this way must ignore the work-items past the global range.
+ */
+
+/* Tuning file location: OCL_TUNING_FILE, then tuning.txt in the program cache directory.
+ * Returns an empty string (results kept in memory only) when neither is available. */
+inline std::string tuning_file_path()
+{
+    if (const char* path = std::getenv("OCL_TUNING_FILE"))
+        return path;
+    std::string dir = program_cache_dir();
+    return dir.empty() ? "" : dir + "/tuning.txt";
+}
+
+/* Smallest power of two greater or equal to value */
+inline size_t next_power_of_two(size_t value)
+{
+    size_t power = 1;
+    while (power < value)
+        power *= 2;
+    return power;
+}
+
+inline std::string format_range(const cl::NDRange& range)
+{
+    std::ostringstream text;
+    const size_t* sizes = range;
+    for (size_t i = 0; i < range.dimensions(); ++i)
+        text << (i ? "x" : "") << sizes[i];
+    return text.str();
+}
+
+/* Inverse of format_range(); returns false on malformed text */
+inline bool parse_range(const std::string& text, cl::NDRange& range)
+{
+    std::vector<size_t> sizes;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, 'x'))
+    {
+        char* end = NULL;
+        unsigned long value = std::strtoul(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0' || value == 0)
+            return false;
+        sizes.push_back(value);
+    }
+    switch (sizes.size())
+    {
+        case 1: range = cl::NDRange(sizes[0]); return true;
+        case 2: range = cl::NDRange(sizes[0], sizes[1]); return true;
+        case 3: range = cl::NDRange(sizes[0], sizes[1], sizes[2]); return true;
+        default: return false;
+    }
+}
+
+class Autotuner
+{
+
+    public:
+    struct Entry
+    {
+        cl::NDRange local;
+        double seconds;
+    };
+
+    private:
+    cl::Device device;
+    std::string device_id;
+    std::string path;
+    bool sweep;
+    /* Timed launches per candidate, after one warm-up launch */
+    size_t repeats;
+    /* Entries of every device found in the file, by device <TAB> key */
+    std::map<std::string, Entry> entries;
+
+    void load()
+    {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            std::vector<std::string> fields;
+            std::stringstream stream(line);
+            std::string field;
+            while (std::getline(stream, field, '\t'))
+                fields.push_back(field);
+            Entry entry;
+            if (fields.size() != 4 || !parse_range(fields[2], entry.local))
+                continue;
+            entry.seconds = std::atof(fields[3].c_str());
+            entries[fields[0] + "\t" + fields[1]] = entry;
+        }
+    }
+
+    /* Rewrite the whole file through a temporary file renamed over it. The temporary
+     * name is unique per call, as several Autotuners of a process may share the file. */
+    void save() const
+    {
+        if (path.empty())
+            return;
+        size_t slash = path.rfind('/');
+        if (slash != std::string::npos)
+            make_directories(path.substr(0, slash));
+
+        static std::atomic<unsigned long> save_count(0);
+        std::string tmp_path = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(save_count++);
+        {
+            std::ofstream file(tmp_path, std::ios::trunc);
+            if (!file.is_open())
+                return;
+            for (auto &entry : entries)
+                file << entry.first << "\t" << format_range(entry.second.local) << "\t" << entry.second.seconds << "\n";
+            if (!file)
+            {
+                file.close();
+                std::remove(tmp_path.c_str());
+                return;
+            }
+        }
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+            std::remove(tmp_path.c_str());
+    }
+
+    /* Best time of repeats launches of kernel with local, or infinity if the launch fails */
+    double measure(cl::CommandQueue& queue, cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local)
+    {
+        cl::NDRange padded = pad_global_range(global, local);
+        double best = std::numeric_limits<double>::infinity();
+        try
+        {
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, padded, local);
+            queue.finish();
+            for (size_t i = 0; i < repeats; ++i)
+            {
+                cl::Event event;
+                Timer t;
+                t.start();
+                queue.enqueueNDRangeKernel(kernel, cl::NullRange, padded, local, NULL, &event);
+                event.wait();
+                double seconds = t.end();
+                try
+                {
+                    cl_ulong start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+                    cl_ulong end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+                    seconds = (end - start) * 1e-9;
+                }
+                catch(cl::Error e)
+                {
+                    /* Queue without profiling: keep the host time */
+                }
+                best = std::min(best, seconds);
+            }
+        }
+        catch(cl::Error e)
+        {
+            /* e.g. CL_INVALID_WORK_GROUP_SIZE or CL_OUT_OF_RESOURCES for this size */
+            queue.finish();
+        }
+        return best;
+    }
+
+    public:
+    Autotuner(cl::Device device, std::string path = tuning_file_path()) :
+        device(device), path(path), sweep(false), repeats(3)
+    {
+        device_id = device.getInfo<CL_DEVICE_NAME>() + " / " + device.getInfo<CL_DRIVER_VERSION>();
+        if (!path.empty())
+            load();
+    }
+
+    /* Key of kernel over global: kernel name, variant (anything changing the best size
+     * besides the problem size, e.g. build definitions or halo) and size bucket */
+    std::string key(const cl::Kernel& kernel, const std::string& variant, const cl::NDRange& global) const
+    {
+        const size_t* sizes = global;
+        std::vector<size_t> bucket(sizes, sizes + global.dimensions());
+        for (auto &size : bucket)
+            size = next_power_of_two(size);
+        std::ostringstream text;
+        text << kernel.getInfo<CL_KERNEL_FUNCTION_NAME>() << "[" << variant << "] ";
+        for (size_t i = 0; i < bucket.size(); ++i)
+            text << (i ? "x" : "") << bucket[i];
+        return text.str();
+    }
+
+    /* Stored local size for key. Sizes the kernel can not run with any more (e.g. after a
+     * rebuild with other options) are ignored. */
+    bool lookup(const std::string& key, cl::NDRange& local, const cl::Kernel* kernel = NULL) const
+    {
+        auto it = entries.find(device_id + "\t" + key);
+        if (it == entries.end())
+            return false;
+        if (kernel)
+        {
+            const size_t* sizes = it->second.local;
+            size_t items = 1;
+            for (size_t i = 0; i < it->second.local.dimensions(); ++i)
+                items *= sizes[i];
+            if (items > kernel->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device))
+                return false;
+        }
+        local = it->second.local;
+        return true;
+    }
+
+    /* Time kernel, whose arguments must be set, over global with every candidate local size
+     * and store the fastest one under key. configure, when given, is called before the
+     * launches of each candidate, e.g. to size local memory arguments.
+     * Returns false (local unchanged) when no candidate could run. */
+    bool tune(cl::CommandQueue& queue, cl::Kernel& kernel, const std::string& key, const cl::NDRange& global,
+              const std::vector<cl::NDRange>& candidates, cl::NDRange& local,
+              std::function<void(const cl::NDRange&)> configure = nullptr)
+    {
+        Entry best;
+        best.seconds = std::numeric_limits<double>::infinity();
+        for (const cl::NDRange& candidate : candidates)
+        {
+            if (configure)
+                configure(candidate);
+            double seconds = measure(queue, kernel, global, candidate);
+            if (seconds < best.seconds)
+            {
+                best.local = candidate;
+                best.seconds = seconds;
+            }
+        }
+        if (best.seconds == std::numeric_limits<double>::infinity())
+            return false;
+
+        entries[device_id + "\t" + key] = best;
+        save();
+        local = best.local;
+        return true;
+    }
+
+    /* Measure missing entries (true) or only use the stored ones (false, the default) */
+    void set_sweep(bool sweep) { this->sweep = sweep; }
+    void set_repeats(size_t repeats) { this->repeats = std::max<size_t>(1, repeats); }
+    bool get_sweep() const { return sweep; }
+    const std::string& get_path() const { return path; }
+    cl::Device& get_device() { return device; }
+
+    /* Entries of this device, by key */
+    std::map<std::string, Entry> get_entries() const
+    {
+        std::map<std::string, Entry> own;
+        std::string prefix = device_id + "\t";
+        for (auto &entry : entries)
+        {
+            if (entry.first.compare(0, prefix.size(), prefix) == 0)
+                own[entry.first.substr(prefix.size())] = entry.second;
+        }
+        return own;
+    }
+
+};
+
+/* Local size of kernel, whose arguments must be set, over a 1D or 2D global range: the
+ * size stored in tuner, measured first when missing and tuner sweeps, or cl::NullRange
+ * (the driver's choice) when there is none */
+inline cl::NDRange tuned_local_size(Autotuner& tuner, cl::CommandQueue& queue, cl::Kernel& kernel, const cl::NDRange& global)
+{
+    std::string key = tuner.key(kernel, "", global);
+    cl::NDRange local;
+    if (tuner.lookup(key, local, &kernel))
+        return local;
+    if (tuner.get_sweep() && global.dimensions() <= 2)
+    {
+        cl::Device& device = tuner.get_device();
+        const size_t* sizes = global;
+        std::vector<cl::NDRange> candidates = global.dimensions() == 1 ?
+            candidate_local_sizes_1d(kernel, device, sizes[0]) :
+            candidate_local_sizes_2d(kernel, device, sizes[0], sizes[1]);
+        if (tuner.tune(queue, kernel, key, global, candidates, local))
+            return local;
+    }
+    return cl::NullRange;
+}
+
+#endif
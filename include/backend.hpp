@@ -0,0 +1,188 @@
+#ifndef BACKEND_HPP
+#define BACKEND_HPP
+
+#include <memory>
+#include <string>
+
+#include "convolution_engine.hpp"
+#include "cpu_backend.hpp"
+
+/* Image operations independent of where they run. Every backend produces the results
+ * of the OpenCL kernels of kernelConv.cl and kernelCopy.cl and returns elapsed times in
+ * seconds. */
+class Backend
+{
+
+    public:
+    virtual ~Backend() {}
+
+    virtual std::string name() const = 0;
+
+    virtual double convolve(const float* mask, size_t mask_width, size_t mask_height,
+                            const unsigned char* in, size_t width, size_t height, unsigned char* out) = 0;
+
+    virtual double convolve_rgba(const float* mask, size_t mask_width, size_t mask_height,
+                                 const unsigned char* in, size_t width, size_t height, unsigned char* out) = 0;
+
+    virtual double erode(const int* se, size_t se_size,
+                         const unsigned char* in, size_t width, size_t height, unsigned char* out) = 0;
+
+    virtual double copy(const unsigned char* in, size_t bytes, unsigned char* out) = 0;
+
+};
+
+/* OpenCL device through a ConvolutionEngine, and copy_buff_vec for copies */
+class OpenClBackend : public Backend
+{
+
+    private:
+    ConvolutionEngine engine;
+    std::string device_name;
+    cl::Kernel copy_kernel;
+
+    public:
+    OpenClBackend(cl::Device device, std::string kernel_source_file = "../src/kernelConv.cl",
+                  std::string copy_source_file = "../src/kernelCopy.cl") :
+        engine(device, kernel_source_file), device_name(device.getInfo<CL_DEVICE_NAME>())
+    {
+        cl::Program copy_program = load_and_build_program(engine.get_context(), device, copy_source_file, vector_build_options(device));
+        copy_kernel = cl::Kernel(copy_program, "copy_buff_vec");
+    }
+
+    std::string name() const
+    {
+        return "opencl (" + device_name + ")";
+    }
+
+    double convolve(const float* mask, size_t mask_width, size_t mask_height,
+                    const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        return engine.convolve(mask, mask_width, mask_height, in, width, height, out);
+    }
+
+    double convolve_rgba(const float* mask, size_t mask_width, size_t mask_height,
+                         const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        return engine.convolve_rgba(mask, mask_width, mask_height, in, width, height, out);
+    }
+
+    double erode(const int* se, size_t se_size,
+                 const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        return engine.erode(se, se_size, in, width, height, out);
+    }
+
+    double copy(const unsigned char* in, size_t bytes, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        cl::CommandQueue& queue = engine.get_queue();
+        PooledBuffer source = engine.get_buffer_pool()->acquire(bytes, CL_MEM_READ_ONLY);
+        PooledBuffer destination = engine.get_buffer_pool()->acquire(bytes, CL_MEM_WRITE_ONLY);
+        queue.enqueueWriteBuffer(source.buffer(), CL_FALSE, 0, bytes, in);
+        copy_kernel.setArg(0, source.buffer());
+        copy_kernel.setArg(1, (cl_uint) bytes);
+        copy_kernel.setArg(2, destination.buffer());
+        /* Every work-item copies vector_width bytes */
+        size_t vector_width = engine.get_vector_width();
+        queue.enqueueNDRangeKernel(copy_kernel, cl::NullRange, cl::NDRange((bytes + vector_width - 1) / vector_width), cl::NullRange);
+        queue.enqueueReadBuffer(destination.buffer(), CL_TRUE, 0, bytes, out);
+        return t.end();
+    }
+
+    ConvolutionEngine& get_engine() { return engine; }
+
+};
+
+/* Native threads and SIMD through a CpuEngine */
+class CpuBackend : public Backend
+{
+
+    private:
+    CpuEngine engine;
+
+    public:
+    CpuBackend() {}
+
+    explicit CpuBackend(size_t threads) : engine(threads) {}
+
+    std::string name() const
+    {
+        return std::string("cpu (") + engine.simd_name() + ", " + std::to_string(engine.get_threads()) + " threads)";
+    }
+
+    double convolve(const float* mask, size_t mask_width, size_t mask_height,
+                    const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        return engine.convolve(mask, mask_width, mask_height, in, width, height, out);
+    }
+
+    double convolve_rgba(const float* mask, size_t mask_width, size_t mask_height,
+                         const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        return engine.convolve_rgba(mask, mask_width, mask_height, in, width, height, out);
+    }
+
+    double erode(const int* se, size_t se_size,
+                 const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        return engine.erode(se, se_size, in, width, height, out);
+    }
+
+    double copy(const unsigned char* in, size_t bytes, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        engine.copy_bytes(in, bytes, out);
+        return t.end();
+    }
+
+    CpuEngine& get_engine() { return engine; }
+
+};
+
+/* Extract "--backend opencl|cpu|auto" from the command line, falling back on the
+ * OCL_BACKEND environment variable, then on auto */
+inline std::string parse_backend_option(int& argc, char** argv)
+{
+    std::string spec = parse_option(argc, argv, "--backend");
+    if (spec.empty())
+    {
+        const char* env = std::getenv("OCL_BACKEND");
+        spec = env != NULL ? env : "auto";
+    }
+    return spec;
+}
+
+/* Backend for spec: "opencl" (device chosen by device_spec, see select_device()), "cpu",
+ * or "auto", i.e. OpenCL when a device is available and the CPU backend otherwise
+ * (e.g. no OpenCL driver installed) */
+inline std::unique_ptr<Backend> create_backend(const std::string& spec, const std::string& device_spec = "")
+{
+    std::unique_ptr<Backend> backend;
+    if (spec == "cpu")
+    {
+        backend.reset(new CpuBackend());
+    }
+    else if (spec == "opencl" || spec == "auto")
+    {
+        if (spec == "auto" && list_devices().empty())
+        {
+            std::cerr << "No OpenCL device available, falling back on the CPU backend." << std::endl;
+            backend.reset(new CpuBackend());
+        }
+        else
+        {
+            backend.reset(new OpenClBackend(select_device(device_spec)));
+        }
+    }
+    else
+    {
+        std::cerr << "Unknown backend " << spec << " (expected opencl, cpu or auto)" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::cerr << "Using backend " << backend->name() << std::endl;
+    return backend;
+}
+
+#endif
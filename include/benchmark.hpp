@@ -1,32 +1,317 @@
 #ifndef BENCHMARK_HPP_
 #define BENCHMARK_HPP_
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
 #include <stdexcept>
-#include <sys/time.h>
+#include <string>
+#include <vector>
 
+#include "options.hpp"
+
+/* Wall-clock timer on the monotonic steady clock, so that measures are not affected by
+ * system time adjustments. Resolution is the one of the clock (usually 1ns). */
 class Timer
 {
 
     private:
-    double start_time;
+    std::chrono::steady_clock::time_point start_time;
 
     public:
-    Timer() : start_time(0)
+    Timer() : start_time(std::chrono::steady_clock::now())
     {}
 
     void start()
     {
-        struct timeval tval;
-        gettimeofday(&tval, NULL);
-        start_time = tval.tv_sec * 1000000 + tval.tv_usec;
+        start_time = std::chrono::steady_clock::now();
     }
 
+    /* Seconds elapsed since the last call to start() */
     double end() const
     {
-        struct timeval tval;
-        gettimeofday(&tval, NULL);
-        double end_time = tval.tv_sec * 1000000 + tval.tv_usec;
-        return static_cast<double>(end_time - start_time) / 1000000.0;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+        return elapsed.count();
+    }
+
+};
+
+/* How long a benchmark runs.
+ * After warmup untimed runs, the function is timed at least min_iterations times and
+ * then until min_time seconds are spent or max_iterations runs are done.
+ * Samples further than outlier_threshold scaled median absolute deviations from the
+ * median are rejected (0 keeps every sample). */
+struct BenchmarkSettings
+{
+    size_t warmup;
+    size_t min_iterations;
+    size_t max_iterations;
+    double min_time;
+    double outlier_threshold;
+
+    BenchmarkSettings() : warmup(3), min_iterations(10), max_iterations(1000), min_time(0.5), outlier_threshold(5.0)
+    {}
+};
+
+/* Statistics of one benchmark, times in seconds */
+struct BenchmarkResult
+{
+    std::string name;
+    size_t iterations;
+    size_t rejected;
+    double median;
+    double mean;
+    double p95;
+    double stddev;
+    double min;
+    /* Bytes moved and floating point operations done by one run, 0 when irrelevant */
+    double bytes;
+    double flops;
+
+    double gbps() const { return median > 0 ? bytes / median / 1e9 : 0; }
+    double gflops() const { return median > 0 ? flops / median / 1e9 : 0; }
+};
+
+/* Value at rank q (in [0, 1]) of the sorted samples, linearly interpolated */
+inline double quantile(const std::vector<double>& sorted, double q)
+{
+    if (sorted.empty())
+        return 0;
+    double rank = q * (sorted.size() - 1);
+    size_t low = (size_t) std::floor(rank);
+    size_t high = std::min(low + 1, sorted.size() - 1);
+    return sorted[low] + (rank - low) * (sorted[high] - sorted[low]);
+}
+
+/* Fill the statistics of result from the raw samples, rejecting outliers first */
+inline void summarize(std::vector<double> samples, double outlier_threshold, BenchmarkResult& result)
+{
+    std::sort(samples.begin(), samples.end());
+    size_t total = samples.size();
+    if (outlier_threshold > 0 && total > 2)
+    {
+        double median = quantile(samples, 0.5);
+        std::vector<double> deviations;
+        for (double s : samples)
+            deviations.push_back(std::fabs(s - median));
+        std::sort(deviations.begin(), deviations.end());
+        /* 1.4826 MAD estimates the standard deviation of normally distributed samples */
+        double mad = 1.4826 * quantile(deviations, 0.5);
+        if (mad > 0)
+        {
+            std::vector<double> kept;
+            for (double s : samples)
+            {
+                if (std::fabs(s - median) <= outlier_threshold * mad)
+                    kept.push_back(s);
+            }
+            samples.swap(kept);
+        }
+    }
+
+    result.iterations = samples.size();
+    result.rejected = total - samples.size();
+    result.median = quantile(samples, 0.5);
+    result.p95 = quantile(samples, 0.95);
+    result.min = samples.empty() ? 0 : samples.front();
+    double sum = 0;
+    for (double s : samples)
+        sum += s;
+    result.mean = samples.empty() ? 0 : sum / samples.size();
+    double variance = 0;
+    for (double s : samples)
+        variance += (s - result.mean) * (s - result.mean);
+    result.stddev = samples.size() > 1 ? std::sqrt(variance / (samples.size() - 1)) : 0;
+}
+
+/* Time function, which must only return once its work is complete (e.g. after
+ * queue.finish()). bytes and flops are the amounts processed by one call. */
+template <typename Function>
+BenchmarkResult run_benchmark(const std::string& name, Function function, const BenchmarkSettings& settings,
+                              double bytes = 0, double flops = 0)
+{
+    for (size_t i = 0; i < settings.warmup; ++i)
+        function();
+
+    std::vector<double> samples;
+    Timer total;
+    Timer t;
+    while (samples.size() < settings.max_iterations &&
+           (samples.size() < settings.min_iterations || total.end() < settings.min_time))
+    {
+        t.start();
+        function();
+        samples.push_back(t.end());
+    }
+
+    BenchmarkResult result;
+    result.name = name;
+    result.bytes = bytes;
+    result.flops = flops;
+    summarize(samples, settings.outlier_threshold, result);
+    return result;
+}
+
+/* Collection of benchmark results with the command line options shared by the
+ * benchmark programs:
+ *     --warmup N --min-iterations N --max-iterations N --min-time seconds --outliers k
+ *     --csv file        write the results as CSV
+ *     --json file       write the results as JSON
+ *     --baseline file   compare medians with a CSV written by --csv
+ *     --tolerance r     relative slowdown accepted against the baseline (default 0.1)
+ * finish() prints the table, writes the files and returns the process exit code:
+ * EXIT_FAILURE when a benchmark regressed against the baseline. */
+class BenchmarkReport
+{
+
+    private:
+    std::vector<BenchmarkResult> results;
+    std::string csv_file;
+    std::string json_file;
+    std::string baseline_file;
+    double tolerance;
+
+    public:
+    BenchmarkSettings settings;
+
+    BenchmarkReport() : tolerance(0.1)
+    {}
+
+    /* Read (and remove) the benchmark options from the command line */
+    void parse_options(int& argc, char** argv)
+    {
+        settings.warmup = std::atoi(parse_option(argc, argv, "--warmup", std::to_string(settings.warmup)).c_str());
+        settings.min_iterations = std::max(1, std::atoi(parse_option(argc, argv, "--min-iterations", std::to_string(settings.min_iterations)).c_str()));
+        settings.max_iterations = std::max(1, std::atoi(parse_option(argc, argv, "--max-iterations", std::to_string(settings.max_iterations)).c_str()));
+        settings.min_time = std::atof(parse_option(argc, argv, "--min-time", std::to_string(settings.min_time)).c_str());
+        settings.outlier_threshold = std::atof(parse_option(argc, argv, "--outliers", std::to_string(settings.outlier_threshold)).c_str());
+        settings.max_iterations = std::max(settings.max_iterations, settings.min_iterations);
+        csv_file = parse_option(argc, argv, "--csv");
+        json_file = parse_option(argc, argv, "--json");
+        baseline_file = parse_option(argc, argv, "--baseline");
+        tolerance = std::atof(parse_option(argc, argv, "--tolerance", "0.1").c_str());
+    }
+
+    static const char* usage()
+    {
+        return "[--warmup N] [--min-iterations N] [--max-iterations N] [--min-time s] [--outliers k] "
+               "[--csv file] [--json file] [--baseline file.csv] [--tolerance r]";
+    }
+
+    template <typename Function>
+    const BenchmarkResult& run(const std::string& name, Function function, double bytes = 0, double flops = 0)
+    {
+        results.push_back(run_benchmark(name, function, settings, bytes, flops));
+        return results.back();
+    }
+
+    void add(const BenchmarkResult& result)
+    {
+        results.push_back(result);
+    }
+
+    const std::vector<BenchmarkResult>& get_results() const { return results; }
+
+    void print(std::ostream& out) const
+    {
+        out << "#Name\tIterations\tRejected\tMedian(s)\tP95(s)\t\tStddev(s)\tGB/s\t\tGFLOP/s" << std::endl;
+        for (auto &r : results)
+        {
+            out << r.name << "\t" << r.iterations << "\t\t" << r.rejected << "\t\t"
+                << r.median << "\t" << r.p95 << "\t" << r.stddev << "\t"
+                << r.gbps() << "\t\t" << r.gflops() << std::endl;
+        }
+    }
+
+    void write_csv(const std::string& file) const
+    {
+        std::ofstream out(file);
+        out << "name,iterations,rejected,median,mean,p95,stddev,min,bytes,flops,gbps,gflops" << std::endl;
+        for (auto &r : results)
+        {
+            out << r.name << "," << r.iterations << "," << r.rejected << ","
+                << r.median << "," << r.mean << "," << r.p95 << "," << r.stddev << "," << r.min << ","
+                << r.bytes << "," << r.flops << "," << r.gbps() << "," << r.gflops() << std::endl;
+        }
+    }
+
+    void write_json(const std::string& file) const
+    {
+        std::ofstream out(file);
+        out << "[" << std::endl;
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const BenchmarkResult& r = results[i];
+            out << "  {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+                << ", \"rejected\": " << r.rejected << ", \"median\": " << r.median
+                << ", \"mean\": " << r.mean << ", \"p95\": " << r.p95 << ", \"stddev\": " << r.stddev
+                << ", \"min\": " << r.min << ", \"gbps\": " << r.gbps() << ", \"gflops\": " << r.gflops() << "}"
+                << (i + 1 < results.size() ? "," : "") << std::endl;
+        }
+        out << "]" << std::endl;
+    }
+
+    /* Medians by name from a CSV written by write_csv() */
+    static std::map<std::string, double> read_baseline(const std::string& file)
+    {
+        std::map<std::string, double> medians;
+        std::ifstream in(file);
+        if (!in)
+        {
+            std::cerr << "Could not read baseline " << file << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::string line;
+        std::getline(in, line);
+        while (std::getline(in, line))
+        {
+            std::stringstream fields(line);
+            std::string name, iterations, rejected, median;
+            if (std::getline(fields, name, ',') && std::getline(fields, iterations, ',') &&
+                std::getline(fields, rejected, ',') && std::getline(fields, median, ','))
+                medians[name] = std::atof(median.c_str());
+        }
+        return medians;
+    }
+
+    /* Number of benchmarks whose median is more than tolerance slower than the baseline */
+    size_t compare(const std::string& file, std::ostream& out) const
+    {
+        std::map<std::string, double> baseline = read_baseline(file);
+        size_t regressions = 0;
+        out << "#Name\tBaseline(s)\tMedian(s)\tRatio" << std::endl;
+        for (auto &r : results)
+        {
+            auto it = baseline.find(r.name);
+            if (it == baseline.end() || it->second <= 0)
+                continue;
+            double ratio = r.median / it->second;
+            bool regressed = ratio > 1 + tolerance;
+            regressions += regressed;
+            out << r.name << "\t" << it->second << "\t" << r.median << "\t" << ratio
+                << (regressed ? "\tREGRESSION" : "") << std::endl;
+        }
+        return regressions;
+    }
+
+    int finish(std::ostream& out)
+    {
+        print(out);
+        if (!csv_file.empty())
+            write_csv(csv_file);
+        if (!json_file.empty())
+            write_json(json_file);
+        if (!baseline_file.empty() && compare(baseline_file, out) > 0)
+        {
+            std::cerr << "Performance regression against " << baseline_file << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
     }
 
 };
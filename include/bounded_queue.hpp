@@ -0,0 +1,59 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/* Blocking FIFO of at most capacity items, shared between producer and consumer threads.
+ * Once closed, push() fails and pop() drains the remaining items before failing. */
+template <typename T>
+class BoundedQueue
+{
+
+    private:
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+
+    public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), closed(false)
+    {}
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed)
+            return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+};
+
+#endif
@@ -0,0 +1,383 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "opencl_utils.hpp"
+
+/* Size of the slabs small blocks are carved from, at most the device allocation limit */
+#define DEFAULT_SLAB_SIZE (16 << 20)
+/* Size classes with fewer blocks per slab get buffers of their own */
+#define SLAB_MIN_BLOCKS 4
+/* Slabs of the smallest classes hold at most this many blocks, not a full slab size */
+#define SLAB_MAX_BLOCKS 64
+/* Smallest size class, raised to the base address alignment of the device */
+#define MIN_POOL_BLOCK 4096
+
+/* Device memory handed out by a BufferPool.
+ * Buffers are recycled in size classes, so that programs processing images or vectors
+ * of varying sizes stop creating and destroying device buffers:
+ *  - small classes (powers of two, at most a quarter of a slab) are sub-buffers
+ *    (createSubBuffer) carved from slabs of at most SLAB_MAX_BLOCKS blocks, one at a
+ *    time as they are first handed out;
+ *  - larger classes (quarter steps between powers of two) are buffers of their own.
+ * Released blocks go back to the free list of their class and serve the next request
+ * of the same class, without any call to the driver. Blocks are never smaller than the
+ * request and are aligned on CL_DEVICE_MEM_BASE_ADDR_ALIGN, so they can be used as any
+ * buffer of the requested size. Sub-buffers of a slab never overlap: a kernel may read
+ * one block and write another one from the same slab.
+ * A block goes back to the pool as soon as its PooledBuffer is destroyed, whatever the
+ * commands still using it: owners must finish these commands before releasing a block
+ * that another queue may take (see ConvolutionEngine::set_buffer_pool). Users of a
+ * single in-order queue need not care.
+ * The pool counts requests, recycled blocks and driver allocations, and keeps the high
+ * water marks of the memory in use and held (report()). It is thread-safe.
+ *
+ * Usage:
+ *     std::shared_ptr<BufferPool> pool = std::make_shared<BufferPool>(context, device);
+ *     PooledBuffer image = pool->acquire(width * height);
+ *     kernel.setArg(0, image.buffer());
+ */
+
+class BufferPool;
+
+/* Block of a BufferPool, given back to the pool on destruction. Move-only. */
+class PooledBuffer
+{
+
+    friend class BufferPool;
+
+    private:
+    std::shared_ptr<BufferPool> pool;
+    cl::Buffer mem;
+    size_t requested;
+    size_t block_size;
+    cl_mem_flags flags;
+    /* Index of the slab of the block, -1 for a buffer of its own */
+    long slab;
+
+    void take(PooledBuffer& other)
+    {
+        pool = std::move(other.pool);
+        mem = other.mem;
+        requested = other.requested;
+        block_size = other.block_size;
+        flags = other.flags;
+        slab = other.slab;
+        other.pool.reset();
+        other.mem = cl::Buffer();
+        other.requested = 0;
+        other.block_size = 0;
+    }
+
+    public:
+    PooledBuffer() : requested(0), block_size(0), flags(0), slab(-1) {}
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    PooledBuffer(PooledBuffer&& other) : requested(0), block_size(0), flags(0), slab(-1)
+    {
+        take(other);
+    }
+
+    PooledBuffer& operator=(PooledBuffer&& other)
+    {
+        if (this != &other)
+        {
+            release();
+            take(other);
+        }
+        return *this;
+    }
+
+    ~PooledBuffer()
+    {
+        release();
+    }
+
+    /* Give the block back to its pool; the handle is then empty */
+    void release();
+
+    const cl::Buffer& buffer() const { return mem; }
+    /* Requested size, and size of the block (at least the requested size) */
+    size_t size() const { return requested; }
+    size_t capacity() const { return block_size; }
+    bool empty() const { return !pool; }
+
+};
+
+/* Counters of a BufferPool. Sizes are in bytes of blocks, i.e. including the rounding
+ * up to the size classes. */
+struct BufferPoolStats
+{
+    /* acquire() calls, those served without allocating device memory (recycled blocks or
+     * blocks carved from an existing slab), and buffers allocated by the driver */
+    size_t requests;
+    size_t hits;
+    size_t allocations;
+    size_t slabs;
+    /* Memory handed out, and memory held by the pool (handed out or free), with their peaks */
+    size_t in_use;
+    size_t in_use_peak;
+    size_t reserved;
+    size_t reserved_peak;
+
+    BufferPoolStats() : requests(0), hits(0), allocations(0), slabs(0), in_use(0), in_use_peak(0), reserved(0), reserved_peak(0) {}
+};
+
+/* Must be created with std::make_shared: blocks keep their pool alive */
+class BufferPool : public std::enable_shared_from_this<BufferPool>
+{
+
+    friend class PooledBuffer;
+
+    private:
+    struct Block
+    {
+        cl::Buffer buffer;
+        long slab;
+    };
+
+    struct Slab
+    {
+        /* Null once trimmed; the index of a slab never changes */
+        cl::Buffer buffer;
+        size_t bytes;
+        size_t block_size;
+        size_t blocks;
+        /* Blocks not handed out, and blocks already created as sub-buffers */
+        size_t free;
+        size_t carved;
+    };
+
+    cl::Context context;
+    size_t min_block;
+    size_t slab_size;
+    size_t max_alloc;
+    std::mutex mutex;
+    /* Free blocks by flags and size class */
+    std::map<std::pair<cl_mem_flags, size_t>, std::vector<Block> > free_blocks;
+    std::vector<Slab> slabs;
+    /* Slab whose blocks are being carved, by flags and size class */
+    std::map<std::pair<cl_mem_flags, size_t>, long> carving;
+    BufferPoolStats stats;
+
+    /* Size of the blocks serving requests of bytes */
+    size_t size_class(size_t bytes) const
+    {
+        size_t power = min_block;
+        while (power < bytes)
+            power *= 2;
+        if (power == min_block || power <= slab_size / SLAB_MIN_BLOCKS)
+            return power;
+        /* Quarter steps between power / 2 and power waste at most 25% */
+        size_t half = power / 2;
+        size_t step = half / 4;
+        size_t size = half + (bytes - half + step - 1) / step * step;
+        return std::max(bytes, std::min(size, max_alloc));
+    }
+
+    void add_reserved(size_t bytes)
+    {
+        stats.reserved += bytes;
+        stats.reserved_peak = std::max(stats.reserved_peak, stats.reserved);
+        ++stats.allocations;
+    }
+
+    /* Create a slab for blocks of block_size bytes, without any sub-buffer yet */
+    long add_slab(cl_mem_flags flags, size_t block_size)
+    {
+        Slab slab;
+        slab.bytes = std::min(slab_size, block_size * SLAB_MAX_BLOCKS);
+        slab.buffer = cl::Buffer(context, flags, slab.bytes);
+        slab.block_size = block_size;
+        slab.blocks = slab.bytes / block_size;
+        slab.free = slab.blocks;
+        slab.carved = 0;
+        long index = slabs.size();
+        slabs.push_back(slab);
+        add_reserved(slab.bytes);
+        ++stats.slabs;
+        return index;
+    }
+
+    /* Put the next block of a slab of flags and block_size in blocks, creating the slab
+     * when the current one is exhausted. Tells whether a slab was created. */
+    bool carve_block(cl_mem_flags flags, size_t block_size, std::vector<Block>& blocks)
+    {
+        std::pair<cl_mem_flags, size_t> key = std::make_pair(flags, block_size);
+        auto it = carving.find(key);
+        bool created = false;
+        if (it == carving.end() || slabs[it->second].carved == slabs[it->second].blocks)
+        {
+            carving[key] = add_slab(flags, block_size);
+            created = true;
+        }
+        long index = carving[key];
+        Slab& slab = slabs[index];
+
+        /* Sub-buffers inherit the host flags of the slab and only take access flags */
+        cl_mem_flags access = flags & (CL_MEM_READ_WRITE | CL_MEM_READ_ONLY | CL_MEM_WRITE_ONLY);
+        cl_buffer_region region = {slab.carved * block_size, block_size};
+        Block block;
+        block.buffer = slab.buffer.createSubBuffer(access, CL_BUFFER_CREATE_TYPE_REGION, &region);
+        block.slab = index;
+        blocks.push_back(block);
+        ++slab.carved;
+        return created;
+    }
+
+    void release(PooledBuffer& handle)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Block block;
+        block.buffer = handle.mem;
+        block.slab = handle.slab;
+        free_blocks[std::make_pair(handle.flags, handle.block_size)].push_back(block);
+        if (block.slab >= 0)
+            ++slabs[block.slab].free;
+        stats.in_use -= handle.block_size;
+    }
+
+    public:
+    BufferPool(cl::Context context, cl::Device device, size_t slab_size = DEFAULT_SLAB_SIZE) : context(context)
+    {
+        size_t alignment = device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8;
+        min_block = std::max<size_t>(MIN_POOL_BLOCK, alignment);
+        max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        this->slab_size = std::max(min_block, std::min(slab_size, max_alloc));
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /* Block of at least bytes bytes created with flags, which can not include host pointer
+     * flags other than CL_MEM_ALLOC_HOST_PTR: recycled blocks hold the data of their
+     * previous owner. Throws cl::Error when the device is out of memory. */
+    PooledBuffer acquire(size_t bytes, cl_mem_flags flags = CL_MEM_READ_WRITE)
+    {
+        if (flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR))
+        {
+            std::cerr << "BufferPool: blocks can not be created from host memory" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        size_t block_size = size_class(std::max<size_t>(bytes, 1));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        ++stats.requests;
+        std::vector<Block>& blocks = free_blocks[std::make_pair(flags, block_size)];
+        if (!blocks.empty())
+        {
+            ++stats.hits;
+        }
+        else if (block_size <= slab_size / SLAB_MIN_BLOCKS)
+        {
+            if (!carve_block(flags, block_size, blocks))
+                ++stats.hits;
+        }
+        else
+        {
+            Block block;
+            block.buffer = cl::Buffer(context, flags, block_size);
+            block.slab = -1;
+            blocks.push_back(block);
+            add_reserved(block_size);
+        }
+
+        PooledBuffer handle;
+        handle.pool = shared_from_this();
+        handle.mem = blocks.back().buffer;
+        handle.slab = blocks.back().slab;
+        handle.requested = bytes;
+        handle.block_size = block_size;
+        handle.flags = flags;
+        blocks.pop_back();
+        if (handle.slab >= 0)
+            --slabs[handle.slab].free;
+        stats.in_use += block_size;
+        stats.in_use_peak = std::max(stats.in_use_peak, stats.in_use);
+        return handle;
+    }
+
+    /* Free the device memory that is not in use: free buffers of their own, and slabs
+     * whose blocks are all free */
+    void trim()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &entry : free_blocks)
+        {
+            std::vector<Block>& blocks = entry.second;
+            std::vector<Block> kept;
+            for (auto &block : blocks)
+            {
+                if (block.slab < 0)
+                    stats.reserved -= entry.first.second;
+                else if (slabs[block.slab].free < slabs[block.slab].blocks)
+                    kept.push_back(block);
+            }
+            blocks.swap(kept);
+        }
+        for (auto &slab : slabs)
+        {
+            if (slab.blocks > 0 && slab.free == slab.blocks)
+            {
+                slab.buffer = cl::Buffer();
+                slab.blocks = 0;
+                slab.free = 0;
+                slab.carved = 0;
+                stats.reserved -= slab.bytes;
+                --stats.slabs;
+            }
+        }
+        /* Trimmed slabs have no block left to carve */
+        for (auto it = carving.begin(); it != carving.end();)
+        {
+            if (slabs[it->second].blocks == 0)
+                it = carving.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    BufferPoolStats get_stats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    size_t get_slab_size() const { return slab_size; }
+
+    /* One line summary of the counters */
+    void report(std::ostream& out)
+    {
+        BufferPoolStats s = get_stats();
+        double served = s.requests ? 100.0 * s.hits / s.requests : 0;
+        out << "# Buffer pool: " << s.requests << " requests, " << s.hits << " served from the pool ("
+            << std::fixed << std::setprecision(1) << served << "%), " << s.allocations << " allocations ("
+            << s.slabs << " slabs), peak " << s.in_use_peak / 1e6 << " MB in use, "
+            << s.reserved_peak / 1e6 << " MB held" << std::endl;
+        out.unsetf(std::ios::floatfield);
+        out << std::setprecision(6);
+    }
+
+};
+
+inline void PooledBuffer::release()
+{
+    if (pool)
+        pool->release(*this);
+    pool.reset();
+    mem = cl::Buffer();
+    requested = 0;
+    block_size = 0;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef COLOR_CONVERSION_HPP
+#define COLOR_CONVERSION_HPP
+
+#include <string>
+
+#include "opencl_utils.hpp"
+
+/* Layout of the pixels of a decoded image */
+enum PixelFormat
+{
+    PIXEL_GRAY,
+    PIXEL_RGB,
+    PIXEL_BGR,
+    PIXEL_RGBA,
+    PIXEL_BGRA
+};
+
+inline size_t pixel_channels(PixelFormat format)
+{
+    switch (format)
+    {
+        case PIXEL_GRAY: return 1;
+        case PIXEL_RGB:
+        case PIXEL_BGR: return 3;
+        default: return 4;
+    }
+}
+
+/* Index of the red byte of a pixel, as expected by the kernels of kernelColor.cl */
+inline cl_uint pixel_red_index(PixelFormat format)
+{
+    return format == PIXEL_BGR || format == PIXEL_BGRA ? 2 : 0;
+}
+
+/* Gray version of the width x height pixels of the given format, computed on the host
+ * as color_to_gray does, for the code paths that run no kernel (e.g. the CPU backend) */
+inline void convert_to_gray(const unsigned char* pixels, size_t width, size_t height, PixelFormat format, unsigned char* out)
+{
+    size_t channels = pixel_channels(format);
+    size_t red = pixel_red_index(format);
+    for (size_t i = 0; i < width * height; ++i)
+    {
+        const unsigned char* pixel = pixels + i * channels;
+        if (channels < 3)
+        {
+            out[i] = pixel[0];
+            continue;
+        }
+        unsigned int r = pixel[red];
+        unsigned int g = pixel[1];
+        unsigned int b = pixel[2 - red];
+        out[i] = (unsigned char)((r * 4899 + g * 9617 + b * 1868 + 8192) >> 14);
+    }
+}
+
+/* On-device colour conversions (kernelColor.cl), replacing the cvtColor calls around
+ * the kernels: decoded pixels are uploaded as they are and converted next to the data.
+ * The converter has no queue of its own: conversions are enqueued on the queue of the
+ * caller, in order with its other commands. Gray conversions match cvtColor exactly. */
+class ColorConverter
+{
+
+    private:
+    cl::Program program;
+    cl::Kernel gray_kernel;
+    cl::Kernel rgba_kernel;
+
+    void launch(cl::CommandQueue& queue, cl::Kernel& kernel, const cl::Buffer& in, size_t width, size_t height,
+                PixelFormat format, const cl::Buffer& out, cl::Event* event)
+    {
+        kernel.setArg(0, in);
+        kernel.setArg(1, (cl_uint) width);
+        kernel.setArg(2, (cl_uint) height);
+        kernel.setArg(3, (cl_uint) pixel_channels(format));
+        kernel.setArg(4, pixel_red_index(format));
+        kernel.setArg(5, out);
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange, NULL, event);
+    }
+
+    public:
+    ColorConverter(cl::Context context, cl::Device device, std::string kernel_source_file = "../src/kernelColor.cl")
+    {
+        program = load_and_build_program(context, device, kernel_source_file);
+        gray_kernel = cl::Kernel(program, "color_to_gray");
+        rgba_kernel = cl::Kernel(program, "color_to_rgba");
+    }
+
+    /* Enqueue the conversion of the width x height image in, of the given format, into
+     * the gray image out */
+    void enqueue_to_gray(cl::CommandQueue& queue, const cl::Buffer& in, size_t width, size_t height,
+                         PixelFormat format, const cl::Buffer& out, cl::Event* event = NULL)
+    {
+        launch(queue, gray_kernel, in, width, height, format, out, event);
+    }
+
+    /* Enqueue the conversion of the width x height image in, of the given format, into
+     * the RGBA image out. PIXEL_BGRA turns an RGBA image into a BGRA one and back. */
+    void enqueue_to_rgba(cl::CommandQueue& queue, const cl::Buffer& in, size_t width, size_t height,
+                         PixelFormat format, const cl::Buffer& out, cl::Event* event = NULL)
+    {
+        launch(queue, rgba_kernel, in, width, height, format, out, event);
+    }
+
+};
+
+#endif
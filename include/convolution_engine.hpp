@@ -0,0 +1,685 @@
+#ifndef CONVOLUTION_ENGINE_HPP
+#define CONVOLUTION_ENGINE_HPP
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <cstring>
+
+#include "opencl_utils.hpp"
+#include "autotuner.hpp"
+#include "benchmark.hpp"
+#include "buffer_pool.hpp"
+#include "image_batch.hpp"
+#include "kernel_variants.hpp"
+#include "masks.hpp"
+#include "profiling.hpp"
+
+/* Convolution mask resident on the device, with everything needed to pick a kernel */
+struct DeviceMask
+{
+    size_t width;
+    size_t height;
+    float total;
+    std::vector<float> values;
+    cl::Buffer buffer;
+    /* Factors of the mask (values = col x row) when it is separable */
+    bool separable;
+    cl::Buffer row;
+    cl::Buffer col;
+
+    DeviceMask() : width(0), height(0), total(0), separable(false) {}
+};
+
+/* Structuring element resident on the device */
+struct DeviceStructuringElement
+{
+    size_t size;
+    std::vector<int> values;
+    cl::Buffer buffer;
+
+    DeviceStructuringElement() : size(0) {}
+};
+
+/* Upload mask to the device in context, or do nothing if device_mask already holds it */
+inline void prepare_device_mask(const cl::Context& context, DeviceMask& device_mask, const float* values, size_t mask_width, size_t mask_height)
+{
+    size_t count = mask_width * mask_height;
+    if (device_mask.width == mask_width && device_mask.height == mask_height &&
+        std::memcmp(device_mask.values.data(), values, count * sizeof(float)) == 0)
+        return;
+
+    device_mask.width = mask_width;
+    device_mask.height = mask_height;
+    device_mask.values.assign(values, values + count);
+    device_mask.total = 0;
+    for (size_t i = 0; i < count; ++i)
+        device_mask.total += values[i];
+    device_mask.buffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, count * sizeof(float), device_mask.values.data());
+
+    std::vector<float> col, row;
+    device_mask.separable = mask_width > 1 && mask_height > 1 && factor_separable(values, mask_width, mask_height, col, row);
+    if (device_mask.separable)
+    {
+        device_mask.row = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, row.size() * sizeof(float), row.data());
+        device_mask.col = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, col.size() * sizeof(float), col.data());
+    }
+}
+
+/* Upload a structuring element to the device in context, or do nothing if device_se already holds it */
+inline void prepare_device_structuring_element(const cl::Context& context, DeviceStructuringElement& device_se, const int* values, size_t se_size)
+{
+    size_t count = se_size * se_size;
+    if (device_se.size == se_size && std::memcmp(device_se.values.data(), values, count * sizeof(int)) == 0)
+        return;
+
+    device_se.size = se_size;
+    device_se.values.assign(values, values + count);
+    device_se.buffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, count * sizeof(int), device_se.values.data());
+}
+
+/* Stateful wrapper around the kernels of kernelConv.cl.
+ * The engine owns its context, queue and program, and keeps device buffers alive
+ * between calls: image buffers grow to the largest image seen and are reused for
+ * every smaller one, kernels are created once, and masks / structuring elements are
+ * only uploaded when they differ from the previous call. Results are written into
+ * memory provided by the caller.
+ * Separable (rank 1) masks such as Gaussians or box filters are detected when the mask
+ * is uploaded and run as a row pass followed by a column pass, i.e. with
+ * mask_width + mask_height instead of mask_width x mask_height operations per pixel.
+ * The enqueue_* functions work on device buffers only, for callers chaining several
+ * operations without going back to the host (see pipeline.hpp).
+ * Batches of small gray images (image_batch.hpp) are convolved or eroded by a single
+ * launch (convolve_batch(), erode_batch()).
+ * RGBA images are convolved on all channels at once by the vectorized rgba_conv kernel,
+ * whose vector width is set when the program is built (see vector_build_options()).
+ * Engines built from a source file compile, on first use, a program specialized for
+ * each common mask / structuring element size, whose loops are unrolled (see
+ * kernel_variants.hpp); other sizes use the generic program.
+ * Image and intermediate buffers come from a BufferPool, which can be shared with other
+ * engines and pipelines of the same context (set_buffer_pool()).
+ * Work-group sizes come from an Autotuner when one is attached (measured on the device
+ * and stored in its tuning file), from choose_local_size_2d() for the tiled kernels
+ * otherwise; the global range is then padded to a multiple of the work-group size.
+ * The queue is created with profiling enabled: when a Profiler is attached, every
+ * transfer and kernel launch is recorded in it. */
+class ConvolutionEngine
+{
+
+    private:
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    cl::Program program;
+    /* Kernels by name and definitions of the program they come from */
+    std::map<std::pair<std::string, std::string>, cl::Kernel> kernels;
+    /* Specialized programs, NULL when every kernel comes from program */
+    std::shared_ptr<KernelVariants> variants;
+
+    /* Device memory of the engine, and of the pipelines built on it */
+    std::shared_ptr<BufferPool> pool;
+    PooledBuffer image_in;
+    PooledBuffer image_out;
+
+    /* Last mask / structuring element used by convolve() and erode() */
+    DeviceMask mask;
+    DeviceStructuringElement structuring_element;
+
+    /* Float buffer between both passes of a separable convolution */
+    PooledBuffer intermediate;
+
+    /* Packed images, results and table of the last batch */
+    PooledBuffer batch_in;
+    PooledBuffer batch_out;
+    PooledBuffer batch_table;
+
+    /* Work-group size chosen for each kernel, by (kernel, definitions, width, height, halo x, halo y).
+     * An empty range means that the driver picks the size, or for the tiled kernels that
+     * the tile does not fit in local memory. */
+    std::map<std::tuple<std::string, std::string, size_t, size_t, size_t, size_t>, cl::NDRange> local_sizes;
+
+    Profiler* profiler;
+    Autotuner* tuner;
+
+    /* VECTOR_WIDTH the program was built with */
+    size_t vector_width;
+
+    /* CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE: larger masks can not be constant kernel arguments */
+    cl_ulong max_constant_bytes;
+
+    void reserve_images(size_t bytes)
+    {
+        if (bytes <= image_in.capacity())
+            return;
+        /* The old blocks may go to another queue sharing the pool */
+        if (!image_in.empty())
+            queue.finish();
+        image_in = pool->acquire(bytes);
+        image_out = pool->acquire(bytes);
+    }
+
+    /* Upload the pixels and the table of batch, which must only hold gray images */
+    void upload_batch(const ImageBatch& batch)
+    {
+        if (batch.get_max_channels() != 1)
+        {
+            std::cerr << "ConvolutionEngine: batches must hold gray images" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        size_t table_bytes = batch.table().size() * sizeof(cl_uint);
+        if (batch.bytes() > batch_in.capacity() || table_bytes > batch_table.capacity())
+        {
+            if (!batch_in.empty())
+                queue.finish();
+            batch_in = pool->acquire(std::max(batch.bytes(), batch_in.capacity()));
+            batch_out = pool->acquire(std::max(batch.bytes(), batch_out.capacity()));
+            batch_table = pool->acquire(std::max(table_bytes, batch_table.capacity()), CL_MEM_READ_ONLY);
+        }
+        queue.enqueueWriteBuffer(batch_in.buffer(), CL_FALSE, 0, batch.bytes(), batch.pixels(), NULL, track(PROFILE_H2D, "batch"));
+        queue.enqueueWriteBuffer(batch_table.buffer(), CL_FALSE, 0, table_bytes, batch.table().data(), NULL, track(PROFILE_H2D, "batch table"));
+    }
+
+    /* Enqueue a *_batch kernel over count images of at most width x height pixels, with
+     * the work-group size kernel_name gets for a single image of that size */
+    void launch_batch(cl::Kernel& kernel, const std::string& kernel_name, const std::string& definitions,
+                      size_t width, size_t height, size_t count)
+    {
+        cl::NDRange local;
+        local_size(kernel_name, definitions, width, height, 0, 0, 0, local);
+        if (local.dimensions() == 2)
+        {
+            const size_t* local_size = local;
+            local = cl::NDRange(local_size[0], local_size[1], 1);
+        }
+        cl::NDRange global = pad_global_range(cl::NDRange(width, height, count), local);
+        cl::Event* event = profiler ? profiler->track(PROFILE_KERNEL, kernel_name) : NULL;
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, NULL, event);
+    }
+
+    /* Enqueue kernel over a width x height range.
+     * The global size is padded to a multiple of local when one is given. */
+    void launch(cl::Kernel& kernel, size_t width, size_t height, const cl::NDRange& local = cl::NullRange)
+    {
+        cl::NDRange global = pad_global_range(cl::NDRange(width, height), local);
+        cl::Event* event = profiler ? profiler->track(PROFILE_KERNEL, kernel.getInfo<CL_KERNEL_FUNCTION_NAME>()) : NULL;
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, NULL, event);
+    }
+
+    public:
+    ConvolutionEngine(cl::Context context, cl::Device device, cl::Program program) :
+        context(context), device(device), queue(context, device, CL_QUEUE_PROFILING_ENABLE), program(program),
+        profiler(NULL), tuner(NULL)
+    {
+        pool = std::make_shared<BufferPool>(context, device);
+        vector_width = program_vector_width(program, device);
+        max_constant_bytes = device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
+    }
+
+    /* build_options (e.g. "-cl-fast-relaxed-math") are added to every program */
+    ConvolutionEngine(cl::Device device, std::string kernel_source_file = "../src/kernelConv.cl", std::string build_options = "") :
+        context(std::vector<cl::Device>(1, device)), device(device), profiler(NULL), tuner(NULL)
+    {
+        queue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+        pool = std::make_shared<BufferPool>(context, device);
+        vector_width = char_vector_width(device);
+        max_constant_bytes = device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
+        std::string options = vector_build_options(device);
+        if (!build_options.empty())
+            options += " " + build_options;
+        variants = std::make_shared<KernelVariants>(context, device, kernel_source_file, options);
+        program = variants->program();
+    }
+
+    /* Kernel name of the program built with definitions (see KernelVariants), or of the
+     * generic program when definitions is empty or the engine has no variants */
+    cl::Kernel& get_kernel(const std::string& name, const std::string& definitions = "")
+    {
+        std::string key = variants ? definitions : "";
+        auto it = kernels.find(std::make_pair(name, key));
+        if (it == kernels.end())
+        {
+            cl::Program& source = key.empty() ? program : variants->program(key);
+            it = kernels.insert(std::make_pair(std::make_pair(name, key), cl::Kernel(source, name.c_str()))).first;
+        }
+        return it->second;
+    }
+
+    /* Definitions of the program specialized for device_mask, "" for the generic one */
+    std::string mask_definitions(const DeviceMask& device_mask) const
+    {
+        return variants ? variants->mask_definitions(device_mask.width, device_mask.height) : "";
+    }
+
+    /* True when device_mask, plus extra_bytes of other constant arguments, fits in the
+     * constant memory of the device */
+    bool mask_fits_constant_memory(const DeviceMask& device_mask, size_t extra_bytes = 0) const
+    {
+        return device_mask.values.size() * sizeof(float) + extra_bytes <= max_constant_bytes;
+    }
+
+    /* Definitions of the program whose gray_conv_tiled, gray_conv_erode and rgba_conv read
+     * the mask from global memory (see MASK_SPACE in kernelConv.cl). Engines built from a
+     * program have no such variant: "" is returned and the callers must do without. */
+    std::string global_mask_definitions() const
+    {
+        return variants ? "-D MASK_SPACE=global" : "";
+    }
+
+    /* Definitions of the program specialized for device_se, "" for the generic one */
+    std::string se_definitions(const DeviceStructuringElement& device_se) const
+    {
+        return variants ? variants->se_definitions(device_se.size) : "";
+    }
+
+    /* Work-group size of kernel_name over a width x height range. Kernels staging a tile
+     * with the given halo of bytes_per_item elements in local memory pass bytes_per_item > 0.
+     * With a tuner attached, the size stored for the device is used, or measured when missing
+     * and sweeping is enabled: the kernel arguments must then be set, and configure is called
+     * with every candidate size to set the local memory arguments. Otherwise tiled kernels get
+     * choose_local_size_2d() and the others cl::NullRange. Returns false if no tile fits. */
+    bool local_size(const std::string& kernel_name, const std::string& definitions, size_t width, size_t height,
+                    size_t halo_x, size_t halo_y, size_t bytes_per_item, cl::NDRange& local,
+                    std::function<void(const cl::NDRange&)> configure = nullptr)
+    {
+        bool tiled = bytes_per_item > 0;
+        auto key = std::make_tuple(kernel_name, definitions, width, height, halo_x, halo_y);
+        auto it = local_sizes.find(key);
+        if (it == local_sizes.end())
+        {
+            cl::Kernel& kernel = get_kernel(kernel_name, definitions);
+            cl::NDRange chosen;
+            bool found = false;
+            if (tuner)
+            {
+                std::string variant = definitions;
+                if (tiled)
+                    variant += (variant.empty() ? "" : " ") + std::string("halo=") + std::to_string(halo_x) + "x" + std::to_string(halo_y);
+                std::string tuning_key = tuner->key(kernel, variant, cl::NDRange(width, height));
+                found = tuner->lookup(tuning_key, chosen, &kernel);
+                if (!found && tuner->get_sweep())
+                {
+                    found = tuner->tune(queue, kernel, tuning_key, cl::NDRange(width, height),
+                                        candidate_local_sizes_2d(kernel, device, width, height, halo_x, halo_y, bytes_per_item),
+                                        chosen, configure);
+                }
+            }
+            if (!found && tiled && !choose_local_size_2d(kernel, device, width, height, chosen, halo_x, halo_y, bytes_per_item))
+                chosen = cl::NullRange;
+            it = local_sizes.insert(std::make_pair(key, chosen)).first;
+        }
+        local = it->second;
+        return !tiled || local.dimensions() == 2;
+    }
+
+    /* Upload mask to the device, or do nothing if device_mask already holds it */
+    void prepare_mask(DeviceMask& device_mask, const float* values, size_t mask_width, size_t mask_height)
+    {
+        prepare_device_mask(context, device_mask, values, mask_width, mask_height);
+    }
+
+    /* Upload a structuring element to the device, or do nothing if device_se already holds it */
+    void prepare_structuring_element(DeviceStructuringElement& device_se, const int* values, size_t se_size)
+    {
+        prepare_device_structuring_element(context, device_se, values, se_size);
+    }
+
+    /* Enqueue the convolution of the width x height gray image in device buffer in into out.
+     * Uses the separable kernels when possible, then the tiled kernel, then the generic one. */
+    void enqueue_convolution(const DeviceMask& device_mask, const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height)
+    {
+        if (device_mask.separable)
+        {
+            size_t bytes = width * height * sizeof(float);
+            if (bytes > intermediate.capacity())
+            {
+                if (!intermediate.empty())
+                    queue.finish();
+                intermediate = pool->acquire(bytes);
+            }
+
+            cl::Kernel& rowKernel = get_kernel("gray_conv_rows");
+            rowKernel.setArg(0, in);
+            rowKernel.setArg(1, (cl_uint) width);
+            rowKernel.setArg(2, (cl_uint) height);
+            rowKernel.setArg(3, device_mask.row);
+            rowKernel.setArg(4, (cl_uint) device_mask.width);
+            rowKernel.setArg(5, intermediate.buffer());
+            cl::NDRange row_local;
+            local_size("gray_conv_rows", "", width, height, 0, 0, 0, row_local);
+            launch(rowKernel, width, height, row_local);
+
+            cl::Kernel& colKernel = get_kernel("gray_conv_cols");
+            colKernel.setArg(0, intermediate.buffer());
+            colKernel.setArg(1, (cl_uint) width);
+            colKernel.setArg(2, (cl_uint) height);
+            colKernel.setArg(3, device_mask.col);
+            colKernel.setArg(4, (cl_uint) device_mask.height);
+            colKernel.setArg(5, out);
+            cl::NDRange col_local;
+            local_size("gray_conv_cols", "", width, height, 0, 0, 0, col_local);
+            launch(colKernel, width, height, col_local);
+            return;
+        }
+        enqueue_dense_convolution(device_mask, in, out, width, height);
+    }
+
+    /* Same as enqueue_convolution, but with the dense kernels even when the mask is separable */
+    void enqueue_dense_convolution(const DeviceMask& device_mask, const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height)
+    {
+        /* The tiled kernel is used whenever the tile and its halo fit in local memory.
+         * Masks larger than the constant memory go to its MASK_SPACE=global variant, or
+         * straight to gray_conv_buff when the engine has none. */
+        bool constant_mask = mask_fits_constant_memory(device_mask);
+        std::string definitions = constant_mask ? mask_definitions(device_mask) : global_mask_definitions();
+        bool tiled = constant_mask || variants;
+        size_t halo_x = device_mask.width - 1;
+        size_t halo_y = device_mask.height - 1;
+        cl::Kernel& convKernel = get_kernel("gray_conv_tiled", definitions);
+        auto set_tile = [&](const cl::NDRange& local)
+        {
+            const size_t* local_size = local;
+            convKernel.setArg(7, cl::Local((local_size[0] + halo_x) * (local_size[1] + halo_y) * sizeof(float)));
+        };
+        if (tiled)
+        {
+            convKernel.setArg(0, in);
+            // Kernel scalar arguments can not be of type size_t
+            convKernel.setArg(1, (cl_uint) width);
+            convKernel.setArg(2, (cl_uint) height);
+            convKernel.setArg(3, device_mask.buffer);
+            convKernel.setArg(4, (cl_uint) device_mask.width);
+            convKernel.setArg(5, (cl_uint) device_mask.height);
+            convKernel.setArg(6, device_mask.total);
+            convKernel.setArg(8, out);
+        }
+        cl::NDRange local;
+        if (tiled && local_size("gray_conv_tiled", definitions, width, height, halo_x, halo_y, sizeof(float), local, set_tile))
+        {
+            set_tile(local);
+            launch(convKernel, width, height, local);
+        }
+        else
+        {
+            cl::Kernel& directKernel = get_kernel("gray_conv_buff", definitions);
+            directKernel.setArg(0, in);
+            directKernel.setArg(1, (cl_uint) width);
+            directKernel.setArg(2, (cl_uint) height);
+            directKernel.setArg(3, device_mask.buffer);
+            directKernel.setArg(4, (cl_uint) device_mask.width);
+            directKernel.setArg(5, (cl_uint) device_mask.height);
+            directKernel.setArg(6, out);
+            cl::NDRange direct_local;
+            local_size("gray_conv_buff", definitions, width, height, 0, 0, 0, direct_local);
+            launch(directKernel, width, height, direct_local);
+        }
+    }
+
+    /* Enqueue the erosion of the width x height gray image in device buffer in into out */
+    void enqueue_erosion(const DeviceStructuringElement& device_se, const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height)
+    {
+        std::string definitions = se_definitions(device_se);
+        cl::Kernel& erodeKernel = get_kernel("erode", definitions);
+        erodeKernel.setArg(0, in);
+        erodeKernel.setArg(1, (cl_uint) width);
+        erodeKernel.setArg(2, (cl_uint) height);
+        erodeKernel.setArg(3, device_se.buffer);
+        erodeKernel.setArg(4, (cl_uint) device_se.size);
+        erodeKernel.setArg(5, out);
+        cl::NDRange local;
+        local_size("erode", definitions, width, height, 0, 0, 0, local);
+        launch(erodeKernel, width, height, local);
+    }
+
+    /* Enqueue the convolution of the four channels of the width x height RGBA image in
+     * device buffer in into out */
+    void enqueue_rgba_convolution(const DeviceMask& device_mask, const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height)
+    {
+        std::string definitions = mask_definitions(device_mask);
+        if (!mask_fits_constant_memory(device_mask))
+        {
+            if (!variants)
+            {
+                std::cerr << "ConvolutionEngine: the " << device_mask.width << "x" << device_mask.height
+                          << " mask does not fit in the constant memory of the device" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            definitions = global_mask_definitions();
+        }
+        cl::Kernel& rgbaKernel = get_kernel("rgba_conv", definitions);
+        rgbaKernel.setArg(0, in);
+        rgbaKernel.setArg(1, (cl_uint) width);
+        rgbaKernel.setArg(2, (cl_uint) height);
+        rgbaKernel.setArg(3, device_mask.buffer);
+        rgbaKernel.setArg(4, (cl_uint) device_mask.width);
+        rgbaKernel.setArg(5, (cl_uint) device_mask.height);
+        rgbaKernel.setArg(6, device_mask.total);
+        rgbaKernel.setArg(7, out);
+        /* Every work-item handles vector_width / 4 pixels of a row */
+        size_t pixels_per_item = vector_width / 4;
+        size_t items = (width + pixels_per_item - 1) / pixels_per_item;
+        cl::NDRange local;
+        local_size("rgba_conv", definitions, items, height, 0, 0, 0, local);
+        launch(rgbaKernel, items, height, local);
+    }
+
+    /* Enqueue the convolution of the count gray images packed in device buffer in and
+     * described by table (see image_batch.hpp), at most max_width x max_height pixels each,
+     * into out */
+    void enqueue_convolution_batch(const DeviceMask& device_mask, const cl::Buffer& in, const cl::Buffer& table, const cl::Buffer& out,
+                                   size_t count, size_t max_width, size_t max_height)
+    {
+        std::string definitions = mask_definitions(device_mask);
+        cl::Kernel& batchKernel = get_kernel("gray_conv_batch", definitions);
+        batchKernel.setArg(0, in);
+        batchKernel.setArg(1, table);
+        batchKernel.setArg(2, device_mask.buffer);
+        batchKernel.setArg(3, (cl_uint) device_mask.width);
+        batchKernel.setArg(4, (cl_uint) device_mask.height);
+        batchKernel.setArg(5, out);
+        launch_batch(batchKernel, "gray_conv_batch", definitions, max_width, max_height, count);
+    }
+
+    /* Enqueue the erosion of the count gray images packed in device buffer in and
+     * described by table, at most max_width x max_height pixels each, into out */
+    void enqueue_erosion_batch(const DeviceStructuringElement& device_se, const cl::Buffer& in, const cl::Buffer& table, const cl::Buffer& out,
+                               size_t count, size_t max_width, size_t max_height)
+    {
+        std::string definitions = se_definitions(device_se);
+        cl::Kernel& batchKernel = get_kernel("erode_batch", definitions);
+        batchKernel.setArg(0, in);
+        batchKernel.setArg(1, table);
+        batchKernel.setArg(2, device_se.buffer);
+        batchKernel.setArg(3, (cl_uint) device_se.size);
+        batchKernel.setArg(4, out);
+        launch_batch(batchKernel, "erode_batch", definitions, max_width, max_height, count);
+    }
+
+    /* Enqueue a convolution directly followed by an erosion in a single kernel, the
+     * convolved tile staying in local memory. Returns false (and enqueues nothing) if
+     * the tiles do not fit on the device, or if the mask and structuring element do not
+     * fit in its constant memory and the engine has no variant reading the mask from
+     * global memory. */
+    bool enqueue_fused_convolution_erosion(const DeviceMask& device_mask, const DeviceStructuringElement& device_se,
+                                           const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height)
+    {
+        size_t se_halo = device_se.size - 1;
+        size_t halo_x = device_mask.width - 1 + se_halo;
+        size_t halo_y = device_mask.height - 1 + se_halo;
+        std::string definitions = variants ? variants->fused_definitions(device_mask.width, device_mask.height, device_se.size) : "";
+        if (!mask_fits_constant_memory(device_mask, device_se.values.size() * sizeof(int)))
+        {
+            if (!variants)
+                return false;
+            definitions = global_mask_definitions();
+        }
+        cl::Kernel& fusedKernel = get_kernel("gray_conv_erode", definitions);
+        fusedKernel.setArg(0, in);
+        fusedKernel.setArg(1, (cl_uint) width);
+        fusedKernel.setArg(2, (cl_uint) height);
+        fusedKernel.setArg(3, device_mask.buffer);
+        fusedKernel.setArg(4, (cl_uint) device_mask.width);
+        fusedKernel.setArg(5, (cl_uint) device_mask.height);
+        fusedKernel.setArg(6, device_mask.total);
+        fusedKernel.setArg(7, device_se.buffer);
+        fusedKernel.setArg(8, (cl_uint) device_se.size);
+        fusedKernel.setArg(11, out);
+        auto set_tiles = [&](const cl::NDRange& local)
+        {
+            const size_t* local_size = local;
+            fusedKernel.setArg(9, cl::Local((local_size[0] + halo_x) * (local_size[1] + halo_y) * sizeof(float)));
+            fusedKernel.setArg(10, cl::Local((local_size[0] + se_halo) * (local_size[1] + se_halo) * sizeof(cl_uchar)));
+        };
+
+        /* One float of image tile and one byte of convolved tile per element, rounded up */
+        cl::NDRange local;
+        if (!local_size("gray_conv_erode", definitions, width, height, halo_x, halo_y, sizeof(float) + 1, local, set_tiles))
+            return false;
+
+        set_tiles(local);
+        launch(fusedKernel, width, height, local);
+        return true;
+    }
+
+    /* Convolve the width x height gray image in with mask and store the result in out.
+     * Returns the elapsed time in seconds. */
+    double convolve(const float* mask_values, size_t mask_width, size_t mask_height,
+                    const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        size_t bytes = width * height * sizeof(unsigned char);
+        reserve_images(bytes);
+        prepare_mask(mask, mask_values, mask_width, mask_height);
+        queue.enqueueWriteBuffer(image_in.buffer(), CL_FALSE, 0, bytes, in, NULL, track(PROFILE_H2D, "image"));
+        enqueue_convolution(mask, image_in.buffer(), image_out.buffer(), width, height);
+        queue.enqueueReadBuffer(image_out.buffer(), CL_TRUE, 0, bytes, out, NULL, track(PROFILE_D2H, "image"));
+        return t.end();
+    }
+
+    /* Convolve the four channels of the width x height RGBA image in with mask and store
+     * the result in out. Returns the elapsed time in seconds. */
+    double convolve_rgba(const float* mask_values, size_t mask_width, size_t mask_height,
+                         const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        size_t bytes = width * height * 4 * sizeof(unsigned char);
+        reserve_images(bytes);
+        prepare_mask(mask, mask_values, mask_width, mask_height);
+        queue.enqueueWriteBuffer(image_in.buffer(), CL_FALSE, 0, bytes, in, NULL, track(PROFILE_H2D, "image"));
+        enqueue_rgba_convolution(mask, image_in.buffer(), image_out.buffer(), width, height);
+        queue.enqueueReadBuffer(image_out.buffer(), CL_TRUE, 0, bytes, out, NULL, track(PROFILE_D2H, "image"));
+        return t.end();
+    }
+
+    /* Erode the width x height gray image in with the se_size x se_size structuring
+     * element se and store the result in out. Returns the elapsed time in seconds. */
+    double erode(const int* se, size_t se_size,
+                 const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        size_t bytes = width * height * sizeof(unsigned char);
+        reserve_images(bytes);
+        prepare_structuring_element(structuring_element, se, se_size);
+        queue.enqueueWriteBuffer(image_in.buffer(), CL_FALSE, 0, bytes, in, NULL, track(PROFILE_H2D, "image"));
+        enqueue_erosion(structuring_element, image_in.buffer(), image_out.buffer(), width, height);
+        queue.enqueueReadBuffer(image_out.buffer(), CL_TRUE, 0, bytes, out, NULL, track(PROFILE_D2H, "image"));
+        return t.end();
+    }
+
+    /* Convolve every image of the gray batch with mask and store the results in out
+     * (batch.bytes() bytes), at the offsets of their images. Returns the elapsed time in seconds. */
+    double convolve_batch(const float* mask_values, size_t mask_width, size_t mask_height,
+                          const ImageBatch& batch, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        if (batch.empty())
+            return 0;
+        upload_batch(batch);
+        prepare_mask(mask, mask_values, mask_width, mask_height);
+        enqueue_convolution_batch(mask, batch_in.buffer(), batch_table.buffer(), batch_out.buffer(),
+                                  batch.size(), batch.get_max_width(), batch.get_max_height());
+        queue.enqueueReadBuffer(batch_out.buffer(), CL_TRUE, 0, batch.bytes(), out, NULL, track(PROFILE_D2H, "batch"));
+        return t.end();
+    }
+
+    /* Erode every image of the gray batch with the se_size x se_size structuring element
+     * se and store the results in out. Returns the elapsed time in seconds. */
+    double erode_batch(const int* se, size_t se_size, const ImageBatch& batch, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        if (batch.empty())
+            return 0;
+        upload_batch(batch);
+        prepare_structuring_element(structuring_element, se, se_size);
+        enqueue_erosion_batch(structuring_element, batch_in.buffer(), batch_table.buffer(), batch_out.buffer(),
+                              batch.size(), batch.get_max_width(), batch.get_max_height());
+        queue.enqueueReadBuffer(batch_out.buffer(), CL_TRUE, 0, batch.bytes(), out, NULL, track(PROFILE_D2H, "batch"));
+        return t.end();
+    }
+
+    /* Record the next enqueued commands in profiler, or stop recording when NULL.
+     * profiler must outlive the engine or be detached. */
+    void set_profiler(Profiler* profiler)
+    {
+        this->profiler = profiler;
+    }
+
+    /* Event to give to an enqueue call for it to be recorded under category, or NULL
+     * when no profiler is attached */
+    cl::Event* track(const std::string& category, const std::string& name)
+    {
+        return profiler ? profiler->track(category, name) : NULL;
+    }
+
+    /* Share the specialized programs of variants, which must have been created for the
+     * context of the engine, or fall back to the generic program only when NULL */
+    void set_variants(std::shared_ptr<KernelVariants> variants)
+    {
+        this->variants = variants;
+        kernels.clear();
+        local_sizes.clear();
+    }
+
+    /* Take work-group sizes from tuner (see autotuner.hpp), or go back to the built-in
+     * choice when NULL. tuner must outlive the engine or be detached. */
+    void set_autotuner(Autotuner* tuner)
+    {
+        this->tuner = tuner;
+        local_sizes.clear();
+    }
+
+    /* Take device memory from pool, which must have been created for the context of the
+     * engine, e.g. to share it between the slots of a stream. The blocks of the engine go
+     * back to its previous pool once its commands are complete. */
+    void set_buffer_pool(std::shared_ptr<BufferPool> pool)
+    {
+        queue.finish();
+        image_in.release();
+        image_out.release();
+        intermediate.release();
+        batch_in.release();
+        batch_out.release();
+        batch_table.release();
+        this->pool = pool;
+    }
+
+    std::shared_ptr<BufferPool> get_buffer_pool() { return pool; }
+    std::shared_ptr<KernelVariants> get_variants() { return variants; }
+    Autotuner* get_autotuner() { return tuner; }
+    Profiler* get_profiler() { return profiler; }
+    size_t get_vector_width() const { return vector_width; }
+    cl::Context& get_context() { return context; }
+    cl::Device& get_device() { return device; }
+    cl::CommandQueue& get_queue() { return queue; }
+    cl::Program& get_program() { return program; }
+
+};
+
+#endif
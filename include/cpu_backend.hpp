@@ -0,0 +1,416 @@
+#ifndef CPU_BACKEND_HPP
+#define CPU_BACKEND_HPP
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "benchmark.hpp"
+#include "thread_pool.hpp"
+
+/* Native implementation of the kernels of kernelConv.cl and kernelCopy.cl, used as a
+ * reference, as a baseline and as a fallback when no OpenCL device is available.
+ * Rows are spread over a thread pool; within a row, pixels whose neighbourhood lies
+ * inside the image are computed with AVX2, SSE4.1 or SSE2 intrinsics, the others with
+ * the bounds checks of the OpenCL kernels. The instruction set is chosen at run time
+ * (__builtin_cpu_supports): the SIMD functions are compiled for their own target
+ * (target attribute), so the binaries run on any x86-64 machine whatever the flags of
+ * the build. Convolution results are saturated to [0, 255], as the kernels do with
+ * convert_uchar_sat. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_SIMD_DISPATCH
+#include <immintrin.h>
+#endif
+
+/* Instruction sets of the SIMD paths, from the least to the most capable */
+enum CpuSimdLevel
+{
+    CPU_SIMD_SCALAR,
+    CPU_SIMD_SSE2,
+    CPU_SIMD_SSE4_1,
+    CPU_SIMD_AVX2
+};
+
+/* Best instruction set of the machine, detected once */
+inline CpuSimdLevel cpu_simd_level()
+{
+#ifdef CPU_SIMD_DISPATCH
+    static const CpuSimdLevel level = []()
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return CPU_SIMD_AVX2;
+        if (__builtin_cpu_supports("sse4.1"))
+            return CPU_SIMD_SSE4_1;
+        if (__builtin_cpu_supports("sse2"))
+            return CPU_SIMD_SSE2;
+        return CPU_SIMD_SCALAR;
+    }();
+    return level;
+#else
+    return CPU_SIMD_SCALAR;
+#endif
+}
+
+inline const char* cpu_simd_name(CpuSimdLevel level)
+{
+    switch (level)
+    {
+        case CPU_SIMD_AVX2: return "avx2";
+        case CPU_SIMD_SSE4_1: return "sse4.1";
+        case CPU_SIMD_SSE2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+/* Rows per chunk of work given to a thread */
+static const size_t CPU_ROWS_PER_TASK = 8;
+
+/* floor(value) saturated to [0, 255], NaN giving 0 */
+inline unsigned char saturate_floor(float value)
+{
+    float rounded = std::floor(value);
+    if (!(rounded > 0.0f))
+        return 0;
+    return rounded < 255.0f ? (unsigned char) rounded : 255;
+}
+
+/* Convolution of byte b of row y of an image of width pixels of channels interleaved
+ * channels, with the bounds checks and normalisation of gray_conv_buff */
+inline unsigned char cpu_convolve_border(const unsigned char* image, size_t width, size_t height, size_t channels,
+                                         const float* mask, size_t mask_width, size_t mask_height, size_t y, size_t b)
+{
+    int mask_hw = mask_width / 2;
+    int mask_hh = mask_height / 2;
+    int x = b / channels;
+    size_t channel = b % channels;
+    float sum = 0.0f;
+    float mask_sum = 0.0f;
+    for (int ix = 0; ix < (int) mask_width; ++ix)
+    {
+        for (int iy = 0; iy < (int) mask_height; ++iy)
+        {
+            int px = x + (ix - mask_hw);
+            int py = (int) y + (iy - mask_hh);
+            if (px < 0 || px >= (int) width || py < 0 || py >= (int) height)
+                continue;
+            float m_value = mask[ix + iy * mask_width];
+            sum += m_value * (float) image[(px + py * width) * channels + channel];
+            mask_sum += m_value;
+        }
+    }
+    return saturate_floor(sum / mask_sum);
+}
+
+#ifdef CPU_SIMD_DISPATCH
+/* SIMD parts of cpu_convolve_interior(), 8 or 4 bytes at a time from byte first of the
+ * row. They return the first byte left to the scalar loop. origin is the address of
+ * byte 0 for the mask coefficient (0, 0). */
+__attribute__((target("avx2")))
+inline size_t cpu_convolve_interior_avx2(const unsigned char* origin, size_t stride, size_t channels,
+                                         const float* mask, size_t mask_width, size_t mask_height, float mask_total,
+                                         size_t first, size_t last, unsigned char* out)
+{
+    size_t b = first;
+    const __m256 total = _mm256_set1_ps(mask_total);
+    for (; b + 8 <= last; b += 8)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        for (size_t ix = 0; ix < mask_width; ++ix)
+        {
+            for (size_t iy = 0; iy < mask_height; ++iy)
+            {
+                const unsigned char* p = origin + iy * stride + ix * channels + b;
+                __m256 pixels = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) p)));
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(mask[ix + iy * mask_width]), pixels));
+            }
+        }
+        __m256 result = _mm256_floor_ps(_mm256_div_ps(sum, total));
+        result = _mm256_min_ps(_mm256_max_ps(result, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+        __m256i values = _mm256_cvttps_epi32(result);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+        _mm_storel_epi64((__m128i*) (out + b), _mm_packus_epi16(words, words));
+    }
+    return b;
+}
+
+__attribute__((target("sse4.1")))
+inline size_t cpu_convolve_interior_sse4_1(const unsigned char* origin, size_t stride, size_t channels,
+                                           const float* mask, size_t mask_width, size_t mask_height, float mask_total,
+                                           size_t first, size_t last, unsigned char* out)
+{
+    size_t b = first;
+    const __m128 total = _mm_set1_ps(mask_total);
+    for (; b + 4 <= last; b += 4)
+    {
+        __m128 sum = _mm_setzero_ps();
+        for (size_t ix = 0; ix < mask_width; ++ix)
+        {
+            for (size_t iy = 0; iy < mask_height; ++iy)
+            {
+                const unsigned char* p = origin + iy * stride + ix * channels + b;
+                int packed;
+                std::memcpy(&packed, p, sizeof(int));
+                __m128 pixels = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(mask[ix + iy * mask_width]), pixels));
+            }
+        }
+        __m128 result = _mm_floor_ps(_mm_div_ps(sum, total));
+        result = _mm_min_ps(_mm_max_ps(result, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+        __m128i values = _mm_cvttps_epi32(result);
+        __m128i words = _mm_packus_epi32(values, values);
+        int packed = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+        std::memcpy(out + b, &packed, sizeof(int));
+    }
+    return b;
+}
+#endif
+
+/* Convolution of bytes [first, last) of row y, whose neighbourhoods lie inside the image.
+ * Coefficients are accumulated in the order of gray_conv_buff. */
+inline void cpu_convolve_interior(const unsigned char* image, size_t width, size_t channels,
+                                  const float* mask, size_t mask_width, size_t mask_height, float mask_total,
+                                  size_t y, size_t first, size_t last, unsigned char* out)
+{
+    size_t stride = width * channels;
+    int mask_hw = mask_width / 2;
+    int mask_hh = mask_height / 2;
+    /* Address of byte 0 for the mask coefficient (ix, iy), relative to the row y */
+    const unsigned char* origin = image + (y - mask_hh) * stride - mask_hw * channels;
+    size_t b = first;
+#ifdef CPU_SIMD_DISPATCH
+    CpuSimdLevel level = cpu_simd_level();
+    if (level >= CPU_SIMD_AVX2)
+        b = cpu_convolve_interior_avx2(origin, stride, channels, mask, mask_width, mask_height, mask_total, b, last, out);
+    else if (level >= CPU_SIMD_SSE4_1)
+        b = cpu_convolve_interior_sse4_1(origin, stride, channels, mask, mask_width, mask_height, mask_total, b, last, out);
+#endif
+    for (; b < last; ++b)
+    {
+        float sum = 0.0f;
+        for (size_t ix = 0; ix < mask_width; ++ix)
+        {
+            for (size_t iy = 0; iy < mask_height; ++iy)
+            {
+                sum += mask[ix + iy * mask_width] * (float) origin[iy * stride + ix * channels + b];
+            }
+        }
+        out[b] = saturate_floor(sum / mask_total);
+    }
+}
+
+#ifdef CPU_SIMD_DISPATCH
+/* SIMD parts of cpu_erode_interior(), 32 or 16 pixels at a time from pixel first of
+ * row. They return the first pixel left to the next path. */
+__attribute__((target("avx2")))
+inline size_t cpu_erode_interior_avx2(const unsigned char* row, const std::vector<long>& offsets,
+                                      size_t first, size_t last, unsigned char* out)
+{
+    size_t x = first;
+    for (; x + 32 <= last; x += 32)
+    {
+        __m256i value = _mm256_loadu_si256((const __m256i*) (row + x));
+        for (long offset : offsets)
+            value = _mm256_min_epu8(value, _mm256_loadu_si256((const __m256i*) (row + x + offset)));
+        _mm256_storeu_si256((__m256i*) (out + x), value);
+    }
+    return x;
+}
+
+__attribute__((target("sse2")))
+inline size_t cpu_erode_interior_sse2(const unsigned char* row, const std::vector<long>& offsets,
+                                      size_t first, size_t last, unsigned char* out)
+{
+    size_t x = first;
+    for (; x + 16 <= last; x += 16)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i*) (row + x));
+        for (long offset : offsets)
+            value = _mm_min_epu8(value, _mm_loadu_si128((const __m128i*) (row + x + offset)));
+        _mm_storeu_si128((__m128i*) (out + x), value);
+    }
+    return x;
+}
+#endif
+
+/* Erosion of pixels [first, last) of row y, whose neighbourhoods lie inside the image.
+ * offsets are the positions of the active structuring element pixels relative to the
+ * pixel being eroded. */
+inline void cpu_erode_interior(const unsigned char* image, size_t width, const std::vector<long>& offsets,
+                               size_t y, size_t first, size_t last, unsigned char* out)
+{
+    const unsigned char* row = image + y * width;
+    size_t x = first;
+#ifdef CPU_SIMD_DISPATCH
+    CpuSimdLevel level = cpu_simd_level();
+    if (level >= CPU_SIMD_AVX2)
+        x = cpu_erode_interior_avx2(row, offsets, x, last, out);
+    if (level >= CPU_SIMD_SSE2)
+        x = cpu_erode_interior_sse2(row, offsets, x, last, out);
+#endif
+    for (; x < last; ++x)
+    {
+        unsigned char value = row[x];
+        for (long offset : offsets)
+            value = std::min(value, row[x + offset]);
+        out[x] = value;
+    }
+}
+
+/* Erosion of pixel (x, y) with the bounds checks of the erode kernel */
+inline unsigned char cpu_erode_border(const unsigned char* image, size_t width, size_t height,
+                                      const int* se, size_t se_size, size_t x, size_t y)
+{
+    int hs = se_size / 2;
+    unsigned char value = image[x + y * width];
+    for (int ix = 0; ix < (int) se_size; ++ix)
+    {
+        for (int iy = 0; iy < (int) se_size; ++iy)
+        {
+            if (se[ix + iy * se_size] != 1)
+                continue;
+            int px = (int) x + (ix - hs);
+            int py = (int) y + (iy - hs);
+            if (px < 0 || px >= (int) width || py < 0 || py >= (int) height)
+                continue;
+            value = std::min(value, image[px + py * width]);
+        }
+    }
+    return value;
+}
+
+/* Multithreaded, vectorized CPU engine with the host-side interface of ConvolutionEngine */
+class CpuEngine
+{
+
+    private:
+    ThreadPool pool;
+
+    public:
+    CpuEngine() {}
+
+    explicit CpuEngine(size_t threads) : pool(threads > 0 ? threads - 1 : 0) {}
+
+    /* Convolve the width x height image in of channels interleaved channels (1 for gray,
+     * 4 for RGBA) with mask, every channel apart, and store the result in out */
+    void convolve_image(const float* mask, size_t mask_width, size_t mask_height,
+                        const unsigned char* in, size_t width, size_t height, size_t channels, unsigned char* out)
+    {
+        size_t mask_hw = mask_width / 2;
+        size_t mask_hh = mask_height / 2;
+        float mask_total = 0.0f;
+        for (size_t i = 0; i < mask_width * mask_height; ++i)
+            mask_total += mask[i];
+        /* Pixels [interior_first, interior_last) of rows [mask_hh, height - (mask_height - 1 - mask_hh)) have their whole neighbourhood inside */
+        size_t right = mask_width - 1 - mask_hw;
+        size_t bottom = mask_height - 1 - mask_hh;
+        bool has_interior = width > mask_hw + right && height > mask_hh + bottom;
+        size_t interior_first = mask_hw * channels;
+        size_t interior_last = has_interior ? (width - right) * channels : 0;
+        size_t stride = width * channels;
+
+        pool.parallel_for(0, height, CPU_ROWS_PER_TASK, [&](size_t first_row, size_t last_row)
+        {
+            for (size_t y = first_row; y < last_row; ++y)
+            {
+                unsigned char* out_row = out + y * stride;
+                if (has_interior && y >= mask_hh && y < height - bottom)
+                {
+                    for (size_t b = 0; b < interior_first; ++b)
+                        out_row[b] = cpu_convolve_border(in, width, height, channels, mask, mask_width, mask_height, y, b);
+                    cpu_convolve_interior(in, width, channels, mask, mask_width, mask_height, mask_total, y, interior_first, interior_last, out_row);
+                    for (size_t b = interior_last; b < stride; ++b)
+                        out_row[b] = cpu_convolve_border(in, width, height, channels, mask, mask_width, mask_height, y, b);
+                }
+                else
+                {
+                    for (size_t b = 0; b < stride; ++b)
+                        out_row[b] = cpu_convolve_border(in, width, height, channels, mask, mask_width, mask_height, y, b);
+                }
+            }
+        });
+    }
+
+    /* Erode the width x height gray image in with the se_size x se_size structuring element se */
+    void erode_image(const int* se, size_t se_size, const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        size_t hs = se_size / 2;
+        size_t far = se_size - 1 - hs;
+        std::vector<long> offsets;
+        for (size_t iy = 0; iy < se_size; ++iy)
+        {
+            for (size_t ix = 0; ix < se_size; ++ix)
+            {
+                if (se[ix + iy * se_size] == 1)
+                    offsets.push_back(((long) iy - (long) hs) * (long) width + ((long) ix - (long) hs));
+            }
+        }
+        bool has_interior = width > hs + far && height > hs + far;
+
+        pool.parallel_for(0, height, CPU_ROWS_PER_TASK, [&](size_t first_row, size_t last_row)
+        {
+            for (size_t y = first_row; y < last_row; ++y)
+            {
+                unsigned char* out_row = out + y * width;
+                if (has_interior && y >= hs && y < height - far)
+                {
+                    for (size_t x = 0; x < hs; ++x)
+                        out_row[x] = cpu_erode_border(in, width, height, se, se_size, x, y);
+                    cpu_erode_interior(in, width, offsets, y, hs, width - far, out_row);
+                    for (size_t x = width - far; x < width; ++x)
+                        out_row[x] = cpu_erode_border(in, width, height, se, se_size, x, y);
+                }
+                else
+                {
+                    for (size_t x = 0; x < width; ++x)
+                        out_row[x] = cpu_erode_border(in, width, height, se, se_size, x, y);
+                }
+            }
+        });
+    }
+
+    /* Copy bytes bytes from in to out, split between the threads */
+    void copy_bytes(const unsigned char* in, size_t bytes, unsigned char* out)
+    {
+        const size_t chunk = 1 << 20;
+        pool.parallel_for(0, (bytes + chunk - 1) / chunk, 1, [&](size_t first, size_t last)
+        {
+            size_t begin = first * chunk;
+            size_t end = std::min(bytes, last * chunk);
+            std::memcpy(out + begin, in + begin, end - begin);
+        });
+    }
+
+    /* Timed versions, same interface and semantics as ConvolutionEngine */
+    double convolve(const float* mask, size_t mask_width, size_t mask_height,
+                    const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        convolve_image(mask, mask_width, mask_height, in, width, height, 1, out);
+        return t.end();
+    }
+
+    double convolve_rgba(const float* mask, size_t mask_width, size_t mask_height,
+                         const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        convolve_image(mask, mask_width, mask_height, in, width, height, 4, out);
+        return t.end();
+    }
+
+    double erode(const int* se, size_t se_size, const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        erode_image(se, se_size, in, width, height, out);
+        return t.end();
+    }
+
+    const char* simd_name() const { return cpu_simd_name(cpu_simd_level()); }
+    size_t get_threads() const { return pool.size(); }
+
+};
+
+#endif
@@ -0,0 +1,514 @@
+#ifndef FFT_CONVOLUTION_HPP
+#define FFT_CONVOLUTION_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencl_utils.hpp"
+#include "benchmark.hpp"
+#include "buffer_pool.hpp"
+#include "convolution_engine.hpp"
+#include "masks.hpp"
+#include "profiling.hpp"
+
+/* Largest FFT tile side */
+#define FFT_MAX_TILE 2048
+/* Device memory for the tiles of one chunk, per buffer (two buffers are needed) */
+#define FFT_CHUNK_BYTES (64 << 20)
+
+/* Overlap-save tiling of a width x height image for a mask_width x mask_height mask:
+ * tiles of n x n values, each yielding step_x x step_y output pixels */
+struct FftPlan
+{
+    size_t n;
+    size_t step_x;
+    size_t step_y;
+    size_t tiles_x;
+    size_t tiles_y;
+
+    size_t tiles() const { return tiles_x * tiles_y; }
+    /* Butterflies of the forward and inverse 2D FFTs of every tile, up to a constant */
+    double work() const { return (double) tiles() * n * n * std::log2((double) n); }
+};
+
+/* Tiling with the least FFT work: larger tiles waste less of their overlap, smaller
+ * ones less of the padding around the image */
+inline FftPlan fft_plan(size_t mask_width, size_t mask_height, size_t width, size_t height)
+{
+    FftPlan best;
+    best.n = 0;
+    size_t n = 2;
+    while (n < std::max(mask_width, mask_height))
+        n *= 2;
+    for (; n <= FFT_MAX_TILE || best.n == 0; n *= 2)
+    {
+        FftPlan plan;
+        plan.n = n;
+        plan.step_x = n - mask_width + 1;
+        plan.step_y = n - mask_height + 1;
+        plan.tiles_x = (width + plan.step_x - 1) / plan.step_x;
+        plan.tiles_y = (height + plan.step_y - 1) / plan.step_y;
+        if (best.n == 0 || plan.work() < best.work())
+            best = plan;
+        /* A single tile covers the image: larger ones only add padding */
+        if (plan.tiles() == 1)
+            break;
+    }
+    return best;
+}
+
+/* Convolution of gray images through the FFT (kernelFFT.cl), with the semantics of
+ * gray_conv_buff. It costs O(log n) per pixel whatever the mask size, against
+ * O(mask_width x mask_height) for the direct kernels, at the price of a fixed cost much
+ * higher than theirs: ConvolutionDispatcher picks the cheapest method.
+ * The image is cut into n x n tiles (overlap-save, see fft_plan()), transformed a chunk
+ * of tiles at a time so that device memory stays bounded for large images. The spectrum
+ * and the summed area table of the last mask are kept on the device. Results may differ
+ * from the direct kernels by one gray level, because of the rounding of the float FFT.
+ * Commands are enqueued on the queue given at construction; buffers come from pool. */
+class FftConvolution
+{
+
+    private:
+    cl::Context context;
+    cl::CommandQueue queue;
+    cl::Program program;
+    cl::Kernel load_kernel;
+    cl::Kernel rows_kernel;
+    cl::Kernel columns_kernel;
+    cl::Kernel multiply_kernel;
+    cl::Kernel store_kernel;
+    std::shared_ptr<BufferPool> pool;
+    Profiler* profiler;
+
+    /* Mask and tile size of spectrum */
+    std::vector<float> spectrum_values;
+    size_t spectrum_width;
+    size_t spectrum_height;
+    size_t spectrum_n;
+    PooledBuffer spectrum;
+    PooledBuffer sat;
+    /* Tiles of a chunk, transformed from one buffer to the other */
+    PooledBuffer tiles[2];
+
+    cl::Event* track(const std::string& name)
+    {
+        return profiler ? profiler->track(PROFILE_KERNEL, name) : NULL;
+    }
+
+    void reserve_tiles(size_t bytes)
+    {
+        if (bytes <= tiles[0].capacity())
+            return;
+        if (!tiles[0].empty())
+            queue.finish();
+        tiles[0] = pool->acquire(bytes);
+        tiles[1] = pool->acquire(bytes);
+    }
+
+    /* Enqueue the forward (direction -1) or inverse (1, unscaled) 2D FFT of count tiles
+     * of n x n values held by tiles[current]. Returns the index of the buffer holding the result. */
+    int enqueue_fft_2d(int current, size_t count, size_t n, float direction)
+    {
+        cl::Kernel* passes[2] = {&rows_kernel, &columns_kernel};
+        for (int dimension = 0; dimension < 2; ++dimension)
+        {
+            cl::Kernel& kernel = *passes[dimension];
+            cl::NDRange range = dimension == 0 ? cl::NDRange(n / 2, n, count) : cl::NDRange(n, n / 2, count);
+            for (size_t p = 1; p < n; p *= 2)
+            {
+                kernel.setArg(0, tiles[current].buffer());
+                kernel.setArg(1, tiles[1 - current].buffer());
+                kernel.setArg(2, (cl_uint) n);
+                kernel.setArg(3, (cl_uint) p);
+                kernel.setArg(4, direction);
+                queue.enqueueNDRangeKernel(kernel, cl::NullRange, range, cl::NullRange, NULL,
+                                           track(dimension == 0 ? "fft_rows" : "fft_columns"));
+                current = 1 - current;
+            }
+        }
+        return current;
+    }
+
+    /* Compute the spectrum of device_mask for n x n tiles and its summed area table, or do
+     * nothing if they are already on the device */
+    void prepare(const DeviceMask& device_mask, size_t n)
+    {
+        if (n == spectrum_n && device_mask.width == spectrum_width && device_mask.height == spectrum_height &&
+            device_mask.values == spectrum_values)
+            return;
+        /* The previous spectrum may still be in use */
+        queue.finish();
+        size_t mask_width = device_mask.width;
+        size_t mask_height = device_mask.height;
+        const std::vector<float>& values = device_mask.values;
+
+        /* gray_conv_buff correlates: transform the mask flipped in both directions */
+        std::vector<cl_float2> tile(n * n);
+        for (auto &value : tile)
+            value.s[0] = value.s[1] = 0;
+        for (size_t b = 0; b < mask_height; ++b)
+        {
+            for (size_t a = 0; a < mask_width; ++a)
+                tile[a + b * n].s[0] = values[(mask_width - 1 - a) + (mask_height - 1 - b) * mask_width];
+        }
+        size_t tile_bytes = n * n * sizeof(cl_float2);
+        reserve_tiles(tile_bytes);
+        queue.enqueueWriteBuffer(tiles[0].buffer(), CL_TRUE, 0, tile_bytes, tile.data());
+        int current = enqueue_fft_2d(0, 1, n, -1.0f);
+        spectrum = pool->acquire(tile_bytes, CL_MEM_READ_ONLY);
+        queue.enqueueCopyBuffer(tiles[current].buffer(), spectrum.buffer(), 0, 0, tile_bytes);
+
+        /* Summed area table, accumulated in double so that large masks keep their precision */
+        size_t sat_width = mask_width + 1;
+        std::vector<double> table(sat_width * (mask_height + 1), 0.0);
+        for (size_t y = 0; y < mask_height; ++y)
+        {
+            for (size_t x = 0; x < mask_width; ++x)
+            {
+                table[(x + 1) + (y + 1) * sat_width] = values[x + y * mask_width] + table[x + (y + 1) * sat_width]
+                                                     + table[(x + 1) + y * sat_width] - table[x + y * sat_width];
+            }
+        }
+        std::vector<float> sat_values(table.begin(), table.end());
+        sat = pool->acquire(sat_values.size() * sizeof(float), CL_MEM_READ_ONLY);
+        queue.enqueueWriteBuffer(sat.buffer(), CL_TRUE, 0, sat_values.size() * sizeof(float), sat_values.data());
+
+        spectrum_values = values;
+        spectrum_width = mask_width;
+        spectrum_height = mask_height;
+        spectrum_n = n;
+    }
+
+    public:
+    FftConvolution(cl::Context context, cl::Device device, cl::CommandQueue queue, std::shared_ptr<BufferPool> pool,
+                   std::string kernel_source_file = "../src/kernelFFT.cl") :
+        context(context), queue(queue), pool(pool), profiler(NULL), spectrum_width(0), spectrum_height(0), spectrum_n(0)
+    {
+        program = load_and_build_program(context, device, kernel_source_file);
+        load_kernel = cl::Kernel(program, "fft_load_tiles");
+        rows_kernel = cl::Kernel(program, "fft_rows");
+        columns_kernel = cl::Kernel(program, "fft_columns");
+        multiply_kernel = cl::Kernel(program, "fft_multiply");
+        store_kernel = cl::Kernel(program, "fft_store_tiles");
+    }
+
+    /* Enqueue the convolution of the width x height gray image in device buffer in into out */
+    void enqueue_convolution(const DeviceMask& device_mask, const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height)
+    {
+        FftPlan plan = fft_plan(device_mask.width, device_mask.height, width, height);
+        size_t n = plan.n;
+        prepare(device_mask, n);
+        size_t tile_bytes = n * n * sizeof(cl_float2);
+        size_t chunk = std::max<size_t>(1, std::min<size_t>(plan.tiles(), FFT_CHUNK_BYTES / tile_bytes));
+        reserve_tiles(chunk * tile_bytes);
+
+        for (size_t first = 0; first < plan.tiles(); first += chunk)
+        {
+            size_t count = std::min(chunk, plan.tiles() - first);
+            load_kernel.setArg(0, in);
+            load_kernel.setArg(1, (cl_uint) width);
+            load_kernel.setArg(2, (cl_uint) height);
+            load_kernel.setArg(3, (cl_uint) plan.tiles_x);
+            load_kernel.setArg(4, (cl_uint) first);
+            load_kernel.setArg(5, (cl_uint) n);
+            load_kernel.setArg(6, (cl_uint) plan.step_x);
+            load_kernel.setArg(7, (cl_uint) plan.step_y);
+            load_kernel.setArg(8, (cl_uint) (device_mask.width / 2));
+            load_kernel.setArg(9, (cl_uint) (device_mask.height / 2));
+            load_kernel.setArg(10, tiles[0].buffer());
+            queue.enqueueNDRangeKernel(load_kernel, cl::NullRange, cl::NDRange(n, n, count), cl::NullRange, NULL, track("fft_load_tiles"));
+
+            int current = enqueue_fft_2d(0, count, n, -1.0f);
+            multiply_kernel.setArg(0, tiles[current].buffer());
+            multiply_kernel.setArg(1, spectrum.buffer());
+            multiply_kernel.setArg(2, (cl_uint) n);
+            queue.enqueueNDRangeKernel(multiply_kernel, cl::NullRange, cl::NDRange(n * n, count), cl::NullRange, NULL, track("fft_multiply"));
+            current = enqueue_fft_2d(current, count, n, 1.0f);
+
+            store_kernel.setArg(0, tiles[current].buffer());
+            store_kernel.setArg(1, (cl_uint) width);
+            store_kernel.setArg(2, (cl_uint) height);
+            store_kernel.setArg(3, (cl_uint) plan.tiles_x);
+            store_kernel.setArg(4, (cl_uint) first);
+            store_kernel.setArg(5, (cl_uint) n);
+            store_kernel.setArg(6, (cl_uint) plan.step_x);
+            store_kernel.setArg(7, (cl_uint) plan.step_y);
+            store_kernel.setArg(8, (cl_uint) device_mask.width);
+            store_kernel.setArg(9, (cl_uint) device_mask.height);
+            store_kernel.setArg(10, sat.buffer());
+            store_kernel.setArg(11, out);
+            queue.enqueueNDRangeKernel(store_kernel, cl::NullRange, cl::NDRange(plan.step_x, plan.step_y, count), cl::NullRange, NULL, track("fft_store_tiles"));
+        }
+    }
+
+    /* Record the kernels in profiler, or stop recording when NULL */
+    void set_profiler(Profiler* profiler)
+    {
+        this->profiler = profiler;
+    }
+
+};
+
+enum ConvolutionMethod
+{
+    /* Cheapest of the others according to the cost model */
+    CONVOLUTION_AUTO,
+    /* 2D kernels of ConvolutionEngine (tiled or direct) */
+    CONVOLUTION_DIRECT,
+    /* Row and column passes of ConvolutionEngine, for separable masks */
+    CONVOLUTION_SEPARABLE,
+    CONVOLUTION_FFT
+};
+
+inline const char* convolution_method_name(ConvolutionMethod method)
+{
+    switch (method)
+    {
+        case CONVOLUTION_DIRECT: return "direct";
+        case CONVOLUTION_SEPARABLE: return "separable";
+        case CONVOLUTION_FFT: return "fft";
+        default: return "auto";
+    }
+}
+
+/* Parse --method auto|direct|fft (direct runs the separable passes on separable masks) */
+inline ConvolutionMethod parse_convolution_method(int& argc, char** argv)
+{
+    std::string method = parse_option(argc, argv, "--method", "auto");
+    if (method == "direct")
+        return CONVOLUTION_DIRECT;
+    if (method == "fft")
+        return CONVOLUTION_FFT;
+    if (method != "auto")
+    {
+        std::cerr << "Invalid convolution method '" << method << "' (expected auto, direct or fft)." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return CONVOLUTION_AUTO;
+}
+
+/* Time of a convolution by each method, modelled as pixels x (per_pixel + per_unit x units)
+ * seconds, where units per pixel are the taps of the mask for the direct kernels, the
+ * taps of both passes for the separable ones and the FFT work of the tiling divided by
+ * the pixels for the FFT (see FftPlan::work()). Indexed by ConvolutionMethod. */
+struct ConvolutionCostModel
+{
+    double per_pixel[4];
+    double per_unit[4];
+
+    ConvolutionCostModel()
+    {
+        std::fill(per_pixel, per_pixel + 4, 0.0);
+        std::fill(per_unit, per_unit + 4, 0.0);
+    }
+
+    static double units(ConvolutionMethod method, size_t mask_width, size_t mask_height, size_t width, size_t height)
+    {
+        switch (method)
+        {
+            case CONVOLUTION_DIRECT: return (double) mask_width * mask_height;
+            case CONVOLUTION_SEPARABLE: return (double) mask_width + mask_height;
+            case CONVOLUTION_FFT: return fft_plan(mask_width, mask_height, width, height).work() / ((double) width * height);
+            default: return 0;
+        }
+    }
+
+    double estimate(ConvolutionMethod method, size_t mask_width, size_t mask_height, size_t width, size_t height) const
+    {
+        return (double) width * height * (per_pixel[method] + per_unit[method] * units(method, mask_width, mask_height, width, height));
+    }
+};
+
+/* Picks, for each mask and image size, the cheapest way to convolve on the device of an
+ * engine: its direct 2D kernels, its separable passes (separable masks only) or the FFT.
+ * The cost model is calibrated on the device the first time a method has to be chosen
+ * (calibrate()): each method is timed on a 512 x 512 image with a small and a large
+ * mask, which fixes its cost per pixel and per unit of work. set_method() forces a method. */
+class ConvolutionDispatcher
+{
+
+    private:
+    ConvolutionEngine& engine;
+    FftConvolution fft;
+    ConvolutionCostModel model;
+    bool calibrated;
+    ConvolutionMethod method;
+
+    /* Mask and images of convolve() */
+    DeviceMask mask;
+    PooledBuffer image_in;
+    PooledBuffer image_out;
+
+    /* Best of three runs of method, after a first one which builds and tunes the kernels */
+    double time_method(ConvolutionMethod method, const DeviceMask& device_mask, const cl::Buffer& in, const cl::Buffer& out, size_t size)
+    {
+        cl::CommandQueue& queue = engine.get_queue();
+        double best = std::numeric_limits<double>::max();
+        Timer t;
+        for (int run = 0; run < 4; ++run)
+        {
+            t.start();
+            enqueue(method, device_mask, in, out, size, size);
+            queue.finish();
+            if (run > 0)
+                best = std::min(best, t.end());
+        }
+        return best;
+    }
+
+    /* Fit the cost of method to its times on masks of sides small and large */
+    void calibrate_method(ConvolutionMethod method, size_t small, size_t large, const cl::Buffer& in, const cl::Buffer& out, size_t size)
+    {
+        double units[2];
+        double times[2];
+        size_t sides[2] = {small, large};
+        for (int i = 0; i < 2; ++i)
+        {
+            size_t side = sides[i];
+            /* Box masks are separable, pseudo-random ones are not */
+            std::vector<float> values(side * side, 1.0f);
+            if (method != CONVOLUTION_SEPARABLE)
+            {
+                unsigned int state = 12345;
+                for (auto &v : values)
+                {
+                    state = state * 1103515245u + 12345u;
+                    v = 1.0f + (state >> 16) % 255;
+                }
+            }
+            DeviceMask device_mask;
+            engine.prepare_mask(device_mask, values.data(), side, side);
+            units[i] = ConvolutionCostModel::units(method, side, side, size, size);
+            times[i] = time_method(method, device_mask, in, out, size) / ((double) size * size);
+        }
+        double per_unit = std::max(0.0, (times[1] - times[0]) / (units[1] - units[0]));
+        model.per_unit[method] = per_unit;
+        model.per_pixel[method] = std::max(0.0, times[0] - per_unit * units[0]);
+    }
+
+    void enqueue(ConvolutionMethod method, const DeviceMask& device_mask, const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height)
+    {
+        if (method == CONVOLUTION_FFT)
+        {
+            fft.set_profiler(engine.get_profiler());
+            fft.enqueue_convolution(device_mask, in, out, width, height);
+        }
+        else if (method == CONVOLUTION_DIRECT)
+        {
+            engine.enqueue_dense_convolution(device_mask, in, out, width, height);
+        }
+        else
+        {
+            engine.enqueue_convolution(device_mask, in, out, width, height);
+        }
+    }
+
+    public:
+    ConvolutionDispatcher(ConvolutionEngine& engine, std::string kernel_source_file = "../src/kernelFFT.cl") :
+        engine(engine),
+        fft(engine.get_context(), engine.get_device(), engine.get_queue(), engine.get_buffer_pool(), kernel_source_file),
+        calibrated(false), method(CONVOLUTION_AUTO)
+    {}
+
+    /* Time every method on a size x size image and fit the cost model */
+    void calibrate(size_t size = 512)
+    {
+        std::shared_ptr<BufferPool> pool = engine.get_buffer_pool();
+        PooledBuffer in = pool->acquire(size * size);
+        PooledBuffer out = pool->acquire(size * size);
+        std::vector<unsigned char> pixels(size * size);
+        unsigned int state = 54321;
+        for (auto &p : pixels)
+        {
+            state = state * 1103515245u + 12345u;
+            p = (unsigned char) (state >> 16);
+        }
+        engine.get_queue().enqueueWriteBuffer(in.buffer(), CL_TRUE, 0, pixels.size(), pixels.data());
+        calibrate_method(CONVOLUTION_DIRECT, 3, 9, in.buffer(), out.buffer(), size);
+        calibrate_method(CONVOLUTION_SEPARABLE, 3, 25, in.buffer(), out.buffer(), size);
+        calibrate_method(CONVOLUTION_FFT, 15, 63, in.buffer(), out.buffer(), size);
+        calibrated = true;
+    }
+
+    /* Method the next convolution by device_mask of a width x height image will use */
+    ConvolutionMethod choose(const DeviceMask& device_mask, size_t width, size_t height)
+    {
+        if (method != CONVOLUTION_AUTO)
+            return method == CONVOLUTION_SEPARABLE && !device_mask.separable ? CONVOLUTION_DIRECT : method;
+        if (!calibrated)
+            calibrate();
+        ConvolutionMethod spatial = device_mask.separable ? CONVOLUTION_SEPARABLE : CONVOLUTION_DIRECT;
+        double spatial_cost = model.estimate(spatial, device_mask.width, device_mask.height, width, height);
+        double fft_cost = model.estimate(CONVOLUTION_FFT, device_mask.width, device_mask.height, width, height);
+        return fft_cost < spatial_cost ? CONVOLUTION_FFT : spatial;
+    }
+
+    /* Enqueue the convolution of the width x height gray image in device buffer in into out
+     * by the cheapest method, which is returned */
+    ConvolutionMethod enqueue_convolution(const DeviceMask& device_mask, const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height)
+    {
+        ConvolutionMethod chosen = choose(device_mask, width, height);
+        enqueue(chosen, device_mask, in, out, width, height);
+        return chosen;
+    }
+
+    /* Convolve the width x height gray image in with mask and store the result in out.
+     * Returns the elapsed time in seconds. */
+    double convolve(const float* mask_values, size_t mask_width, size_t mask_height,
+                    const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        /* Calibrate before the clock starts */
+        engine.prepare_mask(mask, mask_values, mask_width, mask_height);
+        choose(mask, width, height);
+        Timer t;
+        t.start();
+        size_t bytes = width * height * sizeof(unsigned char);
+        if (bytes > image_in.capacity())
+        {
+            image_in = engine.get_buffer_pool()->acquire(bytes);
+            image_out = engine.get_buffer_pool()->acquire(bytes);
+        }
+        cl::CommandQueue& queue = engine.get_queue();
+        queue.enqueueWriteBuffer(image_in.buffer(), CL_FALSE, 0, bytes, in, NULL, engine.track(PROFILE_H2D, "image"));
+        enqueue_convolution(mask, image_in.buffer(), image_out.buffer(), width, height);
+        queue.enqueueReadBuffer(image_out.buffer(), CL_TRUE, 0, bytes, out, NULL, engine.track(PROFILE_D2H, "image"));
+        return t.end();
+    }
+
+    /* Use method for every convolution, or choose again each time with CONVOLUTION_AUTO.
+     * CONVOLUTION_DIRECT runs the dense kernels even on separable masks, and
+     * CONVOLUTION_SEPARABLE falls back to them on masks which are not separable. */
+    void set_method(ConvolutionMethod method)
+    {
+        this->method = method;
+    }
+
+    ConvolutionMethod get_method() const { return method; }
+
+    /* Use model instead of calibrating, e.g. when it comes from a previous run */
+    void set_cost_model(const ConvolutionCostModel& model)
+    {
+        this->model = model;
+        calibrated = true;
+    }
+
+    const ConvolutionCostModel& get_cost_model() const { return model; }
+
+    /* Calibrated costs, in nanoseconds per pixel */
+    void report(std::ostream& out) const
+    {
+        out << "# Convolution costs (ns/pixel): direct " << 1e9 * model.per_pixel[CONVOLUTION_DIRECT] << " + "
+            << 1e9 * model.per_unit[CONVOLUTION_DIRECT] << "/tap, separable " << 1e9 * model.per_pixel[CONVOLUTION_SEPARABLE]
+            << " + " << 1e9 * model.per_unit[CONVOLUTION_SEPARABLE] << "/tap, fft " << 1e9 * model.per_pixel[CONVOLUTION_FFT]
+            << " + " << 1e9 * model.per_unit[CONVOLUTION_FFT] << "/butterfly" << std::endl;
+    }
+
+};
+
+#endif
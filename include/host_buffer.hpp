@@ -0,0 +1,207 @@
+#ifndef HOST_BUFFER_HPP
+#define HOST_BUFFER_HPP
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+#define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <string>
+#include <vector>
+#include <CL/cl.hpp>
+
+#include "options.hpp"
+
+/* How images go between host and device memory.
+ * TRANSFER_COPY: device buffers are written and read with enqueueWriteBuffer / enqueueReadBuffer.
+ * TRANSFER_MAP: buffers live in host-accessible memory (CL_MEM_USE_HOST_PTR / CL_MEM_ALLOC_HOST_PTR)
+ * and are accessed with enqueueMapBuffer, which costs no copy when the device shares
+ * memory with the host (CPUs, integrated GPUs). */
+enum TransferMode
+{
+    TRANSFER_COPY,
+    TRANSFER_MAP
+};
+
+inline const char* transfer_mode_name(TransferMode mode)
+{
+    return mode == TRANSFER_MAP ? "map" : "copy";
+}
+
+/* Remove "--transfer copy|map" from the command line, copy being the default */
+inline TransferMode parse_transfer_mode(int& argc, char** argv)
+{
+    std::string mode = parse_option(argc, argv, "--transfer", "copy");
+    if (mode == "copy")
+        return TRANSFER_COPY;
+    if (mode == "map")
+        return TRANSFER_MAP;
+    std::cerr << "Unknown transfer mode " << mode << " (expected copy or map)" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+/* Zero-copy runtimes want host allocations aligned on a page and sized to a multiple
+ * of a cache line, otherwise they silently fall back to a copy */
+static const size_t HOST_BUFFER_ALIGNMENT = 4096;
+static const size_t HOST_BUFFER_SIZE_MULTIPLE = 64;
+
+inline bool is_aligned(const void* pointer, size_t alignment = HOST_BUFFER_ALIGNMENT)
+{
+    return reinterpret_cast<std::uintptr_t>(pointer) % alignment == 0;
+}
+
+inline void* aligned_malloc(size_t bytes, size_t alignment = HOST_BUFFER_ALIGNMENT)
+{
+    void* pointer = NULL;
+    size_t padded = (bytes + HOST_BUFFER_SIZE_MULTIPLE - 1) / HOST_BUFFER_SIZE_MULTIPLE * HOST_BUFFER_SIZE_MULTIPLE;
+    if (posix_memalign(&pointer, alignment, padded > 0 ? padded : HOST_BUFFER_SIZE_MULTIPLE) != 0)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+inline void aligned_free(void* pointer)
+{
+    free(pointer);
+}
+
+/* Allocator giving page aligned storage to standard containers */
+template <typename T>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(size_t count)
+    {
+        if (count > std::numeric_limits<size_t>::max() / sizeof(T))
+            throw std::bad_alloc();
+        return static_cast<T*>(aligned_malloc(count * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, size_t)
+    {
+        aligned_free(pointer);
+    }
+
+    template <typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+template <typename T>
+using aligned_vector = std::vector<T, AlignedAllocator<T> >;
+
+/* Device buffer backed by host-accessible memory.
+ * Either wraps memory owned by the caller (CL_MEM_USE_HOST_PTR), which must stay valid
+ * for the lifetime of the buffer, or lets the runtime allocate pinned host memory
+ * (CL_MEM_ALLOC_HOST_PTR). The host accesses the content between map() and unmap();
+ * kernels must not use the buffer while it is mapped.
+ *
+ * Usage:
+ *     HostBuffer input(context, CL_MEM_READ_ONLY, pixels, bytes);   // no copy
+ *     HostBuffer output(context, CL_MEM_WRITE_ONLY, bytes);
+ *     ... kernels reading input.get_buffer() and writing output.get_buffer() ...
+ *     const uchar* result = (const uchar*) output.map(queue, CL_MAP_READ);
+ *     ...
+ *     output.unmap(queue);
+ */
+class HostBuffer
+{
+
+    private:
+    cl::Buffer buffer;
+    void* host;
+    size_t size;
+    void* mapped;
+
+    public:
+    HostBuffer() : host(NULL), size(0), mapped(NULL)
+    {}
+
+    /* Wrap size bytes at host_ptr. access is CL_MEM_READ_ONLY, CL_MEM_WRITE_ONLY or CL_MEM_READ_WRITE.
+     * Runtimes only avoid copies when host_ptr is suitably aligned (see HOST_BUFFER_ALIGNMENT). */
+    HostBuffer(const cl::Context& context, cl_mem_flags access, void* host_ptr, size_t size) :
+        buffer(context, access | CL_MEM_USE_HOST_PTR, size, host_ptr), host(host_ptr), size(size), mapped(NULL)
+    {}
+
+    /* size bytes of runtime allocated, host-accessible memory */
+    HostBuffer(const cl::Context& context, cl_mem_flags access, size_t size) :
+        buffer(context, access | CL_MEM_ALLOC_HOST_PTR, size), host(NULL), size(size), mapped(NULL)
+    {}
+
+    HostBuffer(const HostBuffer&) = delete;
+    HostBuffer& operator=(const HostBuffer&) = delete;
+    HostBuffer(HostBuffer&& other) :
+        buffer(other.buffer), host(other.host), size(other.size), mapped(other.mapped)
+    {
+        other.mapped = NULL;
+    }
+    HostBuffer& operator=(HostBuffer&& other)
+    {
+        buffer = other.buffer;
+        host = other.host;
+        size = other.size;
+        mapped = other.mapped;
+        other.mapped = NULL;
+        return *this;
+    }
+
+    /* Make the whole buffer accessible to the host. flags are CL_MAP_READ, CL_MAP_WRITE,
+     * or CL_MAP_WRITE_INVALIDATE_REGION when the previous content is not needed. */
+    void* map(const cl::CommandQueue& queue, cl_map_flags flags, bool blocking = true, cl::Event* event = NULL)
+    {
+        if (mapped == NULL)
+            mapped = queue.enqueueMapBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, flags, 0, size, NULL, event);
+        return mapped;
+    }
+
+    void unmap(const cl::CommandQueue& queue, cl::Event* event = NULL)
+    {
+        if (mapped == NULL)
+            return;
+        queue.enqueueUnmapMemObject(buffer, mapped, NULL, event);
+        mapped = NULL;
+    }
+
+    /* Fill the buffer with size bytes from source, by mapping it or by a write */
+    void upload(const cl::CommandQueue& queue, const void* source, TransferMode mode)
+    {
+        if (mode == TRANSFER_COPY)
+        {
+            queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, size, source);
+            return;
+        }
+        void* pointer = map(queue, source == host ? CL_MAP_WRITE : CL_MAP_WRITE_INVALIDATE_REGION);
+        if (pointer != source)
+            std::memcpy(pointer, source, size);
+        unmap(queue);
+    }
+
+    /* Copy the content of the buffer into destination, by mapping it or by a read */
+    void download(const cl::CommandQueue& queue, void* destination, TransferMode mode)
+    {
+        if (mode == TRANSFER_COPY)
+        {
+            queue.enqueueReadBuffer(buffer, CL_TRUE, 0, size, destination);
+            return;
+        }
+        void* pointer = map(queue, CL_MAP_READ);
+        if (pointer != destination)
+            std::memcpy(destination, pointer, size);
+        unmap(queue);
+    }
+
+    const cl::Buffer& get_buffer() const { return buffer; }
+    void* get_host() const { return host; }
+    size_t get_size() const { return size; }
+    bool is_mapped() const { return mapped != NULL; }
+
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef IMAGE_BATCH_HPP
+#define IMAGE_BATCH_HPP
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "opencl_utils.hpp"
+
+/* uints per image in the table of a batch: offset, width, height, channels */
+#define BATCH_ENTRY 4
+/* Limits of the batches filled by a BatchPacker */
+#define DEFAULT_BATCH_IMAGES 1024
+#define DEFAULT_BATCH_BYTES (64 << 20)
+
+/* Batches of small images processed by one kernel launch each (the *_batch kernels of
+ * kernelConv.cl and kernelCopy.cl), instead of one launch and one set of arguments per
+ * image: for thumbnails, launches cost more than the work itself.
+ * An ImageBatch packs its images one after the other in one host vector, described by
+ * a table of BATCH_ENTRY uints per image. Kernels write each result at the offset of its
+ * image in an output buffer of the same size. BatchPacker groups images of the same
+ * size and channels, so that the range of a launch (the largest image times the number
+ * of images) has no idle work-items.
+ *
+ * Usage:
+ *     BatchPacker packer;
+ *     for (each image i)
+ *         packer.add(i, pixels, width, height);
+ *     for (ImageBatch& batch : packer.flush())
+ *     {
+ *         std::vector<unsigned char> out(batch.bytes());
+ *         engine.convolve_batch(mask, 5, 5, batch, out.data());
+ *         ... result of image batch.ids[k] at out.data() + batch.offset(k) ...
+ *     }
+ */
+class ImageBatch
+{
+
+    private:
+    std::vector<unsigned char> data;
+    std::vector<cl_uint> entries;
+    size_t max_width;
+    size_t max_height;
+    size_t max_channels;
+
+    public:
+    /* Index passed to add() of each image */
+    std::vector<size_t> ids;
+
+    ImageBatch() : max_width(0), max_height(0), max_channels(0) {}
+
+    /* Append a copy of the width x height image with channels interleaved channels */
+    void add(size_t id, const unsigned char* pixels, size_t width, size_t height, size_t channels = 1)
+    {
+        size_t bytes = width * height * channels;
+        if (data.size() + bytes > UINT_MAX)
+        {
+            std::cerr << "ImageBatch: batches are limited to 4 GB" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        entries.insert(entries.end(), {(cl_uint) data.size(), (cl_uint) width, (cl_uint) height, (cl_uint) channels});
+        data.insert(data.end(), pixels, pixels + bytes);
+        ids.push_back(id);
+        max_width = std::max(max_width, width);
+        max_height = std::max(max_height, height);
+        max_channels = std::max(max_channels, channels);
+    }
+
+    size_t size() const { return ids.size(); }
+    bool empty() const { return ids.empty(); }
+    size_t bytes() const { return data.size(); }
+    const unsigned char* pixels() const { return data.data(); }
+    /* Table of the batch, BATCH_ENTRY uints per image */
+    const std::vector<cl_uint>& table() const { return entries; }
+
+    size_t offset(size_t i) const { return entries[BATCH_ENTRY * i]; }
+    size_t width(size_t i) const { return entries[BATCH_ENTRY * i + 1]; }
+    size_t height(size_t i) const { return entries[BATCH_ENTRY * i + 2]; }
+    size_t channels(size_t i) const { return entries[BATCH_ENTRY * i + 3]; }
+
+    /* Size of the range covering every image */
+    size_t get_max_width() const { return max_width; }
+    size_t get_max_height() const { return max_height; }
+    size_t get_max_channels() const { return max_channels; }
+
+};
+
+/* Groups images by size and channels into batches of at most max_images images and
+ * max_bytes bytes (a larger image makes a batch of its own). */
+class BatchPacker
+{
+
+    private:
+    size_t max_images;
+    size_t max_bytes;
+    /* Batches being filled by width, height and channels */
+    std::map<std::tuple<size_t, size_t, size_t>, ImageBatch> open;
+    /* Full batches, in the order they filled up */
+    std::vector<ImageBatch> ready;
+
+    public:
+    BatchPacker(size_t max_images = DEFAULT_BATCH_IMAGES, size_t max_bytes = DEFAULT_BATCH_BYTES) :
+        max_images(std::max<size_t>(1, max_images)), max_bytes(std::min<size_t>(max_bytes, UINT_MAX))
+    {}
+
+    /* Copy the image into the batch of its size, id identifying it in ImageBatch::ids */
+    void add(size_t id, const unsigned char* pixels, size_t width, size_t height, size_t channels = 1)
+    {
+        auto key = std::make_tuple(width, height, channels);
+        ImageBatch& batch = open[key];
+        if (!batch.empty() && batch.bytes() + width * height * channels > max_bytes)
+        {
+            ready.push_back(std::move(batch));
+            batch = ImageBatch();
+        }
+        batch.add(id, pixels, width, height, channels);
+        if (batch.size() >= max_images)
+        {
+            ready.push_back(std::move(batch));
+            open.erase(key);
+        }
+    }
+
+    bool has_ready() const { return !ready.empty(); }
+
+    /* Batches that are full */
+    std::vector<ImageBatch> take_ready()
+    {
+        std::vector<ImageBatch> batches;
+        batches.swap(ready);
+        return batches;
+    }
+
+    /* Every batch, full or not; the packer is then empty */
+    std::vector<ImageBatch> flush()
+    {
+        std::vector<ImageBatch> batches = take_ready();
+        for (auto &entry : open)
+            batches.push_back(std::move(entry.second));
+        open.clear();
+        return batches;
+    }
+
+};
+
+/* Enqueue copy_buff_batch (kernelCopy.cl) on the batch whose pixels and table are in
+ * device buffers in and table: count images of at most max_width x max_height pixels of
+ * channels bytes */
+inline void enqueue_copy_batch(cl::CommandQueue& queue, cl::Kernel& kernel, const cl::Buffer& in, const cl::Buffer& table,
+                               const cl::Buffer& out, size_t count, size_t max_width, size_t max_height, size_t channels)
+{
+    kernel.setArg(0, in);
+    kernel.setArg(1, table);
+    kernel.setArg(2, out);
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(max_width * channels, max_height, count), cl::NullRange);
+}
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef IMAGE_ENGINE_HPP
+#define IMAGE_ENGINE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "opencl_utils.hpp"
+#include "benchmark.hpp"
+#include "convolution_engine.hpp"
+
+/* Format of the gray images used by the image kernels */
+inline cl::ImageFormat gray_image_format()
+{
+    return cl::ImageFormat(CL_R, CL_UNSIGNED_INT8);
+}
+
+inline bool has_image_support(const cl::Device& device)
+{
+    return device.getInfo<CL_DEVICE_IMAGE_SUPPORT>() == CL_TRUE;
+}
+
+/* Image object backend of the gray convolution and erosion (kernelImage.cl).
+ * Images are read through samplers, which handle the borders and go through the
+ * texture caches of GPUs. Results are identical to the ones of ConvolutionEngine, and
+ * masks / structuring elements are the same DeviceMask / DeviceStructuringElement,
+ * so that both engines can share them when they share a context.
+ * Image objects grow to the largest image seen, like the buffers of ConvolutionEngine:
+ * the kernels take the size of the image and never read past it. */
+class ImageEngine
+{
+
+    private:
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    cl::Program program;
+    std::map<std::string, cl::Kernel> kernels;
+
+    cl::Image2D image_in;
+    cl::Image2D image_out;
+    size_t image_width;
+    size_t image_height;
+
+    DeviceMask mask;
+    DeviceStructuringElement structuring_element;
+
+    void check_support()
+    {
+        if (!has_image_support(device))
+        {
+            std::cerr << "Device " << device.getInfo<CL_DEVICE_NAME>() << " does not support images." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    void reserve_images(size_t width, size_t height)
+    {
+        if (width <= image_width && height <= image_height)
+            return;
+        image_width = std::max(width, image_width);
+        image_height = std::max(height, image_height);
+        image_in = cl::Image2D(context, CL_MEM_READ_ONLY, gray_image_format(), image_width, image_height);
+        image_out = cl::Image2D(context, CL_MEM_WRITE_ONLY, gray_image_format(), image_width, image_height);
+    }
+
+    void launch(cl::Kernel& kernel, size_t width, size_t height)
+    {
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange);
+    }
+
+    public:
+    ImageEngine(cl::Device device, std::string kernel_source_file = "../src/kernelImage.cl") :
+        context(std::vector<cl::Device>(1, device)), device(device), image_width(0), image_height(0)
+    {
+        check_support();
+        queue = cl::CommandQueue(context, device);
+        program = load_and_build_program(context, device, kernel_source_file);
+    }
+
+    ImageEngine(cl::Context context, cl::Device device, cl::CommandQueue queue, std::string kernel_source_file = "../src/kernelImage.cl") :
+        context(context), device(device), queue(queue), image_width(0), image_height(0)
+    {
+        check_support();
+        program = load_and_build_program(context, device, kernel_source_file);
+    }
+
+    cl::Kernel& get_kernel(const std::string& name)
+    {
+        auto it = kernels.find(name);
+        if (it == kernels.end())
+        {
+            it = kernels.insert(std::make_pair(name, cl::Kernel(program, name.c_str()))).first;
+        }
+        return it->second;
+    }
+
+    /* Non-blocking upload of the width x height gray pixels into the top-left corner of image */
+    void enqueue_upload(const cl::Image2D& image, const unsigned char* pixels, size_t width, size_t height)
+    {
+        cl::size_t<3> origin;
+        cl::size_t<3> region;
+        region[0] = width;
+        region[1] = height;
+        region[2] = 1;
+        queue.enqueueWriteImage(image, CL_FALSE, origin, region, width * sizeof(unsigned char), 0, pixels);
+    }
+
+    /* Blocking read of the top-left width x height gray pixels of image */
+    void download(const cl::Image2D& image, unsigned char* pixels, size_t width, size_t height)
+    {
+        cl::size_t<3> origin;
+        cl::size_t<3> region;
+        region[0] = width;
+        region[1] = height;
+        region[2] = 1;
+        queue.enqueueReadImage(image, CL_TRUE, origin, region, width * sizeof(unsigned char), 0, pixels);
+    }
+
+    /* Enqueue the convolution of the width x height gray image in into out */
+    void enqueue_convolution(const DeviceMask& device_mask, const cl::Image2D& in, const cl::Image2D& out, size_t width, size_t height)
+    {
+        cl::Kernel& convKernel = get_kernel("gray_conv_img");
+        convKernel.setArg(0, in);
+        // Kernel scalar arguments can not be of type size_t
+        convKernel.setArg(1, (cl_uint) width);
+        convKernel.setArg(2, (cl_uint) height);
+        convKernel.setArg(3, device_mask.buffer);
+        convKernel.setArg(4, (cl_uint) device_mask.width);
+        convKernel.setArg(5, (cl_uint) device_mask.height);
+        convKernel.setArg(6, device_mask.total);
+        convKernel.setArg(7, out);
+        launch(convKernel, width, height);
+    }
+
+    /* Enqueue the erosion of the width x height gray image in into out */
+    void enqueue_erosion(const DeviceStructuringElement& device_se, const cl::Image2D& in, const cl::Image2D& out, size_t width, size_t height)
+    {
+        cl::Kernel& erodeKernel = get_kernel("erode_img");
+        erodeKernel.setArg(0, in);
+        erodeKernel.setArg(1, (cl_uint) width);
+        erodeKernel.setArg(2, (cl_uint) height);
+        erodeKernel.setArg(3, device_se.buffer);
+        erodeKernel.setArg(4, (cl_uint) device_se.size);
+        erodeKernel.setArg(5, out);
+        launch(erodeKernel, width, height);
+    }
+
+    /* Convolve the width x height gray image in with mask and store the result in out.
+     * Returns the elapsed time in seconds. */
+    double convolve(const float* mask_values, size_t mask_width, size_t mask_height,
+                    const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        reserve_images(width, height);
+        prepare_device_mask(context, mask, mask_values, mask_width, mask_height);
+        enqueue_upload(image_in, in, width, height);
+        enqueue_convolution(mask, image_in, image_out, width, height);
+        download(image_out, out, width, height);
+        return t.end();
+    }
+
+    /* Erode the width x height gray image in with the se_size x se_size structuring
+     * element se and store the result in out. Returns the elapsed time in seconds. */
+    double erode(const int* se, size_t se_size,
+                 const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        reserve_images(width, height);
+        prepare_device_structuring_element(context, structuring_element, se, se_size);
+        enqueue_upload(image_in, in, width, height);
+        enqueue_erosion(structuring_element, image_in, image_out, width, height);
+        download(image_out, out, width, height);
+        return t.end();
+    }
+
+    cl::Context& get_context() { return context; }
+    cl::Device& get_device() { return device; }
+    cl::CommandQueue& get_queue() { return queue; }
+    cl::Program& get_program() { return program; }
+
+};
+
+#endif
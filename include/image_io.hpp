@@ -0,0 +1,379 @@
+#ifndef IMAGE_IO_HPP
+#define IMAGE_IO_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bounded_queue.hpp"
+#include "color_conversion.hpp"
+
+/* Image decoding and encoding off the main thread.
+ * Binary PGM / PPM files (P5 / P6, 8 bits) are memory-mapped and used in place; other
+ * formats go through the OpenCV codecs. Decoded images keep the pixel layout of the
+ * file (see PixelFormat): colour conversions are left to the device (color_conversion.hpp).
+ * DecoderPool and EncoderPool run the codecs on several threads around bounded queues,
+ * so that batch jobs decode, process and encode different images at the same time. */
+
+/* Read-only memory mapping of a whole file, unmapped on destruction */
+class MappedFile
+{
+
+    private:
+    void* address;
+    size_t length;
+
+    public:
+    MappedFile() : address(NULL), length(0) {}
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    /* Map path; returns false if it can not be opened or is empty */
+    bool open(const std::string& path)
+    {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+            return false;
+        address = map;
+        length = info.st_size;
+        return true;
+    }
+
+    void close()
+    {
+        if (address)
+            munmap(address, length);
+        address = NULL;
+        length = 0;
+    }
+
+    const unsigned char* data() const { return static_cast<const unsigned char*>(address); }
+    size_t size() const { return length; }
+
+};
+
+/* Decoded image. data points either into mat or into a mapped file, which the image
+ * keeps alive: copies of a HostImage share the pixels. */
+struct HostImage
+{
+    size_t width;
+    size_t height;
+    PixelFormat format;
+    const unsigned char* data;
+    cv::Mat mat;
+    std::shared_ptr<MappedFile> file;
+
+    HostImage() : width(0), height(0), format(PIXEL_GRAY), data(NULL) {}
+
+    size_t channels() const { return pixel_channels(format); }
+    size_t bytes() const { return width * height * channels(); }
+};
+
+inline bool has_extension(const std::string& path, const std::string& extension)
+{
+    std::string lower = path;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    return lower.size() > extension.size() && lower.compare(lower.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+/* Next number of a PNM header starting at position, skipping blanks and comments.
+ * Returns false when there is none or it does not fit in a size_t. */
+inline bool read_pnm_number(const unsigned char* header, size_t size, size_t& position, size_t& value)
+{
+    while (position < size && (std::isspace(header[position]) || header[position] == '#'))
+    {
+        if (header[position] == '#')
+        {
+            while (position < size && header[position] != '\n')
+                ++position;
+        }
+        else
+        {
+            ++position;
+        }
+    }
+    if (position >= size || !std::isdigit(header[position]))
+        return false;
+    value = 0;
+    while (position < size && std::isdigit(header[position]))
+    {
+        size_t digit = header[position++] - '0';
+        if (value > (std::numeric_limits<size_t>::max() - digit) / 10)
+            return false;
+        value = value * 10 + digit;
+    }
+    return true;
+}
+
+/* Map a binary 8 bit PGM (P5) or PPM (P6) file and point image at its pixels.
+ * Returns false for anything else, including ASCII and 16 bit files. */
+inline bool read_netpbm(const std::string& path, HostImage& image)
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(path) || file->size() < 2)
+        return false;
+
+    const unsigned char* bytes = file->data();
+    if (bytes[0] != 'P' || (bytes[1] != '5' && bytes[1] != '6'))
+        return false;
+    size_t position = 2;
+    size_t width, height, max_value;
+    if (!read_pnm_number(bytes, file->size(), position, width) ||
+        !read_pnm_number(bytes, file->size(), position, height) ||
+        !read_pnm_number(bytes, file->size(), position, max_value) || max_value != 255)
+        return false;
+    /* A single whitespace separates the header from the pixels */
+    ++position;
+
+    /* The pixels must fit in the rest of the file: dividing instead of multiplying keeps
+     * width x height x channels from overflowing */
+    PixelFormat format = bytes[1] == '5' ? PIXEL_GRAY : PIXEL_RGB;
+    size_t channels = pixel_channels(format);
+    if (width == 0 || height == 0 || position > file->size())
+        return false;
+    size_t available = file->size() - position;
+    if (width > available / channels || height > available / (width * channels))
+        return false;
+
+    image.width = width;
+    image.height = height;
+    image.format = format;
+    image.data = bytes + position;
+    image.mat = cv::Mat();
+    image.file = file;
+    return true;
+}
+
+/* Decode path into image, mapping PGM / PPM files and using OpenCV for the others.
+ * OpenCV images are BGR(A) or gray, converted to 8 bits if needed. */
+inline bool read_image(const std::string& path, HostImage& image)
+{
+    if ((has_extension(path, ".ppm") || has_extension(path, ".pgm")) && read_netpbm(path, image))
+        return true;
+
+    /* Only 8-bit gray, BGR and BGRA images are kept as they are: other depths and channel
+     * counts (e.g. gray + alpha) have no PixelFormat and are reloaded as BGR */
+    cv::Mat mat = cv::imread(path, cv::IMREAD_UNCHANGED);
+    if (!mat.empty() && (mat.depth() != CV_8U || (mat.channels() != 1 && mat.channels() != 3 && mat.channels() != 4)))
+        mat = cv::imread(path, cv::IMREAD_COLOR);
+    if (mat.empty())
+        return false;
+    if (!mat.isContinuous())
+        mat = mat.clone();
+
+    image.width = mat.cols;
+    image.height = mat.rows;
+    image.format = mat.channels() == 1 ? PIXEL_GRAY : mat.channels() == 3 ? PIXEL_BGR : PIXEL_BGRA;
+    image.data = mat.data;
+    image.mat = mat;
+    image.file.reset();
+    return true;
+}
+
+/* Write a binary PGM (gray) or PPM (RGB) file */
+inline bool write_netpbm(const std::string& path, const unsigned char* pixels, size_t width, size_t height, PixelFormat format)
+{
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == NULL)
+        return false;
+    std::fprintf(file, "P%c\n%zu %zu\n255\n", format == PIXEL_GRAY ? '5' : '6', width, height);
+    size_t bytes = width * height * pixel_channels(format);
+    bool written = std::fwrite(pixels, 1, bytes, file) == bytes;
+    return std::fclose(file) == 0 && written;
+}
+
+/* Encode the width x height image pixels into path, whose extension selects the codec.
+ * Gray and RGB images go to PGM / PPM files as they are. OpenCV encoders expect BGR(A)
+ * pixels: convert RGB(A) images on the device first (ColorConverter), otherwise they are
+ * converted here. */
+inline bool write_image(const std::string& path, const unsigned char* pixels, size_t width, size_t height, PixelFormat format)
+{
+    if ((format == PIXEL_GRAY && has_extension(path, ".pgm")) || (format == PIXEL_RGB && has_extension(path, ".ppm")))
+        return write_netpbm(path, pixels, width, height, format);
+
+    int channels = pixel_channels(format);
+    cv::Mat mat(height, width, CV_MAKETYPE(CV_8U, channels), const_cast<unsigned char*>(pixels));
+    if (format == PIXEL_RGB || format == PIXEL_RGBA)
+    {
+        cv::Mat bgr;
+        cv::cvtColor(mat, bgr, format == PIXEL_RGB ? CV_RGB2BGR : CV_RGBA2BGRA);
+        return cv::imwrite(path, bgr);
+    }
+    return cv::imwrite(path, mat);
+}
+
+/* One image travelling from a DecoderPool to an EncoderPool */
+struct ImageFrame
+{
+    size_t index;
+    std::string name;
+    HostImage image;
+    std::vector<unsigned char> result;
+    PixelFormat result_format;
+    /* Signals the end of the download of result */
+    cl::Event done;
+
+    ImageFrame() : index(0), result_format(PIXEL_GRAY) {}
+};
+
+inline std::string base_name(const std::string& path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+/* name with index appended to its stem ("img.png", 3 -> "img_3.png"), so that inputs of
+ * different directories sharing a name do not overwrite each other's output */
+inline std::string indexed_name(const std::string& name, size_t index)
+{
+    size_t dot = name.find_last_of('.');
+    if (dot == std::string::npos || dot == 0)
+        return name + "_" + std::to_string(index);
+    return name.substr(0, dot) + "_" + std::to_string(index) + name.substr(dot);
+}
+
+/* Threads decoding paths into frames pushed to out, which is closed once every path is
+ * done. Frames carry the index of their path: with several threads they may arrive
+ * out of order. Unreadable files are reported and skipped. */
+class DecoderPool
+{
+
+    private:
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next;
+    std::atomic<size_t> running;
+
+    public:
+    DecoderPool(const std::vector<std::string>& paths, BoundedQueue<std::shared_ptr<ImageFrame> >& out, size_t num_threads) :
+        next(0), running(std::max<size_t>(1, num_threads))
+    {
+        for (size_t t = 0; t < std::max<size_t>(1, num_threads); ++t)
+        {
+            threads.emplace_back([this, &paths, &out]()
+            {
+                for (size_t i = next++; i < paths.size(); i = next++)
+                {
+                    std::shared_ptr<ImageFrame> frame(new ImageFrame());
+                    frame->index = i;
+                    frame->name = base_name(paths[i]);
+                    if (!read_image(paths[i], frame->image))
+                    {
+                        std::cerr << "Could not read " << paths[i] << std::endl;
+                        continue;
+                    }
+                    if (!out.push(frame))
+                        break;
+                }
+                /* The last thread to finish closes the queue */
+                if (--running == 0)
+                    out.close();
+            });
+        }
+    }
+
+    DecoderPool(const DecoderPool&) = delete;
+    DecoderPool& operator=(const DecoderPool&) = delete;
+
+    ~DecoderPool()
+    {
+        join();
+    }
+
+    void join()
+    {
+        for (auto &thread : threads)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+
+};
+
+/* Threads writing the results of the frames popped from in to output_dir, under the
+ * name of their input followed by the frame index (see indexed_name()), until in is
+ * closed and drained */
+class EncoderPool
+{
+
+    private:
+    std::vector<std::thread> threads;
+    std::atomic<size_t> written;
+    std::atomic<size_t> pixels;
+
+    public:
+    EncoderPool(BoundedQueue<std::shared_ptr<ImageFrame> >& in, const std::string& output_dir, size_t num_threads) :
+        written(0), pixels(0)
+    {
+        for (size_t t = 0; t < std::max<size_t>(1, num_threads); ++t)
+        {
+            threads.emplace_back([this, &in, output_dir]()
+            {
+                std::shared_ptr<ImageFrame> frame;
+                while (in.pop(frame))
+                {
+                    std::string path = output_dir + "/" + indexed_name(frame->name, frame->index);
+                    if (!write_image(path, frame->result.data(), frame->image.width, frame->image.height, frame->result_format))
+                    {
+                        std::cerr << "Could not write " << path << std::endl;
+                        continue;
+                    }
+                    ++written;
+                    pixels += frame->image.width * frame->image.height;
+                }
+            });
+        }
+    }
+
+    EncoderPool(const EncoderPool&) = delete;
+    EncoderPool& operator=(const EncoderPool&) = delete;
+
+    ~EncoderPool()
+    {
+        join();
+    }
+
+    void join()
+    {
+        for (auto &thread : threads)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+
+    size_t get_written() const { return written; }
+    size_t get_pixels() const { return pixels; }
+
+};
+
+#endif
@@ -0,0 +1,361 @@
+#ifndef INTEGRAL_IMAGE_HPP
+#define INTEGRAL_IMAGE_HPP
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "opencl_utils.hpp"
+#include "benchmark.hpp"
+#include "buffer_pool.hpp"
+
+/* Accumulator type of a summed area table */
+enum SatAccumulator
+{
+    /* 8 bit images: exact whatever the image size */
+    SAT_ULONG,
+    /* Float images, on devices without double precision */
+    SAT_FLOAT,
+    SAT_DOUBLE
+};
+
+inline size_t sat_element_size(SatAccumulator accumulator)
+{
+    return accumulator == SAT_FLOAT ? sizeof(cl_float) : sizeof(cl_ulong);
+}
+
+/* Summed area tables (integral images) and the window operations built on them
+ * (kernelScan.cl). The table holds at (x, y) the sum of the pixels above and left of
+ * it, both included: the sum over any rectangle then costs four reads, so that box
+ * filters, local means and variances and adaptive thresholds cost O(1) per pixel
+ * whatever the window size.
+ * Tables are computed by work-efficient (Blelloch) scans of the rows, then of the rows
+ * of the transposed table. 8 bit images accumulate in 64 bit integers; float images in
+ * doubles when the device has them, in floats otherwise (then sums over large images
+ * lose precision). enqueue_scan_rows() is exposed as a building block.
+ * Windows are clipped to the image and their operations normalised by the pixels inside
+ * it, like the convolution kernels: box_filter() matches a convolution by a box mask.
+ * Like MorphologyEngine, device buffers come from a BufferPool, are kept between calls
+ * and only grow. */
+class IntegralImageEngine
+{
+
+    private:
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    std::string kernel_source_file;
+    std::map<SatAccumulator, cl::Program> programs;
+    std::map<std::pair<SatAccumulator, std::string>, cl::Kernel> kernels;
+    SatAccumulator float_accumulator;
+    size_t transpose_tile;
+
+    std::shared_ptr<BufferPool> pool;
+    /* Tables of the image and of its squares, transposed table, and block sums of each
+     * level of the scans */
+    PooledBuffer sat;
+    PooledBuffer sat_squares;
+    PooledBuffer transposed;
+    std::vector<PooledBuffer> block_sums;
+    /* Input, output and second output (variance) of the host functions */
+    PooledBuffer input;
+    PooledBuffer output;
+    PooledBuffer output2;
+
+    cl::Program& program(SatAccumulator accumulator)
+    {
+        auto it = programs.find(accumulator);
+        if (it == programs.end())
+        {
+            std::string options = "-D TRANSPOSE_TILE=" + std::to_string(transpose_tile);
+            switch (accumulator)
+            {
+                case SAT_ULONG: options += " -D SCAN_T=ulong -D SCAN_INTEGER"; break;
+                case SAT_FLOAT: options += " -D SCAN_T=float"; break;
+                case SAT_DOUBLE: options += " -D SCAN_T=double -D SCAN_DOUBLE"; break;
+            }
+            it = programs.insert(std::make_pair(accumulator, load_and_build_program(context, device, kernel_source_file, options))).first;
+        }
+        return it->second;
+    }
+
+    cl::Kernel& get_kernel(SatAccumulator accumulator, const std::string& name)
+    {
+        auto key = std::make_pair(accumulator, name);
+        auto it = kernels.find(key);
+        if (it == kernels.end())
+            it = kernels.insert(std::make_pair(key, cl::Kernel(program(accumulator), name.c_str()))).first;
+        return it->second;
+    }
+
+    /* Grow buffer to bytes; the blocks replaced may be in use by enqueued commands */
+    void reserve(PooledBuffer& buffer, size_t bytes)
+    {
+        if (bytes <= buffer.capacity())
+            return;
+        if (!buffer.empty())
+            queue.finish();
+        buffer = pool->acquire(bytes);
+    }
+
+    /* Work-group size of scan_blocks: a power of two */
+    size_t scan_local_size(cl::Kernel& kernel)
+    {
+        size_t limit = std::min<size_t>(256, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+        size_t local = 1;
+        while (local * 2 <= limit)
+            local *= 2;
+        return local;
+    }
+
+    /* data is taken by value: at the next level it is a block of block_sums, which the
+     * resize() of that level may move */
+    void enqueue_scan_level(SatAccumulator accumulator, cl::Buffer data, size_t row_length, size_t rows, size_t level)
+    {
+        cl::Kernel& scanKernel = get_kernel(accumulator, "scan_blocks");
+        size_t local = scan_local_size(scanKernel);
+        size_t block_size = 2 * local;
+        size_t blocks = (row_length + block_size - 1) / block_size;
+        size_t element = sat_element_size(accumulator);
+        if (block_sums.size() <= level)
+            block_sums.resize(level + 1);
+        if (blocks > 1)
+            reserve(block_sums[level], rows * blocks * element);
+
+        scanKernel.setArg(0, data);
+        scanKernel.setArg(1, (cl_uint) row_length);
+        scanKernel.setArg(2, (cl_uint) blocks);
+        scanKernel.setArg(3, (cl_uint) (blocks > 1));
+        /* Unused without block sums, but must be a buffer */
+        scanKernel.setArg(4, blocks > 1 ? block_sums[level].buffer() : data);
+        scanKernel.setArg(5, cl::Local(block_size * element));
+        queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, cl::NDRange(blocks * local, rows), cl::NDRange(local, 1));
+        if (blocks == 1)
+            return;
+
+        /* Scan the sums of the blocks, then add them to the blocks that follow */
+        enqueue_scan_level(accumulator, block_sums[level].buffer(), blocks, rows, level + 1);
+        cl::Kernel& addKernel = get_kernel(accumulator, "add_block_offsets");
+        addKernel.setArg(0, data);
+        addKernel.setArg(1, (cl_uint) row_length);
+        addKernel.setArg(2, (cl_uint) block_size);
+        addKernel.setArg(3, (cl_uint) blocks);
+        addKernel.setArg(4, block_sums[level].buffer());
+        queue.enqueueNDRangeKernel(addKernel, cl::NullRange, cl::NDRange(row_length, rows), cl::NullRange);
+    }
+
+    void enqueue_transpose(SatAccumulator accumulator, const cl::Buffer& in, size_t width, size_t height, const cl::Buffer& out)
+    {
+        cl::Kernel& transposeKernel = get_kernel(accumulator, "transpose");
+        transposeKernel.setArg(0, in);
+        transposeKernel.setArg(1, (cl_uint) width);
+        transposeKernel.setArg(2, (cl_uint) height);
+        transposeKernel.setArg(3, out);
+        queue.enqueueNDRangeKernel(transposeKernel, cl::NullRange,
+                                   cl::NDRange(round_up(width, transpose_tile), round_up(height, transpose_tile)),
+                                   cl::NDRange(transpose_tile, transpose_tile));
+    }
+
+    /* Enqueue a window kernel, whose arguments are set, over a width x height range */
+    void launch(cl::Kernel& kernel, size_t width, size_t height)
+    {
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange);
+    }
+
+    void init()
+    {
+        pool = std::make_shared<BufferPool>(context, device);
+        float_accumulator = device.getInfo<CL_DEVICE_DOUBLE_FP_CONFIG>() != 0 ? SAT_DOUBLE : SAT_FLOAT;
+        transpose_tile = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() >= 256 ? 16 : 8;
+    }
+
+    public:
+    IntegralImageEngine(cl::Device device, std::string kernel_source_file = "../src/kernelScan.cl") :
+        context(std::vector<cl::Device>(1, device)), device(device), kernel_source_file(kernel_source_file)
+    {
+        queue = cl::CommandQueue(context, device);
+        init();
+    }
+
+    IntegralImageEngine(cl::Context context, cl::Device device, cl::CommandQueue queue, std::string kernel_source_file = "../src/kernelScan.cl") :
+        context(context), device(device), queue(queue), kernel_source_file(kernel_source_file)
+    {
+        init();
+    }
+
+    /* Accumulator of the tables of 8 bit (float_input false) or float images */
+    SatAccumulator accumulator(bool float_input) const
+    {
+        return float_input ? float_accumulator : SAT_ULONG;
+    }
+
+    /* Enqueue the inclusive scan, in place, of each of the rows of row_length elements of
+     * data, of the given accumulator type */
+    void enqueue_scan_rows(SatAccumulator accumulator, const cl::Buffer& data, size_t row_length, size_t rows)
+    {
+        enqueue_scan_level(accumulator, data, row_length, rows, 0);
+    }
+
+    /* Enqueue the summed area table of the width x height image in (8 bit, or float with
+     * float_input), or of its squares with squared, into out: width x height elements of
+     * accumulator(float_input) */
+    void enqueue_integral(const cl::Buffer& in, bool float_input, bool squared, const cl::Buffer& out, size_t width, size_t height)
+    {
+        SatAccumulator type = accumulator(float_input);
+        size_t count = width * height;
+        cl::Kernel& widenKernel = get_kernel(type, float_input ? "widen_float" : "widen_uchar");
+        widenKernel.setArg(0, in);
+        widenKernel.setArg(1, (cl_uint) count);
+        widenKernel.setArg(2, (cl_uint) squared);
+        widenKernel.setArg(3, out);
+        queue.enqueueNDRangeKernel(widenKernel, cl::NullRange, cl::NDRange(count), cl::NullRange);
+
+        reserve(transposed, count * sat_element_size(type));
+        enqueue_scan_rows(type, out, width, height);
+        enqueue_transpose(type, out, width, height, transposed.buffer());
+        enqueue_scan_rows(type, transposed.buffer(), height, width);
+        enqueue_transpose(type, transposed.buffer(), height, width, out);
+    }
+
+    /* Enqueue the mean, rounded down, of the (2 radius_x + 1) x (2 radius_y + 1) window
+     * around every pixel of the 8 bit image in into out */
+    void enqueue_box_filter(const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height, size_t radius_x, size_t radius_y)
+    {
+        reserve(sat, width * height * sat_element_size(SAT_ULONG));
+        enqueue_integral(in, false, false, sat.buffer(), width, height);
+        cl::Kernel& boxKernel = get_kernel(SAT_ULONG, "box_filter");
+        boxKernel.setArg(0, sat.buffer());
+        boxKernel.setArg(1, (cl_uint) width);
+        boxKernel.setArg(2, (cl_uint) height);
+        boxKernel.setArg(3, (cl_uint) radius_x);
+        boxKernel.setArg(4, (cl_uint) radius_y);
+        boxKernel.setArg(5, out);
+        launch(boxKernel, width, height);
+    }
+
+    /* Enqueue the float mean of the window around every pixel of in (8 bit, or float with
+     * float_input) into out */
+    void enqueue_box_mean(const cl::Buffer& in, bool float_input, const cl::Buffer& out, size_t width, size_t height, size_t radius_x, size_t radius_y)
+    {
+        SatAccumulator type = accumulator(float_input);
+        reserve(sat, width * height * sat_element_size(type));
+        enqueue_integral(in, float_input, false, sat.buffer(), width, height);
+        cl::Kernel& meanKernel = get_kernel(type, "box_mean");
+        meanKernel.setArg(0, sat.buffer());
+        meanKernel.setArg(1, (cl_uint) width);
+        meanKernel.setArg(2, (cl_uint) height);
+        meanKernel.setArg(3, (cl_uint) radius_x);
+        meanKernel.setArg(4, (cl_uint) radius_y);
+        meanKernel.setArg(5, out);
+        launch(meanKernel, width, height);
+    }
+
+    /* Enqueue the mean and the variance (float) of the window around every pixel of in */
+    void enqueue_mean_variance(const cl::Buffer& in, bool float_input, const cl::Buffer& mean, const cl::Buffer& variance,
+                               size_t width, size_t height, size_t radius_x, size_t radius_y)
+    {
+        SatAccumulator type = accumulator(float_input);
+        reserve(sat, width * height * sat_element_size(type));
+        reserve(sat_squares, width * height * sat_element_size(type));
+        enqueue_integral(in, float_input, false, sat.buffer(), width, height);
+        enqueue_integral(in, float_input, true, sat_squares.buffer(), width, height);
+        cl::Kernel& varianceKernel = get_kernel(type, "mean_variance");
+        varianceKernel.setArg(0, sat.buffer());
+        varianceKernel.setArg(1, sat_squares.buffer());
+        varianceKernel.setArg(2, (cl_uint) width);
+        varianceKernel.setArg(3, (cl_uint) height);
+        varianceKernel.setArg(4, (cl_uint) radius_x);
+        varianceKernel.setArg(5, (cl_uint) radius_y);
+        varianceKernel.setArg(6, mean);
+        varianceKernel.setArg(7, variance);
+        launch(varianceKernel, width, height);
+    }
+
+    /* Enqueue the adaptive threshold of the 8 bit image in into out: 255 where a pixel
+     * is above the mean of its window minus offset, 0 elsewhere */
+    void enqueue_adaptive_threshold(const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height,
+                                    size_t radius_x, size_t radius_y, float offset)
+    {
+        reserve(sat, width * height * sat_element_size(SAT_ULONG));
+        enqueue_integral(in, false, false, sat.buffer(), width, height);
+        cl::Kernel& thresholdKernel = get_kernel(SAT_ULONG, "adaptive_threshold");
+        thresholdKernel.setArg(0, in);
+        thresholdKernel.setArg(1, sat.buffer());
+        thresholdKernel.setArg(2, (cl_uint) width);
+        thresholdKernel.setArg(3, (cl_uint) height);
+        thresholdKernel.setArg(4, (cl_uint) radius_x);
+        thresholdKernel.setArg(5, (cl_uint) radius_y);
+        thresholdKernel.setArg(6, offset);
+        thresholdKernel.setArg(7, out);
+        launch(thresholdKernel, width, height);
+    }
+
+    /* Box filter of the width x height 8 bit image in into out. Returns the elapsed time in seconds. */
+    double box_filter(const unsigned char* in, size_t width, size_t height, size_t radius_x, size_t radius_y, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        size_t bytes = width * height;
+        reserve(input, bytes);
+        reserve(output, bytes);
+        queue.enqueueWriteBuffer(input.buffer(), CL_FALSE, 0, bytes, in);
+        enqueue_box_filter(input.buffer(), output.buffer(), width, height, radius_x, radius_y);
+        queue.enqueueReadBuffer(output.buffer(), CL_TRUE, 0, bytes, out);
+        return t.end();
+    }
+
+    /* Local mean and variance of the width x height 8 bit image in. Returns the elapsed time in seconds. */
+    double mean_variance(const unsigned char* in, size_t width, size_t height, size_t radius_x, size_t radius_y,
+                         float* mean, float* variance)
+    {
+        Timer t;
+        t.start();
+        size_t pixels = width * height;
+        reserve(input, pixels);
+        reserve(output, pixels * sizeof(float));
+        reserve(output2, pixels * sizeof(float));
+        queue.enqueueWriteBuffer(input.buffer(), CL_FALSE, 0, pixels, in);
+        enqueue_mean_variance(input.buffer(), false, output.buffer(), output2.buffer(), width, height, radius_x, radius_y);
+        queue.enqueueReadBuffer(output.buffer(), CL_FALSE, 0, pixels * sizeof(float), mean);
+        queue.enqueueReadBuffer(output2.buffer(), CL_TRUE, 0, pixels * sizeof(float), variance);
+        return t.end();
+    }
+
+    /* Adaptive threshold of the width x height 8 bit image in into out. Returns the elapsed time in seconds. */
+    double adaptive_threshold(const unsigned char* in, size_t width, size_t height, size_t radius_x, size_t radius_y,
+                              float offset, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        size_t bytes = width * height;
+        reserve(input, bytes);
+        reserve(output, bytes);
+        queue.enqueueWriteBuffer(input.buffer(), CL_FALSE, 0, bytes, in);
+        enqueue_adaptive_threshold(input.buffer(), output.buffer(), width, height, radius_x, radius_y, offset);
+        queue.enqueueReadBuffer(output.buffer(), CL_TRUE, 0, bytes, out);
+        return t.end();
+    }
+
+    /* Take device memory from pool, which must have been created for the context of the engine */
+    void set_buffer_pool(std::shared_ptr<BufferPool> pool)
+    {
+        queue.finish();
+        sat.release();
+        sat_squares.release();
+        transposed.release();
+        block_sums.clear();
+        input.release();
+        output.release();
+        output2.release();
+        this->pool = pool;
+    }
+
+    std::shared_ptr<BufferPool> get_buffer_pool() { return pool; }
+    cl::CommandQueue& get_queue() { return queue; }
+
+};
+
+#endif
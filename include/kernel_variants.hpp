@@ -0,0 +1,130 @@
+#ifndef KERNEL_VARIANTS_HPP
+#define KERNEL_VARIANTS_HPP
+
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "opencl_utils.hpp"
+
+/* Mask and structuring element sizes specialized by default */
+#define DEFAULT_SPECIALIZED_SIZES {3, 5, 7}
+
+/* Programs of one kernel source file built for several sets of compile-time constants.
+ * Every program is built with the common options (e.g. "-D VECTOR_WIDTH=16
+ * -cl-mad-enable") plus its own definitions, such as "-D MASK_W=5 -D MASK_H=5" for
+ * the kernels of kernelConv.cl: with the mask size known at compile time, the loops
+ * over the mask are fully unrolled. Programs are built on first use, go through the
+ * on-disk program cache of load_and_build_program(), and stay alive as long as the
+ * object. Only the sizes in the specialized set get their own program; every other
+ * size uses the generic program, whose sizes come from the kernel arguments, so that
+ * unusual masks do not each pay for a compilation. */
+class KernelVariants
+{
+
+    private:
+    cl::Context context;
+    cl::Device device;
+    std::string kernel_source_file;
+    std::string options;
+    std::set<size_t> sizes;
+    /* Programs by definitions, "" being the generic program */
+    std::map<std::string, cl::Program> programs;
+
+    public:
+    KernelVariants(cl::Context context, cl::Device device, std::string kernel_source_file, std::string options = "") :
+        context(context), device(device), kernel_source_file(kernel_source_file), options(options), sizes(DEFAULT_SPECIALIZED_SIZES)
+    {}
+
+    /* Program built with the common options and definitions, built on the first call */
+    cl::Program& program(const std::string& definitions = "")
+    {
+        auto it = programs.find(definitions);
+        if (it == programs.end())
+        {
+            std::string build_options = options;
+            if (!definitions.empty())
+                build_options += (build_options.empty() ? "" : " ") + definitions;
+            it = programs.insert(std::make_pair(definitions, load_and_build_program(context, device, kernel_source_file, build_options))).first;
+        }
+        return it->second;
+    }
+
+    /* Tell whether masks or structuring elements of this size get their own program */
+    bool is_specialized(size_t size) const
+    {
+        return sizes.count(size) > 0;
+    }
+
+    /* Definitions of the program specialized for a mask_width x mask_height mask, or ""
+     * (the generic program) for sizes outside of the specialized set */
+    std::string mask_definitions(size_t mask_width, size_t mask_height) const
+    {
+        if (!is_specialized(mask_width) || !is_specialized(mask_height))
+            return "";
+        std::ostringstream definitions;
+        definitions << "-D MASK_W=" << mask_width << " -D MASK_H=" << mask_height;
+        return definitions.str();
+    }
+
+    /* Definitions of the program specialized for a se_size x se_size structuring element */
+    std::string se_definitions(size_t se_size) const
+    {
+        if (!is_specialized(se_size))
+            return "";
+        std::ostringstream definitions;
+        definitions << "-D SE_SIZE=" << se_size;
+        return definitions.str();
+    }
+
+    /* Definitions of the program specialized for both a mask and a structuring element */
+    std::string fused_definitions(size_t mask_width, size_t mask_height, size_t se_size) const
+    {
+        std::string mask = mask_definitions(mask_width, mask_height);
+        std::string se = se_definitions(se_size);
+        return mask.empty() || se.empty() ? mask + se : mask + " " + se;
+    }
+
+    /* Replace the set of specialized sizes; an empty set disables specialization */
+    void set_specialized_sizes(const std::set<size_t>& sizes)
+    {
+        this->sizes = sizes;
+    }
+
+    const std::set<size_t>& get_specialized_sizes() const { return sizes; }
+    const std::string& get_options() const { return options; }
+    size_t get_program_count() const { return programs.size(); }
+    cl::Context& get_context() { return context; }
+    cl::Device& get_device() { return device; }
+
+};
+
+/* Remove "--specialize sizes" from the command line and return the sizes to specialize:
+ * a comma separated list such as "3,5", "none", or the default set when absent */
+inline std::set<size_t> parse_specialize_option(int& argc, char** argv)
+{
+    std::string spec = parse_option(argc, argv, "--specialize", "");
+    if (spec.empty())
+        return std::set<size_t>(DEFAULT_SPECIALIZED_SIZES);
+
+    std::set<size_t> sizes;
+    if (spec == "none")
+        return sizes;
+    std::stringstream stream(spec);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        char* end = NULL;
+        long size = std::strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0' || size <= 0)
+        {
+            std::cerr << "Invalid --specialize value: " << spec << " (expected sizes such as 3,5 or none)" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        sizes.insert((size_t) size);
+    }
+    return sizes;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef MASKS_HPP
+#define MASKS_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+inline float* create_gaussian_kernel(float sigma, size_t kernel_size)
+{
+    float* kernel = new float[kernel_size * kernel_size];
+    float mean = kernel_size/2;
+    float sum = 0.0;
+    for (int i = 0; i < kernel_size * kernel_size; ++i) 
+    {
+        int x = i % kernel_size;
+        int y = (i - x) / kernel_size % kernel_size;
+        kernel[i] = exp( -0.5 * (pow((x-mean)/sigma, 2.0) + pow((y-mean)/sigma,2.0)) ) / (2 * M_PI * sigma * sigma);
+        // Accumulate the kernel values
+        sum += kernel[i];
+    }
+
+    // Normalize the kernel
+    
+    /*
+    for (int i = 0; i < kernel_size * kernel_size; ++i)
+            kernel[i] /= sum;
+    */
+    return kernel;
+}
+
+inline float* create_box_kernel(size_t kernel_width, size_t kernel_height)
+{
+    float* kernel = new float[kernel_width * kernel_height];
+    for (size_t i = 0; i < kernel_width * kernel_height; ++i)
+        kernel[i] = 1.0f;
+    return kernel;
+}
+
+/* Try to write the mask_width x mask_height mask as the outer product col x row (rank 1).
+ * The factorisation uses the row and column going through the largest coefficient and is
+ * accepted if it reproduces every coefficient within tolerance (relative to that largest
+ * coefficient).
+ * Convolutions normalise by the sum of the mask coefficients lying inside the image, so
+ * the two 1D passes need non-zero partial sums: masks whose factors are not all of the
+ * same sign are therefore reported as non separable. */
+inline bool factor_separable(const float* mask, size_t mask_width, size_t mask_height,
+                             std::vector<float>& col, std::vector<float>& row, float tolerance = 1e-4f)
+{
+    size_t pivot = 0;
+    for (size_t i = 1; i < mask_width * mask_height; ++i)
+    {
+        if (std::fabs(mask[i]) > std::fabs(mask[pivot]))
+            pivot = i;
+    }
+    float pivot_value = mask[pivot];
+    if (pivot_value == 0.0f)
+        return false;
+    size_t px = pivot % mask_width;
+    size_t py = pivot / mask_width;
+
+    row.assign(mask + py * mask_width, mask + (py + 1) * mask_width);
+    col.resize(mask_height);
+    for (size_t iy = 0; iy < mask_height; ++iy)
+        col[iy] = mask[px + iy * mask_width] / pivot_value;
+
+    float limit = tolerance * std::fabs(pivot_value);
+    for (size_t iy = 0; iy < mask_height; ++iy)
+    {
+        for (size_t ix = 0; ix < mask_width; ++ix)
+        {
+            if (std::fabs(mask[ix + iy * mask_width] - col[iy] * row[ix]) > limit)
+                return false;
+        }
+    }
+
+    /* Strictly same-sign factors keep every partial sum away from zero */
+    bool row_positive = row[0] > 0, col_positive = col[0] > 0;
+    for (float v : row)
+    {
+        if (v == 0.0f || (v > 0) != row_positive)
+            return false;
+    }
+    for (float v : col)
+    {
+        if (v == 0.0f || (v > 0) != col_positive)
+            return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef MAT_BUFFER_HPP
+#define MAT_BUFFER_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include "host_buffer.hpp"
+
+/* cv::Mat whose pixels start on a HOST_BUFFER_ALIGNMENT boundary, so that wrapping
+ * it with wrap_mat() does not cost a copy. The memory is reference counted by OpenCV
+ * like any other cv::Mat. */
+inline cv::Mat aligned_mat(int rows, int cols, int type)
+{
+    int depth = CV_MAT_DEPTH(type);
+    int channels = CV_MAT_CN(type);
+    size_t element = CV_ELEM_SIZE1(type);
+    size_t count = (size_t) rows * cols * channels;
+    size_t slack = HOST_BUFFER_ALIGNMENT / element;
+
+    /* Over-allocate a single row and keep the aligned part of it */
+    cv::Mat storage(1, (int) (count + slack), CV_MAKETYPE(depth, 1));
+    size_t misalignment = reinterpret_cast<std::uintptr_t>(storage.data) % HOST_BUFFER_ALIGNMENT;
+    int offset = (int) (misalignment == 0 ? 0 : (HOST_BUFFER_ALIGNMENT - misalignment) / element);
+    return storage.colRange(offset, offset + (int) count).reshape(channels, rows);
+}
+
+/* Aligned copy of mat, or mat itself when it is already continuous and aligned */
+inline cv::Mat make_aligned(const cv::Mat& mat)
+{
+    if (mat.isContinuous() && is_aligned(mat.data))
+        return mat;
+    cv::Mat aligned = aligned_mat(mat.rows, mat.cols, mat.type());
+    mat.copyTo(aligned);
+    return aligned;
+}
+
+/* Device buffer over the pixels of mat, without copy. mat must be continuous and keep
+ * its pixels for the lifetime of the buffer. access is CL_MEM_READ_ONLY,
+ * CL_MEM_WRITE_ONLY or CL_MEM_READ_WRITE. */
+inline HostBuffer wrap_mat(const cl::Context& context, cv::Mat& mat, cl_mem_flags access)
+{
+    if (!mat.isContinuous())
+    {
+        std::cerr << "Only continuous images can be wrapped in a device buffer." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return HostBuffer(context, access, mat.data, mat.total() * mat.elemSize());
+}
+
+#endif
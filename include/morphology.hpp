@@ -0,0 +1,349 @@
+#ifndef MORPHOLOGY_HPP
+#define MORPHOLOGY_HPP
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencl_utils.hpp"
+#include "benchmark.hpp"
+#include "buffer_pool.hpp"
+
+enum MorphologyOperation
+{
+    MORPH_ERODE,
+    MORPH_DILATE,
+    MORPH_OPEN,
+    MORPH_CLOSE,
+    MORPH_GRADIENT
+};
+
+/* Binary structuring element of width x height, anchored at its center.
+ * values[ix + iy * width] is 1 when the element covers the offset (ix - width / 2, iy - height / 2). */
+struct StructuringElement
+{
+    size_t width;
+    size_t height;
+    std::vector<int> values;
+
+    StructuringElement() : width(0), height(0) {}
+
+    StructuringElement(const int* se, size_t se_width, size_t se_height) :
+        width(se_width), height(se_height), values(se, se + se_width * se_height)
+    {}
+
+    static StructuringElement rectangle(size_t width, size_t height)
+    {
+        StructuringElement se;
+        se.width = width;
+        se.height = height;
+        se.values.assign(width * height, 1);
+        return se;
+    }
+
+    static StructuringElement cross(size_t size)
+    {
+        StructuringElement se;
+        se.width = size;
+        se.height = size;
+        se.values.assign(size * size, 0);
+        for (size_t i = 0; i < size; ++i)
+        {
+            se.values[i + (size / 2) * size] = 1;
+            se.values[size / 2 + i * size] = 1;
+        }
+        return se;
+    }
+
+    static StructuringElement disk(size_t radius)
+    {
+        StructuringElement se;
+        se.width = 2 * radius + 1;
+        se.height = 2 * radius + 1;
+        se.values.assign(se.width * se.height, 0);
+        for (size_t iy = 0; iy < se.height; ++iy)
+        {
+            for (size_t ix = 0; ix < se.width; ++ix)
+            {
+                long dx = (long)ix - (long)radius;
+                long dy = (long)iy - (long)radius;
+                if (dx * dx + dy * dy <= (long)(radius * radius))
+                    se.values[ix + iy * se.width] = 1;
+            }
+        }
+        return se;
+    }
+
+    bool is_rectangle() const
+    {
+        for (int v : values)
+        {
+            if (v != 1)
+                return false;
+        }
+        return !values.empty();
+    }
+
+    /* Point reflection, used by dilations: dilating by B is taking the max over -B */
+    StructuringElement reflected() const
+    {
+        StructuringElement se = *this;
+        for (size_t i = 0; i < values.size(); ++i)
+            se.values[i] = values[values.size() - 1 - i];
+        return se;
+    }
+};
+
+/* Grayscale morphology on the kernels of kernelMorph.cl.
+ * Rectangular structuring elements larger than small_se_limit use the separable van
+ * Herk/Gil-Werman path (a row pass then a column pass, each costing about 3 min/max per
+ * pixel whatever the element size). Other shapes use the direct kernel.
+ * Pixels outside of the image are ignored. Like ConvolutionEngine, device buffers come
+ * from a BufferPool, are kept between calls and only grow. */
+class MorphologyEngine
+{
+
+    private:
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    /* Program built with MORPH_OP=min (index 0, erosion) and MORPH_OP=max (index 1, dilation) */
+    cl::Program programs[2];
+    std::map<std::string, cl::Kernel> kernels[2];
+
+    /* Rectangles up to this many pixels are cheaper with the direct kernel */
+    size_t small_se_limit;
+
+    /* Intermediate images, and the input / output images of apply() */
+    std::shared_ptr<BufferPool> pool;
+    PooledBuffer images[3];
+    PooledBuffer input;
+    PooledBuffer output;
+    PooledBuffer scratch_g;
+    PooledBuffer scratch_h;
+    cl::Buffer se_buffer;
+    std::vector<int> se_values;
+
+    void build_programs(const std::string& kernel_source_file)
+    {
+        programs[0] = load_and_build_program(context, device, kernel_source_file, "-D MORPH_OP=min -D MORPH_IDENTITY=255");
+        programs[1] = load_and_build_program(context, device, kernel_source_file, "-D MORPH_OP=max -D MORPH_IDENTITY=0");
+    }
+
+    cl::Kernel& get_kernel(bool dilation, const std::string& name)
+    {
+        std::map<std::string, cl::Kernel>& cache = kernels[dilation ? 1 : 0];
+        auto it = cache.find(name);
+        if (it == cache.end())
+        {
+            it = cache.insert(std::make_pair(name, cl::Kernel(programs[dilation ? 1 : 0], name.c_str()))).first;
+        }
+        return it->second;
+    }
+
+    void reserve_images(size_t bytes)
+    {
+        if (bytes <= input.capacity())
+            return;
+        if (!input.empty())
+            queue.finish();
+        for (auto &image : images)
+            image = pool->acquire(bytes);
+        input = pool->acquire(bytes, CL_MEM_READ_ONLY);
+        output = pool->acquire(bytes, CL_MEM_WRITE_ONLY);
+    }
+
+    void reserve_scratch(size_t bytes)
+    {
+        if (bytes <= scratch_g.capacity())
+            return;
+        if (!scratch_g.empty())
+            queue.finish();
+        scratch_g = pool->acquire(bytes);
+        scratch_h = pool->acquire(bytes);
+    }
+
+    void upload_se(const StructuringElement& se)
+    {
+        if (se.values == se_values)
+            return;
+        se_values = se.values;
+        se_buffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, se_values.size() * sizeof(int), se_values.data());
+    }
+
+    /* van Herk/Gil-Werman filter of window k along rows (vertical == false) or columns */
+    void enqueue_vhgw(bool dilation, bool vertical, size_t k, const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height)
+    {
+        /* Erosions cover [x - k/2, x - k/2 + k - 1], dilations the reflected window */
+        int anchor = dilation ? (int)(k - 1 - k / 2) : (int)(k / 2);
+        size_t length = vertical ? height : width;
+        size_t blocks = (length + k - 1 + k - 1) / k;
+        size_t padded = blocks * k;
+        reserve_scratch(padded * (vertical ? width : height));
+
+        cl::Kernel& blocksKernel = get_kernel(dilation, vertical ? "vhgw_blocks_v" : "vhgw_blocks_h");
+        blocksKernel.setArg(0, in);
+        blocksKernel.setArg(1, (cl_uint) width);
+        blocksKernel.setArg(2, (cl_uint) height);
+        blocksKernel.setArg(3, (cl_uint) k);
+        blocksKernel.setArg(4, (cl_int) anchor);
+        blocksKernel.setArg(5, (cl_uint) padded);
+        blocksKernel.setArg(6, scratch_g.buffer());
+        blocksKernel.setArg(7, scratch_h.buffer());
+        cl::NDRange blocks_range = vertical ? cl::NDRange(width, blocks) : cl::NDRange(blocks, height);
+        queue.enqueueNDRangeKernel(blocksKernel, cl::NullRange, blocks_range, cl::NullRange);
+
+        cl::Kernel& mergeKernel = get_kernel(dilation, vertical ? "vhgw_merge_v" : "vhgw_merge_h");
+        mergeKernel.setArg(0, scratch_g.buffer());
+        mergeKernel.setArg(1, scratch_h.buffer());
+        mergeKernel.setArg(2, (cl_uint) width);
+        mergeKernel.setArg(3, (cl_uint) height);
+        mergeKernel.setArg(4, (cl_uint) k);
+        if (vertical)
+        {
+            mergeKernel.setArg(5, out);
+        }
+        else
+        {
+            mergeKernel.setArg(5, (cl_uint) padded);
+            mergeKernel.setArg(6, out);
+        }
+        queue.enqueueNDRangeKernel(mergeKernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange);
+    }
+
+    /* Single erosion or dilation from in to out. tmp may be used as an intermediate buffer. */
+    void enqueue_basic(bool dilation, const StructuringElement& se, const cl::Buffer& in, const cl::Buffer& tmp,
+                       const cl::Buffer& out, size_t width, size_t height)
+    {
+        if (se.is_rectangle() && se.width * se.height > small_se_limit)
+        {
+            if (se.height == 1)
+            {
+                enqueue_vhgw(dilation, false, se.width, in, out, width, height);
+            }
+            else if (se.width == 1)
+            {
+                enqueue_vhgw(dilation, true, se.height, in, out, width, height);
+            }
+            else
+            {
+                enqueue_vhgw(dilation, false, se.width, in, tmp, width, height);
+                enqueue_vhgw(dilation, true, se.height, tmp, out, width, height);
+            }
+            return;
+        }
+
+        StructuringElement element = dilation ? se.reflected() : se;
+        int anchor_x = dilation ? (int)(se.width - 1 - se.width / 2) : (int)(se.width / 2);
+        int anchor_y = dilation ? (int)(se.height - 1 - se.height / 2) : (int)(se.height / 2);
+        upload_se(element);
+
+        cl::Kernel& genericKernel = get_kernel(dilation, "morph_generic");
+        genericKernel.setArg(0, in);
+        genericKernel.setArg(1, (cl_uint) width);
+        genericKernel.setArg(2, (cl_uint) height);
+        genericKernel.setArg(3, se_buffer);
+        genericKernel.setArg(4, (cl_uint) element.width);
+        genericKernel.setArg(5, (cl_uint) element.height);
+        genericKernel.setArg(6, (cl_int) anchor_x);
+        genericKernel.setArg(7, (cl_int) anchor_y);
+        genericKernel.setArg(8, out);
+        queue.enqueueNDRangeKernel(genericKernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange);
+    }
+
+    public:
+    MorphologyEngine(cl::Device device, std::string kernel_source_file = "../src/kernelMorph.cl") :
+        context(std::vector<cl::Device>(1, device)), device(device), small_se_limit(9)
+    {
+        queue = cl::CommandQueue(context, device);
+        pool = std::make_shared<BufferPool>(context, device);
+        build_programs(kernel_source_file);
+    }
+
+    MorphologyEngine(cl::Context context, cl::Device device, cl::CommandQueue queue, std::string kernel_source_file = "../src/kernelMorph.cl") :
+        context(context), device(device), queue(queue), small_se_limit(9)
+    {
+        pool = std::make_shared<BufferPool>(context, device);
+        build_programs(kernel_source_file);
+    }
+
+    /* Enqueue operation on the width x height gray image held by device buffer in, writing
+     * device buffer out. in and out must be distinct buffers. */
+    void enqueue(MorphologyOperation operation, const StructuringElement& se,
+                 const cl::Buffer& in, const cl::Buffer& out, size_t width, size_t height)
+    {
+        reserve_images(width * height * sizeof(cl_uchar));
+        switch (operation)
+        {
+            case MORPH_ERODE:
+                enqueue_basic(false, se, in, images[0].buffer(), out, width, height);
+                break;
+            case MORPH_DILATE:
+                enqueue_basic(true, se, in, images[0].buffer(), out, width, height);
+                break;
+            case MORPH_OPEN:
+                enqueue_basic(false, se, in, images[0].buffer(), images[1].buffer(), width, height);
+                enqueue_basic(true, se, images[1].buffer(), images[0].buffer(), out, width, height);
+                break;
+            case MORPH_CLOSE:
+                enqueue_basic(true, se, in, images[0].buffer(), images[1].buffer(), width, height);
+                enqueue_basic(false, se, images[1].buffer(), images[0].buffer(), out, width, height);
+                break;
+            case MORPH_GRADIENT:
+            {
+                enqueue_basic(true, se, in, images[0].buffer(), images[1].buffer(), width, height);
+                enqueue_basic(false, se, in, images[0].buffer(), images[2].buffer(), width, height);
+                cl::Kernel& differenceKernel = get_kernel(false, "morph_difference");
+                differenceKernel.setArg(0, images[1].buffer());
+                differenceKernel.setArg(1, images[2].buffer());
+                differenceKernel.setArg(2, (cl_uint) width);
+                differenceKernel.setArg(3, (cl_uint) height);
+                differenceKernel.setArg(4, out);
+                queue.enqueueNDRangeKernel(differenceKernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange);
+                break;
+            }
+        }
+    }
+
+    /* Apply operation to the width x height gray image in and store the result in out.
+     * Returns the elapsed time in seconds. */
+    double apply(MorphologyOperation operation, const StructuringElement& se,
+                 const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        size_t bytes = width * height * sizeof(unsigned char);
+        reserve_images(bytes);
+        queue.enqueueWriteBuffer(input.buffer(), CL_FALSE, 0, bytes, in);
+        enqueue(operation, se, input.buffer(), output.buffer(), width, height);
+        queue.enqueueReadBuffer(output.buffer(), CL_TRUE, 0, bytes, out);
+        return t.end();
+    }
+
+    /* Rectangles of at most limit pixels use the direct kernel */
+    void set_small_se_limit(size_t limit)
+    {
+        small_se_limit = limit;
+    }
+
+    /* Take device memory from pool (see ConvolutionEngine::set_buffer_pool) */
+    void set_buffer_pool(std::shared_ptr<BufferPool> pool)
+    {
+        queue.finish();
+        for (auto &image : images)
+            image.release();
+        input.release();
+        output.release();
+        scratch_g.release();
+        scratch_h.release();
+        this->pool = pool;
+    }
+
+    std::shared_ptr<BufferPool> get_buffer_pool() { return pool; }
+    cl::Context& get_context() { return context; }
+    cl::CommandQueue& get_queue() { return queue; }
+
+};
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef MULTI_DEVICE_HPP
+#define MULTI_DEVICE_HPP
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "opencl_utils.hpp"
+#include "pipeline.hpp"
+
+/* Devices matching a comma separated list of select_device() specifications
+ * (e.g. "gpu,cpu" or "0,2"), or every device of every platform when spec is empty or "all" */
+inline std::vector<cl::Device> select_devices(const std::string& spec)
+{
+    std::vector<cl::Device> devices;
+    if (spec.empty() || spec == "all")
+    {
+        for (auto &info : list_devices())
+            devices.push_back(info.device);
+        if (devices.empty())
+        {
+            std::cerr << "No OpenCL device found on any platform." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return devices;
+    }
+    std::stringstream list(spec);
+    std::string item;
+    while (std::getline(list, item, ','))
+        devices.push_back(select_device(item));
+    return devices;
+}
+
+/* Replace every device with more than parts compute units by parts sub-devices of equal
+ * size (clCreateSubDevices with CL_DEVICE_PARTITION_EQUALLY). Devices that cannot be
+ * partitioned are kept whole. Splitting a CPU device gives several devices on a single
+ * machine. */
+inline std::vector<cl::Device> split_devices(const std::vector<cl::Device>& devices, size_t parts)
+{
+    if (parts < 2)
+        return devices;
+    std::vector<cl::Device> split;
+    /* createSubDevices is not const: work on copies of the device handles */
+    for (cl::Device device : devices)
+    {
+        cl_uint compute_units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        std::vector<cl_device_partition_property> supported = device.getInfo<CL_DEVICE_PARTITION_PROPERTIES>();
+        bool equally = std::find(supported.begin(), supported.end(), CL_DEVICE_PARTITION_EQUALLY) != supported.end();
+        std::vector<cl::Device> sub_devices;
+        if (equally && compute_units >= parts)
+        {
+            cl_device_partition_property properties[] = {
+                CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property) (compute_units / parts), 0
+            };
+            try
+            {
+                device.createSubDevices(properties, &sub_devices);
+            }
+            catch(cl::Error e)
+            {
+                sub_devices.clear();
+            }
+        }
+        if (sub_devices.empty())
+        {
+            std::cerr << "Could not partition " << device.getInfo<CL_DEVICE_NAME>() << ", using it whole." << std::endl;
+            split.push_back(device);
+        }
+        else
+        {
+            split.insert(split.end(), sub_devices.begin(), sub_devices.end());
+        }
+    }
+    return split;
+}
+
+/* Runs a pipeline over one image on several devices at once.
+ * The image is cut into bands of rows, each read with the pipeline halo like the strips
+ * of StripScheduler, so that the stitched output is identical to a single-device run.
+ * Bands are first partitioned between the devices in proportion to their weights
+ * (an estimate from compute units and clock, then the throughput measured by the
+ * previous run) and every device works through its own bands from one thread. A device
+ * running out of bands steals the last band of the device with the most remaining ones,
+ * so that a straggler or a bad estimate does not leave the other devices idle.
+ * Every device has its own context, program and pipeline, so devices may come from
+ * different platforms.
+ *
+ * Usage:
+ *     MultiDeviceScheduler scheduler(split_devices(select_devices("cpu"), 4));
+ *     scheduler.convolution(mask, 5, 5).erosion(se, 3);
+ *     scheduler.run(in, width, height, out);
+ */
+class MultiDeviceScheduler
+{
+
+    public:
+    struct Worker
+    {
+        cl::Device device;
+        std::string name;
+        std::unique_ptr<Pipeline> pipeline;
+        std::deque<size_t> bands;
+        /* Throughput estimate, in rows per second once measured */
+        double weight;
+        /* Statistics of the last run */
+        size_t rows;
+        size_t bands_done;
+        size_t stolen;
+        double busy;
+    };
+
+    private:
+    std::vector<std::unique_ptr<Worker> > workers;
+    std::mutex bands_mutex;
+    /* Rows per band, 0 to use about 8 bands per device */
+    size_t band_rows;
+
+    /* Next band for worker self: its own first band, or the last band of the most
+     * loaded other worker. Returns false when no band is left. */
+    bool take_band(size_t self, size_t& band, bool& stolen)
+    {
+        std::lock_guard<std::mutex> lock(bands_mutex);
+        std::deque<size_t>& own = workers[self]->bands;
+        if (!own.empty())
+        {
+            band = own.front();
+            own.pop_front();
+            stolen = false;
+            return true;
+        }
+        Worker* victim = NULL;
+        for (auto &worker : workers)
+        {
+            if (!worker->bands.empty() && (victim == NULL || worker->bands.size() > victim->bands.size()))
+                victim = worker.get();
+        }
+        if (victim == NULL)
+            return false;
+        band = victim->bands.back();
+        victim->bands.pop_back();
+        stolen = true;
+        return true;
+    }
+
+    /* Give every worker a contiguous run of bands in proportion to its weight */
+    void partition(size_t num_bands)
+    {
+        double total = 0;
+        for (auto &worker : workers)
+            total += worker->weight;
+        size_t next = 0;
+        double cumulated = 0;
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            cumulated += workers[i]->weight;
+            size_t end = i + 1 == workers.size() ? num_bands : (size_t) (num_bands * cumulated / total + 0.5);
+            workers[i]->bands.clear();
+            for (; next < end; ++next)
+                workers[i]->bands.push_back(next);
+        }
+    }
+
+    public:
+    MultiDeviceScheduler(const std::vector<cl::Device>& devices, std::string kernel_source_file = "../src/kernelConv.cl") :
+        band_rows(0)
+    {
+        for (auto &device : devices)
+        {
+            std::unique_ptr<Worker> worker(new Worker());
+            worker->device = device;
+            worker->name = device.getInfo<CL_DEVICE_NAME>();
+            cl::Context context(std::vector<cl::Device>(1, device));
+            std::shared_ptr<KernelVariants> variants = std::make_shared<KernelVariants>(context, device, kernel_source_file, vector_build_options(device));
+            worker->pipeline.reset(new Pipeline(context, device, variants->program()));
+            worker->pipeline->set_variants(variants);
+            worker->weight = (double) device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+            if (worker->weight <= 0)
+                worker->weight = 1;
+            worker->rows = worker->bands_done = worker->stolen = 0;
+            worker->busy = 0;
+            workers.push_back(std::move(worker));
+        }
+    }
+
+    MultiDeviceScheduler& convolution(const float* mask, size_t mask_width, size_t mask_height)
+    {
+        for (auto &worker : workers)
+            worker->pipeline->convolution(mask, mask_width, mask_height);
+        return *this;
+    }
+
+    MultiDeviceScheduler& erosion(const int* se, size_t se_size)
+    {
+        for (auto &worker : workers)
+            worker->pipeline->erosion(se, se_size);
+        return *this;
+    }
+
+    void set_fusion(bool enabled)
+    {
+        for (auto &worker : workers)
+            worker->pipeline->set_fusion(enabled);
+    }
+
+    void set_band_rows(size_t rows)
+    {
+        band_rows = rows;
+    }
+
+    /* Run the pipeline on the width x height gray image in and store the result in out.
+     * Returns the elapsed time in seconds. */
+    double run(const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        size_t rows = band_rows > 0 ? band_rows : std::max<size_t>(1, (height + 8 * workers.size() - 1) / (8 * workers.size()));
+        size_t num_bands = (height + rows - 1) / rows;
+        size_t halo = workers[0]->pipeline->halo();
+        partition(num_bands);
+
+        std::vector<std::string> errors(workers.size());
+        std::vector<std::thread> threads;
+        for (size_t w = 0; w < workers.size(); ++w)
+        {
+            threads.emplace_back([&, w]()
+            {
+                Worker& worker = *workers[w];
+                worker.rows = worker.bands_done = worker.stolen = 0;
+                worker.busy = 0;
+                Timer busy;
+                size_t band;
+                bool stolen;
+                try
+                {
+                    while (take_band(w, band, stolen))
+                    {
+                        busy.start();
+                        size_t first = band * rows;
+                        size_t last = std::min(height, first + rows);
+                        size_t input_first = first >= halo ? first - halo : 0;
+                        size_t input_last = std::min(height, last + halo);
+                        worker.pipeline->enqueue_upload(in + input_first * width, width, input_last - input_first);
+                        worker.pipeline->enqueue_stages(width, input_last - input_first);
+                        worker.pipeline->enqueue_download_rows(out + first * width, width, first - input_first, last - first, true);
+                        worker.busy += busy.end();
+                        worker.rows += last - first;
+                        worker.bands_done++;
+                        worker.stolen += stolen;
+                    }
+                }
+                catch(cl::Error e)
+                {
+                    errors[w] = std::string(e.what()) + " (" + std::to_string(e.err()) + ")";
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+
+        for (size_t w = 0; w < workers.size(); ++w)
+        {
+            if (!errors[w].empty())
+            {
+                std::cerr << "Device " << workers[w]->name << " failed: " << errors[w] << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        /* Measured throughput drives the partition of the next run */
+        for (auto &worker : workers)
+        {
+            if (worker->rows > 0 && worker->busy > 0)
+                worker->weight = worker->rows / worker->busy;
+        }
+        return t.end();
+    }
+
+    /* Per-device statistics of the last run */
+    void report(std::ostream& out) const
+    {
+        out << "#Device\tRows\tBands\tStolen\tBusy(s)\t\tRows/s\t\tName" << std::endl;
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            const Worker& worker = *workers[i];
+            out << i << "\t" << worker.rows << "\t" << worker.bands_done << "\t" << worker.stolen << "\t"
+                << worker.busy << "\t" << (worker.busy > 0 ? worker.rows / worker.busy : 0) << "\t\t"
+                << worker.name << std::endl;
+        }
+    }
+
+    size_t get_devices() const { return workers.size(); }
+
+};
+
+#endif
@@ -4,9 +4,77 @@
 #define CL_HPP_TARGET_OPENCL_VERSION 200
 #define CL_HPP_ENABLE_EXCEPTIONS
 
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 #include <CL/cl2.hpp>
 
+/* Helpers of the OpenCL 2.x path, on the cl2.hpp bindings.
+ * cl.hpp and cl2.hpp both define the cl namespace, so programs include either
+ * opencl_utils.hpp or this file, never both. Everything lives in the opencl2_utils
+ * namespace so that the names can match their 1.2 counterparts. */
+namespace opencl2_utils
+{
+
+/* OpenCL 2.x features of a device */
+struct DeviceFeatures
+{
+    /* Major and minor version of the device */
+    int major;
+    int minor;
+    bool svm_coarse;
+    bool svm_fine;
+    /* enqueue_kernel from kernels (OpenCL C 2.0 and an on-device queue) */
+    bool device_enqueue;
+
+    DeviceFeatures() : major(1), minor(0), svm_coarse(false), svm_fine(false), device_enqueue(false) {}
+};
+
+/* Major and minor numbers of a version string such as "OpenCL 2.0 ..." or "OpenCL C 2.0 ..." */
+inline void parse_version(const std::string& version, int& major, int& minor)
+{
+    major = 1;
+    minor = 0;
+    size_t digit = version.find_first_of("0123456789");
+    if (digit != std::string::npos)
+        std::sscanf(version.c_str() + digit, "%d.%d", &major, &minor);
+}
+
+inline DeviceFeatures device_features(const cl::Device& device)
+{
+    DeviceFeatures features;
+    parse_version(device.getInfo<CL_DEVICE_VERSION>(), features.major, features.minor);
+    if (features.major < 2)
+        return features;
+
+    /* OpenCL 3.0 devices report 0 for the optional features they lack */
+    try
+    {
+        cl_device_svm_capabilities svm = device.getInfo<CL_DEVICE_SVM_CAPABILITIES>();
+        features.svm_coarse = (svm & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER) != 0;
+        features.svm_fine = (svm & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) != 0;
+    }
+    catch(cl::Error e)
+    {
+    }
+    try
+    {
+        int c_major, c_minor;
+        parse_version(device.getInfo<CL_DEVICE_OPENCL_C_VERSION>(), c_major, c_minor);
+        features.device_enqueue = c_major >= 2 && device.getInfo<CL_DEVICE_QUEUE_ON_DEVICE_MAX_SIZE>() > 0;
+    }
+    catch(cl::Error e)
+    {
+    }
+    return features;
+}
+
+/* First platform of version 2.x or later */
 inline cl::Platform get_platform()
 {
     /* Get available platforms.
@@ -19,29 +87,168 @@ inline cl::Platform get_platform()
         exit(EXIT_FAILURE);
     }
 
-    cl::Platform platform;
-    for (auto &p : platforms) {
-        std::string platform_version = p.getInfo<CL_PLATFORM_VERSION>();
-        if (platform_version.find("OpenCL 2.") != std::string::npos) {
-            platform = p;
-            break;
-        }
-    }
-
-    if (platform() == 0)  {
-        std::cerr << "No OpenCL 2.0 platform found." << std::endl;
-        throw std::runtime_error("No OpenCL 2.0 platform found.");
+    for (auto &p : platforms)
+    {
+        int major, minor;
+        parse_version(p.getInfo<CL_PLATFORM_VERSION>(), major, minor);
+        if (major >= 2)
+            return p;
     }
-    return platform;
+    std::cerr << "No OpenCL 2.0 platform found." << std::endl;
+    throw std::runtime_error("No OpenCL 2.0 platform found.");
 }
 
 inline void set_default_platform(cl::Platform plat)
 {
-    if (cl::Platform::setDefault(plat) != plat)
+    if (cl::Platform::setDefault(plat)() != plat())
     {
         std::cerr << "Error while setting default platform." << std::endl;
         throw std::runtime_error("Unable to set default platform.");
     }
 }
 
-#endif
\ No newline at end of file
+/* Devices with coarse-grained SVM at least, on every platform, GPUs first */
+inline std::vector<cl::Device> svm_devices()
+{
+    std::vector<cl::Device> gpus, others;
+    std::vector<cl::Platform> platforms;
+    try
+    {
+        cl::Platform::get(&platforms);
+    }
+    catch(cl::Error e)
+    {
+        /* CL_PLATFORM_NOT_FOUND_KHR without any ICD */
+    }
+    for (auto &platform : platforms)
+    {
+        std::vector<cl::Device> devices;
+        try
+        {
+            platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+        }
+        catch(cl::Error e)
+        {
+            continue;
+        }
+        for (auto &device : devices)
+        {
+            if (!device_features(device).svm_coarse)
+                continue;
+            if (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_GPU)
+                gpus.push_back(device);
+            else
+                others.push_back(device);
+        }
+    }
+    gpus.insert(gpus.end(), others.begin(), others.end());
+    return gpus;
+}
+
+/* Select an SVM capable device according to spec, as select_device() of opencl_utils.hpp:
+ * "" for the first one (GPUs first), "list", "N", or "gpu|cpu|any[:N]" */
+inline cl::Device select_device(const std::string& spec)
+{
+    std::vector<cl::Device> devices = svm_devices();
+    if (devices.empty())
+    {
+        std::cerr << "No OpenCL 2.x device with shared virtual memory found." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (spec == "list")
+    {
+        std::cout << "#\tSVM\tEnqueue\tName" << std::endl;
+        for (size_t i = 0; i < devices.size(); ++i)
+        {
+            DeviceFeatures features = device_features(devices[i]);
+            std::cout << i << "\t" << (features.svm_fine ? "fine" : "coarse") << "\t" << (features.device_enqueue ? "yes" : "no")
+                      << "\t" << devices[i].getInfo<CL_DEVICE_NAME>() << " (" << devices[i].getInfo<CL_DEVICE_VERSION>() << ")" << std::endl;
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    std::string type = spec.empty() ? "any" : spec;
+    int index = 0;
+    size_t colon = spec.find(':');
+    if (colon != std::string::npos)
+    {
+        type = spec.substr(0, colon);
+        index = std::atoi(spec.c_str() + colon + 1);
+    }
+    else if (!spec.empty() && spec.find_first_not_of("0123456789") == std::string::npos)
+    {
+        type = "any";
+        index = std::atoi(spec.c_str());
+    }
+
+    cl_device_type mask = CL_DEVICE_TYPE_ALL;
+    if (type == "gpu")
+        mask = CL_DEVICE_TYPE_GPU;
+    else if (type == "cpu")
+        mask = CL_DEVICE_TYPE_CPU;
+    else if (type == "accelerator" || type == "acc")
+        mask = CL_DEVICE_TYPE_ACCELERATOR;
+    else if (type != "any" && type != "all")
+    {
+        std::cerr << "Invalid device specification '" << spec << "' (expected [gpu|cpu|accelerator|any][:index] or list)." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    int seen = 0;
+    for (auto &device : devices)
+    {
+        if ((device.getInfo<CL_DEVICE_TYPE>() & mask) && seen++ == index)
+        {
+            std::cerr << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << " (" << device.getInfo<CL_DEVICE_VERSION>() << ")" << std::endl;
+            return device;
+        }
+    }
+    std::cerr << "No OpenCL 2.x device matching '" << spec << "' (see --device list)." << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+/* Make context, device and queue the defaults of the bindings, which SVMAllocator maps
+ * and unmaps coarse-grained allocations with. With device_enqueue, also create the
+ * default on-device queue used by get_default_queue() in kernels. */
+inline void set_defaults(const cl::Context& context, const cl::Device& device, const cl::CommandQueue& queue, bool device_enqueue)
+{
+    cl::Context::setDefault(context);
+    cl::Device::setDefault(device);
+    cl::CommandQueue::setDefault(queue);
+    if (device_enqueue)
+        cl::DeviceCommandQueue::makeDefault(context, device);
+}
+
+/* Load the OpenCL source code in kernel_source_file and build it for device with the
+ * given build options. Unlike the 1.2 version, programs are not cached on disk. */
+inline cl::Program load_and_build_program(const cl::Context& context, const cl::Device& device, const std::string& kernel_source_file, const std::string& options = "")
+{
+    std::ifstream kernel_source(kernel_source_file);
+    if (!kernel_source.is_open())
+    {
+        std::cerr << "Cannot open file " << kernel_source_file << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::stringstream source_code;
+    source_code << kernel_source.rdbuf();
+
+    cl::Program program(context, source_code.str());
+    try
+    {
+        program.build({device}, options.c_str());
+    }
+    catch(cl::Error e)
+    {
+        std::cerr << "Could not build program: "<< std::endl
+                    << "\tDevice name: " << device.getInfo<CL_DEVICE_NAME>() << std::endl
+                    << "\tStatus code: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device)  << std::endl
+                    << "Log: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return program;
+}
+
+}
+
+#endif
@@ -8,8 +8,16 @@
 #include <streambuf>
 #include <sstream>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <CL/cl.hpp>
 
+#include "options.hpp"
+#include "program_cache.hpp"
+
 inline cl::Platform get_platform()
 {
 
@@ -30,23 +38,443 @@ inline cl::Platform get_platform()
     return platform;
 }
 
+/* Description of one OpenCL device as seen by the device selection layer */
+struct DeviceInfo
+{
+    cl::Platform platform;
+    cl::Device device;
+    cl_device_type type;
+    std::string name;
+    std::string platform_name;
+    cl_uint compute_units;
+    cl_uint clock_mhz;
+    cl_ulong global_mem;
+    cl_ulong local_mem;
+    std::string extensions;
+    double score;
+};
+
+inline const char* device_type_name(cl_device_type type)
+{
+    if (type & CL_DEVICE_TYPE_GPU)
+        return "gpu";
+    if (type & CL_DEVICE_TYPE_ACCELERATOR)
+        return "accelerator";
+    if (type & CL_DEVICE_TYPE_CPU)
+        return "cpu";
+    return "other";
+}
+
+/* Heuristic ranking of a device.
+ * Raw throughput is estimated as compute units x clock, weighted by device type
+ * since a GPU compute unit is much wider than a CPU core. Memory sizes and a few
+ * useful extensions then act as small multiplicative bonuses so that they only
+ * break ties between otherwise comparable devices. */
+inline double device_score(const DeviceInfo& info)
+{
+    double type_weight = 1.0;
+    if (info.type & CL_DEVICE_TYPE_GPU)
+        type_weight = 8.0;
+    else if (info.type & CL_DEVICE_TYPE_ACCELERATOR)
+        type_weight = 4.0;
+
+    double score = std::max<cl_uint>(info.compute_units, 1) * std::max<cl_uint>(info.clock_mhz, 1) * type_weight;
+    score *= 1.0 + 0.05 * std::log2(1.0 + info.global_mem / (1024.0 * 1024.0));
+    score *= 1.0 + 0.02 * std::log2(1.0 + info.local_mem / 1024.0);
+
+    const char* bonus_extensions[] = { "cl_khr_fp64", "cl_khr_fp16", "cl_khr_int64_base_atomics", "cl_khr_3d_image_writes" };
+    for (const char* ext : bonus_extensions)
+    {
+        if (info.extensions.find(ext) != std::string::npos)
+            score *= 1.05;
+    }
+    return score;
+}
+
+/* Enumerate every device of every platform, in platform/device order.
+ * Platforms failing to report devices (e.g. a broken ICD) are skipped. */
+inline std::vector<DeviceInfo> list_devices()
+{
+    std::vector<DeviceInfo> infos;
+    std::vector<cl::Platform> platforms;
+    try
+    {
+        cl::Platform::get(&platforms);
+    }
+    catch(cl::Error e)
+    {
+        return infos;
+    }
+
+    for (auto &p : platforms)
+    {
+        std::vector<cl::Device> devices;
+        try
+        {
+            p.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+        }
+        catch(cl::Error e)
+        {
+            continue;
+        }
+        for (auto &d : devices)
+        {
+            DeviceInfo info;
+            info.platform = p;
+            info.device = d;
+            info.type = d.getInfo<CL_DEVICE_TYPE>();
+            info.name = d.getInfo<CL_DEVICE_NAME>();
+            info.platform_name = p.getInfo<CL_PLATFORM_NAME>();
+            info.compute_units = d.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+            info.clock_mhz = d.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+            info.global_mem = d.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+            info.local_mem = d.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+            info.extensions = d.getInfo<CL_DEVICE_EXTENSIONS>();
+            info.score = device_score(info);
+            infos.push_back(info);
+        }
+    }
+    return infos;
+}
+
+inline void print_devices(const std::vector<DeviceInfo>& infos)
+{
+    std::cerr << "#Idx\tType\tCU\tMHz\tGlobal(MB)\tLocal(KB)\tScore\tName (Platform)" << std::endl;
+    for (size_t i = 0; i < infos.size(); ++i)
+    {
+        const DeviceInfo& info = infos[i];
+        std::cerr << i << "\t" << device_type_name(info.type)
+                  << "\t" << info.compute_units
+                  << "\t" << info.clock_mhz
+                  << "\t" << info.global_mem / (1024 * 1024)
+                  << "\t\t" << info.local_mem / 1024
+                  << "\t\t" << info.score
+                  << "\t" << info.name << " (" << info.platform_name << ")" << std::endl;
+    }
+}
+
+/* Extract the device override from the command line ("--device spec" or "--device=spec").
+ * Falls back on the OCL_DEVICE environment variable. */
+inline std::string parse_device_option(int& argc, char** argv)
+{
+    std::string spec = parse_option(argc, argv, "--device");
+    if (spec.empty())
+    {
+        const char* env = std::getenv("OCL_DEVICE");
+        if (env != NULL)
+            spec = env;
+    }
+    return spec;
+}
+
+/* Select a device according to spec:
+ *  - ""              : best ranked device among all platforms
+ *  - "list"          : print the available devices and exit
+ *  - "N"             : N-th device in enumeration order (see "list")
+ *  - "type[:N]"      : N-th device (default 0) of the given type, type being one of
+ *                      gpu, cpu, accelerator or any */
+inline cl::Device select_device(const std::string& spec)
+{
+    std::vector<DeviceInfo> infos = list_devices();
+    if (infos.size() == 0)
+    {
+        std::cerr << "No OpenCL device found on any platform." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (spec == "list")
+    {
+        print_devices(infos);
+        exit(EXIT_SUCCESS);
+    }
+
+    const DeviceInfo* chosen = NULL;
+    if (spec.empty())
+    {
+        chosen = &*std::max_element(infos.begin(), infos.end(),
+                                    [](const DeviceInfo& a, const DeviceInfo& b) { return a.score < b.score; });
+    }
+    else
+    {
+        std::string type = spec;
+        std::string index_spec = "0";
+        size_t colon = spec.find(':');
+        if (colon != std::string::npos)
+        {
+            type = spec.substr(0, colon);
+            index_spec = spec.substr(colon + 1);
+        }
+        else if (spec.find_first_not_of("0123456789") == std::string::npos)
+        {
+            type = "any";
+            index_spec = spec;
+        }
+        char* end = NULL;
+        long index = std::strtol(index_spec.c_str(), &end, 10);
+        bool valid_index = !index_spec.empty() && *end == '\0' && index >= 0;
+
+        cl_device_type mask = 0;
+        if (type == "gpu")
+            mask = CL_DEVICE_TYPE_GPU;
+        else if (type == "cpu")
+            mask = CL_DEVICE_TYPE_CPU;
+        else if (type == "accelerator" || type == "acc")
+            mask = CL_DEVICE_TYPE_ACCELERATOR;
+        else if (type == "any" || type == "all")
+            mask = CL_DEVICE_TYPE_ALL;
+        if (mask == 0 || !valid_index)
+        {
+            std::cerr << "Invalid device specification '" << spec << "' (expected [gpu|cpu|accelerator|any][:index] or list)." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        int seen = 0;
+        for (auto &info : infos)
+        {
+            if ((info.type & mask) && seen++ == index)
+            {
+                chosen = &info;
+                break;
+            }
+        }
+        if (chosen == NULL)
+        {
+            std::cerr << "No device matching '" << spec << "'. Available devices:" << std::endl;
+            print_devices(infos);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    std::cerr << "Using platform " << chosen->platform_name << std::endl;
+    std::cerr << "Using device: " << chosen->name << " (" << device_type_name(chosen->type) << ")" << std::endl;
+    return chosen->device;
+}
+
+inline cl::Device select_device(int& argc, char** argv)
+{
+    return select_device(parse_device_option(argc, argv));
+}
+
 inline cl::Device get_device(cl::Platform platform)
 {
-    /* Get available devices from platform. */
+    /* Get available devices from platform, whatever their type,
+     * so that CPU-only runtimes are usable too. */
     std::vector<cl::Device> devices;
-    platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
+    try
+    {
+        platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+    }
+    catch(cl::Error e)
+    {
+        devices.clear();
+    }
     if (devices.size() == 0)
     {
         std::cerr << "No device found." << std::endl;
+        exit(EXIT_FAILURE);
     }
 
-    /* Using the first available device */
+    /* Using the best ranked device of the platform */
+    std::vector<DeviceInfo> infos = list_devices();
     cl::Device device = devices.at(0);
+    double best_score = -1;
+    for (auto &info : infos)
+    {
+        if (info.platform() == platform() && info.score > best_score)
+        {
+            best_score = info.score;
+            device = info.device;
+        }
+    }
     std::cerr << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
     return device;
 }
 
-inline cl::Program load_and_build_program(cl::Context context, cl::Device device, std::string kernel_source_file)
+/* Smallest multiple of multiple greater or equal to value */
+inline size_t round_up(size_t value, size_t multiple)
+{
+    return ((value + multiple - 1) / multiple) * multiple;
+}
+
+/* Bytes handled by one work-item of the vectorized kernels (VECTOR_WIDTH in the .cl files):
+ * CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR rounded to 4, 8 or 16, i.e. at least one RGBA pixel */
+inline size_t char_vector_width(const cl::Device& device)
+{
+    size_t preferred = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR>();
+    if (preferred >= 16)
+        return 16;
+    if (preferred >= 8)
+        return 8;
+    return 4;
+}
+
+/* Build options selecting the vector width of the vectorized kernels for device */
+inline std::string vector_build_options(const cl::Device& device)
+{
+    return "-D VECTOR_WIDTH=" + std::to_string(char_vector_width(device));
+}
+
+/* Vector width a program was built with, 4 (the kernels' default) when not specified */
+inline size_t program_vector_width(const cl::Program& program, const cl::Device& device)
+{
+    std::string options = program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device);
+    std::string flag = "VECTOR_WIDTH=";
+    size_t position = options.find(flag);
+    if (position == std::string::npos)
+        return 4;
+    return std::atoi(options.c_str() + position + flag.size());
+}
+
+/* Every 2D work-group size (powers of two) usable for kernel on device over a width x
+ * height range. The sizes honour the device maximum work-item sizes, the kernel
+ * work-group size limit and, for kernels staging a (local_w + halo_x) x (local_h + halo_y)
+ * tile of bytes_per_item bytes elements in local memory, the local memory available to
+ * the kernel. Groups much larger than the range itself are left out. */
+inline std::vector<cl::NDRange> candidate_local_sizes_2d(const cl::Kernel& kernel, const cl::Device& device,
+                                                         size_t width, size_t height,
+                                                         size_t halo_x = 0, size_t halo_y = 0, size_t bytes_per_item = 0)
+{
+    size_t max_group = std::min(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+                                device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+    std::vector<size_t> max_items = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    cl_ulong local_mem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    cl_ulong used_local_mem = kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+    cl_ulong available = local_mem > used_local_mem ? local_mem - used_local_mem : 0;
+
+    std::vector<cl::NDRange> candidates;
+    for (size_t lx = 1; lx <= std::min<size_t>(max_items.at(0), 256); lx *= 2)
+    {
+        for (size_t ly = 1; ly <= std::min<size_t>(max_items.at(1), 256); ly *= 2)
+        {
+            if (lx * ly > max_group)
+                break;
+            /* No need for groups much larger than the image itself */
+            if ((lx > 1 && lx / 2 >= width) || (ly > 1 && ly / 2 >= height))
+                continue;
+            if (bytes_per_item > 0 && (lx + halo_x) * (ly + halo_y) * bytes_per_item > available)
+                continue;
+            candidates.push_back(cl::NDRange(lx, ly));
+        }
+    }
+    return candidates;
+}
+
+/* Every 1D work-group size (powers of two) usable for kernel on device over count items */
+inline std::vector<cl::NDRange> candidate_local_sizes_1d(const cl::Kernel& kernel, const cl::Device& device, size_t count)
+{
+    size_t max_group = std::min(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+                                device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+    std::vector<size_t> max_items = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+
+    std::vector<cl::NDRange> candidates;
+    for (size_t lx = 1; lx <= std::min(max_items.at(0), max_group); lx *= 2)
+    {
+        if (lx > 1 && lx / 2 >= count)
+            break;
+        candidates.push_back(cl::NDRange(lx));
+    }
+    return candidates;
+}
+
+/* Choose a 2D work-group size for kernel on device instead of letting the driver pick one.
+ * Among the sizes of candidate_local_sizes_2d(), the largest one is taken, preferring
+ * widths that are multiples of the preferred work-group size multiple. Returns false when
+ * no size fits (e.g. halo too large). See autotuner.hpp for sizes measured on the device. */
+inline bool choose_local_size_2d(const cl::Kernel& kernel, const cl::Device& device,
+                                 size_t width, size_t height, cl::NDRange& local,
+                                 size_t halo_x = 0, size_t halo_y = 0, size_t bytes_per_item = 0)
+{
+    size_t preferred = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+
+    size_t best_x = 0, best_y = 0;
+    bool best_aligned = false;
+    for (const cl::NDRange& candidate : candidate_local_sizes_2d(kernel, device, width, height, halo_x, halo_y, bytes_per_item))
+    {
+        const size_t* sizes = candidate;
+        size_t lx = sizes[0];
+        size_t ly = sizes[1];
+        bool aligned = preferred > 0 && lx % preferred == 0;
+        size_t size = lx * ly;
+        size_t best_size = best_x * best_y;
+        if (size > best_size || (size == best_size && (aligned > best_aligned || (aligned == best_aligned && lx > best_x))))
+        {
+            best_x = lx;
+            best_y = ly;
+            best_aligned = aligned;
+        }
+    }
+
+    if (best_x == 0)
+        return false;
+    local = cl::NDRange(best_x, best_y);
+    return true;
+}
+
+/* global padded up to a multiple of local in every dimension, or global itself when local
+ * is cl::NullRange. Kernels launched this way must ignore the work-items past the range. */
+inline cl::NDRange pad_global_range(const cl::NDRange& global, const cl::NDRange& local)
+{
+    if (local.dimensions() == 0)
+        return global;
+    const size_t* global_size = global;
+    const size_t* local_size = local;
+    switch (global.dimensions())
+    {
+        case 1: return cl::NDRange(round_up(global_size[0], local_size[0]));
+        case 2: return cl::NDRange(round_up(global_size[0], local_size[0]), round_up(global_size[1], local_size[1]));
+        default: return cl::NDRange(round_up(global_size[0], local_size[0]), round_up(global_size[1], local_size[1]),
+                                    round_up(global_size[2], local_size[2]));
+    }
+}
+
+/* Build the OpenCL source code source_code for device with the given build options.
+ * Compiled binaries are kept in an on-disk cache (see program_cache.hpp) so that later
+ * runs skip the compilation. */
+inline cl::Program build_program(cl::Context context, cl::Device device, const std::string& source_code, std::string options = "")
+{
+    /* Reuse a previously compiled binary when one matches */
+    std::string cache_dir = program_cache_dir();
+    std::string cache_key, cache_path;
+    if (!cache_dir.empty())
+    {
+        cache_key = program_cache_key(source_code, device, options);
+        cache_path = program_cache_path(cache_dir, cache_key);
+        cl::Program cached;
+        if (load_cached_program(context, device, cache_path, cache_key, options, cached))
+        {
+            return cached;
+        }
+    }
+
+    /* Create the program using the source code and the context */
+    cl::Program program(context, cl::Program::Sources(1, std::make_pair(source_code.c_str(), source_code.length())));
+    try
+    {
+        program.build({device}, options.c_str());
+    }
+    catch(cl::Error e)
+    {
+        std::cerr << "Could not build program: "<< std::endl
+                    << "\tDevice name: " << device.getInfo<CL_DEVICE_NAME>() << std::endl
+                    << "\tStatus code: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device)  << std::endl
+                    << "Log: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (!cache_dir.empty())
+    {
+        /* A cache failure only costs a rebuild on the next run */
+        if (!make_directories(cache_dir) || !store_program_binary(cache_path, cache_key, get_program_binary(program, device)))
+        {
+            std::cerr << "Could not write program cache entry " << cache_path << std::endl;
+        }
+    }
+    return program;
+}
+
+/* Load the OpenCL source code in kernel_source_file and build it for device with the given
+ * build options (see build_program()). */
+inline cl::Program load_and_build_program(cl::Context context, cl::Device device, std::string kernel_source_file, std::string options = "")
 {
     std::ifstream kernel_source(kernel_source_file);
     if (kernel_source.is_open())
@@ -62,21 +490,8 @@ inline cl::Program load_and_build_program(cl::Context context, cl::Device device
         source_code.assign((std::istreambuf_iterator<char>(kernel_source)), 
                             std::istreambuf_iterator<char>());
         kernel_source.close();
-        /* Create the program using the source code and the context */
-        cl::Program program(context, cl::Program::Sources(1, std::make_pair(source_code.c_str(), source_code.length())));
-        try
-        {
-            program.build({device});   
-        }
-        catch(cl::Error e)
-        {
-            std::cerr << "Could not build program: "<< std::endl
-                        << "\tDevice name: " << device.getInfo<CL_DEVICE_NAME>() << std::endl
-                        << "\tStatus code: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device)  << std::endl
-                        << "Log: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
-            exit(EXIT_FAILURE);
-        }
-        return program;    
+
+        return build_program(context, device, source_code, options);
     }
     else
     {
@@ -0,0 +1,61 @@
+#ifndef OPTIONS_HPP
+#define OPTIONS_HPP
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+/* Minimal command line helpers.
+ * Matching arguments are removed from argv so that programs can keep validating their
+ * positional arguments with argc. */
+
+/* Remove every occurrence of flag (e.g. "--no-fusion") and tell whether one was found */
+inline bool parse_flag(int& argc, char** argv, const std::string& flag)
+{
+    bool found = false;
+    int out = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (flag == argv[i])
+            found = true;
+        else
+            argv[out++] = argv[i];
+    }
+    argc = out;
+    argv[argc] = NULL;
+    return found;
+}
+
+/* Remove "name value" or "name=value" and return value, or default_value when absent.
+ * A trailing name without its value is an error rather than a positional argument. */
+inline std::string parse_option(int& argc, char** argv, const std::string& name, const std::string& default_value = "")
+{
+    std::string value = default_value;
+    int out = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == name)
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << "missing value for " << name << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            value = argv[++i];
+        }
+        else if (arg.compare(0, name.size() + 1, name + "=") == 0)
+        {
+            value = arg.substr(name.size() + 1);
+        }
+        else
+        {
+            argv[out++] = argv[i];
+        }
+    }
+    argc = out;
+    argv[argc] = NULL;
+    return value;
+}
+
+#endif
@@ -0,0 +1,358 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <memory>
+#include <vector>
+
+#include "color_conversion.hpp"
+#include "convolution_engine.hpp"
+#include "host_buffer.hpp"
+
+/* Chain of image operations running on device-resident buffers.
+ * The image is uploaded once, every stage reads one of two device buffers and writes
+ * the other one (ping-pong), and only the final result is read back: there is no host
+ * round-trip nor synchronisation point between stages.
+ * When fusion is enabled (the default), a convolution directly followed by an erosion
+ * runs as the single gray_conv_erode kernel, keeping the convolved tile in local memory.
+ * Separable masks are not fused: gray_conv_erode applies them densely, which costs more
+ * than the two separable passes and the erosion.
+ * In TRANSFER_MAP mode, the input image is used in place (CL_MEM_USE_HOST_PTR) instead of
+ * being written to the device, the intermediate buffers live in host-accessible memory,
+ * and the result can be read in place with map_result().
+ * Colour images can be uploaded as decoded with enqueue_upload_pixels(), the conversion
+ * to gray running on the device (see color_conversion.hpp).
+ * Device buffers come from the BufferPool of the engine, shared by every stage.
+ *
+ * Usage:
+ *     Pipeline pipeline(device);
+ *     pipeline.convolution(mask, 5, 5).erosion(se, 3);
+ *     pipeline.run(in, width, height, out);
+ */
+class Pipeline
+{
+
+    private:
+    struct Stage
+    {
+        enum Type { CONVOLUTION, EROSION };
+        Type type;
+        DeviceMask mask;
+        DeviceStructuringElement se;
+    };
+
+    ConvolutionEngine engine;
+    std::vector<Stage> stages;
+    bool fusion;
+
+    PooledBuffer buffers[2];
+    /* Index of the buffer holding the current image, INPUT for the wrapped input image */
+    static const int INPUT = -1;
+    int current;
+
+    TransferMode transfer;
+    /* Input image (gray or colour) used in place in TRANSFER_MAP mode */
+    cl::Buffer input;
+    void* mapped;
+
+    /* Colour image before its conversion to gray, and the converter (created on first use) */
+    PooledBuffer raw;
+    std::shared_ptr<ColorConverter> color;
+
+    void reserve(size_t bytes)
+    {
+        if (bytes <= buffers[0].capacity())
+            return;
+        release_buffers();
+        cl_mem_flags flags = CL_MEM_READ_WRITE | (transfer == TRANSFER_MAP ? CL_MEM_ALLOC_HOST_PTR : 0);
+        buffers[0] = engine.get_buffer_pool()->acquire(bytes, flags);
+        buffers[1] = engine.get_buffer_pool()->acquire(bytes, flags);
+    }
+
+    /* Give the ping-pong buffers back to the pool once the commands using them are complete */
+    void release_buffers()
+    {
+        if (buffers[0].empty())
+            return;
+        engine.get_queue().finish();
+        buffers[0].release();
+        buffers[1].release();
+    }
+
+    const cl::Buffer& image(int index) const
+    {
+        return index == INPUT ? input : buffers[index].buffer();
+    }
+
+    public:
+    Pipeline(cl::Device device, std::string kernel_source_file = "../src/kernelConv.cl", std::string build_options = "") :
+        engine(device, kernel_source_file, build_options), fusion(true), current(0), transfer(TRANSFER_COPY), mapped(NULL)
+    {}
+
+    Pipeline(cl::Context context, cl::Device device, cl::Program program) :
+        engine(context, device, program), fusion(true), current(0), transfer(TRANSFER_COPY), mapped(NULL)
+    {}
+
+    /* Append a convolution by the mask_width x mask_height mask */
+    Pipeline& convolution(const float* mask, size_t mask_width, size_t mask_height)
+    {
+        Stage stage;
+        stage.type = Stage::CONVOLUTION;
+        engine.prepare_mask(stage.mask, mask, mask_width, mask_height);
+        stages.push_back(stage);
+        return *this;
+    }
+
+    /* Append an erosion by the se_size x se_size structuring element se */
+    Pipeline& erosion(const int* se, size_t se_size)
+    {
+        Stage stage;
+        stage.type = Stage::EROSION;
+        engine.prepare_structuring_element(stage.se, se, se_size);
+        stages.push_back(stage);
+        return *this;
+    }
+
+    void clear()
+    {
+        stages.clear();
+    }
+
+    void set_fusion(bool enabled)
+    {
+        fusion = enabled;
+    }
+
+    /* Change how images are uploaded and downloaded (see TransferMode) */
+    void set_transfer_mode(TransferMode mode)
+    {
+        if (mode != transfer)
+            release_buffers();
+        transfer = mode;
+    }
+
+    /* Number of rows/columns around a pixel that can influence its final value */
+    size_t halo() const
+    {
+        size_t total = 0;
+        for (auto &stage : stages)
+        {
+            if (stage.type == Stage::CONVOLUTION)
+                total += std::max(stage.mask.width, stage.mask.height) / 2;
+            else
+                total += stage.se.size / 2;
+        }
+        return total;
+    }
+
+    /* Non-blocking upload of the width x height gray image in. in must stay valid until the
+     * upload is complete, which event signals when given. In TRANSFER_MAP mode, in is read in
+     * place by the first stage and must stay valid until the stages are complete; it
+     * should be aligned with aligned_mat() or aligned_vector to avoid a hidden copy. */
+    void enqueue_upload(const unsigned char* in, size_t width, size_t height, cl::Event* event = NULL)
+    {
+        size_t bytes = width * height * sizeof(unsigned char);
+        reserve(bytes);
+        if (transfer == TRANSFER_MAP)
+        {
+            /* The runtime copies the pixels at creation only if the device cannot access them */
+            input = cl::Buffer(engine.get_context(), CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, bytes, const_cast<unsigned char*>(in));
+            current = INPUT;
+            if (event)
+                *event = cl::Event();
+            return;
+        }
+        current = 0;
+        cl::Event upload;
+        engine.get_queue().enqueueWriteBuffer(buffers[current].buffer(), CL_FALSE, 0, bytes, in, NULL, &upload);
+        if (event)
+            *event = upload;
+        if (engine.get_profiler())
+            engine.get_profiler()->add(PROFILE_H2D, "upload", upload);
+    }
+
+    /* Non-blocking upload of the width x height image pixels, of the given format, converted
+     * to gray on the device. Same lifetime rules for pixels as enqueue_upload(). */
+    void enqueue_upload_pixels(const unsigned char* pixels, size_t width, size_t height, PixelFormat format, cl::Event* event = NULL)
+    {
+        if (format == PIXEL_GRAY)
+        {
+            enqueue_upload(pixels, width, height, event);
+            return;
+        }
+
+        size_t bytes = width * height * pixel_channels(format);
+        reserve(width * height * sizeof(unsigned char));
+        cl::Event upload;
+        if (transfer == TRANSFER_MAP)
+        {
+            input = cl::Buffer(engine.get_context(), CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, bytes, const_cast<unsigned char*>(pixels));
+        }
+        else
+        {
+            if (bytes > raw.capacity())
+            {
+                if (!raw.empty())
+                    engine.get_queue().finish();
+                raw = engine.get_buffer_pool()->acquire(bytes, CL_MEM_READ_ONLY);
+            }
+            engine.get_queue().enqueueWriteBuffer(raw.buffer(), CL_FALSE, 0, bytes, pixels, NULL, &upload);
+            if (engine.get_profiler())
+                engine.get_profiler()->add(PROFILE_H2D, "upload", upload);
+        }
+        if (event)
+            *event = upload;
+
+        current = 0;
+        const cl::Buffer& pixels_buffer = transfer == TRANSFER_MAP ? input : raw.buffer();
+        get_color_converter().enqueue_to_gray(engine.get_queue(), pixels_buffer, width, height, format, buffers[current].buffer(),
+                                              engine.track(PROFILE_KERNEL, "color_to_gray"));
+    }
+
+    /* Use the width x height image of the given format held by in (e.g. a HostBuffer over
+     * a cv::Mat, see wrap_mat()) as the input, in place: nothing is transferred. in must
+     * stay valid until the stages are complete. Colour images are converted to gray on
+     * the device. */
+    void use_input(const cl::Buffer& in, size_t width, size_t height, PixelFormat format)
+    {
+        reserve(width * height * sizeof(unsigned char));
+        input = in;
+        if (format == PIXEL_GRAY)
+        {
+            current = INPUT;
+            return;
+        }
+        current = 0;
+        get_color_converter().enqueue_to_gray(engine.get_queue(), input, width, height, format, buffers[current].buffer(),
+                                              engine.track(PROFILE_KERNEL, "color_to_gray"));
+    }
+
+    /* Enqueue all the stages on the uploaded image */
+    void enqueue_stages(size_t width, size_t height)
+    {
+        for (size_t i = 0; i < stages.size(); ++i)
+        {
+            int next = current == 0 ? 1 : 0;
+            const cl::Buffer& in = image(current);
+            const cl::Buffer& out = buffers[next].buffer();
+            const Stage& stage = stages[i];
+            if (stage.type == Stage::CONVOLUTION)
+            {
+                bool fused = false;
+                if (fusion && !stage.mask.separable && i + 1 < stages.size() && stages[i + 1].type == Stage::EROSION)
+                {
+                    fused = engine.enqueue_fused_convolution_erosion(stage.mask, stages[i + 1].se, in, out, width, height);
+                }
+                if (fused)
+                    ++i;
+                else
+                    engine.enqueue_convolution(stage.mask, in, out, width, height);
+            }
+            else
+            {
+                engine.enqueue_erosion(stage.se, in, out, width, height);
+            }
+            current = next;
+        }
+    }
+
+    /* Read the current image back into out. When non-blocking, event signals the end of the read.
+     * In TRANSFER_MAP mode the result is mapped and copied on the host, which is always blocking;
+     * map_result() avoids the copy. */
+    void enqueue_download(unsigned char* out, size_t width, size_t height, bool blocking = true, cl::Event* event = NULL)
+    {
+        enqueue_download_rows(out, width, 0, height, blocking, event);
+    }
+
+    /* Read rows [first_row, first_row + rows) of the current image, of width pixels, into out */
+    void enqueue_download_rows(unsigned char* out, size_t width, size_t first_row, size_t rows, bool blocking = true, cl::Event* event = NULL)
+    {
+        size_t offset = first_row * width * sizeof(unsigned char);
+        size_t bytes = rows * width * sizeof(unsigned char);
+        if (transfer == TRANSFER_MAP)
+        {
+            std::memcpy(out, map_result(width, first_row + rows, event) + offset, bytes);
+            unmap_result();
+            return;
+        }
+        cl::Event download;
+        engine.get_queue().enqueueReadBuffer(image(current), blocking ? CL_TRUE : CL_FALSE, offset, bytes, out, NULL, &download);
+        if (event)
+            *event = download;
+        if (engine.get_profiler())
+            engine.get_profiler()->add(PROFILE_D2H, "download", download);
+    }
+
+    /* Blocking map of the current image, which stays readable until unmap_result().
+     * No stage can be enqueued while the result is mapped. */
+    const unsigned char* map_result(size_t width, size_t height, cl::Event* event = NULL)
+    {
+        if (mapped)
+            return static_cast<const unsigned char*>(mapped);
+        cl::Event map;
+        mapped = engine.get_queue().enqueueMapBuffer(image(current), CL_TRUE, CL_MAP_READ, 0, width * height * sizeof(unsigned char), NULL, &map);
+        if (event)
+            *event = map;
+        if (engine.get_profiler())
+            engine.get_profiler()->add(PROFILE_D2H, "map", map);
+        return static_cast<const unsigned char*>(mapped);
+    }
+
+    void unmap_result()
+    {
+        if (mapped == NULL)
+            return;
+        engine.get_queue().enqueueUnmapMemObject(image(current), mapped);
+        mapped = NULL;
+    }
+
+    /* Run the whole pipeline on the width x height gray image in and store the result in out.
+     * Returns the elapsed time in seconds. */
+    double run(const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        enqueue_upload(in, width, height);
+        enqueue_stages(width, height);
+        enqueue_download(out, width, height);
+        return t.end();
+    }
+
+    /* Record transfers and kernels in profiler (see ConvolutionEngine::set_profiler) */
+    void set_profiler(Profiler* profiler)
+    {
+        engine.set_profiler(profiler);
+    }
+
+    /* Use the specialized programs of variants (see ConvolutionEngine::set_variants) */
+    void set_variants(std::shared_ptr<KernelVariants> variants)
+    {
+        engine.set_variants(variants);
+    }
+
+    /* Take device memory from pool (see ConvolutionEngine::set_buffer_pool) */
+    void set_buffer_pool(std::shared_ptr<BufferPool> pool)
+    {
+        release_buffers();
+        raw.release();
+        engine.set_buffer_pool(pool);
+    }
+
+    /* Share a colour converter built for the context of the pipeline, e.g. between slots */
+    void set_color_converter(std::shared_ptr<ColorConverter> converter)
+    {
+        color = converter;
+    }
+
+    ColorConverter& get_color_converter()
+    {
+        if (!color)
+            color = std::make_shared<ColorConverter>(engine.get_context(), engine.get_device());
+        return *color;
+    }
+
+    ConvolutionEngine& get_engine() { return engine; }
+    cl::CommandQueue& get_queue() { return engine.get_queue(); }
+
+};
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef PROFILING_HPP
+#define PROFILING_HPP
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+#define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <CL/cl.hpp>
+
+/* Categories of profiled commands */
+static const char PROFILE_H2D[] = "h2d";
+static const char PROFILE_KERNEL[] = "kernel";
+static const char PROFILE_D2H[] = "d2h";
+
+/* Collects the events of enqueued commands and turns their profiling counters
+ * (CL_PROFILING_COMMAND_QUEUED / SUBMIT / START / END) into a per-stage report.
+ * Commands must be enqueued on queues created with CL_QUEUE_PROFILING_ENABLE;
+ * events of other queues are ignored. The counters are only read once the
+ * commands are complete, i.e. after the queues are finished.
+ *
+ * Usage:
+ *     Profiler profiler;
+ *     queue.enqueueWriteBuffer(buffer, CL_FALSE, 0, size, ptr, NULL, profiler.track(PROFILE_H2D, "image"));
+ *     ...
+ *     queue.finish();
+ *     profiler.report(std::cerr);
+ */
+class Profiler
+{
+
+    public:
+    /* Timing of one command, in nanoseconds of the device clock */
+    struct Record
+    {
+        std::string category;
+        std::string name;
+        cl::Event event;
+        cl_ulong queued;
+        cl_ulong submit;
+        cl_ulong start;
+        cl_ulong end;
+        bool valid;
+    };
+
+    private:
+    /* A deque keeps the addresses handed out by track() valid */
+    std::deque<Record> records;
+
+    /* Read the counters of the completed commands */
+    void resolve()
+    {
+        for (auto &record : records)
+        {
+            if (record.valid || record.event() == NULL)
+                continue;
+            try
+            {
+                record.queued = record.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+                record.submit = record.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+                record.start = record.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+                record.end = record.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+                record.valid = true;
+            }
+            catch(cl::Error e)
+            {
+                /* Queue without profiling, or command not complete */
+            }
+        }
+    }
+
+    cl_ulong origin()
+    {
+        cl_ulong first = 0;
+        bool found = false;
+        for (auto &record : records)
+        {
+            if (record.valid && (!found || record.queued < first))
+            {
+                first = record.queued;
+                found = true;
+            }
+        }
+        return first;
+    }
+
+    static std::string escape(const std::string& text)
+    {
+        std::string escaped;
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    public:
+    /* Return the event to give to the next enqueue call */
+    cl::Event* track(const std::string& category, const std::string& name)
+    {
+        Record record;
+        record.category = category;
+        record.name = name;
+        record.queued = record.submit = record.start = record.end = 0;
+        record.valid = false;
+        records.push_back(record);
+        return &records.back().event;
+    }
+
+    /* Record an event obtained elsewhere */
+    void add(const std::string& category, const std::string& name, const cl::Event& event)
+    {
+        *track(category, name) = event;
+    }
+
+    void clear()
+    {
+        records.clear();
+    }
+
+    const std::deque<Record>& get_records()
+    {
+        resolve();
+        return records;
+    }
+
+    /* Per-stage breakdown: count, total and mean execution time, and the time commands
+     * spent waiting between being queued and starting (queue delay). */
+    void report(std::ostream& out)
+    {
+        resolve();
+        struct Total { size_t count; double execution; double delay; };
+        std::map<std::string, Total> totals;
+        std::vector<std::string> order;
+        double first = 0, last = 0;
+        bool any = false;
+        for (auto &record : records)
+        {
+            if (!record.valid)
+                continue;
+            if (totals.find(record.category) == totals.end())
+            {
+                totals[record.category] = Total{0, 0, 0};
+                order.push_back(record.category);
+            }
+            Total& total = totals[record.category];
+            total.count++;
+            total.execution += (record.end - record.start) * 1e-6;
+            total.delay += (record.start - record.queued) * 1e-6;
+            if (!any || record.queued * 1e-6 < first)
+                first = record.queued * 1e-6;
+            if (!any || record.end * 1e-6 > last)
+                last = record.end * 1e-6;
+            any = true;
+        }
+
+        out << "# Profile" << std::endl;
+        out << "#Stage\tCount\tTotal(ms)\tMean(ms)\tQueueDelay(ms)" << std::endl;
+        out << std::fixed << std::setprecision(3);
+        for (auto &category : order)
+        {
+            const Total& total = totals[category];
+            out << category << "\t" << total.count << "\t"
+                << total.execution << "\t\t"
+                << total.execution / total.count << "\t\t"
+                << total.delay << std::endl;
+        }
+        out << "# Device span (first queued to last end): " << (last - first) << " ms" << std::endl;
+        out.unsetf(std::ios::fixed);
+    }
+
+    /* Every command with its counters, in microseconds from the first queued command */
+    void export_json(const std::string& file)
+    {
+        resolve();
+        cl_ulong base = origin();
+        std::ofstream out(file);
+        out << "[" << std::endl;
+        bool first = true;
+        for (auto &record : records)
+        {
+            if (!record.valid)
+                continue;
+            out << (first ? "" : ",\n")
+                << "  {\"category\": \"" << escape(record.category) << "\", \"name\": \"" << escape(record.name) << "\""
+                << ", \"queued\": " << (record.queued - base) / 1000.0
+                << ", \"submit\": " << (record.submit - base) / 1000.0
+                << ", \"start\": " << (record.start - base) / 1000.0
+                << ", \"end\": " << (record.end - base) / 1000.0 << "}";
+            first = false;
+        }
+        out << "\n]" << std::endl;
+    }
+
+    /* Chrome trace event format, to be opened in chrome://tracing or Perfetto.
+     * Each category gets its own row. */
+    void export_chrome_trace(const std::string& file)
+    {
+        resolve();
+        cl_ulong base = origin();
+        std::map<std::string, int> rows;
+        std::ofstream out(file);
+        out << "{\"traceEvents\": [" << std::endl;
+        bool first = true;
+        for (auto &record : records)
+        {
+            if (!record.valid)
+                continue;
+            if (rows.find(record.category) == rows.end())
+            {
+                int row = rows.size();
+                rows[record.category] = row;
+            }
+            out << (first ? "" : ",\n")
+                << "  {\"name\": \"" << escape(record.name) << "\", \"cat\": \"" << escape(record.category) << "\""
+                << ", \"ph\": \"X\", \"pid\": 0, \"tid\": " << rows[record.category]
+                << ", \"ts\": " << (record.start - base) / 1000.0
+                << ", \"dur\": " << (record.end - record.start) / 1000.0
+                << ", \"args\": {\"queue_delay_us\": " << (record.start - record.queued) / 1000.0 << "}}";
+            first = false;
+        }
+        for (auto &row : rows)
+        {
+            out << (first ? "" : ",\n")
+                << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << row.second
+                << ", \"args\": {\"name\": \"" << escape(row.first) << "\"}}";
+            first = false;
+        }
+        out << "\n]}" << std::endl;
+    }
+
+};
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef PROGRAM_CACHE_HPP
+#define PROGRAM_CACHE_HPP
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+#define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <CL/cl.hpp>
+
+/* On-disk cache of compiled OpenCL programs.
+ * Entries are named after a hash of everything that can change the produced binary
+ * (source code, platform, device, driver version and build options). The full key is
+ * also stored inside the entry, so a hash collision or a truncated file is detected
+ * and the entry is simply rebuilt. */
+
+static const char PROGRAM_CACHE_MAGIC[] = "OCLBIN1";
+
+inline uint64_t fnv1a_hash(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline uint64_t fnv1a_hash(const std::string& data, uint64_t hash = 14695981039346656037ULL)
+{
+    return fnv1a_hash(data.data(), data.size(), hash);
+}
+
+inline std::string to_hex(uint64_t value)
+{
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(value));
+    return std::string(buffer);
+}
+
+/* Create path and its missing parents, like mkdir -p */
+inline bool make_directories(const std::string& path)
+{
+    for (size_t pos = 1; pos <= path.size(); ++pos)
+    {
+        if (pos == path.size() || path[pos] == '/')
+        {
+            std::string sub = path.substr(0, pos);
+            if (mkdir(sub.c_str(), 0755) != 0 && errno != EEXIST)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Cache location: OCL_CACHE_DIR, then $XDG_CACHE_HOME/ocl_test, then ~/.cache/ocl_test.
+ * Returns an empty string (cache disabled) when OCL_CACHE_DISABLE is set or no location is known. */
+inline std::string program_cache_dir()
+{
+    if (std::getenv("OCL_CACHE_DISABLE") != NULL)
+        return "";
+    if (const char* dir = std::getenv("OCL_CACHE_DIR"))
+        return dir;
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME"))
+        return std::string(xdg) + "/ocl_test";
+    if (const char* home = std::getenv("HOME"))
+        return std::string(home) + "/.cache/ocl_test";
+    return "";
+}
+
+/* Human readable description of the cache key. */
+inline std::string program_cache_key(const std::string& source, const cl::Device& device, const std::string& options)
+{
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    std::ostringstream key;
+    key << "platform=" << platform.getInfo<CL_PLATFORM_NAME>() << " " << platform.getInfo<CL_PLATFORM_VERSION>()
+        << ";device=" << device.getInfo<CL_DEVICE_NAME>()
+        << ";version=" << device.getInfo<CL_DEVICE_VERSION>()
+        << ";driver=" << device.getInfo<CL_DRIVER_VERSION>()
+        << ";options=" << options
+        << ";source=" << to_hex(fnv1a_hash(source)) << "/" << source.size();
+    return key.str();
+}
+
+inline std::string program_cache_path(const std::string& dir, const std::string& key)
+{
+    return dir + "/" + to_hex(fnv1a_hash(key)) + ".bin";
+}
+
+/* Read a cache entry. Returns false if it is missing, truncated or belongs to another key.
+ * The stored size must match the rest of the file, so that a corrupt size field never
+ * drives a huge allocation. */
+inline bool load_program_binary(const std::string& path, const std::string& key, std::vector<unsigned char>& binary)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    std::string magic, stored_key;
+    std::getline(file, magic);
+    std::getline(file, stored_key);
+    uint64_t size = 0, checksum = 0;
+    file.read(reinterpret_cast<char*>(&size), sizeof(size));
+    file.read(reinterpret_cast<char*>(&checksum), sizeof(checksum));
+    if (!file || magic != PROGRAM_CACHE_MAGIC || stored_key != key || size == 0)
+        return false;
+
+    std::streampos start = file.tellg();
+    file.seekg(0, std::ios::end);
+    std::streampos end = file.tellg();
+    if (!file || start < 0 || end < start || (uint64_t) (end - start) != size)
+        return false;
+    file.seekg(start);
+
+    binary.resize(size);
+    file.read(reinterpret_cast<char*>(binary.data()), size);
+    if (!file || fnv1a_hash(binary.data(), binary.size()) != checksum)
+        return false;
+    return true;
+}
+
+/* Extract the binary of program for device. Returns an empty vector if the runtime has none. */
+inline std::vector<unsigned char> get_program_binary(const cl::Program& program, const cl::Device& device)
+{
+    cl_uint num_devices = 0;
+    clGetProgramInfo(program(), CL_PROGRAM_NUM_DEVICES, sizeof(num_devices), &num_devices, NULL);
+    if (num_devices == 0)
+        return std::vector<unsigned char>();
+
+    std::vector<cl_device_id> devices(num_devices);
+    std::vector<size_t> sizes(num_devices);
+    clGetProgramInfo(program(), CL_PROGRAM_DEVICES, num_devices * sizeof(cl_device_id), devices.data(), NULL);
+    clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, num_devices * sizeof(size_t), sizes.data(), NULL);
+
+    /* CL_PROGRAM_BINARIES expects one preallocated buffer per device of the program */
+    std::vector<std::vector<unsigned char> > binaries(num_devices);
+    std::vector<unsigned char*> pointers(num_devices);
+    for (cl_uint i = 0; i < num_devices; ++i)
+    {
+        binaries[i].resize(sizes[i]);
+        pointers[i] = binaries[i].data();
+    }
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, num_devices * sizeof(unsigned char*), pointers.data(), NULL) != CL_SUCCESS)
+        return std::vector<unsigned char>();
+
+    for (cl_uint i = 0; i < num_devices; ++i)
+    {
+        if (devices[i] == device())
+            return binaries[i];
+    }
+    return std::vector<unsigned char>();
+}
+
+/* Write a cache entry atomically: the data goes to a temporary file in the same
+ * directory which is then renamed over the final path, so that concurrent processes
+ * never observe a partially written entry. The temporary name is unique per call as
+ * well, since threads of one process may store the same entry at once (sub-devices
+ * share their cache key). */
+inline bool store_program_binary(const std::string& path, const std::string& key, const std::vector<unsigned char>& binary)
+{
+    if (binary.empty())
+        return false;
+
+    static std::atomic<unsigned long> store_count(0);
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(store_count++);
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+            return false;
+        uint64_t size = binary.size();
+        uint64_t checksum = fnv1a_hash(binary.data(), binary.size());
+        file << PROGRAM_CACHE_MAGIC << "\n" << key << "\n";
+        file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        file.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+        file.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+        if (!file)
+        {
+            file.close();
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Try to create and build a program from the cache entry at path.
+ * A stale or rejected entry is removed so that it gets rebuilt from source. */
+inline bool load_cached_program(cl::Context context, cl::Device device, const std::string& path,
+                                const std::string& key, const std::string& options, cl::Program& program)
+{
+    std::vector<unsigned char> binary;
+    if (!load_program_binary(path, key, binary))
+    {
+        std::remove(path.c_str());
+        return false;
+    }
+
+    try
+    {
+        cl::Program::Binaries binaries(1, std::make_pair(static_cast<const void*>(binary.data()), binary.size()));
+        std::vector<cl_int> status;
+        program = cl::Program(context, {device}, binaries, &status);
+        program.build({device}, options.c_str());
+    }
+    catch(cl::Error e)
+    {
+        std::cerr << "Discarding unusable program cache entry " << path << std::endl;
+        std::remove(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
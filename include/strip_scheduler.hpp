@@ -0,0 +1,149 @@
+#ifndef STRIP_SCHEDULER_HPP
+#define STRIP_SCHEDULER_HPP
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "pipeline.hpp"
+
+/* Runs a pipeline over images too large for the device, one horizontal strip at a time.
+ * A strip of output rows [y0, y1) is computed from input rows [y0 - halo, y1 + halo)
+ * (clipped to the image), where halo is the pipeline halo: rows close to the strip
+ * edges only see part of their neighbourhood and are discarded, so that the stitched
+ * output is identical to the one of a whole-image run, borders included.
+ * Strips are dealt round-robin to several pipelines (slots), each with its own queue and
+ * device buffers, so that the transfers of a strip overlap the kernels of another one.
+ * Results are read straight into their rows of the output image: no stitching copy.
+ * Device memory stays bounded by slots x strip size whatever the image size.
+ *
+ * Usage:
+ *     StripScheduler scheduler(context, device, program);
+ *     scheduler.convolution(mask, 5, 5).erosion(se, 3);
+ *     scheduler.run(in, width, height, out);
+ */
+class StripScheduler
+{
+
+    private:
+    cl::Device device;
+    std::vector<std::unique_ptr<Pipeline> > slots;
+    /* Output rows per strip, 0 to derive it from the device limits */
+    size_t strip_rows;
+    size_t strips;
+
+    public:
+    /* Device bytes per pixel of a strip: the two ping-pong images and the float
+     * intermediate of separable convolutions */
+    static const size_t BYTES_PER_PIXEL = 2 * sizeof(unsigned char) + sizeof(float);
+
+    StripScheduler(cl::Context context, cl::Device device, cl::Program program, size_t num_slots = 2) :
+        device(device), strip_rows(0), strips(0)
+    {
+        for (size_t i = 0; i < std::max<size_t>(1, num_slots); ++i)
+            slots.emplace_back(new Pipeline(context, device, program));
+        /* Strips of different heights recycle each other's buffers */
+        for (size_t i = 1; i < slots.size(); ++i)
+            slots[i]->set_buffer_pool(slots[0]->get_engine().get_buffer_pool());
+    }
+
+    StripScheduler& convolution(const float* mask, size_t mask_width, size_t mask_height)
+    {
+        for (auto &slot : slots)
+            slot->convolution(mask, mask_width, mask_height);
+        return *this;
+    }
+
+    StripScheduler& erosion(const int* se, size_t se_size)
+    {
+        for (auto &slot : slots)
+            slot->erosion(se, se_size);
+        return *this;
+    }
+
+    /* Take the work-group sizes of every slot from tuner (see ConvolutionEngine::set_autotuner) */
+    void set_autotuner(Autotuner* tuner)
+    {
+        for (auto &slot : slots)
+            slot->get_engine().set_autotuner(tuner);
+    }
+
+    /* Share the specialized programs of variants between all slots */
+    void set_variants(std::shared_ptr<KernelVariants> variants)
+    {
+        for (auto &slot : slots)
+            slot->set_variants(variants);
+    }
+
+    void set_fusion(bool enabled)
+    {
+        for (auto &slot : slots)
+            slot->set_fusion(enabled);
+    }
+
+    /* Force the number of output rows per strip (0 restores the automatic choice) */
+    void set_strip_rows(size_t rows)
+    {
+        strip_rows = rows;
+    }
+
+    /* Largest number of output rows per strip for images of the given width such that
+     * every buffer fits in CL_DEVICE_MAX_MEM_ALLOC_SIZE and all the slots together use at
+     * most half of the global memory. Returns 0 if not even one row fits. */
+    size_t auto_strip_rows(size_t width) const
+    {
+        cl_ulong max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        cl_ulong global_memory = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+        size_t halo = slots[0]->halo();
+
+        /* The float intermediate is the largest single buffer */
+        size_t rows_alloc = max_alloc / (width * sizeof(float));
+        size_t rows_global = global_memory / 2 / slots.size() / (width * BYTES_PER_PIXEL);
+        size_t input_rows = std::min(rows_alloc, rows_global);
+        return input_rows > 2 * halo ? input_rows - 2 * halo : 0;
+    }
+
+    /* Run the pipeline on the width x height gray image in and store the result in out.
+     * Returns the elapsed time in seconds. */
+    double run(const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        Timer t;
+        t.start();
+        size_t rows = strip_rows > 0 ? strip_rows : auto_strip_rows(width);
+        if (rows == 0)
+        {
+            std::cerr << "A strip of " << width << " pixels wide rows does not fit on the device." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        rows = std::min(rows, height);
+        size_t halo = slots[0]->halo();
+
+        strips = (height + rows - 1) / rows;
+        for (size_t s = 0; s < strips; ++s)
+        {
+            Pipeline& pipeline = *slots[s % slots.size()];
+            size_t first = s * rows;
+            size_t last = std::min(height, first + rows);
+            size_t input_first = first >= halo ? first - halo : 0;
+            size_t input_last = std::min(height, last + halo);
+            size_t input_rows = input_last - input_first;
+
+            /* The queue of a slot is in-order: the next strip of the slot only overwrites
+             * its device buffers once this one is read back */
+            pipeline.enqueue_upload(in + input_first * width, width, input_rows);
+            pipeline.enqueue_stages(width, input_rows);
+            pipeline.enqueue_download_rows(out + first * width, width, first - input_first, last - first, false);
+            pipeline.get_queue().flush();
+        }
+        for (auto &slot : slots)
+            slot->get_queue().finish();
+        return t.end();
+    }
+
+    /* Number of strips of the last run */
+    size_t get_strips() const { return strips; }
+    size_t get_slots() const { return slots.size(); }
+
+};
+
+#endif
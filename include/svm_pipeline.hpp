@@ -0,0 +1,342 @@
+#ifndef SVM_PIPELINE_HPP
+#define SVM_PIPELINE_HPP
+
+#include <iostream>
+#include <vector>
+
+#include "opencl2_utils.hpp"
+
+/* OpenCL 2.x execution path of the convolution / erosion chains (kernelChain.cl).
+ * SvmPipeline keeps every image in shared virtual memory: the host fills and reads the
+ * same svm_vector the kernels work on, and a cv::Mat can be put on top of its data, so
+ * nothing is copied between host and device buffers. Coarse-grained allocations are
+ * handed to the device (unmapped) for each run and mapped back afterwards, which costs
+ * no copy on devices sharing the host memory; fine-grained ones are used as they are.
+ * On devices with device-side enqueue, run() launches a single work-item which enqueues
+ * every stage from the device, each waiting for the previous one, so that a chain such
+ * as conv -> erode -> conv runs without the host. Otherwise, or if the device fails to
+ * enqueue, the host enqueues the stages back to back on its in-order queue.
+ * BufferChain runs the same kernels the OpenCL 1.2 way (buffers, writes and reads), as
+ * a baseline.
+ *
+ * Usage:
+ *     SvmPipeline<> pipeline(context, device, queue, program, features.device_enqueue);
+ *     pipeline.convolution(mask, 5, 5).erosion(se, 3).convolution(mask, 5, 5);
+ *     svm_vector<unsigned char> in = pipeline.allocate(width * height);
+ *     svm_vector<unsigned char> out = pipeline.allocate(width * height);
+ *     ... fill in ...
+ *     pipeline.run(in, width, height, out);
+ */
+namespace opencl2_utils
+{
+
+/* Vector in shared virtual memory, coarse-grained by default */
+template <typename T, class SVMTrait = cl::SVMTraitCoarse<> >
+using svm_vector = std::vector<T, cl::SVMAllocator<T, SVMTrait> >;
+
+/* Stage types of kernelChain.cl */
+enum StageType
+{
+    STAGE_CONVOLUTION = 0,
+    STAGE_EROSION = 1
+};
+
+/* Stages in the layout of kernelChain.cl: 4 uints per stage (type, width, height,
+ * offset of the coefficients) and the coefficients of every stage */
+struct StageList
+{
+    std::vector<cl_uint> table;
+    std::vector<float> coefficients;
+
+    void convolution(const float* mask, size_t mask_width, size_t mask_height)
+    {
+        table.insert(table.end(), {STAGE_CONVOLUTION, (cl_uint) mask_width, (cl_uint) mask_height, (cl_uint) coefficients.size()});
+        coefficients.insert(coefficients.end(), mask, mask + mask_width * mask_height);
+    }
+
+    void erosion(const int* se, size_t se_size)
+    {
+        table.insert(table.end(), {STAGE_EROSION, (cl_uint) se_size, (cl_uint) se_size, (cl_uint) coefficients.size()});
+        for (size_t i = 0; i < se_size * se_size; ++i)
+            coefficients.push_back(se[i] == 1 ? 1.0f : 0.0f);
+    }
+
+    size_t size() const
+    {
+        return table.size() / 4;
+    }
+};
+
+/* Enqueue stages from the host, stage i reading the output of stage i - 1: in, then
+ * tmp0 and tmp1 in turn, the last stage writing out. Images and coefficients are
+ * buffers or SVM vectors. */
+template <typename Image, typename Coefficients>
+inline void enqueue_host_stages(cl::CommandQueue& queue, cl::Kernel& convolution, cl::Kernel& erosion,
+                                const StageList& stages, const Coefficients& coefficients,
+                                const Image& in, const Image& tmp0, const Image& tmp1, const Image& out,
+                                size_t width, size_t height)
+{
+    for (size_t s = 0; s < stages.size(); ++s)
+    {
+        const Image& src = s == 0 ? in : (s % 2 == 1 ? tmp0 : tmp1);
+        const Image& dst = s + 1 == stages.size() ? out : (s % 2 == 0 ? tmp0 : tmp1);
+        const cl_uint* stage = &stages.table[4 * s];
+        cl::Kernel& kernel = stage[0] == STAGE_CONVOLUTION ? convolution : erosion;
+        cl_uint arg = 0;
+        kernel.setArg(arg++, src);
+        kernel.setArg(arg++, (cl_uint) width);
+        kernel.setArg(arg++, (cl_uint) height);
+        kernel.setArg(arg++, coefficients);
+        kernel.setArg(arg++, stage[3]);
+        kernel.setArg(arg++, stage[1]);
+        if (stage[0] == STAGE_CONVOLUTION)
+            kernel.setArg(arg++, stage[2]);
+        kernel.setArg(arg++, dst);
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(width, height));
+    }
+}
+
+template <class SVMTrait = cl::SVMTraitCoarse<> >
+class SvmPipeline
+{
+
+    private:
+    cl::Context context;
+    cl::CommandQueue queue;
+    cl::Kernel convolution_kernel;
+    cl::Kernel erosion_kernel;
+    cl::Kernel chain_kernel;
+    bool device_enqueue;
+
+    StageList stages;
+    /* Device copy of stages, replaced when stages change */
+    bool stages_changed;
+    svm_vector<cl_uint, SVMTrait> table;
+    svm_vector<float, SVMTrait> coefficients;
+    /* Result of the enqueues of run_stages, on the host between runs */
+    svm_vector<cl_int, SVMTrait> status;
+    /* Images between stages, on the device */
+    svm_vector<unsigned char, SVMTrait> tmp[2];
+
+    static bool fine_grained()
+    {
+        return (SVMTrait::getSVMMemFlags() & CL_MEM_SVM_FINE_GRAIN_BUFFER) != 0;
+    }
+
+    /* SVMAllocator maps coarse-grained vectors on the host when it allocates them:
+     * unmap them before the kernels use them, map them back for the host */
+    template <typename T>
+    void to_device(svm_vector<T, SVMTrait>& vector)
+    {
+        if (!fine_grained() && !vector.empty())
+            queue.enqueueUnmapSVM(vector);
+    }
+
+    template <typename T>
+    void to_host(svm_vector<T, SVMTrait>& vector, bool blocking)
+    {
+        if (!fine_grained() && !vector.empty())
+            queue.enqueueMapSVM(vector, blocking ? CL_TRUE : CL_FALSE, CL_MAP_READ | CL_MAP_WRITE);
+    }
+
+    /* Vector of values allocated in SVM (and mapped) */
+    template <typename T, typename Iterator>
+    svm_vector<T, SVMTrait> make_vector(Iterator first, Iterator last)
+    {
+        return svm_vector<T, SVMTrait>(first, last, cl::SVMAllocator<T, SVMTrait>(context));
+    }
+
+    void upload_stages()
+    {
+        if (!stages_changed)
+            return;
+        /* The previous tables may still be in use */
+        queue.finish();
+        svm_vector<cl_uint, SVMTrait> new_table = make_vector<cl_uint>(stages.table.begin(), stages.table.end());
+        svm_vector<float, SVMTrait> new_coefficients = make_vector<float>(stages.coefficients.begin(), stages.coefficients.end());
+        table.swap(new_table);
+        coefficients.swap(new_coefficients);
+        to_device(table);
+        to_device(coefficients);
+        stages_changed = false;
+    }
+
+    void reserve(size_t bytes)
+    {
+        if (tmp[0].size() >= bytes)
+            return;
+        queue.finish();
+        for (auto &image : tmp)
+        {
+            svm_vector<unsigned char, SVMTrait> larger = allocate(bytes);
+            image.swap(larger);
+            to_device(image);
+        }
+    }
+
+    public:
+    /* program must come from kernelChain.cl, built with -cl-std=CL2.0 -D DEVICE_ENQUEUE
+     * when device_enqueue is set. context, device and queue must be the defaults of the
+     * bindings (see set_defaults()). */
+    SvmPipeline(cl::Context context, cl::Device device, cl::CommandQueue queue, cl::Program program, bool device_enqueue) :
+        context(context), queue(queue), device_enqueue(device_enqueue), stages_changed(true)
+    {
+        convolution_kernel = cl::Kernel(program, "convolution_stage");
+        erosion_kernel = cl::Kernel(program, "erosion_stage");
+        if (device_enqueue)
+            chain_kernel = cl::Kernel(program, "run_stages");
+        std::vector<cl_int> zero(1, 0);
+        status = make_vector<cl_int>(zero.begin(), zero.end());
+    }
+
+    /* Append a convolution by the mask_width x mask_height mask */
+    SvmPipeline& convolution(const float* mask, size_t mask_width, size_t mask_height)
+    {
+        stages.convolution(mask, mask_width, mask_height);
+        stages_changed = true;
+        return *this;
+    }
+
+    /* Append an erosion by the se_size x se_size structuring element se */
+    SvmPipeline& erosion(const int* se, size_t se_size)
+    {
+        stages.erosion(se, se_size);
+        stages_changed = true;
+        return *this;
+    }
+
+    /* Zeroed host vector of bytes bytes in shared virtual memory, for run() */
+    svm_vector<unsigned char, SVMTrait> allocate(size_t bytes)
+    {
+        return svm_vector<unsigned char, SVMTrait>(bytes, 0, cl::SVMAllocator<unsigned char, SVMTrait>(context));
+    }
+
+    /* Run the stages on the width x height gray image in and store the result in out,
+     * both allocated by allocate() and accessible by the host again on return. There must
+     * be at least one stage. */
+    void run(svm_vector<unsigned char, SVMTrait>& in, size_t width, size_t height, svm_vector<unsigned char, SVMTrait>& out)
+    {
+        if (stages.size() == 0)
+        {
+            std::cerr << "SvmPipeline: no stage to run." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        upload_stages();
+        reserve(width * height);
+        to_device(in);
+        to_device(out);
+
+        bool enqueued = false;
+        if (device_enqueue)
+        {
+            to_device(status);
+            chain_kernel.setArg(0, in);
+            chain_kernel.setArg(1, tmp[0]);
+            chain_kernel.setArg(2, tmp[1]);
+            chain_kernel.setArg(3, out);
+            chain_kernel.setArg(4, (cl_uint) width);
+            chain_kernel.setArg(5, (cl_uint) height);
+            chain_kernel.setArg(6, table);
+            chain_kernel.setArg(7, (cl_uint) stages.size());
+            chain_kernel.setArg(8, coefficients);
+            chain_kernel.setArg(9, status);
+            queue.enqueueNDRangeKernel(chain_kernel, cl::NullRange, cl::NDRange(1));
+            /* The parent kernel completes with its last child */
+            to_host(status, true);
+            if (fine_grained())
+                queue.finish();
+            enqueued = status[0] == 0;
+            if (!enqueued)
+            {
+                std::cerr << "Device-side enqueue failed (" << status[0] << "), the host enqueues the stages from now on." << std::endl;
+                device_enqueue = false;
+            }
+        }
+        if (!enqueued)
+            enqueue_host_stages(queue, convolution_kernel, erosion_kernel, stages, coefficients, in, tmp[0], tmp[1], out, width, height);
+
+        to_host(in, false);
+        to_host(out, true);
+        if (fine_grained())
+            queue.finish();
+    }
+
+    /* Use device-side enqueue (when the program has it) or the host */
+    void set_device_enqueue(bool enabled)
+    {
+        device_enqueue = enabled && chain_kernel() != NULL;
+    }
+
+    bool uses_device_enqueue() const { return device_enqueue; }
+    size_t get_stage_count() const { return stages.size(); }
+
+};
+
+/* Same chain on plain buffers, with a write before and a read after the stages */
+class BufferChain
+{
+
+    private:
+    cl::Context context;
+    cl::CommandQueue queue;
+    cl::Kernel convolution_kernel;
+    cl::Kernel erosion_kernel;
+
+    StageList stages;
+    cl::Buffer coefficients;
+    /* Input, intermediate and output images */
+    cl::Buffer images[4];
+    size_t capacity;
+
+    public:
+    BufferChain(cl::Context context, cl::CommandQueue queue, cl::Program program) :
+        context(context), queue(queue), capacity(0)
+    {
+        convolution_kernel = cl::Kernel(program, "convolution_stage");
+        erosion_kernel = cl::Kernel(program, "erosion_stage");
+    }
+
+    BufferChain& convolution(const float* mask, size_t mask_width, size_t mask_height)
+    {
+        stages.convolution(mask, mask_width, mask_height);
+        coefficients = cl::Buffer();
+        return *this;
+    }
+
+    BufferChain& erosion(const int* se, size_t se_size)
+    {
+        stages.erosion(se, se_size);
+        coefficients = cl::Buffer();
+        return *this;
+    }
+
+    /* Run the stages on the width x height gray image in and store the result in out */
+    void run(const unsigned char* in, size_t width, size_t height, unsigned char* out)
+    {
+        if (stages.size() == 0)
+        {
+            std::cerr << "BufferChain: no stage to run." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (coefficients() == NULL)
+        {
+            coefficients = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                      stages.coefficients.size() * sizeof(float), stages.coefficients.data());
+        }
+        size_t bytes = width * height;
+        if (bytes > capacity)
+        {
+            for (auto &image : images)
+                image = cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+            capacity = bytes;
+        }
+        queue.enqueueWriteBuffer(images[0], CL_FALSE, 0, bytes, in);
+        enqueue_host_stages(queue, convolution_kernel, erosion_kernel, stages, coefficients, images[0], images[1], images[2], images[3], width, height);
+        queue.enqueueReadBuffer(images[3], CL_TRUE, 0, bytes, out);
+    }
+
+};
+
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Fixed set of worker threads running parallel loops.
+ * parallel_for() splits [begin, end) into chunks of grain iterations that the workers
+ * and the calling thread take in turn, and returns once every chunk is done. Loops are
+ * run one at a time.
+ *
+ * Usage:
+ *     ThreadPool pool;
+ *     pool.parallel_for(0, height, 16, [&](size_t first, size_t last) { ... rows [first, last) ... });
+ */
+class ThreadPool
+{
+
+    private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    bool stopping;
+
+    /* Current loop */
+    std::function<void(size_t, size_t)> body;
+    size_t loop_end;
+    size_t loop_grain;
+    std::atomic<size_t> next;
+    size_t generation;
+    size_t busy;
+
+    /* Take chunks of the current loop until there is none left */
+    void run_chunks()
+    {
+        for (;;)
+        {
+            size_t first = next.fetch_add(loop_grain);
+            if (first >= loop_end)
+                return;
+            body(first, std::min(loop_end, first + loop_grain));
+        }
+    }
+
+    void worker()
+    {
+        size_t seen = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                ++busy;
+            }
+            run_chunks();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busy == 0)
+                    work_done.notify_all();
+            }
+        }
+    }
+
+    public:
+    /* num_threads workers besides the calling thread, by default one per hardware thread minus one */
+    explicit ThreadPool(size_t num_threads = std::max(1u, std::thread::hardware_concurrency()) - 1) :
+        stopping(false), loop_end(0), loop_grain(1), next(0), generation(0), busy(0)
+    {
+        for (size_t i = 0; i < num_threads; ++i)
+            threads.emplace_back(&ThreadPool::worker, this);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /* Threads taking part in a loop, the calling one included */
+    size_t size() const { return threads.size() + 1; }
+
+    /* Call body(first, last) on chunks of at most grain iterations covering [begin, end) */
+    void parallel_for(size_t begin, size_t end, size_t grain, std::function<void(size_t, size_t)> function)
+    {
+        if (begin >= end)
+            return;
+        grain = std::max<size_t>(1, grain);
+        if (threads.empty() || end - begin <= grain)
+        {
+            for (size_t first = begin; first < end; first += grain)
+                function(first, std::min(end, first + grain));
+            return;
+        }
+        {
+            /* A worker woken late by the previous loop may still be looking at it */
+            std::unique_lock<std::mutex> lock(mutex);
+            work_done.wait(lock, [&] { return busy == 0; });
+            body = function;
+            loop_end = end;
+            loop_grain = grain;
+            next = begin;
+            ++generation;
+        }
+        work_ready.notify_all();
+        run_chunks();
+        /* Wait for the workers that joined this loop; late ones find no chunk left */
+        std::unique_lock<std::mutex> lock(mutex);
+        work_done.wait(lock, [&] { return busy == 0; });
+    }
+
+};
+
+#endif
@@ -0,0 +1,808 @@
+#ifndef VECTOR_EXPRESSION_HPP
+#define VECTOR_EXPRESSION_HPP
+
+#include <climits>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "opencl_utils.hpp"
+#include "buffer_pool.hpp"
+
+/* Elementwise arithmetic on device vectors, fused into one kernel per expression.
+ * Operators on DeviceVector build an expression tree (expression templates) instead of
+ * computing anything; assigning the tree to a DeviceVector generates the OpenCL source
+ * of a kernel that evaluates the whole tree at each element, so a chain of N operations
+ * reads every input once and writes the result once instead of making N passes over
+ * memory. Reductions (sum, min, max, dot) are fused the same way: the expression is
+ * evaluated inside the reduction kernel and never stored.
+ * The generated source only depends on the shape of the expression (operations, element
+ * types, which operands are the same vector): scalars are kernel arguments. Kernels are
+ * cached by source in the ExpressionEngine, and programs on disk by build_program(), so
+ * an expression evaluated in a loop is compiled once.
+ * Elements are int, float or Half (16 bit floats, stored as such and computed as floats
+ * with vload_half / vstore_half, so cl_khr_fp16 is not needed). As in C, an operation on
+ * an int and a float gives a float; double scalars are used as floats.
+ *
+ * Usage:
+ *     ExpressionEngine engine(context, device, queue);
+ *     DeviceVector<float> a(engine, host_a), b(engine, host_b), c(engine, host_c);
+ *     DeviceVector<float> r = a * 2.0f + b - c;    one kernel launch
+ *     float total = sum(a * b - c);                 one kernel launch
+ *     std::vector<float> result = r.read();
+ */
+
+class ExpressionEngine;
+template <typename T> class DeviceVector;
+
+/* 16 bit float of the host, as the device's half */
+struct Half
+{
+    cl_half bits;
+
+    Half() : bits(0) {}
+    explicit Half(float value) : bits(float_to_half(value)) {}
+    operator float() const { return half_to_float(bits); }
+
+    /* Round to the nearest half, ties to even, as vstore_half */
+    static cl_half float_to_half(float value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        uint32_t sign = (bits >> 16) & 0x8000;
+        int exponent = (int)((bits >> 23) & 0xff);
+        uint32_t mantissa = bits & 0x7fffff;
+        if (exponent == 0xff)
+            return (cl_half)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+        exponent += 15 - 127;
+        if (exponent >= 31)
+            return (cl_half)(sign | 0x7c00);
+        if (exponent <= 0)
+        {
+            /* Subnormal half, or 0 */
+            if (exponent < -10)
+                return (cl_half) sign;
+            mantissa |= 0x800000;
+            int shift = 14 - exponent;
+            uint32_t half = mantissa >> shift;
+            uint32_t rest = mantissa & ((1u << shift) - 1);
+            uint32_t halfway = 1u << (shift - 1);
+            if (rest > halfway || (rest == halfway && (half & 1)))
+                ++half;
+            return (cl_half)(sign | half);
+        }
+        uint32_t half = sign | ((uint32_t) exponent << 10) | (mantissa >> 13);
+        uint32_t rest = mantissa & 0x1fff;
+        /* A carry goes into the exponent, up to infinity */
+        if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+            ++half;
+        return (cl_half) half;
+    }
+
+    static float half_to_float(cl_half value)
+    {
+        uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+        uint32_t exponent = (value >> 10) & 0x1f;
+        uint32_t mantissa = value & 0x3ff;
+        uint32_t bits;
+        if (exponent == 0x1f)
+        {
+            bits = sign | 0x7f800000 | (mantissa << 13);
+        }
+        else if (exponent == 0)
+        {
+            if (mantissa == 0)
+            {
+                bits = sign;
+            }
+            else
+            {
+                /* Subnormal half: normalise */
+                exponent = 1;
+                while (!(mantissa & 0x400))
+                {
+                    mantissa <<= 1;
+                    --exponent;
+                }
+                bits = sign | ((exponent + 112) << 23) | ((mantissa & 0x3ff) << 13);
+            }
+        }
+        else
+        {
+            bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        }
+        float result;
+        memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+};
+
+/* Storage of the element types on the device. compute_type is the type expressions
+ * on these elements are computed in. */
+template <typename T> struct ElementTraits;
+
+template <> struct ElementTraits<cl_int>
+{
+    typedef cl_int compute_type;
+    static const char* name() { return "int"; }
+    static std::string load(const std::string& vector) { return vector + "[i]"; }
+    static std::string store(const std::string& vector, const std::string& value) { return vector + "[i] = (int)(" + value + ")"; }
+};
+
+template <> struct ElementTraits<cl_float>
+{
+    typedef cl_float compute_type;
+    static const char* name() { return "float"; }
+    static std::string load(const std::string& vector) { return vector + "[i]"; }
+    static std::string store(const std::string& vector, const std::string& value) { return vector + "[i] = (float)(" + value + ")"; }
+};
+
+template <> struct ElementTraits<Half>
+{
+    typedef cl_float compute_type;
+    static const char* name() { return "half"; }
+    static std::string load(const std::string& vector) { return "vload_half(i, " + vector + ")"; }
+    static std::string store(const std::string& vector, const std::string& value) { return "vstore_half((float)(" + value + "), i, " + vector + ")"; }
+};
+
+/* Compute types: result of an operation on a and b, type of a scalar operand */
+template <typename A, typename B> struct PromotedType
+{
+    typedef typename std::conditional<std::is_same<A, cl_float>::value || std::is_same<B, cl_float>::value, cl_float, cl_int>::type type;
+};
+
+template <typename S> struct ScalarType
+{
+    typedef typename std::conditional<std::is_floating_point<S>::value, cl_float, cl_int>::type type;
+};
+
+inline const char* compute_type_name(cl_int) { return "int"; }
+inline const char* compute_type_name(cl_float) { return "float"; }
+
+/* Parameters, arguments and size of the kernel generated for an expression. Each
+ * vector is passed once, however many times it appears in the expression. */
+class KernelBuilder
+{
+
+    private:
+    std::vector<std::string> parameters;
+    std::vector<std::function<void(cl::Kernel&, cl_uint)>> arguments;
+    /* Name of each vector already passed */
+    std::map<const void*, std::string> vectors;
+    size_t count;
+    ExpressionEngine* owner;
+
+    std::string next_name(const char* prefix) const
+    {
+        return prefix + std::to_string(parameters.size());
+    }
+
+    template <typename T>
+    std::string add_vector(const DeviceVector<T>& vector, bool output)
+    {
+        if (owner == NULL)
+        {
+            count = vector.size();
+            owner = &vector.get_engine();
+        }
+        else if (vector.size() != count || &vector.get_engine() != owner)
+        {
+            std::cerr << "DeviceVector: operands of " << vector.size() << " and " << count
+                      << " elements, or of several engines, in one expression" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::string name = next_name("v");
+        parameters.push_back(std::string(output ? "global " : "global const ") + ElementTraits<T>::name() + "* " + name);
+        const cl::Buffer& buffer = vector.buffer();
+        arguments.push_back([buffer](cl::Kernel& kernel, cl_uint index) { kernel.setArg(index, buffer); });
+        return name;
+    }
+
+    public:
+    KernelBuilder() : count(0), owner(NULL) {}
+
+    /* Expression loading the current element of vector */
+    template <typename T>
+    std::string input(const DeviceVector<T>& vector)
+    {
+        auto it = vectors.find(&vector);
+        if (it == vectors.end())
+            it = vectors.insert(std::make_pair(&vector, add_vector(vector, false))).first;
+        return ElementTraits<T>::load(it->second);
+    }
+
+    /* Statement storing value into the current element of vector */
+    template <typename T>
+    std::string output(const DeviceVector<T>& vector, const std::string& value)
+    {
+        return ElementTraits<T>::store(add_vector(vector, true), value);
+    }
+
+    template <typename S>
+    std::string scalar(S value)
+    {
+        std::string name = next_name("s");
+        parameters.push_back(std::string("const ") + compute_type_name(value) + " " + name);
+        arguments.push_back([value](cl::Kernel& kernel, cl_uint index) { kernel.setArg(index, value); });
+        return name;
+    }
+
+    /* Parameters declared so far, for the kernel signature */
+    std::string parameter_list() const
+    {
+        std::string list;
+        for (const std::string& parameter : parameters)
+            list += parameter + ",\n                ";
+        return list;
+    }
+
+    /* Set the arguments of the parameters; returns the index of the next argument */
+    cl_uint set_arguments(cl::Kernel& kernel) const
+    {
+        for (size_t i = 0; i < arguments.size(); ++i)
+            arguments[i](kernel, (cl_uint) i);
+        return (cl_uint) arguments.size();
+    }
+
+    /* Elements of the vectors of the expression */
+    size_t size() const { return count; }
+    ExpressionEngine* engine() const { return owner; }
+
+};
+
+/* Base of the expression nodes (CRTP). Nodes define value_type (the compute type of
+ * their result) and generate(), which adds their operands to the builder and returns
+ * the OpenCL expression of their value at element i. */
+template <typename E>
+struct Expression
+{
+    const E& self() const { return static_cast<const E&>(*this); }
+};
+
+/* Vectors are held by reference in expressions, other nodes by value */
+template <typename E> struct ExpressionStorage { typedef E type; };
+template <typename T> struct ExpressionStorage<DeviceVector<T>> { typedef const DeviceVector<T>& type; };
+
+template <typename S>
+class ScalarExpression : public Expression<ScalarExpression<S>>
+{
+
+    private:
+    S value;
+
+    public:
+    typedef S value_type;
+
+    explicit ScalarExpression(S value) : value(value) {}
+
+    std::string generate(KernelBuilder& builder) const { return builder.scalar(value); }
+
+};
+
+template <typename Op, typename L, typename R>
+class BinaryExpression : public Expression<BinaryExpression<Op, L, R>>
+{
+
+    private:
+    typename ExpressionStorage<L>::type left;
+    typename ExpressionStorage<R>::type right;
+
+    public:
+    typedef typename Op::template result<typename L::value_type, typename R::value_type>::type value_type;
+
+    BinaryExpression(const L& left, const R& right) : left(left), right(right) {}
+
+    std::string generate(KernelBuilder& builder) const
+    {
+        std::string a = left.generate(builder);
+        std::string b = right.generate(builder);
+        return Op::code(a, b, compute_type_name(value_type()));
+    }
+
+};
+
+template <typename Op, typename E>
+class UnaryExpression : public Expression<UnaryExpression<Op, E>>
+{
+
+    private:
+    typename ExpressionStorage<E>::type operand;
+
+    public:
+    typedef typename Op::template result<typename E::value_type>::type value_type;
+
+    explicit UnaryExpression(const E& operand) : operand(operand) {}
+
+    std::string generate(KernelBuilder& builder) const
+    {
+        return Op::code(operand.generate(builder), compute_type_name(value_type()));
+    }
+
+};
+
+/* Operations: OpenCL code of the result, and its compute type */
+#define ARITHMETIC_OPERATION(NAME, SYMBOL) \
+struct NAME \
+{ \
+    template <typename A, typename B> struct result : PromotedType<A, B> {}; \
+    static std::string code(const std::string& a, const std::string& b, const char*) \
+    { \
+        return "(" + a + " " SYMBOL " " + b + ")"; \
+    } \
+};
+
+ARITHMETIC_OPERATION(AddOperation, "+")
+ARITHMETIC_OPERATION(SubtractOperation, "-")
+ARITHMETIC_OPERATION(MultiplyOperation, "*")
+ARITHMETIC_OPERATION(DivideOperation, "/")
+#undef ARITHMETIC_OPERATION
+
+/* Operands converted to the result type: min(int, float) has no OpenCL overload */
+#define FUNCTION_OPERATION(NAME, FUNCTION) \
+struct NAME \
+{ \
+    template <typename A, typename B> struct result : PromotedType<A, B> {}; \
+    static std::string code(const std::string& a, const std::string& b, const char* type) \
+    { \
+        return std::string(FUNCTION "((") + type + ")" + a + ", (" + type + ")" + b + ")"; \
+    } \
+};
+
+FUNCTION_OPERATION(MinOperation, "min")
+FUNCTION_OPERATION(MaxOperation, "max")
+#undef FUNCTION_OPERATION
+
+struct NegateOperation
+{
+    template <typename A> struct result { typedef A type; };
+    static std::string code(const std::string& a, const char*) { return "(-" + a + ")"; }
+};
+
+struct SqrtOperation
+{
+    template <typename A> struct result { typedef cl_float type; };
+    static std::string code(const std::string& a, const char*) { return "sqrt((float)" + a + ")"; }
+};
+
+/* Reductions: identity and combination of two partial results, on the device (OpenCL
+ * code) and on the host */
+enum Reduction
+{
+    REDUCE_SUM,
+    REDUCE_MIN,
+    REDUCE_MAX
+};
+
+/* Accumulator of a reduction: int sums accumulate in 64 bits */
+template <typename V, Reduction R> struct ReductionType { typedef V type; };
+template <> struct ReductionType<cl_int, REDUCE_SUM> { typedef cl_long type; };
+
+template <typename A> struct AccumulatorTraits;
+
+template <> struct AccumulatorTraits<cl_int>
+{
+    static const char* name() { return "int"; }
+    static const char* lowest() { return "INT_MIN"; }
+    static const char* highest() { return "INT_MAX"; }
+};
+
+template <> struct AccumulatorTraits<cl_long>
+{
+    static const char* name() { return "long"; }
+    static const char* lowest() { return "LONG_MIN"; }
+    static const char* highest() { return "LONG_MAX"; }
+};
+
+template <> struct AccumulatorTraits<cl_float>
+{
+    static const char* name() { return "float"; }
+    static const char* lowest() { return "-INFINITY"; }
+    static const char* highest() { return "INFINITY"; }
+};
+
+template <typename A>
+A reduction_identity(Reduction reduction)
+{
+    switch (reduction)
+    {
+        case REDUCE_MIN:
+            return std::numeric_limits<A>::has_infinity ? std::numeric_limits<A>::infinity() : std::numeric_limits<A>::max();
+        case REDUCE_MAX:
+            return std::numeric_limits<A>::has_infinity ? -std::numeric_limits<A>::infinity() : std::numeric_limits<A>::lowest();
+        default:
+            return A(0);
+    }
+}
+
+template <typename A>
+A reduction_combine(Reduction reduction, A a, A b)
+{
+    switch (reduction)
+    {
+        case REDUCE_MIN: return b < a ? b : a;
+        case REDUCE_MAX: return a < b ? b : a;
+        default: return a + b;
+    }
+}
+
+/* Evaluates expressions on one device: generates, builds and caches the fused kernels
+ * and launches them. Device memory of the vectors and of the partial results of the
+ * reductions comes from a BufferPool. */
+class ExpressionEngine
+{
+
+    private:
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    std::shared_ptr<BufferPool> pool;
+    /* Kernels by generated source */
+    std::map<std::string, cl::Kernel> kernels;
+    /* Partial results of the work-groups of the last reduction */
+    PooledBuffer partials;
+    size_t compute_units;
+
+    cl::Kernel& get_kernel(const std::string& source, const char* name)
+    {
+        auto it = kernels.find(source);
+        if (it == kernels.end())
+        {
+            cl::Program program = build_program(context, device, source);
+            it = kernels.insert(std::make_pair(source, cl::Kernel(program, name))).first;
+        }
+        return it->second;
+    }
+
+    /* Work-group size: a power of two, as the reduction kernel needs */
+    size_t local_size(cl::Kernel& kernel)
+    {
+        size_t limit = std::min<size_t>(256, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+        size_t local = 1;
+        while (local * 2 <= limit)
+            local *= 2;
+        return local;
+    }
+
+    void init()
+    {
+        pool = std::make_shared<BufferPool>(context, device);
+        compute_units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    }
+
+    public:
+    ExpressionEngine(cl::Device device) : context(std::vector<cl::Device>(1, device)), device(device)
+    {
+        queue = cl::CommandQueue(context, device);
+        init();
+    }
+
+    ExpressionEngine(cl::Context context, cl::Device device, cl::CommandQueue queue) :
+        context(context), device(device), queue(queue)
+    {
+        init();
+    }
+
+    /* OpenCL source of the kernel storing value, generated by builder, into out */
+    template <typename T>
+    std::string elementwise_source(KernelBuilder& builder, const std::string& value, const DeviceVector<T>& out)
+    {
+        if (builder.size() != out.size())
+        {
+            std::cerr << "DeviceVector: cannot store an expression of " << builder.size() << " elements into "
+                      << out.size() << " elements" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::string store = builder.output(out, value);
+        return "void kernel fused_elementwise(" + builder.parameter_list() + "const uint count)\n"
+               "{\n"
+               "    uint i = get_global_id(0);\n"
+               "    if (i >= count)\n"
+               "    {\n"
+               "        return;\n"
+               "    }\n"
+               "    " + store + ";\n"
+               "}\n";
+    }
+
+    /* Enqueue the evaluation of the expression generated by builder (value) into out, in
+     * one kernel. out may be one of the operands: every element is read before being
+     * written by the same work-item. */
+    template <typename T>
+    void enqueue_assign(KernelBuilder& builder, const std::string& value, DeviceVector<T>& out)
+    {
+        std::string source = elementwise_source(builder, value, out);
+        if (out.size() == 0)
+            return;
+        cl::Kernel& kernel = get_kernel(source, "fused_elementwise");
+        cl_uint index = builder.set_arguments(kernel);
+        kernel.setArg(index, (cl_uint) out.size());
+        size_t local = local_size(kernel);
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(round_up(out.size(), local)), cl::NDRange(local));
+    }
+
+    template <typename T, typename E>
+    void enqueue_assign(DeviceVector<T>& out, const Expression<E>& expression)
+    {
+        KernelBuilder builder;
+        std::string value = expression.self().generate(builder);
+        enqueue_assign(builder, value, out);
+    }
+
+    /* OpenCL source of the kernel reducing value, generated by builder: each work-group
+     * writes one partial result, combined on the host */
+    template <typename A>
+    std::string reduction_source(KernelBuilder& builder, Reduction reduction, const std::string& value)
+    {
+        std::string type = AccumulatorTraits<A>::name();
+        std::string identity = reduction == REDUCE_MIN ? AccumulatorTraits<A>::highest()
+                             : reduction == REDUCE_MAX ? AccumulatorTraits<A>::lowest() : "0";
+        auto combine = [reduction](const std::string& a, const std::string& b)
+        {
+            return reduction == REDUCE_MIN ? "min(" + a + ", " + b + ")"
+                 : reduction == REDUCE_MAX ? "max(" + a + ", " + b + ")" : a + " + " + b;
+        };
+        return "void kernel fused_reduction(" + builder.parameter_list() + "const uint count,\n"
+               "                global " + type + "* partials,\n"
+               "                local " + type + "* scratch)\n"
+               "{\n"
+               "    " + type + " accumulator = " + identity + ";\n"
+               "    for (uint i = get_global_id(0); i < count; i += get_global_size(0))\n"
+               "    {\n"
+               "        accumulator = " + combine("accumulator", "(" + type + ")" + value) + ";\n"
+               "    }\n"
+               "    uint lid = get_local_id(0);\n"
+               "    scratch[lid] = accumulator;\n"
+               "    for (uint s = get_local_size(0) / 2; s > 0; s >>= 1)\n"
+               "    {\n"
+               "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+               "        if (lid < s)\n"
+               "        {\n"
+               "            scratch[lid] = " + combine("scratch[lid]", "scratch[lid + s]") + ";\n"
+               "        }\n"
+               "    }\n"
+               "    if (lid == 0)\n"
+               "    {\n"
+               "        partials[get_group_id(0)] = scratch[0];\n"
+               "    }\n"
+               "}\n";
+    }
+
+    /* Reduce the expression generated by builder (value) with accumulator type A. Blocks
+     * until the result is known. */
+    template <typename A>
+    A reduce(KernelBuilder& builder, Reduction reduction, const std::string& value)
+    {
+        std::string source = reduction_source<A>(builder, reduction, value);
+        size_t count = builder.size();
+        A result = reduction_identity<A>(reduction);
+        if (count == 0)
+            return result;
+
+        cl::Kernel& kernel = get_kernel(source, "fused_reduction");
+        size_t local = local_size(kernel);
+        /* A few work-groups per compute unit, each work-item looping over the elements */
+        size_t groups = std::max<size_t>(1, std::min(4 * compute_units, (count + local - 1) / local));
+        if (partials.capacity() < groups * sizeof(A))
+        {
+            queue.finish();
+            partials = pool->acquire(groups * sizeof(A));
+        }
+        cl_uint index = builder.set_arguments(kernel);
+        kernel.setArg(index, (cl_uint) count);
+        kernel.setArg(index + 1, partials.buffer());
+        kernel.setArg(index + 2, cl::Local(local * sizeof(A)));
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(groups * local), cl::NDRange(local));
+
+        std::vector<A> values(groups);
+        queue.enqueueReadBuffer(partials.buffer(), CL_TRUE, 0, groups * sizeof(A), values.data());
+        for (A value : values)
+            result = reduction_combine(reduction, result, value);
+        return result;
+    }
+
+    /* Kernels generated so far */
+    size_t kernel_count() const { return kernels.size(); }
+
+    /* Take device memory from pool, which must have been created for the context of the engine */
+    void set_buffer_pool(std::shared_ptr<BufferPool> pool)
+    {
+        queue.finish();
+        partials.release();
+        this->pool = pool;
+    }
+
+    std::shared_ptr<BufferPool> get_buffer_pool() { return pool; }
+    cl::CommandQueue& get_queue() { return queue; }
+
+};
+
+/* Vector of count elements of type T (cl_int, cl_float or Half) in device memory */
+template <typename T>
+class DeviceVector : public Expression<DeviceVector<T>>
+{
+
+    private:
+    ExpressionEngine* engine;
+    size_t count;
+    PooledBuffer storage;
+
+    void allocate(size_t size)
+    {
+        count = size;
+        storage = engine->get_buffer_pool()->acquire(std::max<size_t>(1, count) * sizeof(T));
+    }
+
+    public:
+    typedef typename ElementTraits<T>::compute_type value_type;
+
+    DeviceVector(ExpressionEngine& engine, size_t count) : engine(&engine)
+    {
+        allocate(count);
+    }
+
+    DeviceVector(ExpressionEngine& engine, const std::vector<T>& values) : engine(&engine)
+    {
+        allocate(values.size());
+        write(values);
+    }
+
+    /* Evaluate expression into a new vector */
+    template <typename E>
+    DeviceVector(const Expression<E>& expression) : engine(NULL)
+    {
+        KernelBuilder builder;
+        std::string value = expression.self().generate(builder);
+        engine = builder.engine();
+        allocate(builder.size());
+        engine->enqueue_assign(builder, value, *this);
+    }
+
+    /* Copies are made on the device */
+    DeviceVector(const DeviceVector& other) : engine(other.engine)
+    {
+        allocate(other.count);
+        engine->enqueue_assign(*this, other);
+    }
+
+    DeviceVector(DeviceVector&& other) = default;
+    DeviceVector& operator=(DeviceVector&& other) = default;
+
+    /* Evaluate expression into this vector, resized to the size of the expression */
+    template <typename E>
+    DeviceVector& operator=(const Expression<E>& expression)
+    {
+        KernelBuilder builder;
+        std::string value = expression.self().generate(builder);
+        if (builder.size() != count)
+        {
+            /* This vector is then not an operand of the expression */
+            engine->get_queue().finish();
+            allocate(builder.size());
+        }
+        engine->enqueue_assign(builder, value, *this);
+        return *this;
+    }
+
+    DeviceVector& operator=(const DeviceVector& other)
+    {
+        if (&other != this)
+            *this = static_cast<const Expression<DeviceVector>&>(other);
+        return *this;
+    }
+
+    std::string generate(KernelBuilder& builder) const { return builder.input(*this); }
+
+    size_t size() const { return count; }
+    const cl::Buffer& buffer() const { return storage.buffer(); }
+    ExpressionEngine& get_engine() const { return *engine; }
+
+    /* Copy values, of size() elements, to the device */
+    void write(const std::vector<T>& values, cl_bool blocking = CL_TRUE)
+    {
+        if (values.size() != count)
+        {
+            std::cerr << "DeviceVector: cannot write " << values.size() << " values into " << count << " elements" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (count > 0)
+            engine->get_queue().enqueueWriteBuffer(storage.buffer(), blocking, 0, count * sizeof(T), values.data());
+    }
+
+    /* Copy the elements back to the host, after the commands enqueued before */
+    std::vector<T> read()
+    {
+        std::vector<T> values(count);
+        if (count > 0)
+            engine->get_queue().enqueueReadBuffer(storage.buffer(), CL_TRUE, 0, count * sizeof(T), values.data());
+        return values;
+    }
+
+};
+
+/* Operators and functions on expressions, and on an expression and a scalar */
+#define EXPRESSION_BINARY(FUNCTION, OPERATION) \
+template <typename L, typename R> \
+BinaryExpression<OPERATION, L, R> FUNCTION(const Expression<L>& left, const Expression<R>& right) \
+{ \
+    return BinaryExpression<OPERATION, L, R>(left.self(), right.self()); \
+} \
+template <typename L, typename S, typename = typename std::enable_if<std::is_arithmetic<S>::value>::type> \
+BinaryExpression<OPERATION, L, ScalarExpression<typename ScalarType<S>::type>> FUNCTION(const Expression<L>& left, S right) \
+{ \
+    typedef ScalarExpression<typename ScalarType<S>::type> Scalar; \
+    return BinaryExpression<OPERATION, L, Scalar>(left.self(), Scalar(right)); \
+} \
+template <typename S, typename R, typename = typename std::enable_if<std::is_arithmetic<S>::value>::type> \
+BinaryExpression<OPERATION, ScalarExpression<typename ScalarType<S>::type>, R> FUNCTION(S left, const Expression<R>& right) \
+{ \
+    typedef ScalarExpression<typename ScalarType<S>::type> Scalar; \
+    return BinaryExpression<OPERATION, Scalar, R>(Scalar(left), right.self()); \
+}
+
+EXPRESSION_BINARY(operator+, AddOperation)
+EXPRESSION_BINARY(operator-, SubtractOperation)
+EXPRESSION_BINARY(operator*, MultiplyOperation)
+EXPRESSION_BINARY(operator/, DivideOperation)
+/* Elementwise minimum and maximum */
+EXPRESSION_BINARY(min, MinOperation)
+EXPRESSION_BINARY(max, MaxOperation)
+#undef EXPRESSION_BINARY
+
+template <typename E>
+UnaryExpression<NegateOperation, E> operator-(const Expression<E>& operand)
+{
+    return UnaryExpression<NegateOperation, E>(operand.self());
+}
+
+template <typename E>
+UnaryExpression<SqrtOperation, E> sqrt(const Expression<E>& operand)
+{
+    return UnaryExpression<SqrtOperation, E>(operand.self());
+}
+
+/* Reduce expression on the engine of its vectors, with accumulator type A */
+template <typename A, typename E>
+A reduce_expression(Reduction reduction, const Expression<E>& expression)
+{
+    KernelBuilder builder;
+    std::string value = expression.self().generate(builder);
+    return builder.engine()->template reduce<A>(builder, reduction, value);
+}
+
+/* Reductions of an expression over all its elements, in one kernel. Sums of ints are
+ * 64 bit, but the elements summed are computed as ints: dot() of int vectors
+ * overflows as the C++ products would. */
+template <typename E>
+typename ReductionType<typename E::value_type, REDUCE_SUM>::type sum(const Expression<E>& expression)
+{
+    typedef typename ReductionType<typename E::value_type, REDUCE_SUM>::type Accumulator;
+    return reduce_expression<Accumulator>(REDUCE_SUM, expression);
+}
+
+template <typename E>
+typename E::value_type min(const Expression<E>& expression)
+{
+    return reduce_expression<typename E::value_type>(REDUCE_MIN, expression);
+}
+
+template <typename E>
+typename E::value_type max(const Expression<E>& expression)
+{
+    return reduce_expression<typename E::value_type>(REDUCE_MAX, expression);
+}
+
+template <typename L, typename R>
+typename ReductionType<typename PromotedType<typename L::value_type, typename R::value_type>::type, REDUCE_SUM>::type
+dot(const Expression<L>& left, const Expression<R>& right)
+{
+    return sum(left * right);
+}
+
+#endif
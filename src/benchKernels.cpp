@@ -0,0 +1,649 @@
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+
+#include "opencl_utils.hpp"
+#include "convolution_engine.hpp"
+#include "masks.hpp"
+#include "host_buffer.hpp"
+#include "image_batch.hpp"
+#include "image_engine.hpp"
+#include "cpu_backend.hpp"
+#include "fft_convolution.hpp"
+#include "integral_image.hpp"
+#include "benchmark.hpp"
+
+/* Deterministic pseudo-random image, so that runs are comparable without input files */
+std::vector<unsigned char> synthetic_image(size_t width, size_t height, size_t channels)
+{
+    std::vector<unsigned char> pixels(width * height * channels);
+    unsigned int state = 12345;
+    for (auto &p : pixels)
+    {
+        state = state * 1103515245u + 12345u;
+        p = (unsigned char) (state >> 16);
+    }
+    return pixels;
+}
+
+/* Largest difference between two images of the same size */
+int max_difference(const std::vector<unsigned char>& a, const std::vector<unsigned char>& b)
+{
+    int difference = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+        difference = std::max(difference, std::abs((int) a[i] - (int) b[i]));
+    return difference;
+}
+
+std::vector<size_t> parse_sizes(const std::string& list)
+{
+    std::vector<size_t> sizes;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        size_t size = std::atoi(item.c_str());
+        if (size > 0)
+            sizes.push_back(size);
+    }
+    return sizes;
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkReport report;
+    report.parse_options(argc, argv);
+    std::string device_spec = parse_device_option(argc, argv);
+    std::vector<size_t> sizes = parse_sizes(parse_option(argc, argv, "--sizes", "512,1024,2048"));
+    std::vector<size_t> thumbnail_sizes = parse_sizes(parse_option(argc, argv, "--thumbnails", "64,128,256"));
+    size_t batch_images = std::max(1, std::atoi(parse_option(argc, argv, "--batch", "1024").c_str()));
+    std::vector<size_t> large_masks = parse_sizes(parse_option(argc, argv, "--large-masks", "15,31,63"));
+    std::vector<size_t> box_radii = parse_sizes(parse_option(argc, argv, "--box-radii", "2,7,15"));
+    TransferMode transfer = parse_transfer_mode(argc, argv);
+    std::string build_options = parse_option(argc, argv, "--build-options", "");
+    bool tune = parse_flag(argc, argv, "--tune");
+    if (argc != 1 || sizes.empty())
+    {
+        std::cerr << "Usage: " << argv[0] << " [--device spec] [--sizes 512,1024,...] [--thumbnails 64,128,...] [--batch N] [--large-masks 15,31,...] [--box-radii 2,7,...] [--transfer copy|map] [--build-options opts] [--tune] " << BenchmarkReport::usage() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    cl::Device device = select_device(device_spec);
+    ConvolutionEngine engine(device, "../src/kernelConv.cl", build_options);
+    /* Engine work-group sizes from the tuning file; with --tune, missing ones are measured
+     * during the warm-up runs */
+    Autotuner tuner(device);
+    tuner.set_sweep(tune);
+    engine.set_autotuner(&tuner);
+    cl::Context& context = engine.get_context();
+    cl::CommandQueue& queue = engine.get_queue();
+    /* Every buffer comes from the pool of the engine, so that the sizes recycle each other's memory */
+    BufferPool& pool = *engine.get_buffer_pool();
+    cl::Program copyProgram = load_and_build_program(context, device, "../src/kernelCopy.cl", vector_build_options(device));
+    cl::Kernel copyKernel(copyProgram, "copy_buff");
+    cl::Kernel copyVecKernel(copyProgram, "copy_buff_vec");
+    size_t vector_width = char_vector_width(device);
+
+    /* Image object backend, on the same queue so that both paths are timed alike */
+    std::unique_ptr<ImageEngine> imageEngine;
+    /* Native baseline */
+    CpuEngine cpuEngine;
+    if (has_image_support(device))
+        imageEngine.reset(new ImageEngine(context, device, queue));
+
+    size_t k_width = 5;
+    size_t k_height = 5;
+    float kernel[k_width * k_height] {
+         3,   1, -1,  1,  3,
+         1,  -2, -2, -2,  1,
+        -1,  -2, -3, -2, -1,
+         1,  -2, -2, -2,  1,
+         3,   1, -1,  1,  3
+    };
+    float* gaussian = create_gaussian_kernel(0.8, k_width);
+    size_t se_size = 3;
+    int structuring_element[se_size * se_size] {
+        1, 1, 1,
+        1, 1, 1,
+        1, 1, 1
+    };
+
+    DeviceMask mask;
+    DeviceMask gaussian_mask;
+    DeviceStructuringElement se;
+    engine.prepare_mask(mask, kernel, k_width, k_height);
+    engine.prepare_mask(gaussian_mask, gaussian, k_width, k_height);
+    engine.prepare_structuring_element(se, structuring_element, se_size);
+    delete[] gaussian;
+
+    /* Checks of the results of the kernels that failed */
+    size_t mismatches = 0;
+    std::cout << "# Kernel benchmarks on " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+    for (size_t size : sizes)
+    {
+        size_t pixels = size * size;
+        std::string suffix = "/" + std::to_string(size) + "x" + std::to_string(size);
+
+        /* RGBA copy */
+        std::vector<unsigned char> rgba = synthetic_image(size, size, 4);
+        PooledBuffer rgba_in = pool.acquire(rgba.size(), CL_MEM_READ_ONLY);
+        PooledBuffer rgba_out = pool.acquire(rgba.size(), CL_MEM_WRITE_ONLY);
+        queue.enqueueWriteBuffer(rgba_in.buffer(), CL_FALSE, 0, rgba.size(), rgba.data());
+        copyKernel.setArg(0, rgba_in.buffer());
+        copyKernel.setArg(1, (cl_uint) size);
+        copyKernel.setArg(2, (cl_uint) size);
+        copyKernel.setArg(3, rgba_out.buffer());
+        report.run("copy_buff" + suffix, [&]()
+        {
+            queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, cl::NDRange(size, size, 4), cl::NullRange);
+            queue.finish();
+        }, 2.0 * rgba.size());
+
+        copyVecKernel.setArg(0, rgba_in.buffer());
+        copyVecKernel.setArg(1, (cl_uint) rgba.size());
+        copyVecKernel.setArg(2, rgba_out.buffer());
+        report.run("copy_buff_vec" + std::to_string(vector_width) + suffix, [&]()
+        {
+            queue.enqueueNDRangeKernel(copyVecKernel, cl::NullRange, cl::NDRange((rgba.size() + vector_width - 1) / vector_width), cl::NullRange);
+            queue.finish();
+        }, 2.0 * rgba.size());
+
+        PooledBuffer rgba_conv_out = pool.acquire(rgba.size());
+        report.run("rgba_conv5x5" + suffix, [&]()
+        {
+            engine.enqueue_rgba_convolution(mask, rgba_in.buffer(), rgba_conv_out.buffer(), size, size);
+            queue.finish();
+        }, 2.0 * rgba.size(), 2.0 * k_width * k_height * rgba.size());
+
+        /* Gray convolutions and erosion */
+        std::vector<unsigned char> gray = synthetic_image(size, size, 1);
+        PooledBuffer gray_in = pool.acquire(gray.size(), CL_MEM_READ_ONLY);
+        PooledBuffer gray_out = pool.acquire(gray.size());
+        queue.enqueueWriteBuffer(gray_in.buffer(), CL_TRUE, 0, gray.size(), gray.data());
+
+        /* Buffer creation by the driver against a recycled block, both touched by a one
+         * byte write so that lazy allocators commit the memory */
+        report.run("alloc_driver" + suffix, [&]()
+        {
+            cl::Buffer buffer(context, CL_MEM_READ_WRITE, gray.size());
+            queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, 1, gray.data());
+        });
+        report.run("alloc_pool" + suffix, [&]()
+        {
+            PooledBuffer buffer = pool.acquire(gray.size());
+            queue.enqueueWriteBuffer(buffer.buffer(), CL_TRUE, 0, 1, gray.data());
+        });
+
+        /* Direct kernel from the generic program (sizes as arguments) and from the program
+         * specialized for 5x5 masks (sizes as constants, loops unrolled) */
+        const std::string conv_variants[][2] = {{"generic", ""}, {"unrolled", engine.mask_definitions(mask)}};
+        for (auto &variant : conv_variants)
+        {
+            if (variant[0] != "generic" && variant[1].empty())
+                continue;
+            cl::Kernel& directKernel = engine.get_kernel("gray_conv_buff", variant[1]);
+            directKernel.setArg(0, gray_in.buffer());
+            directKernel.setArg(1, (cl_uint) size);
+            directKernel.setArg(2, (cl_uint) size);
+            directKernel.setArg(3, mask.buffer);
+            directKernel.setArg(4, (cl_uint) k_width);
+            directKernel.setArg(5, (cl_uint) k_height);
+            directKernel.setArg(6, gray_out.buffer());
+            report.run("conv5x5_" + variant[0] + suffix, [&]()
+            {
+                queue.enqueueNDRangeKernel(directKernel, cl::NullRange, cl::NDRange(size, size), cl::NullRange);
+                queue.finish();
+            }, 2.0 * pixels, 2.0 * k_width * k_height * pixels);
+        }
+
+        report.run("conv5x5" + suffix, [&]()
+        {
+            engine.enqueue_convolution(mask, gray_in.buffer(), gray_out.buffer(), size, size);
+            queue.finish();
+        }, 2.0 * pixels, 2.0 * k_width * k_height * pixels);
+
+        /* Flops of the direct 2D convolution, so that the separable speed-up shows in GFLOP/s */
+        report.run("gauss5x5" + suffix, [&]()
+        {
+            engine.enqueue_convolution(gaussian_mask, gray_in.buffer(), gray_out.buffer(), size, size);
+            queue.finish();
+        }, 2.0 * pixels, 2.0 * k_width * k_height * pixels);
+
+        report.run("erode3x3" + suffix, [&]()
+        {
+            engine.enqueue_erosion(se, gray_in.buffer(), gray_out.buffer(), size, size);
+            queue.finish();
+        }, 2.0 * pixels, 1.0 * se_size * se_size * pixels);
+
+        cl::Kernel& genericErodeKernel = engine.get_kernel("erode");
+        genericErodeKernel.setArg(0, gray_in.buffer());
+        genericErodeKernel.setArg(1, (cl_uint) size);
+        genericErodeKernel.setArg(2, (cl_uint) size);
+        genericErodeKernel.setArg(3, se.buffer);
+        genericErodeKernel.setArg(4, (cl_uint) se_size);
+        genericErodeKernel.setArg(5, gray_out.buffer());
+        report.run("erode3x3_generic" + suffix, [&]()
+        {
+            queue.enqueueNDRangeKernel(genericErodeKernel, cl::NullRange, cl::NDRange(size, size), cl::NullRange);
+            queue.finish();
+        }, 2.0 * pixels, 1.0 * se_size * se_size * pixels);
+
+        /* Same kernels through image objects and samplers */
+        if (imageEngine)
+        {
+            cl::Image2D image_in(context, CL_MEM_READ_ONLY, gray_image_format(), size, size);
+            cl::Image2D image_out(context, CL_MEM_WRITE_ONLY, gray_image_format(), size, size);
+            imageEngine->enqueue_upload(image_in, gray.data(), size, size);
+            queue.finish();
+
+            report.run("conv5x5_image" + suffix, [&]()
+            {
+                imageEngine->enqueue_convolution(mask, image_in, image_out, size, size);
+                queue.finish();
+            }, 2.0 * pixels, 2.0 * k_width * k_height * pixels);
+
+            report.run("erode3x3_image" + suffix, [&]()
+            {
+                imageEngine->enqueue_erosion(se, image_in, image_out, size, size);
+                queue.finish();
+            }, 2.0 * pixels, 1.0 * se_size * se_size * pixels);
+
+            /* The samplers and the border skipping must give the results of the buffer kernels */
+            std::vector<unsigned char> image_result(pixels);
+            std::vector<unsigned char> buffer_result(pixels);
+            const char* names[] = {"conv5x5", "erode3x3"};
+            for (int op = 0; op < 2; ++op)
+            {
+                if (op == 0)
+                {
+                    imageEngine->enqueue_convolution(mask, image_in, image_out, size, size);
+                    engine.enqueue_convolution(mask, gray_in.buffer(), gray_out.buffer(), size, size);
+                }
+                else
+                {
+                    imageEngine->enqueue_erosion(se, image_in, image_out, size, size);
+                    engine.enqueue_erosion(se, gray_in.buffer(), gray_out.buffer(), size, size);
+                }
+                imageEngine->download(image_out, image_result.data(), size, size);
+                queue.enqueueReadBuffer(gray_out.buffer(), CL_TRUE, 0, pixels, buffer_result.data());
+                if (max_difference(image_result, buffer_result) != 0)
+                {
+                    std::cerr << names[op] << "_image" << suffix << ": image objects and buffers disagree" << std::endl;
+                    ++mismatches;
+                }
+            }
+        }
+
+        /* Same operations with the CPU backend, for the speed-up numbers */
+        std::vector<unsigned char> cpu_rgba_out(rgba.size());
+        std::vector<unsigned char> cpu_gray_out(gray.size());
+        report.run("copy_cpu" + suffix, [&]()
+        {
+            cpuEngine.copy_bytes(rgba.data(), rgba.size(), cpu_rgba_out.data());
+        }, 2.0 * rgba.size());
+        report.run("rgba_conv5x5_cpu" + suffix, [&]()
+        {
+            cpuEngine.convolve_image(kernel, k_width, k_height, rgba.data(), size, size, 4, cpu_rgba_out.data());
+        }, 2.0 * rgba.size(), 2.0 * k_width * k_height * rgba.size());
+        report.run("conv5x5_cpu" + suffix, [&]()
+        {
+            cpuEngine.convolve_image(kernel, k_width, k_height, gray.data(), size, size, 1, cpu_gray_out.data());
+        }, 2.0 * pixels, 2.0 * k_width * k_height * pixels);
+        report.run("erode3x3_cpu" + suffix, [&]()
+        {
+            cpuEngine.erode_image(structuring_element, se_size, gray.data(), size, size, cpu_gray_out.data());
+        }, 2.0 * pixels, 1.0 * se_size * se_size * pixels);
+
+        /* The CPU backend must give the results of the kernels: the 5x5 mask sums to -3, so
+         * out of range sums, saturated on both sides, are common */
+        std::vector<unsigned char> device_gray_out(gray.size());
+        cpuEngine.convolve_image(kernel, k_width, k_height, gray.data(), size, size, 1, cpu_gray_out.data());
+        engine.enqueue_convolution(mask, gray_in.buffer(), gray_out.buffer(), size, size);
+        queue.enqueueReadBuffer(gray_out.buffer(), CL_TRUE, 0, gray.size(), device_gray_out.data());
+        size_t conv_differences = 0;
+        for (size_t i = 0; i < gray.size(); ++i)
+            conv_differences += cpu_gray_out[i] != device_gray_out[i];
+        cpuEngine.erode_image(structuring_element, se_size, gray.data(), size, size, cpu_gray_out.data());
+        engine.enqueue_erosion(se, gray_in.buffer(), gray_out.buffer(), size, size);
+        queue.enqueueReadBuffer(gray_out.buffer(), CL_TRUE, 0, gray.size(), device_gray_out.data());
+        size_t erode_differences = 0;
+        for (size_t i = 0; i < gray.size(); ++i)
+            erode_differences += cpu_gray_out[i] != device_gray_out[i];
+        std::cout << "# cpu against opencl" << suffix << ": conv5x5 " << conv_differences
+                  << " pixels differ, erode3x3 " << erode_differences << " pixels differ" << std::endl;
+        if (conv_differences != 0 || erode_differences != 0)
+        {
+            std::cerr << "cpu backend and opencl kernels disagree" << suffix << std::endl;
+            ++mismatches;
+        }
+
+        /* Convolution including the host <-> device transfers */
+        std::string roundtrip = std::string("conv5x5_") + transfer_mode_name(transfer) + suffix;
+        aligned_vector<unsigned char> host_in(gray.begin(), gray.end());
+        aligned_vector<unsigned char> host_out(pixels);
+        if (transfer == TRANSFER_MAP)
+        {
+            HostBuffer mapped_in(context, CL_MEM_READ_ONLY, host_in.data(), pixels);
+            HostBuffer mapped_out(context, CL_MEM_WRITE_ONLY, host_out.data(), pixels);
+            report.run(roundtrip, [&]()
+            {
+                mapped_in.upload(queue, host_in.data(), TRANSFER_MAP);
+                engine.enqueue_convolution(mask, mapped_in.get_buffer(), mapped_out.get_buffer(), size, size);
+                mapped_out.download(queue, host_out.data(), TRANSFER_MAP);
+            }, 2.0 * pixels, 2.0 * k_width * k_height * pixels);
+        }
+        else
+        {
+            report.run(roundtrip, [&]()
+            {
+                queue.enqueueWriteBuffer(gray_in.buffer(), CL_FALSE, 0, pixels, host_in.data());
+                engine.enqueue_convolution(mask, gray_in.buffer(), gray_out.buffer(), size, size);
+                queue.enqueueReadBuffer(gray_out.buffer(), CL_TRUE, 0, pixels, host_out.data());
+            }, 2.0 * pixels, 2.0 * k_width * k_height * pixels);
+        }
+    }
+
+    /* Many small images: one launch per image against one launch per batch */
+    cl::Kernel copyBatchKernel(copyProgram, "copy_buff_batch");
+    for (size_t size : thumbnail_sizes)
+    {
+        /* The blocks of the previous size are of no use to this one */
+        pool.trim();
+        size_t pixels = size * size;
+        std::string suffix = "/" + std::to_string(size) + "x" + std::to_string(size) + "x" + std::to_string(batch_images);
+        std::vector<unsigned char> gray = synthetic_image(size, size, 1);
+        std::vector<unsigned char> rgba = synthetic_image(size, size, 4);
+        ImageBatch gray_batch;
+        ImageBatch rgba_batch;
+        std::vector<PooledBuffer> gray_in, gray_out, rgba_in, rgba_out;
+        for (size_t i = 0; i < batch_images; ++i)
+        {
+            gray_batch.add(i, gray.data(), size, size);
+            rgba_batch.add(i, rgba.data(), size, size, 4);
+            gray_in.push_back(pool.acquire(pixels, CL_MEM_READ_ONLY));
+            gray_out.push_back(pool.acquire(pixels));
+            rgba_in.push_back(pool.acquire(rgba.size(), CL_MEM_READ_ONLY));
+            rgba_out.push_back(pool.acquire(rgba.size(), CL_MEM_WRITE_ONLY));
+            queue.enqueueWriteBuffer(gray_in.back().buffer(), CL_FALSE, 0, pixels, gray.data());
+            queue.enqueueWriteBuffer(rgba_in.back().buffer(), CL_FALSE, 0, rgba.size(), rgba.data());
+        }
+        size_t table_bytes = gray_batch.table().size() * sizeof(cl_uint);
+        PooledBuffer gray_batch_in = pool.acquire(gray_batch.bytes(), CL_MEM_READ_ONLY);
+        PooledBuffer gray_batch_out = pool.acquire(gray_batch.bytes());
+        PooledBuffer gray_table = pool.acquire(table_bytes, CL_MEM_READ_ONLY);
+        PooledBuffer rgba_batch_in = pool.acquire(rgba_batch.bytes(), CL_MEM_READ_ONLY);
+        PooledBuffer rgba_batch_out = pool.acquire(rgba_batch.bytes(), CL_MEM_WRITE_ONLY);
+        PooledBuffer rgba_table = pool.acquire(table_bytes, CL_MEM_READ_ONLY);
+        queue.enqueueWriteBuffer(gray_batch_in.buffer(), CL_FALSE, 0, gray_batch.bytes(), gray_batch.pixels());
+        queue.enqueueWriteBuffer(gray_table.buffer(), CL_FALSE, 0, table_bytes, gray_batch.table().data());
+        queue.enqueueWriteBuffer(rgba_batch_in.buffer(), CL_FALSE, 0, rgba_batch.bytes(), rgba_batch.pixels());
+        queue.enqueueWriteBuffer(rgba_table.buffer(), CL_TRUE, 0, table_bytes, rgba_batch.table().data());
+        double gray_bytes = 2.0 * gray_batch.bytes();
+        double rgba_bytes = 2.0 * rgba_batch.bytes();
+
+        report.run("copy_each" + suffix, [&]()
+        {
+            for (size_t i = 0; i < batch_images; ++i)
+            {
+                copyKernel.setArg(0, rgba_in[i].buffer());
+                copyKernel.setArg(1, (cl_uint) size);
+                copyKernel.setArg(2, (cl_uint) size);
+                copyKernel.setArg(3, rgba_out[i].buffer());
+                queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, cl::NDRange(size, size, 4), cl::NullRange);
+            }
+            queue.finish();
+        }, rgba_bytes);
+        report.run("copy_batch" + suffix, [&]()
+        {
+            enqueue_copy_batch(queue, copyBatchKernel, rgba_batch_in.buffer(), rgba_table.buffer(), rgba_batch_out.buffer(),
+                               batch_images, size, size, 4);
+            queue.finish();
+        }, rgba_bytes);
+
+        report.run("conv5x5_each" + suffix, [&]()
+        {
+            for (size_t i = 0; i < batch_images; ++i)
+                engine.enqueue_convolution(mask, gray_in[i].buffer(), gray_out[i].buffer(), size, size);
+            queue.finish();
+        }, gray_bytes, 2.0 * k_width * k_height * pixels * batch_images);
+        report.run("conv5x5_batch" + suffix, [&]()
+        {
+            engine.enqueue_convolution_batch(mask, gray_batch_in.buffer(), gray_table.buffer(), gray_batch_out.buffer(),
+                                             batch_images, size, size);
+            queue.finish();
+        }, gray_bytes, 2.0 * k_width * k_height * pixels * batch_images);
+
+        report.run("erode3x3_each" + suffix, [&]()
+        {
+            for (size_t i = 0; i < batch_images; ++i)
+                engine.enqueue_erosion(se, gray_in[i].buffer(), gray_out[i].buffer(), size, size);
+            queue.finish();
+        }, gray_bytes, 1.0 * se_size * se_size * pixels * batch_images);
+        report.run("erode3x3_batch" + suffix, [&]()
+        {
+            engine.enqueue_erosion_batch(se, gray_batch_in.buffer(), gray_table.buffer(), gray_batch_out.buffer(),
+                                         batch_images, size, size);
+            queue.finish();
+        }, gray_bytes, 1.0 * se_size * se_size * pixels * batch_images);
+
+        /* Every image of a batch, at its offset, must equal the result of its own launch.
+         * The images of the batch are the same, so one single-image result serves them all. */
+        std::vector<unsigned char> single(rgba.size());
+        std::vector<unsigned char> batched(rgba_batch.bytes());
+        const char* names[] = {"copy", "conv5x5", "erode3x3"};
+        for (int op = 0; op < 3; ++op)
+        {
+            const ImageBatch& batch = op == 0 ? rgba_batch : gray_batch;
+            if (op == 0)
+            {
+                enqueue_copy_batch(queue, copyBatchKernel, rgba_batch_in.buffer(), rgba_table.buffer(), rgba_batch_out.buffer(),
+                                   batch_images, size, size, 4);
+                single = rgba;
+            }
+            else
+            {
+                if (op == 1)
+                {
+                    engine.enqueue_convolution_batch(mask, gray_batch_in.buffer(), gray_table.buffer(), gray_batch_out.buffer(),
+                                                     batch_images, size, size);
+                    engine.enqueue_convolution(mask, gray_in[0].buffer(), gray_out[0].buffer(), size, size);
+                }
+                else
+                {
+                    engine.enqueue_erosion_batch(se, gray_batch_in.buffer(), gray_table.buffer(), gray_batch_out.buffer(),
+                                                 batch_images, size, size);
+                    engine.enqueue_erosion(se, gray_in[0].buffer(), gray_out[0].buffer(), size, size);
+                }
+                single.resize(pixels);
+                queue.enqueueReadBuffer(gray_out[0].buffer(), CL_FALSE, 0, pixels, single.data());
+            }
+            const cl::Buffer& out = op == 0 ? rgba_batch_out.buffer() : gray_batch_out.buffer();
+            queue.enqueueReadBuffer(out, CL_TRUE, 0, batch.bytes(), batched.data());
+            size_t wrong_images = 0;
+            for (size_t k = 0; k < batch.size(); ++k)
+                wrong_images += std::memcmp(batched.data() + batch.offset(k), single.data(), single.size()) != 0;
+            if (wrong_images != 0)
+            {
+                std::cerr << names[op] << "_batch" << suffix << ": " << wrong_images << " images differ from their own launch" << std::endl;
+                ++mismatches;
+            }
+        }
+
+        /* Whole round trip of a batch: upload, kernel and download */
+        std::vector<unsigned char> batch_result(gray_batch.bytes());
+        report.run("conv5x5_batch_roundtrip" + suffix, [&]()
+        {
+            engine.convolve_batch(kernel, k_width, k_height, gray_batch, batch_result.data());
+        }, gray_bytes, 2.0 * k_width * k_height * pixels * batch_images);
+    }
+
+    /* Large masks on the smallest size: direct kernels, FFT, and the choice of the dispatcher */
+    if (!large_masks.empty())
+    {
+        size_t size = *std::min_element(sizes.begin(), sizes.end());
+        size_t pixels = size * size;
+        std::string suffix = "/" + std::to_string(size) + "x" + std::to_string(size);
+        ConvolutionDispatcher dispatcher(engine);
+        dispatcher.calibrate();
+        dispatcher.report(std::cout);
+        std::vector<unsigned char> gray = synthetic_image(size, size, 1);
+        PooledBuffer gray_in = pool.acquire(pixels, CL_MEM_READ_ONLY);
+        PooledBuffer direct_out = pool.acquire(pixels);
+        PooledBuffer fft_out = pool.acquire(pixels);
+        PooledBuffer auto_out = pool.acquire(pixels);
+        queue.enqueueWriteBuffer(gray_in.buffer(), CL_TRUE, 0, pixels, gray.data());
+        for (size_t side : large_masks)
+        {
+            std::string name = "conv" + std::to_string(side) + "x" + std::to_string(side);
+            /* Pseudo-random weights: a gaussian would be separable, and never run by the dense kernels */
+            std::vector<float> values(side * side);
+            unsigned int state = 54321;
+            for (auto &v : values)
+            {
+                state = state * 1103515245u + 12345u;
+                v = 1.0f + (state >> 16) % 255;
+            }
+            DeviceMask large_mask;
+            engine.prepare_mask(large_mask, values.data(), side, side);
+            double flops = 2.0 * side * side * pixels;
+
+            const ConvolutionMethod methods[] = {CONVOLUTION_DIRECT, CONVOLUTION_FFT, CONVOLUTION_AUTO};
+            const cl::Buffer* outs[] = {&direct_out.buffer(), &fft_out.buffer(), &auto_out.buffer()};
+            for (int m = 0; m < 3; ++m)
+            {
+                dispatcher.set_method(methods[m]);
+                /* Rows carry the method which actually runs, e.g. conv31x31_auto-fft */
+                std::string label = convolution_method_name(methods[m]);
+                ConvolutionMethod chosen = dispatcher.choose(large_mask, size, size);
+                if (chosen != methods[m])
+                    label += std::string("-") + convolution_method_name(chosen);
+                const cl::Buffer& out = *outs[m];
+                report.run(name + "_" + label + suffix, [&]()
+                {
+                    dispatcher.enqueue_convolution(large_mask, gray_in.buffer(), out, size, size);
+                    queue.finish();
+                }, 2.0 * pixels, flops);
+            }
+            dispatcher.set_method(CONVOLUTION_AUTO);
+
+            std::vector<unsigned char> direct_result(pixels);
+            std::vector<unsigned char> fft_result(pixels);
+            std::vector<unsigned char> auto_result(pixels);
+            queue.enqueueReadBuffer(direct_out.buffer(), CL_FALSE, 0, pixels, direct_result.data());
+            queue.enqueueReadBuffer(fft_out.buffer(), CL_FALSE, 0, pixels, fft_result.data());
+            queue.enqueueReadBuffer(auto_out.buffer(), CL_TRUE, 0, pixels, auto_result.data());
+            ConvolutionMethod picked = dispatcher.choose(large_mask, size, size);
+            int difference = max_difference(direct_result, fft_result);
+            std::cout << "# " << name << suffix << ": auto picks " << convolution_method_name(picked)
+                      << ", FFT within " << difference << " gray levels of the direct kernels" << std::endl;
+            /* The FFT rounds differently from the direct kernels by at most one gray level */
+            if (difference > 1)
+            {
+                std::cerr << name << suffix << ": the FFT differs from the direct kernels by " << difference << " gray levels" << std::endl;
+                ++mismatches;
+            }
+            /* auto must give the output of the method it picked; the mask is not separable,
+             * so only the direct kernels or the FFT may run */
+            const std::vector<unsigned char>& picked_result = picked == CONVOLUTION_FFT ? fft_result : direct_result;
+            if (max_difference(auto_result, picked_result) != 0)
+            {
+                std::cerr << name << suffix << ": auto differs from the " << convolution_method_name(picked) << " method it picked" << std::endl;
+                ++mismatches;
+            }
+        }
+    }
+
+    /* Summed area tables, and box filters through them against convolutions by box masks */
+    IntegralImageEngine integral(context, device, queue);
+    integral.set_buffer_pool(engine.get_buffer_pool());
+    for (size_t size : sizes)
+    {
+        size_t pixels = size * size;
+        std::string suffix = "/" + std::to_string(size) + "x" + std::to_string(size);
+        std::vector<unsigned char> gray = synthetic_image(size, size, 1);
+        PooledBuffer gray_in = pool.acquire(pixels, CL_MEM_READ_ONLY);
+        PooledBuffer sat_out = pool.acquire(pixels * sat_element_size(SAT_ULONG));
+        PooledBuffer box_out = pool.acquire(pixels);
+        PooledBuffer conv_out = pool.acquire(pixels);
+        queue.enqueueWriteBuffer(gray_in.buffer(), CL_TRUE, 0, pixels, gray.data());
+
+        report.run("sat_uchar" + suffix, [&]()
+        {
+            integral.enqueue_integral(gray_in.buffer(), false, false, sat_out.buffer(), size, size);
+            queue.finish();
+        }, (1.0 + sat_element_size(SAT_ULONG)) * pixels);
+
+        /* Rows longer than a scan block go through the block sums: check the whole table */
+        std::vector<cl_ulong> table(pixels);
+        queue.enqueueReadBuffer(sat_out.buffer(), CL_TRUE, 0, pixels * sizeof(cl_ulong), table.data());
+        std::vector<cl_ulong> column_sums(size, 0);
+        size_t wrong_sums = 0;
+        for (size_t y = 0; y < size; ++y)
+        {
+            cl_ulong row_sum = 0;
+            for (size_t x = 0; x < size; ++x)
+            {
+                row_sum += gray[y * size + x];
+                column_sums[x] += row_sum;
+                wrong_sums += table[y * size + x] != column_sums[x];
+            }
+        }
+        if (wrong_sums != 0)
+        {
+            std::cerr << "sat_uchar" << suffix << ": " << wrong_sums << " sums differ from the host prefix sums" << std::endl;
+            ++mismatches;
+        }
+
+        for (size_t radius : box_radii)
+        {
+            size_t side = 2 * radius + 1;
+            std::string name = "box" + std::to_string(side) + "x" + std::to_string(side);
+            float* box = create_box_kernel(side, side);
+            DeviceMask box_mask;
+            engine.prepare_mask(box_mask, box, side, side);
+            delete[] box;
+
+            report.run(name + "_sat" + suffix, [&]()
+            {
+                integral.enqueue_box_filter(gray_in.buffer(), box_out.buffer(), size, size, radius, radius);
+                queue.finish();
+            }, 2.0 * pixels);
+            report.run(name + "_conv" + suffix, [&]()
+            {
+                engine.enqueue_convolution(box_mask, gray_in.buffer(), conv_out.buffer(), size, size);
+                queue.finish();
+            }, 2.0 * pixels, 2.0 * side * side * pixels);
+
+            /* The dense kernels sum the integer weights exactly and floor the mean as box_filter
+             * does (the separable passes round their row means), so both must agree exactly */
+            engine.enqueue_dense_convolution(box_mask, gray_in.buffer(), conv_out.buffer(), size, size);
+            std::vector<unsigned char> box_result(pixels);
+            std::vector<unsigned char> conv_result(pixels);
+            queue.enqueueReadBuffer(box_out.buffer(), CL_FALSE, 0, pixels, box_result.data());
+            queue.enqueueReadBuffer(conv_out.buffer(), CL_TRUE, 0, pixels, conv_result.data());
+            int difference = max_difference(box_result, conv_result);
+            std::cout << "# " << name << suffix << ": summed area table within " << difference
+                      << " gray levels of the convolution" << std::endl;
+            if (difference != 0)
+            {
+                std::cerr << name << suffix << ": the summed area table and the convolution disagree" << std::endl;
+                ++mismatches;
+            }
+        }
+
+        report.run("adaptive_threshold15x15" + suffix, [&]()
+        {
+            integral.enqueue_adaptive_threshold(gray_in.buffer(), box_out.buffer(), size, size, 7, 7, 5.0f);
+            queue.finish();
+        }, 2.0 * pixels);
+    }
+    pool.report(std::cerr);
+    int status = report.finish(std::cout);
+    if (mismatches > 0)
+    {
+        std::cerr << mismatches << " result checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return status;
+}
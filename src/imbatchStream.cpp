@@ -0,0 +1,180 @@
+#include <opencv2/opencv.hpp>
+
+#include <dirent.h>
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+#include "opencl_utils.hpp"
+#include "bounded_queue.hpp"
+#include "image_io.hpp"
+#include "pipeline.hpp"
+#include "benchmark.hpp"
+
+/* Processing slot: a pipeline with its own in-order queue and device buffers.
+ * Several slots work on different frames at the same time, so that the upload of a
+ * frame, the kernels of another one and the download of a third one can overlap. */
+struct Slot
+{
+    std::unique_ptr<Pipeline> pipeline;
+    std::shared_ptr<ImageFrame> frame;
+};
+
+bool has_image_extension(const std::string& name)
+{
+    const char* extensions[] = { ".png", ".jpg", ".jpeg", ".bmp", ".ppm", ".pgm", ".tif", ".tiff" };
+    for (const char* ext : extensions)
+    {
+        if (has_extension(name, ext))
+            return true;
+    }
+    return false;
+}
+
+/* Expand directories into the images they contain, sorted by name */
+std::vector<std::string> list_inputs(int argc, char** argv, int first)
+{
+    std::vector<std::string> inputs;
+    for (int i = first; i < argc; ++i)
+    {
+        std::string path = argv[i];
+        DIR* dir = opendir(path.c_str());
+        if (dir == NULL)
+        {
+            inputs.push_back(path);
+            continue;
+        }
+        std::vector<std::string> entries;
+        while (struct dirent* entry = readdir(dir))
+        {
+            if (has_image_extension(entry->d_name))
+                entries.push_back(path + "/" + entry->d_name);
+        }
+        closedir(dir);
+        std::sort(entries.begin(), entries.end());
+        inputs.insert(inputs.end(), entries.begin(), entries.end());
+    }
+    return inputs;
+}
+
+int main(int argc, char** argv)
+{
+    /* Strip options before looking at positional arguments */
+    std::string device_spec = parse_device_option(argc, argv);
+    size_t num_slots = std::max(1, std::atoi(parse_option(argc, argv, "--slots", "3").c_str()));
+    size_t queue_depth = std::max(1, std::atoi(parse_option(argc, argv, "--queue-depth", "8").c_str()));
+    size_t num_decoders = std::max(1, std::atoi(parse_option(argc, argv, "--decoders", "2").c_str()));
+    size_t num_encoders = std::max(1, std::atoi(parse_option(argc, argv, "--encoders", "2").c_str()));
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--device spec] [--slots N] [--queue-depth N] [--decoders N] [--encoders N] dst_dir src_dir|src_file.*..." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::string output_dir = argv[1];
+    std::vector<std::string> inputs = list_inputs(argc, argv, 2);
+    if (inputs.empty())
+    {
+        std::cerr << "No input image." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    size_t k_width = 5;
+    size_t k_height = 5;
+    float kernel[k_width * k_height] {
+         3,   1, -1,  1,  3,
+         1,  -2, -2, -2,  1,
+        -1,  -2, -3, -2, -1,
+         1,  -2, -2, -2,  1,
+         3,   1, -1,  1,  3
+    };
+    size_t se_size = 3;
+    int structuring_element[se_size * se_size] {
+        1, 1, 1,
+        1, 1, 1,
+        1, 1, 1
+    };
+
+    cl::Device device = select_device(device_spec);
+    cl::Context runtimeContext({device});
+    std::shared_ptr<KernelVariants> variants = std::make_shared<KernelVariants>(runtimeContext, device, "../src/kernelConv.cl");
+
+    std::shared_ptr<ColorConverter> color = std::make_shared<ColorConverter>(runtimeContext, device);
+
+    /* Every slot shares the context, programs and buffer pool but has its own queue and
+     * buffers: the buffers a slot outgrows serve the other slots */
+    std::shared_ptr<BufferPool> pool = std::make_shared<BufferPool>(runtimeContext, device);
+    std::vector<Slot> slots(num_slots);
+    for (auto &slot : slots)
+    {
+        slot.pipeline.reset(new Pipeline(runtimeContext, device, variants->program()));
+        slot.pipeline->set_variants(variants);
+        slot.pipeline->set_buffer_pool(pool);
+        slot.pipeline->set_color_converter(color);
+        slot.pipeline->convolution(kernel, k_width, k_height).erosion(structuring_element, se_size);
+    }
+
+    BoundedQueue<std::shared_ptr<ImageFrame> > decoded(queue_depth);
+    BoundedQueue<std::shared_ptr<ImageFrame> > processed(queue_depth);
+
+    Timer t;
+    t.start();
+
+    /* Decode and encode stages, each with its pool of threads. Decoded images keep their
+     * colours: the conversion to gray runs on the device. */
+    DecoderPool decoders(inputs, decoded, num_decoders);
+    EncoderPool encoders(processed, output_dir, num_encoders);
+
+    /* Device stage: frames are dealt round-robin to the slots. Before a slot takes a new
+     * frame, its previous frame is waited for and handed to the encoder. */
+    size_t next_slot = 0;
+    std::shared_ptr<ImageFrame> frame;
+    while (decoded.pop(frame))
+    {
+        Slot& slot = slots[next_slot];
+        next_slot = (next_slot + 1) % slots.size();
+        if (slot.frame)
+        {
+            slot.frame->done.wait();
+            processed.push(slot.frame);
+        }
+
+        size_t width = frame->image.width;
+        size_t height = frame->image.height;
+        frame->result.resize(width * height);
+        frame->result_format = PIXEL_GRAY;
+        slot.pipeline->enqueue_upload_pixels(frame->image.data, width, height, frame->image.format);
+        slot.pipeline->enqueue_stages(width, height);
+        slot.pipeline->enqueue_download(frame->result.data(), width, height, false, &frame->done);
+        slot.pipeline->get_queue().flush();
+        slot.frame = frame;
+    }
+
+    /* Drain the slots in submission order */
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+        Slot& slot = slots[(next_slot + i) % slots.size()];
+        if (slot.frame)
+        {
+            slot.frame->done.wait();
+            processed.push(slot.frame);
+            slot.frame.reset();
+        }
+    }
+    processed.close();
+
+    decoders.join();
+    encoders.join();
+    double elapsed = t.end();
+    size_t written = encoders.get_written();
+    size_t pixels = encoders.get_pixels();
+
+    std::cout << "# Streaming batch" << std::endl;
+    std::cout << "#Frames\tSlots\tDecoders\tEncoders\tTime(s)\t\tFrames/s\tMPixels/s" << std::endl;
+    std::cout << written << "\t" << num_slots << "\t" << num_decoders << "\t\t" << num_encoders << "\t\t"
+              << elapsed << "\t"
+              << written / elapsed << "\t\t"
+              << pixels / elapsed / 1e6 << std::endl;
+    pool->report(std::cout);
+    exit(EXIT_SUCCESS);
+}
@@ -1,33 +1,26 @@
 #include <opencv2/opencv.hpp>
 
 #include "opencl_utils.hpp"
+#include "image_io.hpp"
+#include "masks.hpp"
+#include "mat_buffer.hpp"
+#include "pipeline.hpp"
 #include "benchmark.hpp"
 
-float* create_gaussian_kernel(float sigma, size_t kernel_size)
-{
-    float* kernel = new float[kernel_size * kernel_size];
-    float mean = kernel_size/2;
-    float sum = 0.0;
-    for (int i = 0; i < kernel_size * kernel_size; ++i) 
-    {
-        int x = i % kernel_size;
-        int y = (i - x) / kernel_size % kernel_size;
-        kernel[i] = exp( -0.5 * (pow((x-mean)/sigma, 2.0) + pow((y-mean)/sigma,2.0)) ) / (2 * M_PI * sigma * sigma);
-        // Accumulate the kernel values
-        sum += kernel[i];
-    }
-
-    // Normalize the kernel
-    
-    /*
-    for (int i = 0; i < kernel_size * kernel_size; ++i)
-            kernel[i] /= sum;
-    */
-    return kernel;
-}
-
 int main(int argc, char** argv)
 {
+    /* Strip --device option before looking at positional arguments */
+    std::string device_spec = parse_device_option(argc, argv);
+    bool fusion = !parse_flag(argc, argv, "--no-fusion");
+    bool profile = parse_flag(argc, argv, "--profile");
+    std::string trace_file = parse_option(argc, argv, "--trace", "");
+    TransferMode transfer = parse_transfer_mode(argc, argv);
+    bool rgba = parse_flag(argc, argv, "--rgba");
+    /* Extra OpenCL compiler options, e.g. "-cl-fast-relaxed-math -cl-mad-enable" */
+    std::string build_options = parse_option(argc, argv, "--build-options", "");
+    std::set<size_t> specialized_sizes = parse_specialize_option(argc, argv);
+    bool tune = parse_flag(argc, argv, "--tune");
+
     size_t k_width = 5;
     size_t k_height = 5;
     //float* kernel = create_gaussian_kernel(0.8, k_width);
@@ -48,79 +41,108 @@ int main(int argc, char** argv)
 
     if (argc != 3)
     {
-        std::cerr << "Usage: " << argv[0] << " src_file.*" << "dst_file.*" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " [--device spec] [--no-fusion] [--profile] [--trace trace.json] [--transfer copy|map] [--rgba] [--build-options opts] [--specialize sizes|none] [--tune] src_file.* dst_file.*" << std::endl;
         exit(EXIT_FAILURE);
     }
     
-    /* Load image file */
-    cv::Mat image = cv::imread(argv[1], cv::IMREAD_UNCHANGED);
-    size_t height = image.rows;
-    size_t width = image.cols;
-
-    /* Convert it to RGBA */
-    cv::Mat image_rgba;
-    cv::cvtColor(image, image_rgba, CV_BGRA2GRAY);
-    
-    // Get pixel data array
-    int size = strlen(reinterpret_cast<char*>(image_rgba.data));
-    uchar* pixels = new uchar[width * height];
-    pixels = image_rgba.data;
-
-    cl::Platform platform = get_platform();
-    cl::Device device = get_device(platform);
-
-    cl::Context runtimeContext({device});
-    cl::Program program = load_and_build_program(runtimeContext, device, "../src/kernelConv.cl");
-
-    Timer t;
-    t.start();
-    // Create input and output image buffer
-    cl::Buffer IMAGE(runtimeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, width * height * sizeof(uchar), pixels);
-    cl::Buffer KERNEL(runtimeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, k_width * k_height * sizeof(int), kernel);
-    cl::Buffer OUT_IMAGE(runtimeContext, CL_MEM_WRITE_ONLY, width * height * sizeof(uchar));
-    
-    cl::Kernel convKernel(program, "gray_conv_buff");
-    convKernel.setArg(0, IMAGE);
-    // Kernel scalar arguments can not be of type size_t
-    convKernel.setArg(1, (uint) width);
-    convKernel.setArg(2, (uint) height);
-    convKernel.setArg(3, KERNEL);
-    convKernel.setArg(4, (uint) k_width);
-    convKernel.setArg(5, (uint) k_height);
-    convKernel.setArg(6, OUT_IMAGE);
-
-    /* Creating the command queue that will be used to process */
-    cl::CommandQueue queue(runtimeContext, device);
-    /* Launch the kernel on the compute device */
-    queue.enqueueNDRangeKernel(convKernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange);
-
-    uchar* copy_pixels = new uchar[width * height];
-    /* Get the result back to host */
-    queue.enqueueReadBuffer(OUT_IMAGE, CL_TRUE, 0, width * height * sizeof(uchar), copy_pixels);
-
-    IMAGE = cl::Buffer(runtimeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, width * height * sizeof(uchar), copy_pixels);
-    KERNEL = cl::Buffer(runtimeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, se_size * se_size * sizeof(float), structuring_element);
-    OUT_IMAGE = cl::Buffer(runtimeContext, CL_MEM_WRITE_ONLY, width * height * sizeof(uchar));
-
-    cl::Kernel erodeKernel(program, "erode");
-    erodeKernel.setArg(0, IMAGE);
-    erodeKernel.setArg(1, (uint)width);
-    erodeKernel.setArg(2, (uint)height);
-    erodeKernel.setArg(3, KERNEL);
-    erodeKernel.setArg(4, (uint)se_size);
-    erodeKernel.setArg(5, OUT_IMAGE);
-
-    queue.enqueueNDRangeKernel(erodeKernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange);
-    uchar* erode_pixels = new uchar[width * height];
-    queue.enqueueReadBuffer(OUT_IMAGE, CL_TRUE, 0, width * height * sizeof(uchar), erode_pixels);
-    float end_time = t.end();
+    /* Load image file, as decoded: colour conversions run on the device */
+    HostImage image;
+    if (!read_image(argv[1], image))
+    {
+        std::cerr << "Could not read " << argv[1] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t height = image.height;
+    size_t width = image.width;
+
+    cl::Device device = select_device(device_spec);
+
+    /* Convolution then erosion on device-resident buffers, fused into a single kernel unless disabled */
+    Pipeline pipeline(device, "../src/kernelConv.cl", build_options);
+    pipeline.get_engine().get_variants()->set_specialized_sizes(specialized_sizes);
+    /* Work-group sizes from the tuning file, measured for missing sizes with --tune */
+    Autotuner tuner(device);
+    tuner.set_sweep(tune);
+    pipeline.get_engine().set_autotuner(&tuner);
+    pipeline.convolution(kernel, k_width, k_height).erosion(structuring_element, se_size);
+    pipeline.set_fusion(fusion);
+    pipeline.set_transfer_mode(transfer);
+
+    /* Device-side timing of every transfer and kernel */
+    Profiler profiler;
+    if (profile || !trace_file.empty())
+        pipeline.set_profiler(&profiler);
+
+    std::vector<uchar> result;
+    PixelFormat result_format = PIXEL_GRAY;
+    float end_time;
+    if (rgba)
+    {
+        /* Colour output: the four channels are convolved in one pass. Erosion is only
+         * defined on gray images, so the colour path stops after the convolution.
+         * The image goes to RGBA and the result back to BGRA on the device. */
+        ConvolutionEngine& engine = pipeline.get_engine();
+        cl::CommandQueue& queue = engine.get_queue();
+        ColorConverter& color = pipeline.get_color_converter();
+        BufferPool& pool = *engine.get_buffer_pool();
+        PooledBuffer raw = pool.acquire(image.bytes(), CL_MEM_READ_ONLY);
+        PooledBuffer colour = pool.acquire(width * height * 4);
+        PooledBuffer convolved = pool.acquire(width * height * 4);
+        DeviceMask mask;
+        engine.prepare_mask(mask, kernel, k_width, k_height);
+        result.resize(width * height * 4);
+        result_format = PIXEL_BGRA;
+
+        Timer t;
+        t.start();
+        queue.enqueueWriteBuffer(raw.buffer(), CL_FALSE, 0, image.bytes(), image.data, NULL, engine.track(PROFILE_H2D, "image"));
+        color.enqueue_to_rgba(queue, raw.buffer(), width, height, image.format, colour.buffer(), engine.track(PROFILE_KERNEL, "color_to_rgba"));
+        engine.enqueue_rgba_convolution(mask, colour.buffer(), convolved.buffer(), width, height);
+        color.enqueue_to_rgba(queue, convolved.buffer(), width, height, PIXEL_BGRA, colour.buffer(), engine.track(PROFILE_KERNEL, "color_to_rgba"));
+        queue.enqueueReadBuffer(colour.buffer(), CL_TRUE, 0, result.size(), result.data(), NULL, engine.track(PROFILE_D2H, "image"));
+        end_time = t.end();
+    }
+    else if (transfer == TRANSFER_MAP)
+    {
+        /* The frame is wrapped in a device buffer and read in place, and the result is
+         * mapped: the transfers copy nothing. make_aligned() copies the frame once, here,
+         * only if the decoder did not leave its pixels page aligned. */
+        cv::Mat decoded = image.mat.empty() ? cv::Mat(height, width, CV_MAKETYPE(CV_8U, image.channels()), const_cast<uchar*>(image.data)) : image.mat;
+        cv::Mat frame = make_aligned(decoded);
+        HostBuffer wrapped = wrap_mat(pipeline.get_engine().get_context(), frame, CL_MEM_READ_ONLY);
+        Timer t;
+        t.start();
+        pipeline.use_input(wrapped.get_buffer(), width, height, image.format);
+        pipeline.enqueue_stages(width, height);
+        const uchar* erode_pixels = pipeline.map_result(width, height);
+        end_time = t.end();
+        result.assign(erode_pixels, erode_pixels + width * height);
+        pipeline.unmap_result();
+    }
+    else
+    {
+        result.resize(width * height);
+        Timer t;
+        t.start();
+        pipeline.enqueue_upload_pixels(image.data, width, height, image.format);
+        pipeline.enqueue_stages(width, height);
+        pipeline.enqueue_download(result.data(), width, height);
+        end_time = t.end();
+    }
 
-    std::cout << "Convolution & erosion done in " << end_time << std::endl;
+    std::cout << "Convolution & erosion done in " << end_time << " (" << transfer_mode_name(transfer) << " transfers)" << std::endl;
 
-    cv::Mat result;
-    cv::cvtColor(cv::Mat(height, width, CV_8UC1, erode_pixels), result, CV_GRAY2BGRA);
-    cv::imwrite(argv[2], result);
+    if (profile)
+    {
+        profiler.report(std::cout);
+        pipeline.get_engine().get_buffer_pool()->report(std::cout);
+    }
+    if (!trace_file.empty())
+        profiler.export_chrome_trace(trace_file);
 
-    image.release();
-    result.release();
+    if (!write_image(argv[2], result.data(), width, height, result_format))
+    {
+        std::cerr << "Could not write " << argv[2] << std::endl;
+        exit(EXIT_FAILURE);
+    }
 }
\ No newline at end of file
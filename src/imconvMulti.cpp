@@ -0,0 +1,69 @@
+#include <opencv2/opencv.hpp>
+
+#include "opencl_utils.hpp"
+#include "multi_device.hpp"
+#include "benchmark.hpp"
+
+int main(int argc, char** argv)
+{
+    /* Strip options before looking at positional arguments */
+    std::string devices_spec = parse_option(argc, argv, "--devices", "all");
+    size_t split = std::atoi(parse_option(argc, argv, "--split", "0").c_str());
+    size_t band_rows = std::atoi(parse_option(argc, argv, "--band-rows", "0").c_str());
+    size_t runs = std::max(1, std::atoi(parse_option(argc, argv, "--runs", "3").c_str()));
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--devices all|spec,spec...] [--split N] [--band-rows N] [--runs N] src_file.* dst_file.*" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    size_t k_width = 5;
+    size_t k_height = 5;
+    float kernel[k_width * k_height] {
+         3,   1, -1,  1,  3,
+         1,  -2, -2, -2,  1,
+        -1,  -2, -3, -2, -1,
+         1,  -2, -2, -2,  1,
+         3,   1, -1,  1,  3
+    };
+    size_t se_size = 3;
+    int structuring_element[se_size * se_size] {
+        1, 1, 1,
+        1, 1, 1,
+        1, 1, 1
+    };
+
+    cv::Mat image = cv::imread(argv[1], cv::IMREAD_GRAYSCALE);
+    if (image.empty())
+    {
+        std::cerr << "Could not read " << argv[1] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!image.isContinuous())
+        image = image.clone();
+    size_t height = image.rows;
+    size_t width = image.cols;
+
+    /* e.g. --devices cpu --split 4 partitions the CPU into 4 sub-devices */
+    std::vector<cl::Device> devices = split_devices(select_devices(devices_spec), split);
+    MultiDeviceScheduler scheduler(devices);
+    scheduler.convolution(kernel, k_width, k_height).erosion(structuring_element, se_size);
+    scheduler.set_band_rows(band_rows);
+
+    /* Later runs are partitioned with the throughput measured by the previous ones */
+    cv::Mat result(height, width, CV_8UC1);
+    std::cout << "# Multi-device convolution & erosion on " << scheduler.get_devices() << " devices" << std::endl;
+    std::cout << "#Run\tTime(s)" << std::endl;
+    for (size_t r = 0; r < runs; ++r)
+    {
+        double elapsed = scheduler.run(image.data, width, height, result.data);
+        std::cout << r << "\t" << elapsed << std::endl;
+    }
+    scheduler.report(std::cout);
+
+    if (!cv::imwrite(argv[2], result))
+    {
+        std::cerr << "Could not write " << argv[2] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,76 @@
+#include <opencv2/opencv.hpp>
+
+#include "opencl_utils.hpp"
+#include "strip_scheduler.hpp"
+#include "benchmark.hpp"
+
+int main(int argc, char** argv)
+{
+    /* Strip options before looking at positional arguments */
+    std::string device_spec = parse_device_option(argc, argv);
+    bool fusion = !parse_flag(argc, argv, "--no-fusion");
+    size_t strip_rows = std::atoi(parse_option(argc, argv, "--strip-rows", "0").c_str());
+    size_t num_slots = std::max(1, std::atoi(parse_option(argc, argv, "--slots", "2").c_str()));
+    bool tune = parse_flag(argc, argv, "--tune");
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--device spec] [--no-fusion] [--strip-rows N] [--slots N] [--tune] src_file.* dst_file.*" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    size_t k_width = 5;
+    size_t k_height = 5;
+    float kernel[k_width * k_height] {
+         3,   1, -1,  1,  3,
+         1,  -2, -2, -2,  1,
+        -1,  -2, -3, -2, -1,
+         1,  -2, -2, -2,  1,
+         3,   1, -1,  1,  3
+    };
+    size_t se_size = 3;
+    int structuring_element[se_size * se_size] {
+        1, 1, 1,
+        1, 1, 1,
+        1, 1, 1
+    };
+
+    /* Load image file directly as gray */
+    cv::Mat image = cv::imread(argv[1], cv::IMREAD_GRAYSCALE);
+    if (image.empty())
+    {
+        std::cerr << "Could not read " << argv[1] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!image.isContinuous())
+        image = image.clone();
+    size_t height = image.rows;
+    size_t width = image.cols;
+
+    cl::Device device = select_device(device_spec);
+    cl::Context runtimeContext({device});
+    /* The slots share the generic program and the programs specialized for the mask sizes */
+    std::shared_ptr<KernelVariants> variants = std::make_shared<KernelVariants>(runtimeContext, device, "../src/kernelConv.cl", vector_build_options(device));
+
+    /* Convolution then erosion, strip by strip */
+    StripScheduler scheduler(runtimeContext, device, variants->program(), num_slots);
+    scheduler.set_variants(variants);
+    scheduler.convolution(kernel, k_width, k_height).erosion(structuring_element, se_size);
+    scheduler.set_fusion(fusion);
+    scheduler.set_strip_rows(strip_rows);
+    /* Work-group sizes from the tuning file, measured for missing sizes with --tune */
+    Autotuner tuner(device);
+    tuner.set_sweep(tune);
+    scheduler.set_autotuner(&tuner);
+
+    cv::Mat result(height, width, CV_8UC1);
+    double end_time = scheduler.run(image.data, width, height, result.data);
+
+    std::cout << "Convolution & erosion of " << width << "x" << height << " done in " << end_time
+              << " (" << scheduler.get_strips() << " strips, " << scheduler.get_slots() << " slots)" << std::endl;
+
+    if (!cv::imwrite(argv[2], result))
+    {
+        std::cerr << "Could not write " << argv[2] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
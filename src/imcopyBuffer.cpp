@@ -1,90 +1,73 @@
 #include <opencv2/opencv.hpp>
 
 #include "opencl_utils.hpp"
+#include "autotuner.hpp"
 #include "benchmark.hpp"
+#include "buffer_pool.hpp"
+#include "image_io.hpp"
 
 int main(int argc, char** argv)
 {
+    /* Strip --device option before looking at positional arguments */
+    std::string device_spec = parse_device_option(argc, argv);
+    bool tune = parse_flag(argc, argv, "--tune");
     if (argc != 3)
     {
-        std::cerr << "Usage: " << argv[0] << " src_file.*" << "dst_file.*" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " [--device spec] [--tune] src_file.* dst_file.*" << std::endl;
         exit(EXIT_FAILURE);
     }
     
-    /* Load image file */
-    cv::Mat image = cv::imread(argv[1], cv::IMREAD_UNCHANGED);
-    size_t height = image.rows;
-    size_t width = image.cols;
-
-    /* Convert it to RGBA */
-    cv::Mat image_rgba;
-    cv::cvtColor(image, image_rgba, CV_BGRA2RGBA);
-    
-    // Get pixel data array
-    int size = strlen(reinterpret_cast<char*>(image_rgba.data));
-    uchar* pixels = new uchar[width * height * 4];
-    pixels = image_rgba.data;
+    /* Load image file. The copy is byte-wise, so the pixels are used as decoded, whatever
+     * their channels: no colour conversion on either side. */
+    HostImage image;
+    if (!read_image(argv[1], image))
+    {
+        std::cerr << "Could not read " << argv[1] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t height = image.height;
+    size_t width = image.width;
+    size_t count = image.bytes();
+    const uchar* pixels = image.data;
 
-    /* Debug informations */
-    std::cerr << "Loaded " << argv[1] << " - " << width << "x" << height << " - " << size * sizeof(char) / 1e6 << " MB" << std::endl;
-    std::cerr << "Old size: " << strlen((char*)(reinterpret_cast<char*>(image.data))) << " - Expected size: " << width * height * 4 << " - Real size: " << size << std::endl;
+    std::cerr << "Loaded " << argv[1] << " - " << width << "x" << height << "x" << image.channels() << " - " << count / 1e6 << " MB" << std::endl;
 
-    cl::Platform platform = get_platform();
-    cl::Device device = get_device(platform);
+    cl::Device device = select_device(device_spec);
 
     cl::Context runtimeContext({device});
-    cl::Program program = load_and_build_program(runtimeContext, device, "../src/kernelCopy.cl");
+    cl::Program program = load_and_build_program(runtimeContext, device, "../src/kernelCopy.cl", vector_build_options(device));
+    size_t vector_width = char_vector_width(device);
+
+    /* Creating the command queue that will be used to process */
+    cl::CommandQueue queue(runtimeContext, device, CL_QUEUE_PROFILING_ENABLE);
 
     // Create input and output image buffer
-    cl::Buffer IMAGE(runtimeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, width * height * 4 * sizeof(uchar), pixels);
-    cl::Buffer OUT_IMAGE(runtimeContext, CL_MEM_WRITE_ONLY, width * height * 4 * sizeof(uchar));
+    std::shared_ptr<BufferPool> pool = std::make_shared<BufferPool>(runtimeContext, device);
+    PooledBuffer IMAGE = pool->acquire(count * sizeof(uchar), CL_MEM_READ_ONLY);
+    PooledBuffer OUT_IMAGE = pool->acquire(count * sizeof(uchar), CL_MEM_WRITE_ONLY);
+    queue.enqueueWriteBuffer(IMAGE.buffer(), CL_FALSE, 0, count * sizeof(uchar), pixels);
     
-    cl::Kernel copyKernel(program, "copy_buff");
-    copyKernel.setArg(0, IMAGE);
+    /* Each work-item copies vector_width bytes */
+    cl::Kernel copyKernel(program, "copy_buff_vec");
+    copyKernel.setArg(0, IMAGE.buffer());
     // Kernel scalar arguments can not be of type size_t
-    copyKernel.setArg(1, (uint) width);
-    copyKernel.setArg(2, OUT_IMAGE);
+    copyKernel.setArg(1, (uint) count);
+    copyKernel.setArg(2, OUT_IMAGE.buffer());
 
-    /* Creating the command queue that will be used to process */
-    cl::CommandQueue queue(runtimeContext, device);
+    Autotuner tuner(device);
+    tuner.set_sweep(tune);
+    cl::NDRange global((count + vector_width - 1) / vector_width);
+    cl::NDRange local = tuned_local_size(tuner, queue, copyKernel, global);
     /* Launch the kernel on the compute device */
-    queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, cl::NDRange(width, height, 4), cl::NullRange);
+    queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, pad_global_range(global, local), local);
 
-    uchar* copy_pixels = new uchar[width * height * 4];
+    std::vector<uchar> copy_pixels(count);
     /* Get the result back to host */
-    queue.enqueueReadBuffer(OUT_IMAGE, CL_TRUE, 0, width * height * 4 * sizeof(uchar), copy_pixels);
+    queue.enqueueReadBuffer(OUT_IMAGE.buffer(), CL_TRUE, 0, count * sizeof(uchar), copy_pixels.data());
 
-    cv::Mat result;
-    cv::cvtColor(cv::Mat(height, width, CV_8UC4, copy_pixels), result, CV_RGBA2BGRA);
-    cv::imwrite(argv[2], result);
-
-    image.release();
-    result.release();
+    if (!write_image(argv[2], copy_pixels.data(), width, height, image.format))
+    {
+        std::cerr << "Could not write " << argv[2] << std::endl;
+        exit(EXIT_FAILURE);
+    }
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
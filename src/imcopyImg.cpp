@@ -1,50 +1,87 @@
-#include <opencv2/opencv.hpp>
-
 #include "opencl_utils.hpp"
+#include "autotuner.hpp"
+#include "buffer_pool.hpp"
+#include "color_conversion.hpp"
+#include "image_io.hpp"
+#include "image_engine.hpp"
 #include "benchmark.hpp"
 
 int main (int argc, char** argv)
 {
+    /* Strip --device option before looking at positional arguments */
+    std::string device_spec = parse_device_option(argc, argv);
+    bool tune = parse_flag(argc, argv, "--tune");
     if (argc != 3)
     {
-        std::cerr << "Usage: " << argv[0] << " src_file.*" << "dst_file.*" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " [--device spec] [--tune] src_file.* dst_file.*" << std::endl;
         exit(EXIT_FAILURE);
     }
 
-    /* Load image file */
-    cv::Mat image = cv::imread(argv[1], cv::IMREAD_UNCHANGED);
-    size_t height = image.rows;
-    size_t width = image.cols;
-
-    /* Convert it to RGBA */
-    cv::Mat image_rgba;
-    cv::cvtColor(image, image_rgba, CV_BGRA2RGBA);
-
-    // Get pixel data array
-    int size = strlen(reinterpret_cast<char*>(image_rgba.data));
-    uchar* pixels = new uchar[width * height * 4];
-    pixels = image_rgba.data;
+    /* Load image file, as decoded: the conversions to and from RGBA run on the device */
+    HostImage image;
+    if (!read_image(argv[1], image))
+    {
+        std::cerr << "Could not read " << argv[1] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t height = image.height;
+    size_t width = image.width;
 
-    cl::Platform platform = get_platform();
-    cl::Device device = get_device(platform);
+    cl::Device device = select_device(device_spec);
+    if (!has_image_support(device))
+    {
+        std::cerr << "Device " << device.getInfo<CL_DEVICE_NAME>() << " does not support images." << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
     cl::Context runtimeContext({device});
     cl::Program program = load_and_build_program(runtimeContext, device, "../src/kernelCopy.cl");
 
-    // SEGFAULT: 
+    ColorConverter color(runtimeContext, device);
+
+    // Create input and output images, 4 x 8 bits unsigned integers per pixel
     cl::ImageFormat format(CL_RGBA, CL_UNSIGNED_INT8);
-    // cl::Image2D IMAGE(runtimeContext, 
-    //                 CL_MEM_READ_ONLY | CL_MEM_HOST_PTR, 
-    //                 format, 
-    //                 (uint)width, 
-    //                 (uint)height, 
-    //                 0, 
-    //                 (void*) pixels);
-    
-    // cl::Image2D IMAGE_OUT(runtimeContext,
-    //                     CL_MEM_WRITE_ONLY,
-    //                     format,
-    //                     (uint)width,
-    //                     (uint)height);
-    
-}
\ No newline at end of file
+    cl::Image2D IMAGE(runtimeContext, CL_MEM_READ_ONLY, format, width, height);
+    cl::Image2D IMAGE_OUT(runtimeContext, CL_MEM_WRITE_ONLY, format, width, height);
+    /* Decoded pixels, and the RGBA pixels going to and coming from the images */
+    std::shared_ptr<BufferPool> pool = std::make_shared<BufferPool>(runtimeContext, device);
+    PooledBuffer RAW = pool->acquire(image.bytes(), CL_MEM_READ_ONLY);
+    PooledBuffer RGBA = pool->acquire(width * height * 4);
+    PooledBuffer BGRA = pool->acquire(width * height * 4);
+    cl::size_t<3> origin;
+    cl::size_t<3> region;
+    region[0] = width;
+    region[1] = height;
+    region[2] = 1;
+
+    cl::Kernel copyKernel(program, "copy");
+    copyKernel.setArg(0, IMAGE);
+    copyKernel.setArg(1, IMAGE_OUT);
+
+    /* Creating the command queue that will be used to process */
+    cl::CommandQueue queue(runtimeContext, device, CL_QUEUE_PROFILING_ENABLE);
+    queue.enqueueWriteBuffer(RAW.buffer(), CL_FALSE, 0, image.bytes(), image.data);
+    color.enqueue_to_rgba(queue, RAW.buffer(), width, height, image.format, RGBA.buffer());
+    queue.enqueueCopyBufferToImage(RGBA.buffer(), IMAGE, 0, origin, region);
+    Autotuner tuner(device);
+    tuner.set_sweep(tune);
+    cl::NDRange global(width, height);
+    cl::NDRange local = tuned_local_size(tuner, queue, copyKernel, global);
+    Timer t;
+    t.start();
+    /* Launch the kernel on the compute device */
+    queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, pad_global_range(global, local), local);
+
+    std::vector<uchar> copy_pixels(width * height * 4);
+    /* Get the result back to host, as BGRA for the encoders */
+    queue.enqueueCopyImageToBuffer(IMAGE_OUT, RGBA.buffer(), origin, region, 0);
+    color.enqueue_to_rgba(queue, RGBA.buffer(), width, height, PIXEL_BGRA, BGRA.buffer());
+    queue.enqueueReadBuffer(BGRA.buffer(), CL_TRUE, 0, copy_pixels.size(), copy_pixels.data());
+    std::cout << "Image copy done in " << t.end() << std::endl;
+
+    if (!write_image(argv[2], copy_pixels.data(), width, height, PIXEL_BGRA))
+    {
+        std::cerr << "Could not write " << argv[2] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,89 @@
+#include "opencl_utils.hpp"
+#include "color_conversion.hpp"
+#include "image_io.hpp"
+#include "morphology.hpp"
+
+int main(int argc, char** argv)
+{
+    /* Strip --device option before looking at positional arguments */
+    std::string device_spec = parse_device_option(argc, argv);
+    if (argc != 6)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--device spec] erode|dilate|open|close|gradient rect|cross|disk size src_file.* dst_file.*" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::string op_name = argv[1];
+    MorphologyOperation operation;
+    if (op_name == "erode")
+        operation = MORPH_ERODE;
+    else if (op_name == "dilate")
+        operation = MORPH_DILATE;
+    else if (op_name == "open")
+        operation = MORPH_OPEN;
+    else if (op_name == "close")
+        operation = MORPH_CLOSE;
+    else if (op_name == "gradient")
+        operation = MORPH_GRADIENT;
+    else
+    {
+        std::cerr << "Unknown operation " << op_name << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::string shape = argv[2];
+    size_t se_size = std::atoi(argv[3]);
+    if (se_size == 0)
+    {
+        std::cerr << "Invalid structuring element size " << argv[3] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    StructuringElement se;
+    if (shape == "rect")
+        se = StructuringElement::rectangle(se_size, se_size);
+    else if (shape == "cross")
+        se = StructuringElement::cross(se_size);
+    else if (shape == "disk")
+        se = StructuringElement::disk(se_size / 2);
+    else
+    {
+        std::cerr << "Unknown structuring element shape " << shape << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    /* Load image file, as decoded: the gray conversion runs on the device */
+    HostImage image;
+    if (!read_image(argv[4], image))
+    {
+        std::cerr << "Could not read " << argv[4] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t height = image.height;
+    size_t width = image.width;
+
+    cl::Device device = select_device(device_spec);
+    cl::Context context({device});
+    cl::CommandQueue queue(context, device);
+    MorphologyEngine engine(context, device, queue, "../src/kernelMorph.cl");
+    ColorConverter color(context, device);
+    BufferPool& pool = *engine.get_buffer_pool();
+    PooledBuffer raw = pool.acquire(image.bytes(), CL_MEM_READ_ONLY);
+    PooledBuffer gray = pool.acquire(width * height);
+    PooledBuffer out = pool.acquire(width * height);
+
+    std::vector<uchar> pixels(width * height);
+    Timer t;
+    t.start();
+    queue.enqueueWriteBuffer(raw.buffer(), CL_FALSE, 0, image.bytes(), image.data);
+    color.enqueue_to_gray(queue, raw.buffer(), width, height, image.format, gray.buffer());
+    engine.enqueue(operation, se, gray.buffer(), out.buffer(), width, height);
+    queue.enqueueReadBuffer(out.buffer(), CL_TRUE, 0, width * height, pixels.data());
+    double time = t.end();
+    std::cout << op_name << " (" << shape << " " << se_size << ") done in " << time << std::endl;
+
+    if (!write_image(argv[5], pixels.data(), width, height, PIXEL_GRAY))
+    {
+        std::cerr << "Could not write " << argv[5] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
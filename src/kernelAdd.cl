@@ -1,5 +1,10 @@
-void kernel simple_add(global const int* A, global const int* B, global int* C)
+void kernel simple_add(global const int* A, global const int* B, global int* C, const uint count)
 {
     int idx = get_global_id(0);
+    // The global size may be rounded up to a multiple of the work-group size
+    if (idx >= (int)count)
+    {
+        return;
+    }
     C[idx] = A[idx] + B[idx];
 }
\ No newline at end of file
@@ -0,0 +1,157 @@
+/* Chains of convolutions and erosions for the OpenCL 2.x path (see svm_pipeline.hpp).
+ * Stages are described by a table of 4 uints per stage: type, width, height and offset
+ * of the stage coefficients in a float array. Convolution masks are stored as they are,
+ * structuring elements as 0 / 1 values.
+ * The stage kernels are plain OpenCL C 1.2 and are enqueued by the host one after the
+ * other. Built with -cl-std=CL2.0 -D DEVICE_ENQUEUE, run_stages enqueues the whole
+ * chain from the device instead, each stage waiting for the previous one. */
+
+#define STAGE_CONVOLUTION 0
+#define STAGE_EROSION 1
+
+/* Same computation as gray_conv_buff (kernelConv.cl): pixels outside of the image are
+ * left out and the sum is normalised by the coefficients actually used */
+void convolve_pixel(global const uchar* image, const uint width, const uint height,
+                    global const float* mask, const uint mask_width, const uint mask_height,
+                    global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    int mask_hw = mask_width / 2;
+    int mask_hh = mask_height / 2;
+
+    float sum = 0.0;
+    float mask_sum = 0.0;
+    for (int ix = 0; ix < (int)mask_width; ++ix)
+    {
+        for (int iy = 0; iy < (int)mask_height; ++iy)
+        {
+            int px = x + (ix - mask_hw);
+            int py = y + (iy - mask_hh);
+            if (px < 0 || px >= (int)width || py < 0 || py >= (int)height)
+            {
+                continue;
+            }
+            float m_value = mask[ix + iy * mask_width];
+            sum += m_value * (float)image[px + py * width];
+            mask_sum += m_value;
+        }
+    }
+    out[x + y * width] = convert_uchar_sat(floor(sum / mask_sum));
+}
+
+/* Same computation as erode (kernelConv.cl), with the structuring element as floats */
+void erode_pixel(global const uchar* image, const uint width, const uint height,
+                 global const float* se, const uint se_size, global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    int hs = se_size / 2;
+
+    uchar current_value = image[x + y * width];
+    for (int ix = 0; ix < (int)se_size; ++ix)
+    {
+        for (int iy = 0; iy < (int)se_size; ++iy)
+        {
+            int px = x + (ix - hs);
+            int py = y + (iy - hs);
+            if (se[ix + iy * se_size] == 0.0f || px < 0 || px >= (int)width || py < 0 || py >= (int)height)
+            {
+                continue;
+            }
+            current_value = min(current_value, image[px + py * width]);
+        }
+    }
+    out[x + y * width] = current_value;
+}
+
+void kernel convolution_stage(global const uchar* image,
+                              const uint width,
+                              const uint height,
+                              global const float* coefficients,
+                              const uint offset,
+                              const uint mask_width,
+                              const uint mask_height,
+                              global uchar* out)
+{
+    convolve_pixel(image, width, height, coefficients + offset, mask_width, mask_height, out);
+}
+
+void kernel erosion_stage(global const uchar* image,
+                          const uint width,
+                          const uint height,
+                          global const float* coefficients,
+                          const uint offset,
+                          const uint se_size,
+                          global uchar* out)
+{
+    erode_pixel(image, width, height, coefficients + offset, se_size, out);
+}
+
+#ifdef DEVICE_ENQUEUE
+/* Run with a single work-item: enqueue the stage_count stages of stages on the default
+ * device queue, reading in, ping-ponging between tmp0 and tmp1 and writing the last
+ * stage to out. The host sees the kernel complete once every stage is complete.
+ * status receives CLK_SUCCESS or the error of the first enqueue that failed. */
+void kernel run_stages(global const uchar* in,
+                       global uchar* tmp0,
+                       global uchar* tmp1,
+                       global uchar* out,
+                       const uint width,
+                       const uint height,
+                       global const uint* stages,
+                       const uint stage_count,
+                       global const float* coefficients,
+                       global int* status)
+{
+    queue_t queue = get_default_queue();
+    ndrange_t range = ndrange_2D((size_t)width, (size_t)height);
+    clk_event_t previous;
+    *status = CLK_SUCCESS;
+
+    for (uint s = 0; s < stage_count; ++s)
+    {
+        global const uchar* src = s == 0 ? in : (s % 2 == 1 ? tmp0 : tmp1);
+        global uchar* dst = s + 1 == stage_count ? out : (s % 2 == 0 ? tmp0 : tmp1);
+        uint type = stages[4 * s];
+        uint stage_width = stages[4 * s + 1];
+        uint stage_height = stages[4 * s + 2];
+        global const float* c = coefficients + stages[4 * s + 3];
+
+        clk_event_t done;
+        int err;
+        if (type == STAGE_CONVOLUTION)
+        {
+            err = enqueue_kernel(queue, CLK_ENQUEUE_FLAGS_NO_WAIT, range, s > 0 ? 1 : 0, s > 0 ? &previous : NULL, &done,
+                                 ^{ convolve_pixel(src, width, height, c, stage_width, stage_height, dst); });
+        }
+        else
+        {
+            err = enqueue_kernel(queue, CLK_ENQUEUE_FLAGS_NO_WAIT, range, s > 0 ? 1 : 0, s > 0 ? &previous : NULL, &done,
+                                 ^{ erode_pixel(src, width, height, c, stage_width, dst); });
+        }
+        if (s > 0)
+        {
+            release_event(previous);
+        }
+        if (err != CLK_SUCCESS)
+        {
+            *status = err;
+            return;
+        }
+        previous = done;
+    }
+    if (stage_count > 0)
+    {
+        release_event(previous);
+    }
+}
+#endif
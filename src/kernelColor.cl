@@ -0,0 +1,64 @@
+/* Colour conversions of decoded images, so that the host does not have to run cvtColor.
+ * Pixels are channels bytes (1, 3 or 4) and red is the index of their red byte: 0 for
+ * RGB / RGBA images, 2 for the BGR / BGRA images decoded by OpenCV. */
+
+/* Gray level with the integer weights of OpenCV (Y = 0.299 R + 0.587 G + 0.114 B with
+ * 14 fractional bits), so that the result matches cvtColor bit for bit.
+ * 1-channel images are copied. */
+void kernel color_to_gray(global const uchar* image,
+                          const uint width,
+                          const uint height,
+                          const uint channels,
+                          const uint red,
+                          global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+
+    int idx = x + y * width;
+    global const uchar* pixel = image + idx * channels;
+    if (channels < 3)
+    {
+        out[idx] = pixel[0];
+        return;
+    }
+    uint r = pixel[red];
+    uint g = pixel[1];
+    uint b = pixel[2 - red];
+    out[idx] = (uchar)((r * 4899 + g * 9617 + b * 1868 + 8192) >> 14);
+}
+
+/* RGBA image from pixels of channels bytes; alpha is 255 when the input has none.
+ * Converting an RGBA image with red = 2 swaps its red and blue channels, i.e. gives
+ * the BGRA image expected by the OpenCV encoders. */
+void kernel color_to_rgba(global const uchar* image,
+                          const uint width,
+                          const uint height,
+                          const uint channels,
+                          const uint red,
+                          global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+
+    int idx = x + y * width;
+    global const uchar* pixel = image + idx * channels;
+    uchar4 rgba;
+    if (channels < 3)
+    {
+        rgba = (uchar4)(pixel[0], pixel[0], pixel[0], 255);
+    }
+    else
+    {
+        rgba = (uchar4)(pixel[red], pixel[1], pixel[2 - red], channels == 4 ? pixel[3] : 255);
+    }
+    vstore4(rgba, idx, out);
+}
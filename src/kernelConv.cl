@@ -1,18 +1,50 @@
-void kernel gray_conv_buff(global const uchar* image, const uint width, const uint height, global const float* mask, const uint mask_width, const uint mask_height, global uchar* out)
+/* Mask and structuring element sizes.
+ * Programs specialized by KernelVariants (see kernel_variants.hpp) are built with
+ * -D MASK_W=w -D MASK_H=h and/or -D SE_SIZE=s: the sizes are then compile-time
+ * constants, the loops over the mask are fully unrolled and the matching kernel
+ * arguments are ignored. Without them the sizes come from the arguments. */
+#ifdef MASK_W
+#define MASK_WIDTH(arg) MASK_W
+#define MASK_HEIGHT(arg) MASK_H
+#define UNROLL_MASK _Pragma("unroll")
+#else
+#define MASK_WIDTH(arg) ((int)(arg))
+#define MASK_HEIGHT(arg) ((int)(arg))
+#define UNROLL_MASK
+#endif
+
+/* Address space of the masks of gray_conv_tiled, gray_conv_erode and rgba_conv:
+ * constant memory, unless the host builds the program with -D MASK_SPACE=global for
+ * masks larger than CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE. */
+#ifndef MASK_SPACE
+#define MASK_SPACE constant
+#endif
+
+#ifdef SE_SIZE
+#define SE_WIDTH(arg) SE_SIZE
+#define UNROLL_SE _Pragma("unroll")
+#else
+#define SE_WIDTH(arg) ((int)(arg))
+#define UNROLL_SE
+#endif
+
+/* Convolution of pixel (x, y) of the width x height gray image: pixels outside of the
+ * image are left out and the sum is normalised by the coefficients actually used */
+uchar convolve_gray_pixel(global const uchar* image, const int width, const int height, global const float* mask, const uint mask_width, const uint mask_height, const int x, const int y)
 {
+    const int mask_w = MASK_WIDTH(mask_width);
+    const int mask_h = MASK_HEIGHT(mask_height);
     // Mask half size
-    int mask_hw = (int)floor((float)mask_width / 2);
-    int mask_hh = (int)floor((float)mask_height / 2);
-
-	int x = get_global_id(0);
-	int y = get_global_id(1);
-	int idx = x + y * width;
+    int mask_hw = mask_w / 2;
+    int mask_hh = mask_h / 2;
 
     float sum = 0.0;
     float mask_sum = 0.0;
-    for (int ix = 0; ix < mask_width ; ++ix)
+    UNROLL_MASK
+    for (int ix = 0; ix < mask_w ; ++ix)
     {
-        for (int iy = 0 ; iy < mask_height ; ++iy)
+        UNROLL_MASK
+        for (int iy = 0 ; iy < mask_h ; ++iy)
         {
             int px = x + (ix - mask_hw);
             int py = y + (iy - mask_hh);
@@ -23,7 +55,7 @@ void kernel gray_conv_buff(global const uchar* image, const uint width, const ui
             }
 
             // Getting mask value
-            float m_value = mask[ix + iy * mask_width];
+            float m_value = mask[ix + iy * mask_w];
             // Getting image value
             int current_idx = px + py * width;
             sum += m_value * (float)image[current_idx];
@@ -31,10 +63,53 @@ void kernel gray_conv_buff(global const uchar* image, const uint width, const ui
         }
     }
 
-	out[idx] = (uchar) floor(sum / mask_sum);
-    //out[idx] = image[idx];
+    return convert_uchar_sat(floor(sum / mask_sum));
+}
+
+/* Erosion of pixel (x, y) of the width x height gray image by a square structuring element */
+uchar erode_gray_pixel(global const uchar* image, const int width, const int height, global const int* se, const uint se_size, const int x, const int y)
+{
+    const int se_w = SE_WIDTH(se_size);
+    int hs = se_w / 2;
+
+    int current_value = (int) image[x + y * width];
+
+    UNROLL_SE
+    for (int ix = 0; ix < se_w; ++ix)
+    {
+        UNROLL_SE
+        for (int iy = 0 ; iy < se_w; ++iy)
+        {
+            int se_value = se[ix + iy * se_w];
+            if (se_value == 1)
+            {
+                int px = x + (ix - hs);
+                int py = y + (iy - hs);
+                // Pixels outside of the image do not take part in the erosion
+                if (px < 0 || px >= width || py < 0 || py >= height)
+                {
+                    continue;
+                }
+                current_value = current_value > image[px + py * width] ? image[px + py * width] : current_value;
+            }
+        }
+    }
+    return current_value;
+}
+
+void kernel gray_conv_buff(global const uchar* image, const uint width, const uint height, global const float* mask, const uint mask_width, const uint mask_height, global uchar* out)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+    // The global size may be rounded up to a multiple of the work-group size
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+	out[x + y * width] = convolve_gray_pixel(image, width, height, mask, mask_width, mask_height, x, y);
 }
 
+/* Erosion by a square structuring element (see kernelMorph.cl for the other operations) */
 void kernel erode(global const uchar* image, 
                 const uint width,
                 const uint height,
@@ -42,44 +117,415 @@ void kernel erode(global const uchar* image,
                 const uint se_size,
                 global uchar* out) 
 {
-    int hs = floor((float)se_size / 2);
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    out[x + y * width] = erode_gray_pixel(image, width, height, se, se_size, x, y);
+}
+
+/* Batches of small images (see image_batch.hpp), processed by a single launch.
+ * The images are packed one after the other in one buffer, the results at the same
+ * offsets in the output buffer, and described by a table of BATCH_ENTRY uints per
+ * image: offset of the first pixel, width, height and channels. The third dimension of
+ * the range is the index of the image, the first two cover the largest image of the
+ * batch: work-items beyond the size of their image do nothing. */
+#define BATCH_ENTRY 4
+
+void kernel gray_conv_batch(global const uchar* images,
+                            global const uint* table,
+                            global const float* mask,
+                            const uint mask_width,
+                            const uint mask_height,
+                            global uchar* out)
+{
+    uint4 entry = vload4(get_global_id(2), table);
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)entry.y || y >= (int)entry.z)
+    {
+        return;
+    }
+    out[entry.x + x + y * entry.y] = convolve_gray_pixel(images + entry.x, entry.y, entry.z, mask, mask_width, mask_height, x, y);
+}
 
+void kernel erode_batch(global const uchar* images,
+                        global const uint* table,
+                        global const int* se,
+                        const uint se_size,
+                        global uchar* out)
+{
+    uint4 entry = vload4(get_global_id(2), table);
     int x = get_global_id(0);
     int y = get_global_id(1);
-    int idx = x + y * width;
+    if (x >= (int)entry.y || y >= (int)entry.z)
+    {
+        return;
+    }
+    out[entry.x + x + y * entry.y] = erode_gray_pixel(images + entry.x, entry.y, entry.z, se, se_size, x, y);
+}
 
-    int current_value = (int) image[idx];
+/* Sum of the mask coefficients lying inside the image when the mask's top-left corner
+ * is at (first_x, first_y), i.e. the normalisation factor of gray_conv_buff.
+ * Pixels far enough from the border use the whole mask, whose sum is mask_total. */
+float border_mask_sum(MASK_SPACE float* mask,
+                      const uint mask_width,
+                      const uint mask_height,
+                      const float mask_total,
+                      const int first_x,
+                      const int first_y,
+                      const uint width,
+                      const uint height)
+{
+    if (first_x >= 0 && first_y >= 0 && first_x + (int)mask_width <= (int)width && first_y + (int)mask_height <= (int)height)
+    {
+        return mask_total;
+    }
 
-    for (int ix = 0; ix < se_size; ++ix)
+    int start_x = max(0, -first_x);
+    int start_y = max(0, -first_y);
+    int end_x = min((int)mask_width, (int)width - first_x);
+    int end_y = min((int)mask_height, (int)height - first_y);
+    float mask_sum = 0.0;
+    for (int iy = start_y; iy < end_y; ++iy)
     {
-        for (int iy = 0 ; iy < se_size; ++iy)
+        for (int ix = start_x; ix < end_x; ++ix)
         {
-            int se_value = se[ix + iy * se_size];
-            if (se_value == 1)
+            mask_sum += mask[ix + iy * mask_width];
+        }
+    }
+    return mask_sum;
+}
+
+/* Tiled version of gray_conv_buff.
+ * Each work-group first copies its block of the image plus a halo of half the mask
+ * size into local memory (tile must hold (local_w + mask_width - 1) x (local_h + mask_height - 1)
+ * floats), then every work-item convolves from local memory with the mask read
+ * from constant memory. Pixels outside of the image are loaded as 0 so that the
+ * inner loop has no bounds check: only the normalisation factor of pixels close to
+ * the border needs the in-image part of the mask, computed apart from the hot loop.
+ * mask_total is the sum of all the mask coefficients.
+ * The global size may be rounded up to a multiple of the work-group size. */
+void kernel gray_conv_tiled(global const uchar* image,
+                            const uint width,
+                            const uint height,
+                            MASK_SPACE float* mask,
+                            const uint mask_width,
+                            const uint mask_height,
+                            const float mask_total,
+                            local float* tile,
+                            global uchar* out)
+{
+    const int mask_w = MASK_WIDTH(mask_width);
+    const int mask_h = MASK_HEIGHT(mask_height);
+    const int mask_hw = mask_w / 2;
+    const int mask_hh = mask_h / 2;
+
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int lw = get_local_size(0);
+    const int lh = get_local_size(1);
+    const int tile_w = lw + mask_w - 1;
+    const int tile_h = lh + mask_h - 1;
+    const int origin_x = get_group_id(0) * lw - mask_hw;
+    const int origin_y = get_group_id(1) * lh - mask_hh;
+
+    // Cooperative load of the tile and its halo
+    for (int ty = ly; ty < tile_h; ty += lh)
+    {
+        int py = origin_y + ty;
+        for (int tx = lx; tx < tile_w; tx += lw)
+        {
+            int px = origin_x + tx;
+            bool inside = px >= 0 && px < (int)width && py >= 0 && py < (int)height;
+            tile[tx + ty * tile_w] = inside ? (float)image[px + py * width] : 0.0f;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+
+    float sum = 0.0;
+    UNROLL_MASK
+    for (int iy = 0; iy < mask_h; ++iy)
+    {
+        local const float* row = tile + lx + (ly + iy) * tile_w;
+        MASK_SPACE float* mask_row = mask + iy * mask_w;
+        UNROLL_MASK
+        for (int ix = 0; ix < mask_w; ++ix)
+        {
+            sum += mask_row[ix] * row[ix];
+        }
+    }
+
+    float mask_sum = border_mask_sum(mask, mask_w, mask_h, mask_total, x - mask_hw, y - mask_hh, width, height);
+    out[x + y * width] = convert_uchar_sat(floor(sum / mask_sum));
+}
+
+
+/* First pass of a separable convolution (mask = col x row).
+ * Filters every row of image with row_mask and normalises by the part of row_mask
+ * lying inside the image. The float output feeds gray_conv_cols. */
+void kernel gray_conv_rows(global const uchar* image,
+                           const uint width,
+                           const uint height,
+                           constant float* row_mask,
+                           const uint mask_width,
+                           global float* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+
+    int first_x = x - (int)mask_width / 2;
+    int start = max(0, -first_x);
+    int end = min((int)mask_width, (int)width - first_x);
+
+    global const uchar* line = image + y * width;
+    float sum = 0.0;
+    float mask_sum = 0.0;
+    for (int ix = start; ix < end; ++ix)
+    {
+        sum += row_mask[ix] * (float)line[first_x + ix];
+        mask_sum += row_mask[ix];
+    }
+    out[x + y * width] = sum / mask_sum;
+}
+
+/* Second pass of a separable convolution: filters the columns of the output of
+ * gray_conv_rows with col_mask. Normalising each pass by its in-image partial sum
+ * gives exactly the normalisation of gray_conv_buff, since the in-image part of a
+ * rank 1 mask is itself the product of the in-image parts of its factors. */
+void kernel gray_conv_cols(global const float* image,
+                           const uint width,
+                           const uint height,
+                           constant float* col_mask,
+                           const uint mask_height,
+                           global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+
+    int first_y = y - (int)mask_height / 2;
+    int start = max(0, -first_y);
+    int end = min((int)mask_height, (int)height - first_y);
+
+    global const float* column = image + x;
+    float sum = 0.0;
+    float mask_sum = 0.0;
+    for (int iy = start; iy < end; ++iy)
+    {
+        sum += col_mask[iy] * column[(first_y + iy) * (int)width];
+        mask_sum += col_mask[iy];
+    }
+    out[x + y * width] = convert_uchar_sat(floor(sum / mask_sum));
+}
+
+
+/* Convolution directly followed by an erosion, in a single pass.
+ * Each work-group stages its block of the image, with a halo covering both the mask
+ * and the structuring element, in tile (floats). It then convolves the block plus the
+ * structuring element halo into conv_tile (uchars, same rounding as gray_conv_buff),
+ * and erodes from there: the intermediate image never goes back to global memory.
+ * Convolved pixels lying outside of the image are set to 255 so that they do not take
+ * part in the erosion, as in erode. */
+void kernel gray_conv_erode(global const uchar* image,
+                            const uint width,
+                            const uint height,
+                            MASK_SPACE float* mask,
+                            const uint mask_width,
+                            const uint mask_height,
+                            const float mask_total,
+                            constant int* se,
+                            const uint se_size,
+                            local float* tile,
+                            local uchar* conv_tile,
+                            global uchar* out)
+{
+    const int mask_w = MASK_WIDTH(mask_width);
+    const int mask_h = MASK_HEIGHT(mask_height);
+    const int se_w = SE_WIDTH(se_size);
+    const int mask_hw = mask_w / 2;
+    const int mask_hh = mask_h / 2;
+    const int se_hs = se_w / 2;
+
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int lw = get_local_size(0);
+    const int lh = get_local_size(1);
+    const int conv_w = lw + se_w - 1;
+    const int conv_h = lh + se_w - 1;
+    const int tile_w = conv_w + mask_w - 1;
+    const int tile_h = conv_h + mask_h - 1;
+    const int conv_x0 = get_group_id(0) * lw - se_hs;
+    const int conv_y0 = get_group_id(1) * lh - se_hs;
+    const int tile_x0 = conv_x0 - mask_hw;
+    const int tile_y0 = conv_y0 - mask_hh;
+
+    // Cooperative load of the image tile and its halo
+    for (int ty = ly; ty < tile_h; ty += lh)
+    {
+        int py = tile_y0 + ty;
+        for (int tx = lx; tx < tile_w; tx += lw)
+        {
+            int px = tile_x0 + tx;
+            bool inside = px >= 0 && px < (int)width && py >= 0 && py < (int)height;
+            tile[tx + ty * tile_w] = inside ? (float)image[px + py * width] : 0.0f;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Convolution of the block and of the structuring element halo
+    for (int cy = ly; cy < conv_h; cy += lh)
+    {
+        int py = conv_y0 + cy;
+        for (int cx = lx; cx < conv_w; cx += lw)
+        {
+            int px = conv_x0 + cx;
+            if (px < 0 || px >= (int)width || py < 0 || py >= (int)height)
             {
-                int px = x + (ix - se_size);
-                int py = y + (iy - se_size);
-                // Erosion
-                current_value = current_value > image[px + py * width] ? image[px + py * width] : current_value;
-                // Dilation
-                //current_value = current_value < image[px + py * width] ? image[px + py * width] : current_value;
+                conv_tile[cx + cy * conv_w] = 255;
+                continue;
             }
+
+            float sum = 0.0;
+            UNROLL_MASK
+            for (int iy = 0; iy < mask_h; ++iy)
+            {
+                local const float* row = tile + cx + (cy + iy) * tile_w;
+                MASK_SPACE float* mask_row = mask + iy * mask_w;
+                UNROLL_MASK
+                for (int ix = 0; ix < mask_w; ++ix)
+                {
+                    sum += mask_row[ix] * row[ix];
+                }
+            }
+            float mask_sum = border_mask_sum(mask, mask_w, mask_h, mask_total, px - mask_hw, py - mask_hh, width, height);
+            conv_tile[cx + cy * conv_w] = convert_uchar_sat(floor(sum / mask_sum));
         }
     }
-    out[idx] = current_value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
 
-    /*
-    int start_x = x < hs ? x : hs;
-    int start_y = y < hs ? y : hs;
-    int end_x = hs + 1 > width - x ? width - x : hs + 1;
-    int end_y = hs + 1 > height - y ? height - y : hs + 1;
-    
-    for (int ix = -start_x; ix < end_x ; ++ix)
+    // Erosion from the convolved tile
+    uchar current_value = conv_tile[(lx + se_hs) + (ly + se_hs) * conv_w];
+    UNROLL_SE
+    for (int iy = 0; iy < se_w; ++iy)
     {
-        for (int iy = -start_y ; iy < end_y ; ++iy)
+        UNROLL_SE
+        for (int ix = 0; ix < se_w; ++ix)
         {
-            int se_val = se[ix + hs + (iy + hs) * width];
+            if (se[ix + iy * se_w] == 1)
+            {
+                current_value = min(current_value, conv_tile[(lx + ix) + (ly + iy) * conv_w]);
+            }
         }
     }
-    */
-}
\ No newline at end of file
+    out[x + y * width] = current_value;
+}
+
+/* Vector types of the RGBA kernels. VECTOR_WIDTH (4, 8 or 16 bytes, chosen on the host
+ * from CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR) is the number of channels handled at once
+ * by a work-item, i.e. VECTOR_WIDTH / 4 consecutive RGBA pixels. */
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 4
+#endif
+#define RGBA_PIXELS (VECTOR_WIDTH / 4)
+#define CAT(a, b) a ## b
+#define XCAT(a, b) CAT(a, b)
+#define floatV XCAT(float, VECTOR_WIDTH)
+#define vloadV XCAT(vload, VECTOR_WIDTH)
+#define vstoreV XCAT(vstore, VECTOR_WIDTH)
+#define convert_floatV XCAT(convert_float, VECTOR_WIDTH)
+#define convert_ucharV_sat XCAT(XCAT(convert_uchar, VECTOR_WIDTH), _sat)
+
+/* Convolution of the four channels of an RGBA image in a single pass, with the
+ * normalisation of gray_conv_buff. Each work-item computes RGBA_PIXELS consecutive
+ * pixels of a row with vector loads and arithmetic, so that the global size is
+ * (ceil(width / RGBA_PIXELS), height). Work-items whose neighbourhood crosses the
+ * border fall back to one pixel at a time with bounds checks.
+ * mask_total is the sum of all the mask coefficients. */
+void kernel rgba_conv(global const uchar* image,
+                      const uint width,
+                      const uint height,
+                      MASK_SPACE float* mask,
+                      const uint mask_width,
+                      const uint mask_height,
+                      const float mask_total,
+                      global uchar* out)
+{
+    const int mask_w = MASK_WIDTH(mask_width);
+    const int mask_h = MASK_HEIGHT(mask_height);
+    const int mask_hw = mask_w / 2;
+    const int mask_hh = mask_h / 2;
+
+    int x0 = get_global_id(0) * RGBA_PIXELS;
+    int y = get_global_id(1);
+    if (x0 >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+
+    if (x0 >= mask_hw && x0 + RGBA_PIXELS - 1 + mask_hw < (int)width && y >= mask_hh && y + mask_hh < (int)height)
+    {
+        floatV sum = (floatV)(0.0f);
+        UNROLL_MASK
+        for (int iy = 0; iy < mask_h; ++iy)
+        {
+            int row = (y + iy - mask_hh) * width;
+            UNROLL_MASK
+            for (int ix = 0; ix < mask_w; ++ix)
+            {
+                floatV pixels = convert_floatV(vloadV(0, image + (row + x0 + ix - mask_hw) * 4));
+                sum += mask[ix + iy * mask_w] * pixels;
+            }
+        }
+        vstoreV(convert_ucharV_sat(floor(sum / mask_total)), 0, out + (y * width + x0) * 4);
+        return;
+    }
+
+    for (int p = 0; p < RGBA_PIXELS && x0 + p < (int)width; ++p)
+    {
+        int x = x0 + p;
+        float4 sum = (float4)(0.0f);
+        for (int iy = 0; iy < mask_h; ++iy)
+        {
+            int py = y + iy - mask_hh;
+            if (py < 0 || py >= (int)height)
+            {
+                continue;
+            }
+            for (int ix = 0; ix < mask_w; ++ix)
+            {
+                int px = x + ix - mask_hw;
+                if (px < 0 || px >= (int)width)
+                {
+                    continue;
+                }
+                sum += mask[ix + iy * mask_w] * convert_float4(vload4(px + py * width, image));
+            }
+        }
+        float mask_sum = border_mask_sum(mask, mask_w, mask_h, mask_total, x - mask_hw, y - mask_hh, width, height);
+        vstore4(convert_uchar4_sat(floor(sum / mask_sum)), x + y * width, out);
+    }
+}
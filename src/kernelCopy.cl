@@ -1,21 +1,76 @@
-void kernel copy_buff(global const uchar* image, const uint width, global uchar* out)
+void kernel copy_buff(global const uchar* image, const uint width, const uint height, global uchar* out)
 {
 	int x = get_global_id(0);
 	int y = get_global_id(1);
 	int c = get_global_id(2);
+	// The global size may be rounded up to a multiple of the work-group size
+	if (x >= (int)width || y >= (int)height || c >= 4)
+	{
+		return;
+	}
 	int idx = (x * 4) + (y * width * 4) + c;
 	out[idx] = image[idx];
 }
 
-const sampler_t smp = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+/* Copy of a batch of images packed as for gray_conv_batch (kernelConv.cl): 4 uints per
+ * image (offset, width, height, channels). Dimension 0 covers the bytes of the longest
+ * row, dimension 2 is the index of the image. */
+void kernel copy_buff_batch(global const uchar* images, global const uint* table, global uchar* out)
+{
+	uint4 entry = vload4(get_global_id(2), table);
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	uint row = entry.y * entry.w;
+	if (x >= (int)row || y >= (int)entry.z)
+	{
+		return;
+	}
+	uint idx = entry.x + x + y * row;
+	out[idx] = images[idx];
+}
+
+/* read_imageui requires nearest filtering */
+const sampler_t smp = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
 
 void kernel copy(__read_only image2d_t in, __write_only image2d_t out)
 {
 	int x = get_global_id(0);
 	int y = get_global_id(1);
+	if (x >= get_image_width(out) || y >= get_image_height(out))
+	{
+		return;
+	}
 
 	int2 pos = (int2)(x, y);
 	
 	uint4 pixel = read_imageui(in, smp, pos);
 	write_imageui(out, pos, pixel);
-}
\ No newline at end of file
+}
+
+/* Vectorized buffer copy: each work-item moves VECTOR_WIDTH bytes (4, 8 or 16, chosen
+ * on the host from CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR) instead of one. The last
+ * work-item copies the bytes left when count is not a multiple of VECTOR_WIDTH. */
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 4
+#endif
+#define CAT(a, b) a ## b
+#define XCAT(a, b) CAT(a, b)
+#define vloadV XCAT(vload, VECTOR_WIDTH)
+#define vstoreV XCAT(vstore, VECTOR_WIDTH)
+
+void kernel copy_buff_vec(global const uchar* image, const uint count, global uchar* out)
+{
+	uint i = get_global_id(0);
+	uint first = i * VECTOR_WIDTH;
+	if (first + VECTOR_WIDTH <= count)
+	{
+		vstoreV(vloadV(i, image), i, out);
+	}
+	else
+	{
+		for (uint k = first; k < count; ++k)
+		{
+			out[k] = image[k];
+		}
+	}
+}
@@ -0,0 +1,125 @@
+/* Convolution of gray images through the FFT (see fft_convolution.hpp), for masks too
+ * large for gray_conv_buff.
+ * The image is cut into overlapping tiles of n x n complex values (n a power of two).
+ * Each tile goes through a 2D FFT, is multiplied by the spectrum of the mask and comes
+ * back through the inverse FFT (overlap-save): a tile yields the
+ * (n - mask_width + 1) x (n - mask_height + 1) output pixels that its circular
+ * convolution gets right. Tiles are stored one after the other, row by row.
+ * 1D FFTs are radix-2 Stockham passes, which need no bit reversal: log2(n) passes per
+ * dimension, each reading one buffer and writing the other.
+ * The result matches gray_conv_buff (pixels outside of the image left out, normalised by
+ * the coefficients used), up to the rounding of the float FFT: a pixel may differ by one
+ * gray level. */
+
+float2 complex_mul(const float2 a, const float2 b)
+{
+    return (float2)(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);
+}
+
+/* Butterfly k (< n / 2) of the pass of span p (1, 2, 4, ..., n / 2) over the n values of
+ * the line starting at base with the given stride. direction is -1 for the forward
+ * transform and 1 for the inverse one, which is not scaled. */
+void stockham_radix2(global const float2* in, global float2* out, const uint base, const uint stride,
+                     const uint n, const uint p, const uint k, const float direction)
+{
+    uint i = k & (p - 1);
+    float2 u0 = in[base + k * stride];
+    float2 u1 = in[base + (k + n / 2) * stride];
+    float c;
+    float s = sincos(direction * M_PI_F * (float)i / (float)p, &c);
+    u1 = complex_mul(u1, (float2)(c, s));
+    uint j = ((k - i) << 1) + i;
+    out[base + j * stride] = u0 + u1;
+    out[base + (j + p) * stride] = u0 - u1;
+}
+
+/* One pass over the rows of the tiles: range (n / 2, n, tiles) */
+void kernel fft_rows(global const float2* in, global float2* out, const uint n, const uint p, const float direction)
+{
+    uint base = get_global_id(2) * n * n + get_global_id(1) * n;
+    stockham_radix2(in, out, base, 1, n, p, get_global_id(0), direction);
+}
+
+/* One pass over the columns of the tiles: range (n, n / 2, tiles), neighbouring
+ * work-items on neighbouring columns */
+void kernel fft_columns(global const float2* in, global float2* out, const uint n, const uint p, const float direction)
+{
+    uint base = get_global_id(2) * n * n + get_global_id(0);
+    stockham_radix2(in, out, base, n, n, p, get_global_id(1), direction);
+}
+
+/* Copy tiles first_tile, first_tile + 1, ... of the width x height image into out:
+ * range (n, n, tiles). Tile t covers the pixels from ((t % tiles_x) * step_x - origin_x,
+ * (t / tiles_x) * step_y - origin_y); pixels outside of the image are 0. */
+void kernel fft_load_tiles(global const uchar* image,
+                           const uint width,
+                           const uint height,
+                           const uint tiles_x,
+                           const uint first_tile,
+                           const uint n,
+                           const uint step_x,
+                           const uint step_y,
+                           const uint origin_x,
+                           const uint origin_y,
+                           global float2* out)
+{
+    uint tile = first_tile + get_global_id(2);
+    int x = (int)((tile % tiles_x) * step_x + get_global_id(0)) - (int)origin_x;
+    int y = (int)((tile / tiles_x) * step_y + get_global_id(1)) - (int)origin_y;
+    float value = 0.0f;
+    if (x >= 0 && x < (int)width && y >= 0 && y < (int)height)
+    {
+        value = (float)image[x + y * width];
+    }
+    out[get_global_id(2) * n * n + get_global_id(1) * n + get_global_id(0)] = (float2)(value, 0.0f);
+}
+
+/* Multiply every tile by spectrum (n x n): range (n * n, tiles) */
+void kernel fft_multiply(global float2* tiles, global const float2* spectrum, const uint n)
+{
+    uint i = get_global_id(0);
+    uint t = get_global_id(1) * n * n + i;
+    tiles[t] = complex_mul(tiles[t], spectrum[i]);
+}
+
+/* Write the valid part of the inverse transformed tiles (before scaling by 1 / n²) to
+ * out: range (step_x, step_y, tiles). The normalisation factor of each pixel, the sum of
+ * the mask coefficients lying inside the image, comes from the summed area table sat of
+ * the mask ((mask_width + 1) x (mask_height + 1), first row and column 0). */
+void kernel fft_store_tiles(global const float2* tiles,
+                            const uint width,
+                            const uint height,
+                            const uint tiles_x,
+                            const uint first_tile,
+                            const uint n,
+                            const uint step_x,
+                            const uint step_y,
+                            const uint mask_width,
+                            const uint mask_height,
+                            global const float* sat,
+                            global uchar* out)
+{
+    uint tile = first_tile + get_global_id(2);
+    int x = (tile % tiles_x) * step_x + get_global_id(0);
+    int y = (tile / tiles_x) * step_y + get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    uint col = get_global_id(0) + mask_width - 1;
+    uint row = get_global_id(1) + mask_height - 1;
+    float sum = tiles[get_global_id(2) * n * n + row * n + col].x / ((float)n * (float)n);
+
+    /* Rows and columns of the mask over the image */
+    int first_x = x - (int)(mask_width / 2);
+    int first_y = y - (int)(mask_height / 2);
+    int start_x = max(0, -first_x);
+    int start_y = max(0, -first_y);
+    int end_x = min((int)mask_width, (int)width - first_x);
+    int end_y = min((int)mask_height, (int)height - first_y);
+    int sat_width = mask_width + 1;
+    float mask_sum = sat[end_y * sat_width + end_x] - sat[start_y * sat_width + end_x]
+                   - sat[end_y * sat_width + start_x] + sat[start_y * sat_width + start_x];
+
+    out[x + y * width] = convert_uchar_sat(floor(sum / mask_sum));
+}
@@ -0,0 +1,110 @@
+/* Image object versions of the gray kernels of kernelConv.cl.
+ * Images are single channel CL_R / CL_UNSIGNED_INT8: reads go through the texture
+ * caches of the device. The image is the top-left width x height pixels of the image
+ * object, which may be larger (ImageEngine reuses its images): samplers clamp at the
+ * bounds of the object, not of the image, so pixels whose neighbourhood crosses the
+ * border of the image skip the out-of-image taps explicitly, and only the other pixels
+ * run the inner loops without bounds check. Results are identical to gray_conv_buff and
+ * erode. */
+
+const sampler_t nearest = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
+
+/* Sampler version of gray_conv_buff.
+ * mask_total is the sum of all the mask coefficients, the normalisation factor of pixels
+ * whose neighbourhood lies inside the image. Pixels close to the border only read the
+ * in-image taps and divide by the sum of their coefficients. */
+void kernel gray_conv_img(read_only image2d_t image,
+                          const uint width,
+                          const uint height,
+                          constant float* mask,
+                          const uint mask_width,
+                          const uint mask_height,
+                          const float mask_total,
+                          write_only image2d_t out)
+{
+    const int mask_hw = mask_width / 2;
+    const int mask_hh = mask_height / 2;
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+
+    /* Taps [start, end) of the mask lie inside the image */
+    int first_x = x - mask_hw;
+    int first_y = y - mask_hh;
+    int start_x = max(0, -first_x);
+    int start_y = max(0, -first_y);
+    int end_x = min((int)mask_width, (int)width - first_x);
+    int end_y = min((int)mask_height, (int)height - first_y);
+
+    float sum = 0.0f;
+    float mask_sum = mask_total;
+    if (start_x == 0 && start_y == 0 && end_x == (int)mask_width && end_y == (int)mask_height)
+    {
+        for (int iy = 0; iy < (int)mask_height; ++iy)
+        {
+            for (int ix = 0; ix < (int)mask_width; ++ix)
+            {
+                uint value = read_imageui(image, nearest, (int2)(first_x + ix, first_y + iy)).x;
+                sum += mask[ix + iy * mask_width] * (float)value;
+            }
+        }
+    }
+    else
+    {
+        mask_sum = 0.0f;
+        for (int iy = start_y; iy < end_y; ++iy)
+        {
+            for (int ix = start_x; ix < end_x; ++ix)
+            {
+                uint value = read_imageui(image, nearest, (int2)(first_x + ix, first_y + iy)).x;
+                sum += mask[ix + iy * mask_width] * (float)value;
+                mask_sum += mask[ix + iy * mask_width];
+            }
+        }
+    }
+
+    write_imageui(out, (int2)(x, y), (uint4)(convert_uchar_sat(floor(sum / mask_sum)), 0, 0, 0));
+}
+
+/* Sampler version of erode: pixels close to the border skip the out-of-image pixels */
+void kernel erode_img(read_only image2d_t image,
+                      const uint width,
+                      const uint height,
+                      constant int* se,
+                      const uint se_size,
+                      write_only image2d_t out)
+{
+    int hs = se_size / 2;
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+
+    uint current_value = read_imageui(image, nearest, (int2)(x, y)).x;
+    bool interior = x >= hs && y >= hs && x + hs < (int)width && y + hs < (int)height;
+    for (int iy = 0; iy < (int)se_size; ++iy)
+    {
+        for (int ix = 0; ix < (int)se_size; ++ix)
+        {
+            if (se[ix + iy * se_size] != 1)
+            {
+                continue;
+            }
+            int px = x + (ix - hs);
+            int py = y + (iy - hs);
+            if (!interior && (px < 0 || px >= (int)width || py < 0 || py >= (int)height))
+            {
+                continue;
+            }
+            current_value = min(current_value, read_imageui(image, nearest, (int2)(px, py)).x);
+        }
+    }
+    write_imageui(out, (int2)(x, y), (uint4)(current_value, 0, 0, 0));
+}
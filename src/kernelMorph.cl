@@ -0,0 +1,175 @@
+/* Grayscale morphology kernels.
+ * The same source is built twice: with MORPH_OP=min / MORPH_IDENTITY=255 for erosions
+ * and with MORPH_OP=max / MORPH_IDENTITY=0 for dilations. Pixels outside of the image
+ * hold MORPH_IDENTITY, so that they never take part in the result. */
+#ifndef MORPH_OP
+#define MORPH_OP min
+#define MORPH_IDENTITY 255
+#endif
+
+/* Arbitrary structuring element of se_width x se_height (1 = part of the element),
+ * element (ix, iy) covering the pixel (x + ix - anchor_x, y + iy - anchor_y). */
+void kernel morph_generic(global const uchar* image,
+                          const uint width,
+                          const uint height,
+                          global const int* se,
+                          const uint se_width,
+                          const uint se_height,
+                          const int anchor_x,
+                          const int anchor_y,
+                          global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+
+    uchar value = MORPH_IDENTITY;
+    for (int iy = 0; iy < se_height; ++iy)
+    {
+        int py = y + iy - anchor_y;
+        if (py < 0 || py >= (int)height)
+        {
+            continue;
+        }
+        for (int ix = 0; ix < se_width; ++ix)
+        {
+            int px = x + ix - anchor_x;
+            if (se[ix + iy * se_width] == 1 && px >= 0 && px < (int)width)
+            {
+                value = MORPH_OP(value, image[px + py * width]);
+            }
+        }
+    }
+    out[x + y * width] = value;
+}
+
+/* van Herk/Gil-Werman 1D min/max filter over windows of k pixels.
+ * Each row is seen as a padded sequence f(i) = image(i - anchor), i in [0, padded_width),
+ * cut into blocks of k values. vhgw_blocks_h computes, for each block, the running
+ * MORPH_OP from the start of the block (g) and from its end (h): one work-item per block.
+ * vhgw_merge_h then gets the window [x, x + k - 1] of f as MORPH_OP(h(x), g(x + k - 1)),
+ * hence about 3 operations per pixel whatever the window size.
+ * padded_width must be a multiple of k, at least width + k - 1. */
+void kernel vhgw_blocks_h(global const uchar* image,
+                          const uint width,
+                          const uint height,
+                          const uint k,
+                          const int anchor,
+                          const uint padded_width,
+                          global uchar* g,
+                          global uchar* h)
+{
+    int start = get_global_id(0) * k;
+    int y = get_global_id(1);
+    if (start >= (int)padded_width || y >= (int)height)
+    {
+        return;
+    }
+
+    global const uchar* line = image + y * width;
+    global uchar* g_line = g + y * padded_width;
+    global uchar* h_line = h + y * padded_width;
+
+    uchar acc = MORPH_IDENTITY;
+    for (int i = start; i < start + (int)k; ++i)
+    {
+        int x = i - anchor;
+        acc = MORPH_OP(acc, (x >= 0 && x < (int)width) ? line[x] : (uchar)MORPH_IDENTITY);
+        g_line[i] = acc;
+    }
+    acc = MORPH_IDENTITY;
+    for (int i = start + (int)k - 1; i >= start; --i)
+    {
+        int x = i - anchor;
+        acc = MORPH_OP(acc, (x >= 0 && x < (int)width) ? line[x] : (uchar)MORPH_IDENTITY);
+        h_line[i] = acc;
+    }
+}
+
+void kernel vhgw_merge_h(global const uchar* g,
+                         global const uchar* h,
+                         const uint width,
+                         const uint height,
+                         const uint k,
+                         const uint padded_width,
+                         global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    int row = y * padded_width;
+    out[x + y * width] = MORPH_OP(h[row + x], g[row + x + k - 1]);
+}
+
+/* Column counterparts of vhgw_blocks_h / vhgw_merge_h. g and h are padded_height x width,
+ * so that neighbouring work-items access neighbouring columns. */
+void kernel vhgw_blocks_v(global const uchar* image,
+                          const uint width,
+                          const uint height,
+                          const uint k,
+                          const int anchor,
+                          const uint padded_height,
+                          global uchar* g,
+                          global uchar* h)
+{
+    int x = get_global_id(0);
+    int start = get_global_id(1) * k;
+    if (x >= (int)width || start >= (int)padded_height)
+    {
+        return;
+    }
+
+    uchar acc = MORPH_IDENTITY;
+    for (int i = start; i < start + (int)k; ++i)
+    {
+        int y = i - anchor;
+        acc = MORPH_OP(acc, (y >= 0 && y < (int)height) ? image[x + y * width] : (uchar)MORPH_IDENTITY);
+        g[x + i * width] = acc;
+    }
+    acc = MORPH_IDENTITY;
+    for (int i = start + (int)k - 1; i >= start; --i)
+    {
+        int y = i - anchor;
+        acc = MORPH_OP(acc, (y >= 0 && y < (int)height) ? image[x + y * width] : (uchar)MORPH_IDENTITY);
+        h[x + i * width] = acc;
+    }
+}
+
+void kernel vhgw_merge_v(global const uchar* g,
+                         global const uchar* h,
+                         const uint width,
+                         const uint height,
+                         const uint k,
+                         global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    out[x + y * width] = MORPH_OP(h[x + y * width], g[x + (y + k - 1) * width]);
+}
+
+/* Saturated difference a - b, e.g. for the morphological gradient */
+void kernel morph_difference(global const uchar* a,
+                             global const uchar* b,
+                             const uint width,
+                             const uint height,
+                             global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    int idx = x + y * width;
+    out[idx] = sub_sat(a[idx], b[idx]);
+}
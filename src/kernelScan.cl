@@ -0,0 +1,251 @@
+/* Prefix scans and summed area tables (see integral_image.hpp).
+ * The program is built for one accumulator type SCAN_T: -D SCAN_T=ulong -D SCAN_INTEGER
+ * for 8 bit images (no overflow below 2^56 pixels), -D SCAN_T=float or
+ * -D SCAN_T=double -D SCAN_DOUBLE for float images.
+ * A summed area table is an inclusive scan of the rows, then of the columns: the scan
+ * of the columns is a scan of the rows of the transposed table, transposed back.
+ * Rows are scanned by blocks of twice the work-group size (Blelloch: an up-sweep then a
+ * down-sweep in local memory, O(n) additions). The sums of the blocks are scanned the
+ * same way and added to the following blocks, so rows of any length are scanned. */
+
+#ifdef SCAN_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef SCAN_T
+#define SCAN_T float
+#endif
+
+#ifndef TRANSPOSE_TILE
+#define TRANSPOSE_TILE 16
+#endif
+
+/* Copy count pixels into the accumulator type, squared if square is set */
+void kernel widen_uchar(global const uchar* in, const uint count, const uint square, global SCAN_T* out)
+{
+    uint i = get_global_id(0);
+    if (i >= count)
+    {
+        return;
+    }
+    SCAN_T value = (SCAN_T) in[i];
+    out[i] = square ? value * value : value;
+}
+
+void kernel widen_float(global const float* in, const uint count, const uint square, global SCAN_T* out)
+{
+    uint i = get_global_id(0);
+    if (i >= count)
+    {
+        return;
+    }
+    SCAN_T value = (SCAN_T) in[i];
+    out[i] = square ? value * value : value;
+}
+
+/* Inclusive scan, in place, of the blocks of 2 x local size elements of rows of
+ * row_length elements: range (blocks_per_row x local size, rows), temp holding
+ * 2 x local size elements. The local size must be a power of two. With write_sums, the
+ * total of each block goes to block_sums (blocks_per_row per row). */
+void kernel scan_blocks(global SCAN_T* data,
+                        const uint row_length,
+                        const uint blocks_per_row,
+                        const uint write_sums,
+                        global SCAN_T* block_sums,
+                        local SCAN_T* temp)
+{
+    uint lid = get_local_id(0);
+    uint l = get_local_size(0);
+    uint block = get_group_id(0);
+    uint row = get_global_id(1);
+    global SCAN_T* line = data + (size_t)row * row_length;
+    uint a = block * 2 * l + lid;
+    uint b = a + l;
+    SCAN_T va = a < row_length ? line[a] : 0;
+    SCAN_T vb = b < row_length ? line[b] : 0;
+    temp[lid] = va;
+    temp[lid + l] = vb;
+
+    /* Up-sweep: partial sums up a balanced tree */
+    uint offset = 1;
+    for (uint d = l; d > 0; d >>= 1)
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < d)
+        {
+            uint ai = offset * (2 * lid + 1) - 1;
+            uint bi = offset * (2 * lid + 2) - 1;
+            temp[bi] += temp[ai];
+        }
+        offset <<= 1;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid == 0)
+    {
+        if (write_sums)
+        {
+            block_sums[row * blocks_per_row + block] = temp[2 * l - 1];
+        }
+        temp[2 * l - 1] = 0;
+    }
+
+    /* Down-sweep: exclusive scan back down the tree */
+    for (uint d = 1; d < 2 * l; d <<= 1)
+    {
+        offset >>= 1;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < d)
+        {
+            uint ai = offset * (2 * lid + 1) - 1;
+            uint bi = offset * (2 * lid + 2) - 1;
+            SCAN_T t = temp[ai];
+            temp[ai] = temp[bi];
+            temp[bi] += t;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    /* Exclusive plus own value: inclusive */
+    if (a < row_length)
+    {
+        line[a] = temp[lid] + va;
+    }
+    if (b < row_length)
+    {
+        line[b] = temp[lid + l] + vb;
+    }
+}
+
+/* Add to every block but the first the inclusive scan of the sums of the previous
+ * blocks of its row: range (row_length, rows) */
+void kernel add_block_offsets(global SCAN_T* data,
+                              const uint row_length,
+                              const uint block_size,
+                              const uint blocks_per_row,
+                              global const SCAN_T* scanned_sums)
+{
+    uint x = get_global_id(0);
+    uint row = get_global_id(1);
+    uint block = x / block_size;
+    if (x >= row_length || block == 0)
+    {
+        return;
+    }
+    data[(size_t)row * row_length + x] += scanned_sums[row * blocks_per_row + block - 1];
+}
+
+/* out (height x width) = transpose of in (width x height), through a local tile:
+ * range padded to multiples of TRANSPOSE_TILE, local size TRANSPOSE_TILE x TRANSPOSE_TILE */
+void kernel transpose(global const SCAN_T* in, const uint width, const uint height, global SCAN_T* out)
+{
+    /* One more column so that the columns read back fall in different banks */
+    local SCAN_T tile[TRANSPOSE_TILE][TRANSPOSE_TILE + 1];
+    uint lx = get_local_id(0);
+    uint ly = get_local_id(1);
+    uint x = get_group_id(0) * TRANSPOSE_TILE + lx;
+    uint y = get_group_id(1) * TRANSPOSE_TILE + ly;
+    if (x < width && y < height)
+    {
+        tile[ly][lx] = in[(size_t)y * width + x];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    /* Written along the rows of out */
+    uint ox = get_group_id(1) * TRANSPOSE_TILE + lx;
+    uint oy = get_group_id(0) * TRANSPOSE_TILE + ly;
+    if (ox < height && oy < width)
+    {
+        out[(size_t)oy * height + ox] = tile[lx][ly];
+    }
+}
+
+/* Box queries: the window of radius (radius_x, radius_y) around (x, y), clipped to
+ * the image, as for gray_conv_buff with a box mask */
+typedef struct
+{
+    SCAN_T sum;
+    uint count;
+} BoxSum;
+
+/* Element (x, y) of the inclusive summed area table, 0 left of or above the image */
+SCAN_T sat_at(global const SCAN_T* sat, const uint width, const int x, const int y)
+{
+    return x < 0 || y < 0 ? 0 : sat[(size_t)y * width + x];
+}
+
+BoxSum box_sum(global const SCAN_T* sat, const uint width, const uint height,
+               const uint radius_x, const uint radius_y, const int x, const int y)
+{
+    int x0 = max(x - (int)radius_x, 0) - 1;
+    int y0 = max(y - (int)radius_y, 0) - 1;
+    int x1 = min(x + (int)radius_x, (int)width - 1);
+    int y1 = min(y + (int)radius_y, (int)height - 1);
+    BoxSum box;
+    box.sum = sat_at(sat, width, x1, y1) - sat_at(sat, width, x0, y1) - sat_at(sat, width, x1, y0) + sat_at(sat, width, x0, y0);
+    box.count = (x1 - x0) * (y1 - y0);
+    return box;
+}
+
+#ifdef SCAN_INTEGER
+/* Mean of the window, rounded down, from the table of an 8 bit image: range (width, height) */
+void kernel box_filter(global const SCAN_T* sat, const uint width, const uint height,
+                       const uint radius_x, const uint radius_y, global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    BoxSum box = box_sum(sat, width, height, radius_x, radius_y, x, y);
+    out[y * width + x] = (uchar)(box.sum / box.count);
+}
+
+/* Pixels above the mean of their window minus offset become 255, the others 0 (as
+ * cv::adaptiveThreshold with ADAPTIVE_THRESH_MEAN_C): range (width, height) */
+void kernel adaptive_threshold(global const uchar* image, global const SCAN_T* sat, const uint width, const uint height,
+                               const uint radius_x, const uint radius_y, const float offset, global uchar* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    BoxSum box = box_sum(sat, width, height, radius_x, radius_y, x, y);
+    float mean = (float)box.sum / (float)box.count;
+    out[y * width + x] = (float)image[y * width + x] > mean - offset ? 255 : 0;
+}
+#endif
+
+/* Mean of the window: range (width, height) */
+void kernel box_mean(global const SCAN_T* sat, const uint width, const uint height,
+                     const uint radius_x, const uint radius_y, global float* out)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    BoxSum box = box_sum(sat, width, height, radius_x, radius_y, x, y);
+    out[y * width + x] = (float)box.sum / (float)box.count;
+}
+
+/* Mean and variance of the window, from the tables of the image and of its squares:
+ * range (width, height) */
+void kernel mean_variance(global const SCAN_T* sat, global const SCAN_T* sat_squares, const uint width, const uint height,
+                          const uint radius_x, const uint radius_y, global float* mean, global float* variance)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= (int)width || y >= (int)height)
+    {
+        return;
+    }
+    BoxSum box = box_sum(sat, width, height, radius_x, radius_y, x, y);
+    BoxSum squares = box_sum(sat_squares, width, height, radius_x, radius_y, x, y);
+    float m = (float)box.sum / (float)box.count;
+    mean[y * width + x] = m;
+    variance[y * width + x] = max((float)squares.sum / (float)box.count - m * m, 0.0f);
+}
@@ -1,7 +1,12 @@
 #define __CL_ENABLE_EXCEPTIONS
 
+#include <cmath>
+
 #include "opencl_utils.hpp"
+#include "autotuner.hpp"
 #include "benchmark.hpp"
+#include "buffer_pool.hpp"
+#include "vector_expression.hpp"
 
 void printVector(int* vector, int length)
 {
@@ -13,7 +18,7 @@ void printVector(int* vector, int length)
     std::cout << "}" << std::endl;
 }
 
-void printVector(std::vector<int> vector, int length)
+void printVector(const std::vector<int>& vector, int length)
 {
     std::cout << "{" << " ";
     for (int i = 0; i < length; i++)
@@ -23,9 +28,9 @@ void printVector(std::vector<int> vector, int length)
     std::cout << "}" << std::endl;
 }
 
-void vectorAdd(std::vector<int> vec1, std::vector<int> vec2, std::vector<int> *out)
+void vectorAdd(const std::vector<int>& vec1, const std::vector<int>& vec2, std::vector<int> *out)
 {
-    for (int i = 0 ; i < vec1.size() ; i++)
+    for (size_t i = 0 ; i < vec1.size() ; i++)
     {
         (*out)[i] = vec1[i] + vec2[i];
     }
@@ -33,16 +38,34 @@ void vectorAdd(std::vector<int> vec1, std::vector<int> vec2, std::vector<int> *o
 
 int main(int argc, char** argv)
 {
-    cl::Platform platform = get_platform();
-    cl::Device device = get_device(platform);
+    BenchmarkReport report;
+    report.parse_options(argc, argv);
+    cl::Device device = select_device(argc, argv);
+    bool tune = parse_flag(argc, argv, "--tune");
+    if (argc != 1)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--device spec] [--tune] " << BenchmarkReport::usage() << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
     cl::Context runtimeContext({device});
     cl::Program program = load_and_build_program(runtimeContext, device, "../src/kernelAdd.cl");
 
     cl::Kernel simpleAddKernel(program, "simple_add");
+    /* Creating the command queue that will be used to process */
+    cl::CommandQueue queue(runtimeContext, device);
+    /* Work-group sizes from the tuning file, measured for missing sizes with --tune */
+    Autotuner tuner(device);
+    tuner.set_sweep(tune);
+    /* Buffers of each size step go back to the pool and serve the next steps */
+    std::shared_ptr<BufferPool> pool = std::make_shared<BufferPool>(runtimeContext, device);
+    /* Fused elementwise expressions and reductions */
+    ExpressionEngine expressions(runtimeContext, device, queue);
+    expressions.set_buffer_pool(pool);
 
+    /* Wrong results of the kernels, which fail the run */
+    size_t failures = 0;
     std::cout << "# Vector Addition benchmark" << std::endl;
-    std::cout << "#N\tTime(OCL)\tTime\t\tMB/s(OCL)\tMB/s" << std::endl;
     for (int i = 1000 ; i < 1e6 ; i = i * 1.5)
     {
         int vecSize = i;
@@ -56,41 +79,164 @@ int main(int argc, char** argv)
             vec2.push_back(i * i);
         }
 
-        cl::Buffer VEC1(runtimeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, vec1.size() * sizeof(int), vec1.data());
-        cl::Buffer VEC2(runtimeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, vec2.size() * sizeof(int), vec2.data());
-        cl::Buffer VEC3(runtimeContext, CL_MEM_WRITE_ONLY, vec3.size() * sizeof(int));
+        PooledBuffer VEC1 = pool->acquire(vec1.size() * sizeof(int), CL_MEM_READ_ONLY);
+        PooledBuffer VEC2 = pool->acquire(vec2.size() * sizeof(int), CL_MEM_READ_ONLY);
+        PooledBuffer VEC3 = pool->acquire(vec3.size() * sizeof(int), CL_MEM_WRITE_ONLY);
+        queue.enqueueWriteBuffer(VEC1.buffer(), CL_FALSE, 0, vec1.size() * sizeof(int), vec1.data());
+        queue.enqueueWriteBuffer(VEC2.buffer(), CL_TRUE, 0, vec2.size() * sizeof(int), vec2.data());
 
-        Timer timer;
-        double opencl_time = 0;
-        double classic_time = 0;
-        for (int j = 0 ; j < 20 ; j++)
+        /* Setting kernel parameters (i.e the ones specified in the associated function in the associated .cl file) */
+        simpleAddKernel.setArg(0, VEC1.buffer());
+        simpleAddKernel.setArg(1, VEC2.buffer());
+        simpleAddKernel.setArg(2, VEC3.buffer());
+        simpleAddKernel.setArg(3, (cl_uint) vecSize);
+        cl::NDRange local = tuned_local_size(tuner, queue, simpleAddKernel, cl::NDRange(vecSize));
+        cl::NDRange global = pad_global_range(cl::NDRange(vecSize), local);
+
+        /* Two reads and one write per element */
+        double bytes = 3.0 * vecSize * sizeof(int);
+        std::string size = std::to_string(vecSize);
+
+        report.run("vecadd_ocl/" + size, [&]()
         {
-            timer.start();
-            /* Setting kernel parameters (i.e the ones specified in the associated function in the associated .cl file) */
-            simpleAddKernel.setArg(0, VEC1);
-            simpleAddKernel.setArg(1, VEC2);
-            simpleAddKernel.setArg(2, VEC3);
-
-            /* Creating the command queue that will be used to process */
-            cl::CommandQueue queue(runtimeContext, device);
             /* Launch the kernel on the compute device */
-            queue.enqueueNDRangeKernel(simpleAddKernel, cl::NullRange, vecSize, cl::NullRange);
+            queue.enqueueNDRangeKernel(simpleAddKernel, cl::NullRange, global, local);
+            queue.finish();
+        }, bytes, vecSize);
+
+        report.run("vecadd_ocl_read/" + size, [&]()
+        {
+            queue.enqueueNDRangeKernel(simpleAddKernel, cl::NullRange, global, local);
             /* Get the result back to host */
-            queue.enqueueReadBuffer(VEC3, CL_TRUE, 0, vec3.size() * sizeof(int), vec3.data());
-            
-            opencl_time += timer.end();
-            timer.start();
+            queue.enqueueReadBuffer(VEC3.buffer(), CL_TRUE, 0, vec3.size() * sizeof(int), vec3.data());
+        }, bytes + vecSize * sizeof(int), vecSize);
+
+        /* The global range is padded to the tuned work-group size: the extra work-items must not write */
+        std::vector<int> expected_sum(vecSize);
+        vectorAdd(vec1, vec2, &expected_sum);
+        if (vec3 != expected_sum)
+        {
+            std::cerr << "vecadd_ocl/" << size << ": wrong sum" << std::endl;
+            ++failures;
+        }
+
+        report.run("vecadd_cpu/" + size, [&]()
+        {
             vectorAdd(vec1, vec2, &(vec3));
-            classic_time += timer.end();
+        }, bytes, vecSize);
+
+        /* r = a * 3 + c - a / 2 in one fused kernel, against one kernel per operation */
+        std::vector<int> small(vecSize);
+        for (int i = 0; i < vecSize; i++)
+            small[i] = i % 1000;
+        DeviceVector<cl_int> a(expressions, vec1);
+        DeviceVector<cl_int> c(expressions, small);
+        DeviceVector<cl_int> r(expressions, vecSize);
+        DeviceVector<cl_int> t(expressions, vecSize);
+
+        report.run("vecexpr_fused/" + size, [&]()
+        {
+            r = a * 3 + c - a / 2;
+            queue.finish();
+        }, 3.0 * vecSize * sizeof(int), 4.0 * vecSize);
+
+        report.run("vecexpr_steps/" + size, [&]()
+        {
+            t = a * 3;
+            t = t + c;
+            r = t - a / 2;
+            queue.finish();
+        }, 8.0 * vecSize * sizeof(int), 4.0 * vecSize);
+
+        std::vector<int> result = r.read();
+        for (int i = 0; i < vecSize; i++)
+        {
+            if (result[i] != vec1[i] * 3 + small[i] - vec1[i] / 2)
+            {
+                std::cerr << "vecexpr/" << size << ": wrong element " << i << std::endl;
+                ++failures;
+                break;
+            }
+        }
+
+        /* The same expression on floats and halves: half the bytes to move */
+        std::vector<float> floats(small.begin(), small.end());
+        std::vector<Half> halves(vecSize);
+        for (int i = 0; i < vecSize; i++)
+            halves[i] = Half(floats[i]);
+        DeviceVector<cl_float> af(expressions, floats);
+        DeviceVector<cl_float> rf(expressions, vecSize);
+        DeviceVector<Half> ah(expressions, halves);
+        DeviceVector<Half> rh(expressions, vecSize);
+
+        report.run("vecexpr_fused_float/" + size, [&]()
+        {
+            rf = af * 0.5f + sqrt(af) - 1.0f;
+            queue.finish();
+        }, 2.0 * vecSize * sizeof(float), 4.0 * vecSize);
+
+        report.run("vecexpr_fused_half/" + size, [&]()
+        {
+            rh = ah * 0.5f + sqrt(ah) - 1.0f;
+            queue.finish();
+        }, 2.0 * vecSize * sizeof(Half), 4.0 * vecSize);
+
+        /* sqrt is not correctly rounded on every device, and halves keep 11 significant bits */
+        std::vector<float> result_float = rf.read();
+        std::vector<Half> result_half = rh.read();
+        for (int i = 0; i < vecSize; i++)
+        {
+            float expected_value = floats[i] * 0.5f + std::sqrt(floats[i]) - 1.0f;
+            if (std::fabs(result_float[i] - expected_value) > 1e-5f * std::fabs(expected_value) + 1e-5f)
+            {
+                std::cerr << "vecexpr_fused_float/" << size << ": wrong element " << i << std::endl;
+                ++failures;
+                break;
+            }
+        }
+        for (int i = 0; i < vecSize; i++)
+        {
+            float expected_value = floats[i] * 0.5f + std::sqrt(floats[i]) - 1.0f;
+            if (std::fabs((float) result_half[i] - expected_value) > 4e-3f * std::fabs(expected_value) + 1e-2f)
+            {
+                std::cerr << "vecexpr_fused_half/" << size << ": wrong element " << i << std::endl;
+                ++failures;
+                break;
+            }
+        }
+
+        /* Reductions: the expression is evaluated inside the reduction kernel */
+        long long expected = 0;
+        for (int i = 0; i < vecSize; i++)
+            expected += (long long) small[i] * small[i];
+        long long product = 0;
+
+        report.run("vecdot_ocl/" + size, [&]()
+        {
+            product = dot(c, c);
+        }, 1.0 * vecSize * sizeof(int), 2.0 * vecSize);
+
+        report.run("vecdot_cpu/" + size, [&]()
+        {
+            long long total = 0;
+            for (int i = 0; i < vecSize; i++)
+                total += (long long) small[i] * small[i];
+            product = total;
+        }, 1.0 * vecSize * sizeof(int), 2.0 * vecSize);
+
+        if (dot(c, c) != expected || max(a - c) != vec1.back() - small.back() || min(c) != 0)
+        {
+            std::cerr << "vecdot/" << size << ": wrong reduction" << std::endl;
+            ++failures;
         }
-        opencl_time /= 20;
-        classic_time /= 20;
-        std::cout << vecSize << "\t" 
-                    << opencl_time << "\t" 
-                    << classic_time << "\t" 
-                    << vecSize * sizeof(int) / opencl_time / 1e6 << "\t\t"
-                    << vecSize * sizeof(int) / classic_time / 1e6
-                    << std::endl;
     }
-    exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+    std::cerr << "# " << expressions.kernel_count() << " fused kernels generated" << std::endl;
+    pool->report(std::cerr);
+    int status = report.finish(std::cout);
+    if (failures > 0)
+    {
+        std::cerr << failures << " wrong results" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return status;
+}